@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Totals over ledger archives, without the database:
+ *
+ *     archive-query [-n top] [-s student] [-t terminal] file...
+ *
+ * Counts and sums the rows of the given archive files (ledger-archive),
+ * optionally only those of one student key (student.id) or terminal, and
+ * with -n lists the students with the highest totals. The column scans are
+ * plain loops over the mapped arrays, without branches, that the compiler
+ * vectorizes.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "wallet-archive.h"
+#include "wallet-db.h"
+
+struct {
+    long student;		/* -1 for all */
+    long terminal;		/* -1 for all */
+    size_t top;
+} query_options = {
+    .student = -1,
+    .terminal = -1
+};
+
+struct student_total {
+    uint32_t key;
+    int64_t sum;
+};
+
+struct {
+    uint64_t count;
+    int64_t sum;
+    struct student_total *students;
+    size_t student_count;
+} query_totals;
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-n top] [-s student] [-t terminal] file...\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -n     List the top students by total\n");
+    fprintf (stderr, "  -s     Only the rows of this student key (student.id)\n");
+    fprintf (stderr, "  -t     Only the rows of this terminal\n");
+}
+
+/*
+ * The student codes index the dictionary and the per-student sums: a file
+ * with a code outside its dictionary is refused before anything is counted.
+ */
+static int
+check_codes (const struct wallet_archive *archive, const char *path)
+{
+    const uint16_t *student = archive->student;
+    size_t dict_count = archive->hdr->dict_count;
+    uint16_t max_code = 0;
+
+    for (size_t i = 0; i < archive->hdr->rows; i++)
+		max_code = (student[i] > max_code) ? student[i] : max_code;
+    if (archive->hdr->rows && (max_code >= dict_count)) {
+		warnx ("%s: invalid archive (student code %u, %zu in the dictionary)", path, max_code, dict_count);
+		return -1;
+    }
+    return 0;
+}
+
+/*
+ * Count and sum the rows matching the filters: the match is a 0/1 value
+ * masking the amount, so the loop has no branch.
+ */
+static void
+scan_totals (const struct wallet_archive *archive, int code)
+{
+    const uint16_t *student = archive->student, *terminal = archive->terminal;
+    const int32_t *amount = archive->amount;
+    const uint16_t s = code, t = query_options.terminal;
+    const int any_student = (code < 0), any_terminal = (query_options.terminal < 0);
+    uint64_t count = 0;
+    int64_t sum = 0;
+
+    for (size_t i = 0; i < archive->hdr->rows; i++) {
+		int64_t match = ((student[i] == s) | any_student) & ((terminal[i] == t) | any_terminal);
+
+		count += match;
+		sum += amount[i] & -match;
+    }
+    query_totals.count += count;
+    query_totals.sum += sum;
+}
+
+/*
+ * Totals per dictionary code, added to the per-student list. The codes
+ * have been checked by check_codes().
+ */
+static int
+scan_students (const struct wallet_archive *archive, const char *path)
+{
+    const uint16_t *student = archive->student, *terminal = archive->terminal;
+    const int32_t *amount = archive->amount;
+    const uint16_t t = query_options.terminal;
+    const int any_terminal = (query_options.terminal < 0);
+    size_t dict_count = archive->hdr->dict_count;
+    int64_t *sums;
+    struct student_total *p;
+
+    if (!(sums = calloc (dict_count ? dict_count : 1, sizeof (*sums)))) {
+		warn ("%s", path);
+		return -1;
+    }
+    for (size_t i = 0; i < archive->hdr->rows; i++)
+		sums[student[i]] += amount[i] & -(int64_t) ((terminal[i] == t) | any_terminal);
+
+    if (!(p = realloc (query_totals.students, (query_totals.student_count + dict_count) * sizeof (*p)))) {
+		warn ("%s", path);
+		free (sums);
+		return -1;
+    }
+    query_totals.students = p;
+    for (size_t c = 0; c < dict_count; c++) {
+		p[query_totals.student_count].key = archive->dict[c];
+		p[query_totals.student_count].sum = sums[c];
+		query_totals.student_count++;
+    }
+    free (sums);
+    return 0;
+}
+
+static int
+query_file (const char *path)
+{
+    struct wallet_archive archive;
+    int code = -1, res = 0;
+
+    if (wallet_archive_open (&archive, path) < 0)
+		return -1;
+    if (check_codes (&archive, path) < 0) {
+		wallet_archive_close (&archive);
+		return -1;
+    }
+
+    if (query_options.student >= 0) {
+		for (size_t c = 0; c < archive.hdr->dict_count; c++)
+			if (archive.dict[c] == query_options.student)
+				code = c;
+    }
+    /* Unless the student has no row in this file. */
+    if ((query_options.student < 0) || (code >= 0))
+		scan_totals (&archive, code);
+    if (query_options.top && (scan_students (&archive, path) < 0))
+		res = -1;
+    wallet_archive_close (&archive);
+    return res;
+}
+
+static int
+by_key (const void *a, const void *b)
+{
+    const struct student_total *ta = a, *tb = b;
+
+    return (ta->key > tb->key) - (ta->key < tb->key);
+}
+
+static int
+by_sum (const void *a, const void *b)
+{
+    const struct student_total *ta = a, *tb = b;
+
+    return (ta->sum < tb->sum) - (ta->sum > tb->sum);
+}
+
+/*
+ * The same student appears in the dictionary of every month: merge, then
+ * order by total.
+ */
+static void
+print_top (void)
+{
+    struct student_total *s = query_totals.students;
+    size_t n = 0;
+    char sum_char[24];
+
+    qsort (s, query_totals.student_count, sizeof (*s), by_key);
+    for (size_t i = 0; i < query_totals.student_count; i++) {
+		if (n && (s[n - 1].key == s[i].key))
+			s[n - 1].sum += s[i].sum;
+		else
+			s[n++] = s[i];
+    }
+    qsort (s, n, sizeof (*s), by_sum);
+
+    printf ("\n%-10s %12s\n", "student", "total");
+    for (size_t i = 0; (i < n) && (i < query_options.top); i++) {
+		if (s[i].key)
+			printf ("%-10u %12s\n", s[i].key, wallet_format_cents (sum_char, sizeof (sum_char), s[i].sum));
+		else
+			printf ("%-10s %12s\n", "-", wallet_format_cents (sum_char, sizeof (sum_char), s[i].sum));
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch, res = EXIT_SUCCESS;
+    char sum_char[24];
+
+    while ((ch = getopt (argc, argv, "hn:s:t:")) != -1) {
+		switch (ch) {
+		case 'n':
+			query_options.top = strtoul (optarg, NULL, 10);
+			break;
+		case 's':
+			query_options.student = strtol (optarg, NULL, 10);
+			break;
+		case 't':
+			query_options.terminal = strtol (optarg, NULL, 10);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+    if (optind == argc) {
+		usage(argv[0]);
+		exit (EXIT_FAILURE);
+    }
+
+    for (int i = optind; i < argc; i++)
+		if (query_file (argv[i]) < 0)
+			res = EXIT_FAILURE;
+
+    printf ("%llu rows, total %s\n", (unsigned long long) query_totals.count,
+	    wallet_format_cents (sum_char, sizeof (sum_char), query_totals.sum));
+    if (query_options.top)
+		print_top ();
+
+    free (query_totals.students);
+    exit (res);
+}
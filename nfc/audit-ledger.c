@@ -0,0 +1,458 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+/*
+ * Seal and check the sales and topup ledgers (wallet-audit.h):
+ *
+ *     audit-ledger [-b rows] [-F]
+ *     audit-ledger -v [-A]
+ *     audit-ledger -p sales|topup:id
+ *
+ * Without options, seals the rows committed since the last run in batches
+ * of -b rows; -F also seals the last, partial batch. Run it from cron.
+ *
+ * -v checks the batches sealed since the last check: their rows against the
+ * root, the chain from the last batch checked, and each seal against its
+ * copy in the spool directory. -A checks every batch again; rows moved out
+ * by ledger-partitions -a can no longer be checked.
+ *
+ * -p prints the inclusion proof of one ledger row.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-audit.h"
+#include "wallet-db.h"
+
+#define DEFAULT_BATCH	1024
+#define SEAL_COLUMNS	"batch, first_id, last_id, entries, root, chain"
+
+struct {
+    size_t batch;
+    int flush;
+    int verify;
+    int all;
+    const char *proof;
+} audit_options = {
+    .batch = DEFAULT_BATCH
+};
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-b rows] [-F]\n", progname);
+    fprintf (stderr, "       %s -v [-A]\n", progname);
+    fprintf (stderr, "       %s -p sales|topup:id\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -b     Rows per batch (default %d)\n", DEFAULT_BATCH);
+    fprintf (stderr, "  -F     Also seal the last, partial batch\n");
+    fprintf (stderr, "  -v     Check the batches sealed since the last check\n");
+    fprintf (stderr, "  -A     With -v, check every batch\n");
+    fprintf (stderr, "  -p     Print the inclusion proof of a ledger row\n");
+}
+
+static int
+seal_from_row (MYSQL_ROW row, const unsigned long *lengths, enum wallet_audit_ledger ledger, struct wallet_audit_seal *seal)
+{
+    memset (seal, 0, sizeof (*seal));
+    seal->ledger = ledger;
+    seal->batch = strtoull (row[0], NULL, 10);
+    seal->first_id = strtoull (row[1], NULL, 10);
+    seal->last_id = strtoull (row[2], NULL, 10);
+    seal->entries = strtoul (row[3], NULL, 10);
+    if ((lengths[4] != WALLET_AUDIT_HASH_LEN) || (lengths[5] != WALLET_AUDIT_HASH_LEN))
+		return -1;
+    memcpy (seal->root, row[4], WALLET_AUDIT_HASH_LEN);
+    memcpy (seal->chain, row[5], WALLET_AUDIT_HASH_LEN);
+    return 0;
+}
+
+/*
+ * The first seal of the ledger matching cond (with its ORDER BY). Returns 1
+ * when found, 0 when not and -1 on error.
+ */
+static int
+select_seal (MYSQL *conn, enum wallet_audit_ledger ledger, struct wallet_audit_seal *seal, const char *cond)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int found = 0;
+
+    if (wallet_db_exec (conn, "SELECT " SEAL_COLUMNS " FROM audit_batch WHERE ledger='%s' %s LIMIT 1", wallet_audit_ledger_name (ledger), cond) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn))) {
+		warnx ("mysql_store_result: %s", mysql_error (conn));
+		return -1;
+    }
+    if ((row = mysql_fetch_row (result))) {
+		if (seal_from_row (row, mysql_fetch_lengths (result), ledger, seal) < 0) {
+			warnx ("%s batch %s: malformed seal", wallet_audit_ledger_name (ledger), row[0]);
+			found = -1;
+		} else {
+			found = 1;
+		}
+    }
+    mysql_free_result (result);
+
+    return found;
+}
+
+static int
+store_seal (MYSQL *conn, const struct wallet_audit_seal *seal)
+{
+    char root_hex[2 * WALLET_AUDIT_HASH_LEN + 1], chain_hex[2 * WALLET_AUDIT_HASH_LEN + 1];
+
+    if ((wallet_db_begin (conn) < 0) ||
+	(wallet_db_exec (conn, "INSERT INTO audit_batch (ledger, " SEAL_COLUMNS ", sealed) VALUES ('%s', %llu, %llu, %llu, %u, X'%s', X'%s', NOW())",
+			 wallet_audit_ledger_name (seal->ledger), (unsigned long long) seal->batch, (unsigned long long) seal->first_id,
+			 (unsigned long long) seal->last_id, seal->entries, wallet_audit_hex (seal->root, root_hex),
+			 wallet_audit_hex (seal->chain, chain_hex)) < 0) ||
+	(wallet_audit_append (seal) < 0) ||
+	(wallet_db_commit (conn) < 0)) {
+		wallet_db_rollback (conn);
+		return -1;
+    }
+    return 0;
+}
+
+/*
+ * Seal the ledger rows up to the horizon of the previous run, then move
+ * the horizon up to the rows there are now.
+ */
+static int
+seal_ledger (MYSQL *conn, enum wallet_audit_ledger ledger, wallet_audit_hash *hashes, uint64_t *ids)
+{
+    const char *name = wallet_audit_ledger_name (ledger);
+    struct wallet_audit_seal last, seal;
+    wallet_audit_hash prev;
+    char value[24];
+    uint64_t horizon = 0;
+    long n;
+    int found, sealed = 0;
+
+    if ((found = select_seal (conn, ledger, &last, "ORDER BY batch DESC")) < 0)
+		return -1;
+    if (!found)
+		memset (&last, 0, sizeof (last));
+    memcpy (prev, last.chain, WALLET_AUDIT_HASH_LEN);
+
+    if ((found = wallet_db_select_str (conn, value, sizeof (value), "SELECT horizon FROM audit_horizon WHERE ledger='%s'", name)) < 0)
+		return -1;
+    if (found)
+		horizon = strtoull (value, NULL, 10);
+
+    while ((n = wallet_audit_hash_rows (conn, ledger, last.last_id, horizon, audit_options.batch, hashes, ids)) > 0) {
+		if (((size_t) n < audit_options.batch) && !audit_options.flush)
+			break;
+
+		memset (&seal, 0, sizeof (seal));
+		seal.ledger = ledger;
+		seal.batch = last.batch + 1;
+		seal.first_id = ids[0];
+		seal.last_id = ids[n - 1];
+		seal.entries = n;
+		wallet_audit_root (hashes, n, seal.root);
+		wallet_audit_chain (prev, &seal, seal.chain);
+		if (store_seal (conn, &seal) < 0)
+			return -1;
+
+		memcpy (prev, seal.chain, WALLET_AUDIT_HASH_LEN);
+		last = seal;
+		sealed++;
+    }
+    if (n < 0)
+		return -1;
+
+    if ((wallet_db_select_str (conn, value, sizeof (value), "SELECT COALESCE(MAX(id), 0) FROM %s", name) < 0) ||
+	(wallet_db_exec (conn, "REPLACE INTO audit_horizon (ledger, horizon) VALUES ('%s', %s)", name, value) < 0))
+		return -1;
+
+    printf ("%s: %d batches sealed, up to id %llu\n", name, sealed, (unsigned long long) last.last_id);
+    return 0;
+}
+
+/*
+ * Check one batch against its rows, the chain and its copy. Returns 0 when
+ * it holds, 1 when it does not and -1 on error.
+ */
+static int
+verify_batch (MYSQL *conn, const struct wallet_audit_seal *seal, const wallet_audit_hash prev, wallet_audit_hash *hashes)
+{
+    const char *name = wallet_audit_ledger_name (seal->ledger);
+    struct wallet_audit_seal copy;
+    wallet_audit_hash hash;
+    long n;
+    int found, broken = 0;
+
+    if ((found = wallet_audit_find (seal->ledger, seal->batch, &copy)) < 0)
+		return -1;
+    if (!found) {
+		printf ("%s batch %llu: no copy of the seal in the spool\n", name, (unsigned long long) seal->batch);
+		broken = 1;
+    } else if (memcmp (&copy, seal, sizeof (copy))) {
+		printf ("%s batch %llu: seal differs from its copy\n", name, (unsigned long long) seal->batch);
+		broken = 1;
+    }
+
+    wallet_audit_chain (prev, seal, hash);
+    if (memcmp (hash, seal->chain, WALLET_AUDIT_HASH_LEN)) {
+		printf ("%s batch %llu: chain broken\n", name, (unsigned long long) seal->batch);
+		broken = 1;
+    }
+
+    /* One row more than sealed, to catch rows added in the range. */
+    if ((n = wallet_audit_hash_rows (conn, seal->ledger, seal->first_id - 1, seal->last_id, seal->entries + 1, hashes, NULL)) < 0)
+		return -1;
+    if ((size_t) n != seal->entries) {
+		printf ("%s batch %llu: %ld rows in ids %llu-%llu, %u sealed\n", name, (unsigned long long) seal->batch, n,
+			(unsigned long long) seal->first_id, (unsigned long long) seal->last_id, seal->entries);
+		broken = 1;
+    } else {
+		wallet_audit_root (hashes, n, hash);
+		if (memcmp (hash, seal->root, WALLET_AUDIT_HASH_LEN)) {
+			printf ("%s batch %llu: rows changed since sealed (ids %llu-%llu)\n", name, (unsigned long long) seal->batch,
+				(unsigned long long) seal->first_id, (unsigned long long) seal->last_id);
+			broken = 1;
+		}
+    }
+
+    return broken;
+}
+
+static int
+verify_ledger (MYSQL *conn, enum wallet_audit_ledger ledger)
+{
+    const char *name = wallet_audit_ledger_name (ledger);
+    struct wallet_audit_seal last, seal;
+    wallet_audit_hash prev, *hashes = NULL;
+    size_t hashes_len = 0;
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int found, res, checked = 0, broken = 0;
+
+    memset (&last, 0, sizeof (last));
+    if (!audit_options.all) {
+		if ((found = select_seal (conn, ledger, &last, "AND verified IS NOT NULL ORDER BY batch DESC")) < 0)
+			return -1;
+		/* The seal the chain goes on from must still be the one checked. */
+		if (found && ((1 != wallet_audit_find (ledger, last.batch, &seal)) || memcmp (&seal, &last, sizeof (seal)))) {
+			printf ("%s batch %llu: seal differs from its copy\n", name, (unsigned long long) last.batch);
+			return 1;
+		}
+    }
+    memcpy (prev, last.chain, WALLET_AUDIT_HASH_LEN);
+
+    /* Buffered: the rows of each batch are read while going through them. */
+    if (wallet_db_exec (conn, "SELECT " SEAL_COLUMNS " FROM audit_batch WHERE ledger='%s' AND batch > %llu ORDER BY batch",
+			name, (unsigned long long) last.batch) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn))) {
+		warnx ("mysql_store_result: %s", mysql_error (conn));
+		return -1;
+    }
+
+    while ((row = mysql_fetch_row (result))) {
+		if (seal_from_row (row, mysql_fetch_lengths (result), ledger, &seal) < 0) {
+			printf ("%s batch %s: malformed seal\n", name, row[0]);
+			broken++;
+			break;
+		}
+		if (seal.batch != last.batch + 1) {
+			printf ("%s batches %llu-%llu missing\n", name, (unsigned long long) last.batch + 1, (unsigned long long) seal.batch - 1);
+			broken++;
+		}
+		if (seal.entries + 1 > hashes_len) {
+			free (hashes);
+			hashes_len = seal.entries + 1;
+			if (!(hashes = malloc (hashes_len * sizeof (*hashes)))) {
+				warn ("malloc");
+				broken = -1;
+				break;
+			}
+		}
+
+		if ((res = verify_batch (conn, &seal, prev, hashes)) < 0) {
+			broken = -1;
+			break;
+		}
+		if (res)
+			broken++;
+		else if (wallet_db_exec (conn, "UPDATE audit_batch SET verified=NOW() WHERE ledger='%s' AND batch=%llu", name, (unsigned long long) seal.batch) < 0) {
+			broken = -1;
+			break;
+		}
+
+		/* Go on from the stored chain, so that one bad batch is reported once. */
+		memcpy (prev, seal.chain, WALLET_AUDIT_HASH_LEN);
+		last = seal;
+		checked++;
+    }
+    mysql_free_result (result);
+    free (hashes);
+
+    if (broken < 0)
+		return -1;
+    printf ("%s: %d batches checked, %d failed\n", name, checked, broken);
+    return broken ? 1 : 0;
+}
+
+static int
+print_proof (MYSQL *conn, const char *arg)
+{
+    const char *colon = strchr (arg, ':');
+    enum wallet_audit_ledger ledger;
+    struct wallet_audit_seal seal;
+    wallet_audit_hash *hashes = NULL, path[WALLET_AUDIT_PROOF_MAX], leaf;
+    uint64_t *ids = NULL, id;
+    char cond[64], hex[2 * WALLET_AUDIT_HASH_LEN + 1];
+    size_t index, path_len;
+    long n;
+    int found, res = -1;
+
+    if (colon && (colon - arg == 5) && (0 == strncmp (arg, "sales", 5)))
+		ledger = WALLET_AUDIT_SALES;
+    else if (colon && (colon - arg == 5) && (0 == strncmp (arg, "topup", 5)))
+		ledger = WALLET_AUDIT_TOPUP;
+    else {
+		warnx ("%s: expected sales:id or topup:id", arg);
+		return -1;
+    }
+    id = strtoull (colon + 1, NULL, 10);
+
+    snprintf (cond, sizeof (cond), "AND first_id <= %llu AND last_id >= %llu ORDER BY last_id", (unsigned long long) id, (unsigned long long) id);
+    if ((found = select_seal (conn, ledger, &seal, cond)) < 0)
+		return -1;
+    if (!found) {
+		printf ("%s %llu: not sealed yet\n", wallet_audit_ledger_name (ledger), (unsigned long long) id);
+		return -1;
+    }
+
+    if (!(hashes = malloc ((seal.entries + 1) * sizeof (*hashes))) || !(ids = malloc ((seal.entries + 1) * sizeof (*ids)))) {
+		warn ("malloc");
+		goto out;
+    }
+    if ((n = wallet_audit_hash_rows (conn, ledger, seal.first_id - 1, seal.last_id, seal.entries + 1, hashes, ids)) < 0)
+		goto out;
+    for (index = 0; (index < (size_t) n) && (ids[index] != id); index++)
+		;
+    if (index == (size_t) n) {
+		printf ("%s %llu: not in the ledger\n", wallet_audit_ledger_name (ledger), (unsigned long long) id);
+		goto out;
+    }
+
+    memcpy (leaf, hashes[index], WALLET_AUDIT_HASH_LEN);
+    path_len = wallet_audit_proof (hashes, n, index, path);
+
+    printf ("%s %llu: batch %llu, leaf %zu of %u\n", wallet_audit_ledger_name (ledger), (unsigned long long) id,
+	    (unsigned long long) seal.batch, index, seal.entries);
+    printf ("leaf  %s\n", wallet_audit_hex (leaf, hex));
+    for (size_t i = 0; i < path_len; i++)
+		printf ("path  %s\n", wallet_audit_hex (path[i], hex));
+    printf ("root  %s\n", wallet_audit_hex (seal.root, hex));
+    printf ("chain %s\n", wallet_audit_hex (seal.chain, hex));
+
+    if (((size_t) n == seal.entries) && wallet_audit_proof_verify (leaf, index, n, (const wallet_audit_hash *) path, path_len, seal.root)) {
+		printf ("proof holds\n");
+		res = 0;
+    } else {
+		printf ("proof does not hold: the batch changed since sealed\n");
+    }
+
+out:
+    free (hashes);
+    free (ids);
+    return res;
+}
+
+int
+main(int argc, char *argv[])
+{
+    wallet_audit_hash *hashes;
+    uint64_t *ids;
+    int ch, res = EXIT_SUCCESS;
+
+    while ((ch = getopt (argc, argv, "Ab:Fhp:v")) != -1) {
+		switch (ch) {
+		case 'A':
+			audit_options.all = 1;
+			break;
+		case 'b':
+			audit_options.batch = strtoul (optarg, NULL, 10);
+			break;
+		case 'F':
+			audit_options.flush = 1;
+			break;
+		case 'p':
+			audit_options.proof = optarg;
+			break;
+		case 'v':
+			audit_options.verify = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+    if (!audit_options.batch) {
+		usage(argv[0]);
+		exit (EXIT_FAILURE);
+    }
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    if (audit_options.proof) {
+		if (print_proof (conn, audit_options.proof) < 0)
+			res = EXIT_FAILURE;
+    } else if (audit_options.verify) {
+		for (int l = WALLET_AUDIT_SALES; l <= WALLET_AUDIT_TOPUP; l++)
+			if (verify_ledger (conn, l) != 0)
+				res = EXIT_FAILURE;
+    } else {
+		if (!(hashes = malloc (audit_options.batch * sizeof (*hashes))) || !(ids = malloc (audit_options.batch * sizeof (*ids))))
+			err (EXIT_FAILURE, "malloc");
+		for (int l = WALLET_AUDIT_SALES; l <= WALLET_AUDIT_TOPUP; l++)
+			if (seal_ledger (conn, l, hashes, ids) < 0)
+				res = EXIT_FAILURE;
+		free (hashes);
+		free (ids);
+    }
+
+	mysql_close(conn);
+    exit (res);
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+/*
+ * Balance of a student at a past moment, for disputes:
+ *
+ *     balance-at student_id [YYYY-MM-DD HH:MM[:SS]]
+ *     balance-at -c [-k days]
+ *
+ * The balance is read from the last checkpoint taken before that moment
+ * and the sales, top-ups and transfers of the student recorded after the
+ * checkpoint up to that moment are replayed on it (see
+ * schema/008-balance-checkpoints.sql). A student enrolled after the
+ * checkpoint starts from the opening balance in student_change.
+ *
+ * -c takes a checkpoint of every balance; run it from cron, daily or more
+ * often. With -k, checkpoints older than that many days are removed.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+
+struct {
+    int checkpoint;
+    int keep_days;		/* 0 to keep every checkpoint */
+} balance_options;
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s student_id [YYYY-MM-DD HH:MM[:SS]]\n", progname);
+    fprintf (stderr, "       %s -c [-k days]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -c     Take a checkpoint of every balance\n");
+    fprintf (stderr, "  -k     With -c, remove the checkpoints older than this many days\n");
+}
+
+static int
+take_checkpoint (MYSQL *conn)
+{
+    char count[24], taken[24], sales_id[24], topup_id[24], transfer_id[24];
+
+    if ((wallet_db_exec (conn, "SET TRANSACTION ISOLATION LEVEL READ COMMITTED") < 0) || (wallet_db_begin (conn) < 0))
+		return -1;
+
+    /*
+     * Every transaction changing a balance locks the student row before it
+     * adds its ledger row. Share-locking all of them waits for those in
+     * flight and holds off new ones until the commit, so that the ledger ids
+     * read next split the rows into those in the balances and the others.
+     */
+    if ((wallet_db_select_str (conn, count, sizeof (count), "SELECT COUNT(*) FROM student LOCK IN SHARE MODE") < 0) ||
+	(wallet_db_select_str (conn, taken, sizeof (taken), "SELECT NOW()") < 0) ||
+	(wallet_db_select_str (conn, sales_id, sizeof (sales_id), "SELECT COALESCE(MAX(id), 0) FROM sales") < 0) ||
+	(wallet_db_select_str (conn, topup_id, sizeof (topup_id), "SELECT COALESCE(MAX(id), 0) FROM topup") < 0) ||
+	(wallet_db_select_str (conn, transfer_id, sizeof (transfer_id), "SELECT COALESCE(MAX(id), 0) FROM transfer") < 0))
+		goto error;
+
+    if ((wallet_db_exec (conn, "INSERT INTO balance_checkpoint (taken, sales_id, topup_id, transfer_id) VALUES ('%s', %s, %s, %s)",
+			 taken, sales_id, topup_id, transfer_id) < 0) ||
+	(wallet_db_exec (conn, "INSERT INTO checkpoint_balance (taken, student_id, student, balance) SELECT '%s', student_id, id, balance FROM student", taken) < 0) ||
+	(wallet_db_commit (conn) < 0))
+		goto error;
+
+    printf ("Checkpoint %s: %s balances\n", taken, count);
+
+    if (balance_options.keep_days &&
+	((wallet_db_exec (conn, "DELETE FROM checkpoint_balance WHERE taken < NOW() - INTERVAL %d DAY", balance_options.keep_days) < 0) ||
+	 (wallet_db_exec (conn, "DELETE FROM balance_checkpoint WHERE taken < NOW() - INTERVAL %d DAY", balance_options.keep_days) < 0)))
+		return -1;
+
+    return 0;
+
+error:
+    wallet_db_rollback (conn);
+    return -1;
+}
+
+/*
+ * Opening balance of a student enrolled after the checkpoint (or with no
+ * checkpoint at all). Returns 1 when found, 0 when the student was not
+ * enrolled yet at the given moment and -1 when student_change no longer
+ * has it.
+ */
+static int
+opening_balance (MYSQL *conn, const char *id_esc, const char *after, const char *at, long *balance)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int res = -1;
+
+    if (wallet_db_exec (conn, "SELECT time, balance FROM student_change WHERE time > '%s' AND student_id='%s' AND deleted=0 ORDER BY id LIMIT 1",
+			after, id_esc) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn))) {
+		warnx ("mysql_store_result: %s", mysql_error (conn));
+		return -1;
+    }
+    if ((row = mysql_fetch_row (result))) {
+		if (strcmp (row[0], at) > 0) {
+			res = 0;
+		} else {
+			*balance = wallet_parse_cents (row[1]);
+			res = 1;
+		}
+    }
+    mysql_free_result (result);
+
+    return res;
+}
+
+static int
+balance_at (MYSQL *conn, const char *student_id, const char *at)
+{
+    ulong id_length = strlen (student_id);
+    char id_esc[(2 * id_length) + 1];
+    char taken[24] = "1970-01-01 00:00:00", keys[256] = "", key[16], aliases[200] = "";
+    char balance_char[16], sales_char[16], topups_char[16], transfers_char[16];
+    unsigned long long sales_id = 0, topup_id = 0, transfer_id = 0;
+    long base = 0, sales = 0, topups = 0, transfers = 0;
+    int checkpoint = 0, found;
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    mysql_real_escape_string (conn, id_esc, student_id, id_length);
+
+    /* The last checkpoint before, with the student's balance if it had one. */
+    if (wallet_db_exec (conn, "SELECT c.taken, c.sales_id, c.topup_id, c.transfer_id, b.balance, b.student FROM balance_checkpoint c "
+			"LEFT JOIN checkpoint_balance b ON b.taken=c.taken AND b.student_id='%s' WHERE c.taken <= '%s' ORDER BY c.taken DESC LIMIT 1",
+			id_esc, at) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn))) {
+		warnx ("mysql_store_result: %s", mysql_error (conn));
+		return -1;
+    }
+    if ((row = mysql_fetch_row (result))) {
+		snprintf (taken, sizeof (taken), "%s", row[0]);
+		sales_id = strtoull (row[1], NULL, 10);
+		topup_id = strtoull (row[2], NULL, 10);
+		transfer_id = strtoull (row[3], NULL, 10);
+		if (row[4]) {
+			base = wallet_parse_cents (row[4]);
+			snprintf (keys, sizeof (keys), "%s", row[5]);
+			checkpoint = 1;
+		}
+    }
+    mysql_free_result (result);
+
+    /*
+     * Ledger rows name the student by key: lost-card used to give it a new
+     * one, kept as an alias of the current key since.
+     */
+    if ((found = wallet_db_select_str (conn, key, sizeof (key), "SELECT id FROM student WHERE student_id='%s'", id_esc)) < 0)
+		return -1;
+    if (found && (wallet_db_select_str (conn, aliases, sizeof (aliases), "SELECT GROUP_CONCAT(alias) FROM student_key_alias WHERE student=%s", key) < 0))
+		return -1;
+    if (found && strcmp (key, keys))
+		snprintf (keys + strlen (keys), sizeof (keys) - strlen (keys), "%s%s", keys[0] ? ", " : "", key);
+    if (strlen (aliases) == sizeof (aliases) - 1) {
+		warnx ("%s: too many former keys", student_id);
+		return -1;
+    }
+    if (aliases[0])
+		snprintf (keys + strlen (keys), sizeof (keys) - strlen (keys), ", %s", aliases);
+    if (!keys[0]) {
+		printf ("%s: no such student\n", student_id);
+		return -1;
+    }
+
+    if (!checkpoint) {
+		if ((found = opening_balance (conn, id_esc, taken, at, &base)) == 0) {
+			printf ("%s was not enrolled yet at %s\n", student_id, at);
+			return 0;
+		}
+		if (found < 0)
+			warnx ("%s: opening balance no longer in student_change, counted as 0", student_id);
+    }
+
+    if ((wallet_db_select_cents (conn, &sales, "SELECT COALESCE(SUM(price), 0) FROM sales WHERE student IN (%s) AND id > %llu AND time <= '%s'",
+				 keys, sales_id, at) < 0) ||
+	(wallet_db_select_cents (conn, &topups, "SELECT COALESCE(SUM(amount), 0) FROM topup WHERE student IN (%s) AND id > %llu AND time <= '%s'",
+				 keys, topup_id, at) < 0) ||
+	(wallet_db_select_cents (conn, &transfers, "SELECT COALESCE(SUM(IF(to_student='%s', amount, -amount)), 0) FROM transfer "
+				 "WHERE (from_student='%s' OR to_student='%s') AND id > %llu AND time <= '%s'",
+				 id_esc, id_esc, id_esc, transfer_id, at) < 0))
+		return -1;
+
+    printf ("%s at %s: RM%s\n", student_id, at, wallet_format_cents (balance_char, sizeof (balance_char), base - sales + topups + transfers));
+    printf ("  %-12s %s %s\n", checkpoint ? "checkpoint" : "opening", checkpoint ? taken : "", wallet_format_cents (balance_char, sizeof (balance_char), base));
+    printf ("  %-12s -%s\n", "sales", wallet_format_cents (sales_char, sizeof (sales_char), sales));
+    printf ("  %-12s +%s\n", "top-ups", wallet_format_cents (topups_char, sizeof (topups_char), topups));
+    printf ("  %-12s %s%s\n", "transfers", (transfers < 0) ? "" : "+", wallet_format_cents (transfers_char, sizeof (transfers_char), transfers));
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *progname = argv[0];
+    char at[20];
+    struct tm tm;
+    time_t now;
+    int ch, res;
+
+    while ((ch = getopt (argc, argv, "chk:")) != -1) {
+		switch (ch) {
+		case 'c':
+			balance_options.checkpoint = 1;
+			break;
+		case 'k':
+			balance_options.keep_days = atoi (optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (!balance_options.checkpoint) {
+		if ((argc < 1) || (argc > 2)) {
+			usage(progname);
+			exit (EXIT_FAILURE);
+		}
+
+		/* Parsed and printed again: the moment goes into the queries. */
+		memset (&tm, 0, sizeof (tm));
+		if (argc == 2) {
+			if (sscanf (argv[1], "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) < 5)
+				errx (EXIT_FAILURE, "%s: expected YYYY-MM-DD HH:MM[:SS]", argv[1]);
+			if ((tm.tm_year < 1000) || (tm.tm_year > 9999) || (tm.tm_mon < 1) || (tm.tm_mon > 12) || (tm.tm_mday < 1) || (tm.tm_mday > 31) ||
+			    (tm.tm_hour < 0) || (tm.tm_hour > 23) || (tm.tm_min < 0) || (tm.tm_min > 59) || (tm.tm_sec < 0) || (tm.tm_sec > 59))
+				errx (EXIT_FAILURE, "%s: no such moment", argv[1]);
+			snprintf (at, sizeof (at), "%04d-%02d-%02d %02d:%02d:%02d", tm.tm_year, tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		} else {
+			now = time (NULL);
+			strftime (at, sizeof (at), "%Y-%m-%d %H:%M:%S", localtime (&now));
+		}
+    }
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    if (balance_options.checkpoint)
+		res = take_checkpoint (conn);
+    else
+		res = balance_at (conn, argv[0], at);
+
+	mysql_close(conn);
+    exit ((res < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
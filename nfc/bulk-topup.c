@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Bulk topup runner: credit many students at once from a file of
+ *
+ *     student_id,amount
+ *
+ * lines (scholarships, refunds, monthly allowances). The credits are applied
+ * server-side in chunked transactions and queued in pending_credit, so each
+ * card picks its credit up on its next tap.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <time.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+#include "wallet-card.h"
+#include "wallet-event.h"
+
+#define DEFAULT_CHUNK	500
+#define ROW_SQL_MAX	64
+
+struct topup_line {
+    size_t line;
+    char student_id[WALLET_ID_LEN + 1];
+    long amount;
+};
+
+struct {
+    size_t chunk;
+    const char *reason;
+} bulk_options = {
+    .chunk  = DEFAULT_CHUNK,
+    .reason = "bulk"
+};
+
+struct {
+    size_t lines;
+    size_t credited;
+    size_t failed;
+    long amount;
+} bulk_stats;
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-n chunk] [-r reason] [file]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -n     Number of credits per transaction (default %d)\n", DEFAULT_CHUNK);
+    fprintf (stderr, "  -r     Reason recorded with the pending card credits (default \"bulk\")\n");
+    fprintf (stderr, "\nReads \"student_id,amount\" lines from file, or from stdin.\n");
+}
+
+void
+report_failure (size_t line, const char *student_id, const char *reason)
+{
+    fprintf (stderr, "line %zu: %s: %s\n", line, student_id, reason);
+    bulk_stats.failed++;
+}
+
+/*
+ * Parse "student_id,amount". Blank lines and lines starting with '#' are
+ * skipped (returns 0); malformed lines are reported (returns -1).
+ */
+int
+parse_line (char *buffer, size_t line, struct topup_line *entry)
+{
+    char *id, *amount, *end, *p;
+    int digits = 0, decimals = -1;
+
+    buffer[strcspn (buffer, "\r\n")] = '\0';
+    for (id = buffer; isspace ((unsigned char) *id); id++)
+		;
+    if ((*id == '\0') || (*id == '#'))
+		return 0;
+
+    if (!(amount = strchr (id, ','))) {
+		report_failure (line, id, "missing amount");
+		return -1;
+    }
+    *amount++ = '\0';
+    for (end = amount - 2; (end >= id) && isspace ((unsigned char) *end); end--)
+		*end = '\0';
+
+    if ((strlen (id) == 0) || (strlen (id) > WALLET_ID_LEN)) {
+		report_failure (line, id, "invalid student ID");
+		return -1;
+    }
+    for (end = amount; isspace ((unsigned char) *end); end++)
+		;
+    /* Ringgit with up to two decimals, nothing after but spaces. */
+    for (p = end; isdigit ((unsigned char) *p); p++)
+		digits++;
+    if (*p == '.')
+		for (p++, decimals = 0; isdigit ((unsigned char) *p); p++)
+			decimals++;
+    while (isspace ((unsigned char) *p))
+		p++;
+    if (!digits || (decimals == 0) || (decimals > 2) || (*p != '\0')) {
+		report_failure (line, id, "invalid amount");
+		return -1;
+    }
+
+    entry->line = line;
+    snprintf (entry->student_id, sizeof (entry->student_id), "%s", id);
+    entry->student_id[0] = toupper (entry->student_id[0]);
+    entry->student_id[1] = toupper (entry->student_id[1]);
+    entry->amount = wallet_parse_cents (end);
+
+    if ((entry->amount <= 0) || (entry->amount >= WALLET_BALANCE_LIMIT)) {
+		report_failure (line, entry->student_id, "amount out of range");
+		return -1;
+    }
+    return 1;
+}
+
+/*
+ * Whether student_id already appears in the chunk. A multi-table UPDATE only
+ * changes a row once, so the same student must not occur twice in a chunk.
+ */
+int
+chunk_contains (const struct topup_line *chunk, size_t count, const char *student_id)
+{
+    for (size_t i = 0; i < count; i++)
+		if (0 == strcmp (chunk[i].student_id, student_id))
+			return 1;
+    return 0;
+}
+
+/*
+ * Credit one chunk in a single transaction. Returns 0 on success, 1 if it
+ * was rolled back by a deadlock or lock wait timeout and is worth another
+ * try, -1 on any other error.
+ */
+int
+apply_chunk_once (MYSQL *conn, const struct topup_line *chunk, size_t count, char *sql_stmnt, size_t sql_len, size_t *credited)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    struct wallet_event *events = NULL;
+    size_t n, rejected = 0, published = 0;
+    int retry;
+
+    /* The staging table is MEMORY (not transactional): reload it each time. */
+    if (wallet_db_exec (conn, "DELETE FROM bulk_topup") < 0)
+		return -1;
+
+    n = snprintf (sql_stmnt, sql_len, "INSERT INTO bulk_topup (student_id, line, amount) VALUES ");
+    for (size_t i = 0; i < count; i++) {
+		char id_esc[(2 * WALLET_ID_LEN) + 1];
+		char amount_char[16];
+
+		mysql_real_escape_string (conn, id_esc, chunk[i].student_id, strlen (chunk[i].student_id));
+		n += snprintf (sql_stmnt + n, sql_len - n, "%s('%s', %zu, %s)", i ? ", " : "",
+			       id_esc, chunk[i].line, wallet_format_cents (amount_char, sizeof (amount_char), chunk[i].amount));
+    }
+    if (mysql_real_query (conn, sql_stmnt, n)) {
+		warnx ("INSERT INTO bulk_topup: %s", mysql_error (conn));
+		return -1;
+    }
+
+    if (wallet_db_begin (conn) < 0)
+		return -1;
+
+    /*
+     * Lock every student of the chunk in student_id order, like the transfer
+     * engine, before anything is checked: the limit is then checked and
+     * applied against balances no one else can change in between.
+     */
+    if (wallet_db_exec (conn, "SELECT s.id FROM student s JOIN bulk_topup b ON s.student_id=b.student_id ORDER BY s.student_id FOR UPDATE") < 0)
+		goto error;
+    if (!(result = mysql_store_result (conn)))
+		goto error;
+    mysql_free_result (result);
+
+    /* Report the credits that cannot be applied. */
+    if (wallet_db_exec (conn, "SELECT b.line, b.student_id, s.student_id IS NULL FROM bulk_topup b LEFT JOIN student s ON s.student_id=b.student_id "
+			"WHERE s.student_id IS NULL OR s.balance+b.amount>=%d ORDER BY b.student_id FOR UPDATE", WALLET_BALANCE_LIMIT / 100) < 0)
+		goto error;
+    if (!(result = mysql_store_result (conn)))
+		goto error;
+    while ((row = mysql_fetch_row (result))) {
+		report_failure (strtoul (row[0], NULL, 10), row[1], (row[2][0] == '1') ? "no such student" : "balance limit exceeded");
+		rejected++;
+    }
+    mysql_free_result (result);
+
+    if (rejected && (wallet_db_exec (conn, "DELETE b FROM bulk_topup b LEFT JOIN student s ON s.student_id=b.student_id "
+				    "WHERE s.student_id IS NULL OR s.balance+b.amount>=%d", WALLET_BALANCE_LIMIT / 100) < 0))
+		goto error;
+
+    if (wallet_db_exec (conn, "UPDATE student s JOIN bulk_topup b ON s.student_id=b.student_id SET s.balance=s.balance+b.amount") < 0)
+		goto error;
+    *credited = (size_t) mysql_affected_rows (conn);
+
+    //log activity into database, one multi-row insert per ledger
+    if (wallet_db_exec (conn, "INSERT INTO topup (time, amount, uid, student) SELECT NOW(), b.amount, s.uid, s.id FROM bulk_topup b JOIN student s ON s.student_id=b.student_id") < 0)
+		goto error;
+    if (wallet_db_exec (conn, "INSERT INTO pending_credit (student_id, amount, reason, created) SELECT student_id, amount, '%s', NOW() FROM bulk_topup",
+			bulk_options.reason) < 0)
+		goto error;
+
+    /* The credits applied, published once they are committed. */
+    if (wallet_db_exec (conn, "SELECT b.student_id, s.uid, b.amount, s.balance FROM bulk_topup b JOIN student s ON s.student_id=b.student_id") < 0)
+		goto error;
+    if (!(result = mysql_store_result (conn)))
+		goto error;
+    if (!(events = calloc (mysql_num_rows (result) + 1, sizeof (*events)))) {
+		mysql_free_result (result);
+		goto error;
+    }
+    while ((row = mysql_fetch_row (result))) {
+		unsigned long *lengths = mysql_fetch_lengths (result);
+		struct wallet_event *ev = &events[published++];
+
+		wallet_event_init (ev, WALLET_EVENT_TOPUP, NULL, row[0]);
+		if (row[1])
+			ev->uid_len = wallet_uid_bytes (row[1], lengths[1], ev->uid);
+		ev->amount = wallet_parse_cents (row[2]);
+		ev->balance = wallet_parse_cents (row[3]);
+    }
+    mysql_free_result (result);
+
+    if (wallet_db_commit (conn) < 0)
+		goto error;
+
+    wallet_event_publish (events, published);
+    free (events);
+    return 0;
+
+error:
+    retry = wallet_db_abort (conn);
+    free (events);
+    bulk_stats.failed -= rejected;
+    return retry ? 1 : -1;
+}
+
+int
+apply_chunk (MYSQL *conn, const struct topup_line *chunk, size_t count, char *sql_stmnt, size_t sql_len)
+{
+    size_t credited = 0;
+    long amount = 0;
+    int res;
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+		if (0 == (res = apply_chunk_once (conn, chunk, count, sql_stmnt, sql_len, &credited))) {
+			for (size_t i = 0; i < count; i++)
+				amount += chunk[i].amount;
+			bulk_stats.credited += credited;
+			bulk_stats.amount += amount;
+			return 0;
+		}
+		if (res < 0)
+			break;
+    }
+
+    for (size_t i = 0; i < count; i++)
+		report_failure (chunk[i].line, chunk[i].student_id, "not applied (database error)");
+    return -1;
+}
+
+void
+display_progress (const struct timespec *start)
+{
+    struct timespec now;
+    double elapsed;
+    char amount_char[32];
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1E9;
+
+    printf ("%zu lines, %zu credited, %zu failed, RM%s (%.0f lines/s)\n",
+	    bulk_stats.lines, bulk_stats.credited, bulk_stats.failed,
+	    wallet_format_cents (amount_char, sizeof (amount_char), bulk_stats.amount),
+	    elapsed > 0 ? bulk_stats.lines / elapsed : 0.0);
+    fflush (stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch;
+    FILE *input = stdin;
+
+    while ((ch = getopt (argc, argv, "hn:r:")) != -1) {
+		switch (ch) {
+		case 'n':
+			bulk_options.chunk = strtoul (optarg, NULL, 10);
+			if (bulk_options.chunk == 0)
+				errx (EXIT_FAILURE, "invalid chunk size: %s", optarg);
+			break;
+		case 'r':
+			bulk_options.reason = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if ((argc > 0) && (0 != strcmp (argv[0], "-"))) {
+		if (!(input = fopen (argv[0], "r")))
+			err (EXIT_FAILURE, "%s", argv[0]);
+    }
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+	printf("Connection successful\n");
+
+    char reason_esc[(2 * strlen (bulk_options.reason)) + 1];
+    mysql_real_escape_string (conn, reason_esc, bulk_options.reason, strlen (bulk_options.reason));
+    bulk_options.reason = reason_esc;
+
+    if (wallet_db_exec (conn, "CREATE TEMPORARY TABLE bulk_topup (student_id CHAR(8) NOT NULL, line INT UNSIGNED NOT NULL, "
+			"amount DECIMAL(5,2) NOT NULL, PRIMARY KEY (student_id)) ENGINE=MEMORY") < 0)
+		exit (EXIT_FAILURE);
+
+    struct topup_line *chunk;
+    char *sql_stmnt;
+    size_t sql_len = (bulk_options.chunk * ROW_SQL_MAX) + 128;
+
+    if (!(chunk = malloc (bulk_options.chunk * sizeof (*chunk))) || !(sql_stmnt = malloc (sql_len)))
+		err (EXIT_FAILURE, "malloc");
+
+    struct timespec start;
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    char buffer[BUFSIZ];
+    size_t line = 0, count = 0;
+    struct topup_line entry;
+
+    while (fgets (buffer, sizeof (buffer), input)) {
+		line++;
+		if (parse_line (buffer, line, &entry) <= 0)
+			continue;
+		bulk_stats.lines++;
+
+		if ((count == bulk_options.chunk) || chunk_contains (chunk, count, entry.student_id)) {
+			apply_chunk (conn, chunk, count, sql_stmnt, sql_len);
+			display_progress (&start);
+			count = 0;
+		}
+		chunk[count++] = entry;
+    }
+    if (ferror (input))
+		warn ("read error at line %zu", line);
+
+    if (count)
+		apply_chunk (conn, chunk, count, sql_stmnt, sql_len);
+    display_progress (&start);
+
+    free (sql_stmnt);
+    free (chunk);
+    if (input != stdin)
+		fclose (input);
+	mysql_close(conn);
+
+    exit (bulk_stats.failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
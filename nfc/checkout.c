@@ -30,6 +30,17 @@
 #include <math.h>
 #include <mysql/mysql.h>
 #include "common.h"
+#include "wallet-db.h"
+#include "wallet-card.h"
+#include "wallet-pending.h"
+#include "wallet-intent.h"
+#include "wallet-monitor.h"
+#include "wallet-tapsnap.h"
+#include "wallet-rotate.h"
+#include "wallet-snapshot.h"
+#include "wallet-debit.h"
+#include "wallet-offline.h"
+#include "wallet-config.h"
 
 #include <nfc/nfc.h>
 
@@ -125,27 +136,226 @@ fix_mad_trailer_block (nfc_device_t *device, MifareTag tag, MifareClassicSectorN
 uint8_t ndef_msg[20] = {0};
 size_t  ndef_msg_len;
 
+/*
+ * Ask for the price of the sale, in cents. Returns -1 (and says so) unless
+ * it is a positive amount: a sale of zero or less would credit the wallet.
+ */
 int
-main(int argc, char *argv[])
+read_price(long *cents)
+{
+	double price = 0;
+	printf("\nFood price: RM ");
+	if(scanf("%lf", &price) != 1)
+		price = 0;
+	while (getchar() != '\n') continue;
+	
+	*cents = lround(price * 100);
+	if(*cents <= 0)
+	{
+		printf("\nInvalid price.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * UID-only mode: the card is just an identity token. Nothing is read from
+ * or written to it; the sale is checked and debited by the database in a
+ * single call.
+ */
+int
+uid_only_checkout(MYSQL *conn, const struct wallet_snapshot *snapshot, const char *tag_uid)
 {
+	struct wallet_student student;
+	struct wallet_debit debit;
+	enum wallet_debit_status status;
+	char balance_char[16] = {'\0'};
+	
+	//cards unregistered since the last snapshot-sync are refused right away
+	if(wallet_snapshot_lookup(snapshot, tag_uid, &student) < 0)
+	{
+		printf("\n%s\n", wallet_debit_strerror(WALLET_DEBIT_BLOCKED));
+		return 0;
+	}
+	
+	long price_cents = 0;
+	
+	if(read_price(&price_cents) < 0)
+		return 0;
+	
+	status = wallet_debit(conn, tag_uid, price_cents, &debit);
+	printf("\n%s\n", wallet_debit_strerror(status));
+	
+	switch(status)
+	{
+		case WALLET_DEBIT_OK:
+			printf("\nStudent: %s\nRemaining balance: RM%s\n", debit.student_id, wallet_format_cents(balance_char, sizeof(balance_char), debit.balance));
+			return 0;
+		case WALLET_DEBIT_INSUFFICIENT:
+			printf("\nPress enter to continue.\n");
+			getchar();
+			return 0;
+		case WALLET_DEBIT_DB_ERROR:
+			return -1;
+		default:
+			return 0;
+	}
+}
 
-	char ndef_input[15] = {'\0'};
+/*
+ * Offline mode: the database is not used at all. The card record is
+ * trusted if it was sealed with the wallet key, the debit is written to the
+ * card and the sale journaled for offline-sync.
+ */
+int
+offline_checkout(MifareTag tag, const char *tag_uid)
+{
+	Mad mad;
+	struct wallet_intent intent = { .kind = WALLET_INTENT_SALE };
+	char balance_char[16] = {'\0'};
+	time_t now = time(NULL);
+	long spent;
+	int res = 0;
 	
+	if((mifare_classic_connect(tag) != 0) || !(mad = mad_read(tag)))
+	{
+		fprintf(stderr, "No MAD detected.\n");
+		return -1;
+	}
+	if(wallet_card_read(tag, mad, &intent.before) < 0)
+	{
+		printf("\n\nInvalid balance\n\n");
+		wallet_tapsnap_append(tag_uid, NULL, 0);
+		free(mad);
+		return -1;
+	}
+	wallet_tapsnap_append(tag_uid, &intent.before, 0);
+	
+	if(wallet_record_verify(&intent.before, tag_uid) != 1)
+	{
+		printf("\nCard cannot be used offline, please pay at an online counter.\n");
+		free(mad);
+		return 0;
+	}
+	
+	//a sale left in doubt on this card is decided before anything else
+	if(wallet_offline_resolve(tag_uid, &intent.before) == 1)
+		printf("\nPrevious sale on this card completed.\n");
+	
+	printf("\nStudent found: %s\n", intent.before.student_id);
+	printf("Balance: RM%s\n", wallet_format_cents(balance_char, sizeof(balance_char), intent.before.balance));
+	spent = wallet_record_spent_today(&intent.before, now);
+	printf("Spent today: RM%s\n", wallet_format_cents(balance_char, sizeof(balance_char), spent));
+	
+	if(read_price(&intent.amount) < 0)
+	{
+		free(mad);
+		return 0;
+	}
+	
+	if(intent.before.balance < intent.amount)
+	{
+		printf("\nInsufficient fund.\n");
+		printf("\nPress enter to continue.\n");
+		getchar();
+		free(mad);
+		return 0;
+	}
+	
+	//bound what a card can spend before it is seen online again
+	if(spent + intent.amount > WALLET_OFFLINE_DAILY_LIMIT)
+	{
+		printf("\nDaily offline limit reached, please pay at an online counter.\n");
+		free(mad);
+		return 0;
+	}
+	
+	snprintf(intent.uid, sizeof(intent.uid), "%s", tag_uid);
+	intent.time = now;
+	intent.after = intent.before;
+	intent.after.balance -= intent.amount;
+	intent.after.seq++;
+	wallet_record_spend(&intent.after, intent.amount, now);
+	
+	switch(wallet_intent_write(tag, mad, &intent))
+	{
+		case WALLET_INTENT_COMMITTED:
+			wallet_tapsnap_append(tag_uid, &intent.after, WALLET_TAPSNAP_WRITTEN);
+			if(wallet_offline_append(&intent, WALLET_OFFLINE_COMMITTED) < 0)
+				res = -1;
+			printf("Update successful\n");
+			printf("\nRemaining balance: RM%s\n", wallet_format_cents(balance_char, sizeof(balance_char), intent.after.balance));
+			break;
+		case WALLET_INTENT_ABORTED:
+			printf("\nCard write failed, nothing was charged. Please tap again.\n");
+			res = -1;
+			break;
+		default:
+			wallet_offline_append(&intent, WALLET_OFFLINE_IN_DOUBT);
+			printf("\nCard removed too early, please tap again to complete.\n");
+			res = -1;
+			break;
+	}
+	
+	free(mad);
+	return res;
+}
+
+int
+main(int argc, char *argv[])
+{
+
 	MYSQL *conn;
-	MYSQL_RES *result;
-	MYSQL_ROW row;
-	MYSQL_FIELD *field;
 	int retval;
+	int ch;
+	int uid_only = 0;
+	int offline = 0;
+	
+	while((ch = getopt(argc, argv, "uo")) != -1)
+	{
+		switch(ch)
+		{
+			case 'u':
+				uid_only = 1;
+				break;
+			case 'o':
+				offline = 1;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-u | -o]\n", argv[0]);
+				fprintf(stderr, "  -u     UID-only mode: debit in the database without reading or writing the card\n");
+				fprintf(stderr, "  -o     Offline mode: debit sealed cards without the database (see offline-sync)\n");
+				exit(EXIT_FAILURE);
+		}
+	}
+	if(uid_only && offline)
+		errx(EXIT_FAILURE, "UID-only mode needs the database");
+	if(offline && !wallet_mac_available())
+		errx(EXIT_FAILURE, "Offline mode needs the wallet key");
 	
 	conn = mysql_init(NULL);
 	
-	retval = mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag);
-	if(!retval)
+	if(!offline)
 	{
-		printf("Error connecting to database: %s\n", mysql_error(conn));
-		return -1;
+		//the UID-only sale is a stored procedure call
+		retval = mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag | CLIENT_MULTI_RESULTS);
+		if(!retval)
+		{
+			printf("Error connecting to database: %s\n", mysql_error(conn));
+			return -1;
+		}
+		printf("Connection successful\n");
+		
+		//settle checkouts interrupted by a crash that later taps already decided
+		if((retval = wallet_intent_recover(conn)) > 0)
+			printf("Recovered %d interrupted transactions\n", retval);
 	}
-	printf("Connection successful\n");
+	
+	//map the local student snapshot (kept up to date by snapshot-sync)
+	struct wallet_snapshot snapshot;
+	
+	if(wallet_snapshot_open(&snapshot) < 0)
+		printf("No student snapshot, looking students up in the database\n");
     
     int error = 0;
     nfc_device_t *device = NULL;
@@ -187,6 +397,19 @@ main(int argc, char *argv[])
 			char buffer[BUFSIZ];
 
 			printf ("Found %s with UID %s.\n", freefare_get_tag_friendly_name (tags[i]), tag_uid);
+			
+			if(uid_only)
+			{
+				if(uid_only_checkout(conn, &snapshot, tag_uid) < 0)
+					error = EXIT_FAILURE;
+				goto error;
+			}
+			if(offline)
+			{
+				if(offline_checkout(tags[i], tag_uid) < 0)
+					error = EXIT_FAILURE;
+				goto error;
+			}
 
 			// NFCForum card has a MAD, load it.
 			if (mifare_classic_connect (tags[i]) == 0) {
@@ -201,7 +424,7 @@ main(int argc, char *argv[])
 				// Dump the NFCForum application using MAD information
 				uint8_t buffer[4096];
 				ssize_t len;
-				if ((len = mifare_application_read (tags[i], mad, mad_nfcforum_aid, buffer, sizeof(buffer), mifare_classic_nfcforum_public_key_a, MFC_KEY_A)) != -1) 
+				if ((len = wallet_app_read (tags[i], mad, buffer, sizeof(buffer))) != -1) 
 				{
 					uint8_t tlv_type;
 					uint16_t tlv_data_len;
@@ -234,33 +457,37 @@ main(int argc, char *argv[])
 							break;
 					}
 					
-					int i=0, j=0;
+					int j=0;
 					char ID[9] = {'\0'};
 					
-					for(i=0;i<8;i++)
-						ID[i] = tlv_data[i];
+					for(j=0;j<8;j++)
+						ID[j] = tlv_data[j];
 					
-					ulong uid_length = strlen(tag_uid);
-					char uid_esc[(2 * uid_length)+1];
+					char uid_sql[WALLET_UID_SQL_LEN];
 
-					mysql_real_escape_string(conn, uid_esc, tag_uid, uid_length);
-					char sql_stmnt[52] = {'\0'};
-					int n = 0;
-					
-					n = snprintf(sql_stmnt, 52, "SELECT student_id FROM student WHERE uid='%s'", uid_esc);
-					retval = mysql_real_query(conn, sql_stmnt, n);
-					if(retval)
-					{
-						printf("Select data from DB Failed\n");
-						return -1;
-					}
-					printf("Select to DB successful\n");
+					wallet_uid_sql(tag_uid, uid_sql);
 					
 					char *ID_db = NULL;
+					struct wallet_student student;
 					
-					result = mysql_store_result(conn);
-					while (row = mysql_fetch_row(result)) {
-						ID_db = row[0];
+					//look the card up in the snapshot first; the balance query
+					//below still checks it against the database
+					if(wallet_snapshot_lookup(&snapshot, tag_uid, &student) == 1)
+					{
+						ID_db = student.student_id;
+					}
+					else
+					{
+						retval = wallet_db_select_str(conn, student.student_id, sizeof(student.student_id), "SELECT student_id FROM student WHERE uid=%s", uid_sql);
+						if(retval < 0)
+						{
+							printf("Select data from DB Failed\n");
+							return -1;
+						}
+						printf("Select to DB successful\n");
+						
+						if(retval == 1)
+							ID_db = student.student_id;
 					}
 					
 					if(ID_db == NULL)
@@ -282,65 +509,63 @@ main(int argc, char *argv[])
 						char id_esc[(2 * id_length)+1];
 
 						mysql_real_escape_string(conn, id_esc, ID, id_length);
-						char sql_stmnt[56] = {'\0'};
-						int n = 0;
 						
-						n = snprintf(sql_stmnt, 56, "SELECT balance FROM student WHERE student_id='%s'", id_esc);
-						retval = mysql_real_query(conn, sql_stmnt, n);
-						if(retval)
+						//finish or cancel a checkout that was interrupted on
+						//this card before looking at its balance
+						struct wallet_record record;
+						
+						if(wallet_record_decode(tlv_data, tlv_data_len, &record) < 0)
 						{
-							printf("Select data from DB Failed\n");
-							return -1;
+							printf("\n\nInvalid balance\n\n");
+							wallet_tapsnap_append(tag_uid, NULL, 0);
+							goto done;
+						}
+						wallet_tapsnap_append(tag_uid, &record, 0);
+						if(wallet_intent_resolve(conn, tag_uid, &record) != 0)
+						{
+							printf("\nPrevious transaction on this card is unresolved, please tap again.\n");
+							error = EXIT_FAILURE;
+							goto done;
 						}
-						printf("Select to DB successful\n");
 						
-						double balance_db = 0;
+						//the card must still be registered to the student: the
+						//snapshot may predate a lost card report
+						long balance_db = 0;
 						
-						result = mysql_store_result(conn);
-
-						while(field = mysql_fetch_field(result))
+						retval = wallet_db_select_cents(conn, &balance_db, "SELECT balance FROM student WHERE student_id='%s' AND uid=%s", id_esc, uid_sql);
+						if(retval < 0)
 						{
-							if(field->type == MYSQL_TYPE_NEWDECIMAL)
-							{
-								while (row = mysql_fetch_row(result))
-								{
-									balance_db = atof(row[0]);
-								}
-							}
-							else
-							{
-								printf("The field contains non-numeric data.\n");
-							}
+							printf("Select data from DB Failed\n");
+							return -1;
 						}
+						if(retval == 0)
+						{
+							printf("\nNo user found\n");
+							goto done;
+						}
+						printf("Select to DB successful\n");
+						
+						//compare balance from database with balance from card,
+						//counting the credits queued while the card was away
+						struct wallet_pending pending;
 						
-						//compare balance from database with balance from card
-						char balance_char[6] = {'\0'};
-						double balance = 0;
-						j=0;
-						for(i=8;i<13;i++)
+						if(wallet_pending_fetch(conn, id_esc, &pending) < 0)
 						{
-							balance_char[j] = tlv_data[i];
-							j++;
+							printf("Select data from DB Failed\n");
+							return -1;
 						}
-							
-						balance = atof(balance_char);
 						
-						if(balance == balance_db)
+						if(record.balance + pending.amount == balance_db)
 						{
 							printf("\n\nValid balance\n\n");
 							
 							//start to check out
-							double price = 0;
-							printf("\nFood price: RM ");
-							scanf("%lf", &price);
-							while (getchar() != '\n') continue;
+							long price_cents = 0;
 							
-							if(balance >= price)
-							{
-								balance -= price;
-								snprintf(balance_char, 6, "%.2f", balance ); 
-							}
-							else
+							if(read_price(&price_cents) < 0)
+								goto done;
+							
+							if(balance_db < price_cents)
 							{
 								printf("\nInsufficient fund.\n");
 								printf("\nPress enter to continue.\n");
@@ -348,54 +573,53 @@ main(int argc, char *argv[])
 								exit(EXIT_SUCCESS);
 							}
 							
-							//ensure balance always with 4 digit, 4.00 => 04.00
-							char final_balance[6] = {'\0'};
-							if(strlen(balance_char) != 5)
-							{
-								strcat(final_balance, "0");
-								strcat(final_balance, balance_char);
-							}
-							else
-								strcpy(final_balance, balance_char);
-							
-							strcat(ndef_input, ID);
-							strcat(ndef_input, final_balance);
-							
-							//update database														
-							char sql_stmnt[60] = {'\0'};
-							int n = 0;
+							//record the intent, write the card and read it back,
+							//then commit the sale together with the settlement
+							//of the queued credits
+							struct wallet_intent intent = {
+								.kind = WALLET_INTENT_SALE,
+								.amount = price_cents,
+								.pending_last_id = pending.last_id,
+								.pending_amount = pending.amount,
+								.before = record,
+								.after = record
+							};
+							snprintf(intent.uid, sizeof(intent.uid), "%s", tag_uid);
+							intent.after.balance = balance_db - price_cents;
+							wallet_record_spend(&intent.after, price_cents, time(NULL));
 							
-							n = snprintf(sql_stmnt, 60, "UPDATE student SET balance=%.1f WHERE student_id='%s'", balance, id_esc);
-							retval = mysql_real_query(conn, sql_stmnt, n);
-							if(retval)
-							{
-								printf("Updating data from DB Failed\n");
-								return -1;
-							}
-							else
+							switch(wallet_intent_run(conn, tags[i], mad, &intent))
 							{
-								printf("Update successful\n");
-								
-								//log activity into database
-								char sql_stmnt[50] = {'\0'};
-								int n = 0;
-								
-								n = snprintf(sql_stmnt, 50, "INSERT INTO sales VALUES(NOW(), %.1f, '%s')", price, uid_esc);
-								retval = mysql_real_query(conn, sql_stmnt, n);
-								if(retval)
-								{
-									printf("Inserting data from DB Failed\n");
+								case WALLET_INTENT_COMMITTED:
+									printf("Update successful\n");
+									break;
+								case WALLET_INTENT_ABORTED:
+									printf("\nCard write failed, nothing was charged. Please tap again.\n");
+									error = EXIT_FAILURE;
+									goto done;
+								case WALLET_INTENT_IN_DOUBT:
+									printf("\nCard removed too early, please tap again to complete.\n");
+									error = EXIT_FAILURE;
+									goto done;
+								default:
+									printf("Updating data from DB Failed\n");
 									return -1;
-								}
-								printf("Insert to DB successful\n");
 							}
+							
+							char balance_char[16] = {'\0'};
+							printf("\nRemaining balance: RM%s\n", wallet_format_cents(balance_char, sizeof(balance_char), intent.after.balance));
+							
+							//move the card one sector closer to the current keys
+							wallet_key_rotate(conn, tags[i], mad);
 						}
 						else
 						{
 							printf("\n\nInvalid balance\n\n");
+							wallet_monitor_mismatch(tag_uid, &record);
 						}
 					}
 					
+					done:
 					free (tlv_data);
 				} else {
 					fprintf (stderr, "No NFC Forum application.\n");
@@ -419,20 +643,8 @@ main(int argc, char *argv[])
 		nfc_disconnect (device);
     }
 	
-	mysql_free_result(result);
+	wallet_snapshot_close(&snapshot);
 	mysql_close(conn);
-	
-	if(strlen(ndef_input) != NULL)
-	{
-		//write back to card
-		//assuming ndef_input always have same length
-		char command[66] = {'\0'};
-		
-		strcat(command, "~/Dropbox/Work/libfreefare/examples/simple-write -i ");
-		strcat(command, ndef_input);
-		
-		system(command);
-	}
 
     exit (error);
 
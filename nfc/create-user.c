@@ -31,6 +31,10 @@
 #include <math.h>
 #include <mysql/mysql.h>
 #include "common.h"
+#include "wallet-card.h"
+#include "wallet-db.h"
+#include "wallet-event.h"
+#include "wallet-keys.h"
 
 #include <nfc/nfc.h>
 
@@ -128,8 +132,6 @@ main(int argc, char *argv[])
 {
 	
 	MYSQL *conn;
-	MYSQL_RES *result;
-	MYSQL_ROW row;
 	int retval;
 	
 	conn = mysql_init(NULL);
@@ -312,7 +314,7 @@ main(int argc, char *argv[])
 					sectors = p = mifare_application_find (mad, mad_nfcforum_aid);
 					if (sectors) {
 						while (*p) {
-							if (mifare_classic_authenticate (tags[i], mifare_classic_sector_last_block(*p), default_keyb, MFC_KEY_B) < 0) {
+							if (wallet_sector_authenticate (tags[i], *p, MFC_KEY_B) < 0) {
 								nfc_perror (device, "mifare_classic_authenticate");
 								error = 1;
 								goto error;
@@ -384,7 +386,12 @@ main(int argc, char *argv[])
 				while (sectors[s]) {
 					MifareClassicBlockNumber block = mifare_classic_sector_last_block (sectors[s]);
 					MifareClassicBlock block_data;
-					mifare_classic_trailer_block (&block_data, mifare_classic_nfcforum_public_key_a, 0x0, 0x0, 0x0, 0x6, 0x40, default_keyb);
+					MifareClassicKey key_a, key_b;
+
+					//the card's own keys, see wallet-keys.c
+					wallet_sector_key (tag_uid, sectors[s], MFC_KEY_A, key_a);
+					wallet_sector_key (tag_uid, sectors[s], MFC_KEY_B, key_b);
+					mifare_classic_trailer_block (&block_data, key_a, 0x0, 0x0, 0x0, 0x6, 0x40, key_b);
 					if (mifare_classic_authenticate (tags[i], block, card_write_keys[sectors[s]].key, card_write_keys[sectors[s]].type) < 0) {
 						nfc_perror (device, "mifare_classic_authenticate");
 						error = EXIT_FAILURE;
@@ -398,28 +405,28 @@ main(int argc, char *argv[])
 					s++;
 				}
 
-				if ((ssize_t) encoded_size != mifare_application_write (tags[i], mad, mad_nfcforum_aid, tlv_data, encoded_size, default_keyb, MCAB_WRITE_KEYB)) {
-					nfc_perror (device, "mifare_application_write");
+				if ((ssize_t) encoded_size != wallet_app_write (tags[i], mad, tlv_data, encoded_size)) {
+					nfc_perror (device, "wallet_app_write");
 					error = EXIT_FAILURE;
 					goto error;
 				}
 
 
 				//create new student record in database
-				char sql_stmnt[57] = {'\0'};
+				char sql_stmnt[112] = {'\0'};
 				int n = 0;
 				
 				//filter tag_uid
-				ulong uid_length = strlen(tag_uid);
-				char uid_esc[(2 * uid_length)+1];
-				mysql_real_escape_string(conn, uid_esc, tag_uid, uid_length);
+				char uid_sql[WALLET_UID_SQL_LEN];
+				wallet_uid_sql(tag_uid, uid_sql);
 
 				//filter ID
 				ulong id_length = strlen(ID);
 				char id_esc[(2 * id_length)+1];
 				mysql_real_escape_string(conn, id_esc, ID, id_length);
 				
-				n = snprintf(sql_stmnt, 57, "INSERT INTO student VALUES('%s', '%s', %.1f)", uid_esc, id_esc, balance);
+				//same balance as written to the card
+				n = snprintf(sql_stmnt, 112, "INSERT INTO student (uid, student_id, balance) VALUES(%s, '%s', %s)", uid_sql, id_esc, final_balance);
 				retval = mysql_real_query(conn, sql_stmnt, n);
 				if(retval)
 				{
@@ -428,6 +435,12 @@ main(int argc, char *argv[])
 				}
 				printf("Insert to DB successful\n");
 				
+				struct wallet_event event;
+				
+				wallet_event_init(&event, WALLET_EVENT_ENROL, tag_uid, ID);
+				event.amount = event.balance = wallet_parse_cents(final_balance);
+				wallet_event_publish(&event, 1);
+				
 				free (sectors);
 
 				free (tlv_data);
@@ -450,7 +463,6 @@ main(int argc, char *argv[])
     }
 
     free (card_write_keys);
-	mysql_free_result(result);
 	mysql_close(conn);
 
 		exit (error);
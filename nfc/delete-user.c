@@ -28,114 +28,25 @@
 #include <unistd.h>
 #include <mysql/mysql.h>
 #include "common.h"
+#include "wallet-db.h"
+#include "wallet-event.h"
+#include "wallet-stock.h"
 
 #include <nfc/nfc.h>
 
 #include <freefare.h>
 
-#define START_FORMAT_N	"Formatting %d sectors ["
-#define DONE_FORMAT	"] done.\n"
-
-MifareClassicKey default_keys[] = {
-    { 0xff,0xff,0xff,0xff,0xff,0xff },
-    { 0xd3,0xf7,0xd3,0xf7,0xd3,0xf7 },
-    { 0xa0,0xa1,0xa2,0xa3,0xa4,0xa5 },
-    { 0xb0,0xb1,0xb2,0xb3,0xb4,0xb5 },
-    { 0x4d,0x3a,0x99,0xc3,0x51,0xdd },
-    { 0x1a,0x98,0x2c,0x7e,0x45,0x9a },
-    { 0xaa,0xbb,0xcc,0xdd,0xee,0xff },
-    { 0x00,0x00,0x00,0x00,0x00,0x00 }
-};
-int		 format_mifare_classic_1k (MifareTag tag);
-int		 format_mifare_classic_4k (MifareTag tag);
-int		 try_format_sector (MifareTag tag, MifareClassicSectorNumber sector);
-
-static int at_block = 0;
-static int mod_block = 10;
-
 struct {
-    bool fast;
     bool interactive;
-} format_options = {
-    .fast        = false,
+} delete_options = {
     .interactive = true
 };
 
-void
-display_progress ()
-{
-    at_block++;
-    if (0 == (at_block % mod_block)) {
-	printf ("%d", at_block);
-	fflush (stdout);
-    } else {
-	printf (".");
-	fflush (stdout);
-    }
-}
-
-int
-format_mifare_classic_1k (MifareTag tag)
-{
-    printf (START_FORMAT_N, 16);
-    for (int sector = 0; sector < 16; sector++) {
-	if (!try_format_sector (tag, sector))
-	    return 0;
-    }
-    printf (DONE_FORMAT);
-    return 1;
-}
-
-int
-format_mifare_classic_4k (MifareTag tag)
-{
-    printf (START_FORMAT_N, 32 + 8);
-    for (int sector = 0; sector < (32 + 8); sector++) {
-	if (!try_format_sector (tag, sector))
-	    return 0;
-    }
-    printf (DONE_FORMAT);
-    return 1;
-}
-
-int
-try_format_sector (MifareTag tag, MifareClassicSectorNumber sector)
-{
-    display_progress ();
-    for (size_t i = 0; i < (sizeof (default_keys) / sizeof (MifareClassicKey)); i++) {
-		MifareClassicBlockNumber block = mifare_classic_sector_last_block (sector);
-		if ((0 == mifare_classic_connect (tag)) && (0 == mifare_classic_authenticate (tag, block, default_keys[i], MFC_KEY_A))) {
-			if (0 == mifare_classic_format_sector (tag, sector)) {
-				mifare_classic_disconnect (tag);
-				return 1;
-			} else if (EIO == errno) {
-				err (EXIT_FAILURE, "sector %d", sector);
-			}
-			mifare_classic_disconnect (tag);
-		}
-
-		if ((0 == mifare_classic_connect (tag)) && (0 == mifare_classic_authenticate (tag, block, default_keys[i], MFC_KEY_B))) {
-			if (0 == mifare_classic_format_sector (tag, sector)) {
-				mifare_classic_disconnect (tag);
-				return 1;
-			} else if (EIO == errno) {
-				err (EXIT_FAILURE, "sector %d", sector);
-			}
-			mifare_classic_disconnect (tag);
-		}
-    }
-
-    warnx ("No known authentication key for sector %d", sector);
-    return 0;
-}
-
 int
 main(int argc, char *argv[])
 {
 	//initilize database
 	MYSQL *conn;
-	MYSQL_RES *result;
-	MYSQL_ROW row;
 	int retval;
 	
 	conn = mysql_init(NULL);
@@ -188,62 +99,52 @@ main(int argc, char *argv[])
 			char buffer[BUFSIZ];
 
 			printf ("Found %s with UID %s.", freefare_get_tag_friendly_name (tags[i]), tag_uid);
-			bool format = true;
-			if (format_options.interactive) {
+			bool confirmed = true;
+			if (delete_options.interactive) {
 				printf ("\nAre you sure you want to remove this user? [yN] ");
 				fgets (buffer, BUFSIZ, stdin);
-				format = ((buffer[0] == 'y') || (buffer[0] == 'Y'));
+				confirmed = ((buffer[0] == 'y') || (buffer[0] == 'Y'));
 			} else {
 				printf ("\n");
 			}
 
-			if (format) {
-				enum mifare_tag_type tt = freefare_get_tag_type (tags[i]);
-				at_block = 0;
-
-				if (format_options.fast) {
-					printf (START_FORMAT_N, (tt == CLASSIC_1K) ? 1 : 2);
-					if (!try_format_sector (tags[i], 0x00))
-					break;
-
-					if (tt == CLASSIC_4K)
-					if (!try_format_sector (tags[i], 0x10))
-						break;
-
-					printf (DONE_FORMAT);
-					continue;
-				}
-				switch (tt) {
-				case CLASSIC_1K:
-					mod_block = 4;
-					if (!format_mifare_classic_1k (tags[i]))
-					error = 1;
-					break;
-				case CLASSIC_4K:
-					mod_block = 10;
-					if (!format_mifare_classic_4k (tags[i]))
-					error = 1;
-					break;
-				default:
-					/* Keep compiler quiet */
-					break;
-				}
-				
-				//delete user from database
-				ulong uid_length = strlen(tag_uid);
-				char uid_esc[(2 * uid_length)+1];
-
-				mysql_real_escape_string(conn, uid_esc, tag_uid, uid_length);
-				char sql_stmnt_del[41] = {'\0'};
-				int n = 0;
-				n = snprintf(sql_stmnt_del, 41, "DELETE FROM student WHERE UID='%s'", uid_esc);
-				retval = mysql_real_query(conn, sql_stmnt_del, n);
-				if(retval)
+			if (confirmed) {
+				//block the card and delete the user in one transaction
+				//before touching the card, it can no longer be spent even
+				//if the card write below fails
+				char uid_sql[WALLET_UID_SQL_LEN];
+				char student_id[WALLET_ID_LEN + 1];
+				struct wallet_event event;
+				long balance = 0;
+				int found = 0;
+
+				wallet_uid_sql(tag_uid, uid_sql);
+				if((wallet_db_begin(conn) < 0) ||
+					((found = wallet_db_select_str(conn, student_id, sizeof(student_id), "SELECT student_id FROM student WHERE uid=%s FOR UPDATE", uid_sql)) < 0) ||
+					(found && (wallet_db_select_cents(conn, &balance, "SELECT balance FROM student WHERE uid=%s", uid_sql) < 0)) ||
+					(wallet_stock_retire(conn, tag_uid, "closed") < 0) ||
+					(wallet_db_exec(conn, "DELETE FROM student WHERE uid=%s", uid_sql) < 0) ||
+					(wallet_db_commit(conn) < 0))
 				{
+					wallet_db_rollback(conn);
 					printf("Deleting record from DB Failed\n");
 					return -1;
 				}
 				printf("Delete successful\n");
+				
+				if(found)
+				{
+					wallet_event_init(&event, WALLET_EVENT_DELETE, tag_uid, student_id);
+					event.amount = -balance;
+					event.balance = 0;
+					wallet_event_publish(&event, 1);
+				}
+				
+				//one block write; the full format is left to recycle-cards
+				if (wallet_stock_void (tags[i]) < 0)
+					printf("Card could not be invalidated, it is blocked anyway.\n");
+				else
+					printf("Card invalidated, put it in the recycling tray.\n");
 			}
 
 			free (tag_uid);
@@ -254,7 +155,6 @@ main(int argc, char *argv[])
     }
 	
 	// Close the handle to free memory
-	mysql_free_result(result);
 	mysql_close(conn);
 	
     exit (error);
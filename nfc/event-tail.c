@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+/*
+ * Read the wallet change events of this host (wallet-event.c):
+ *
+ *     event-tail [-c consumer] [-s seq] [-n count] [-f]
+ *     event-tail -P
+ *
+ * Prints one tab-separated line per event: number, time, type, student,
+ * amount, balance after, terminal, card UID and the other student or card.
+ * With -c, reading starts where that consumer stopped last time and its
+ * offset is saved once the lines are written out; -f keeps waiting for new
+ * events. -P removes the log segments every consumer has read.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "wallet-card.h"
+#include "wallet-db.h"
+#include "wallet-event.h"
+
+#define POLL_INTERVAL	1
+
+struct {
+    const char *consumer;
+    uint64_t start;
+    unsigned long count;	/* 0 for all */
+    int follow;
+    int prune;
+} tail_options;
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-c consumer] [-s seq] [-n count] [-f]\n", progname);
+    fprintf (stderr, "       %s -P\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -c     Read on from the offset of this consumer and save it\n");
+    fprintf (stderr, "  -s     First event to read, when there is no saved offset\n");
+    fprintf (stderr, "  -n     Stop after this many events\n");
+    fprintf (stderr, "  -f     Wait for new events instead of stopping at the end\n");
+    fprintf (stderr, "  -P     Remove the segments every consumer has read\n");
+}
+
+static void
+print_event (const struct wallet_event *ev)
+{
+    char time_char[24], amount_char[16], balance_char[16] = "-";
+    char uid_char[2 * WALLET_UID_MAX + 1], peer_char[2 * WALLET_UID_MAX + 1];
+    time_t t = ev->time;
+
+    strftime (time_char, sizeof (time_char), "%Y-%m-%d %H:%M:%S", localtime (&t));
+    wallet_format_cents (amount_char, sizeof (amount_char), ev->amount);
+    if (ev->balance != WALLET_EVENT_NO_BALANCE)
+		wallet_format_cents (balance_char, sizeof (balance_char), ev->balance);
+    wallet_uid_format (ev->uid, ev->uid_len, uid_char, sizeof (uid_char));
+    if (ev->peer_uid_len)
+		wallet_uid_format (ev->peer_uid, ev->peer_uid_len, peer_char, sizeof (peer_char));
+    else
+		snprintf (peer_char, sizeof (peer_char), "%.*s", WALLET_ID_LEN, ev->peer_id);
+
+    printf ("%llu\t%s\t%s\t%.*s\t%s\t%s\t%u\t%s\t%s\n", (unsigned long long) ev->seq, time_char,
+	    wallet_event_type_name (ev->type), WALLET_ID_LEN, ev->student_id, amount_char, balance_char,
+	    ev->terminal, uid_char[0] ? uid_char : "-", peer_char[0] ? peer_char : "-");
+}
+
+/*
+ * Lines go out before the offset moves past them: a consumer killed in
+ * between sees the last events again, it never misses one.
+ */
+static int
+save_offset (struct wallet_event_reader *reader)
+{
+    if (fflush (stdout) == EOF) {
+		warn ("stdout");
+		return -1;
+    }
+    return wallet_event_commit (reader);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct wallet_event_reader reader;
+    struct wallet_event ev;
+    unsigned long read_count = 0;
+    int ch, n, res = EXIT_SUCCESS;
+
+    while ((ch = getopt (argc, argv, "c:fhn:Ps:")) != -1) {
+		switch (ch) {
+		case 'c':
+			tail_options.consumer = optarg;
+			break;
+		case 'f':
+			tail_options.follow = 1;
+			break;
+		case 'n':
+			tail_options.count = strtoul (optarg, NULL, 10);
+			break;
+		case 'P':
+			tail_options.prune = 1;
+			break;
+		case 's':
+			tail_options.start = strtoull (optarg, NULL, 10);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+
+    if (tail_options.prune) {
+		if ((n = wallet_event_prune ()) < 0)
+			exit (EXIT_FAILURE);
+		printf ("%d segments removed\n", n);
+		exit (EXIT_SUCCESS);
+    }
+
+    if (wallet_event_reader_open (&reader, tail_options.consumer, tail_options.start) < 0)
+		exit (EXIT_FAILURE);
+
+    while (!tail_options.count || (read_count < tail_options.count)) {
+		if ((n = wallet_event_read (&reader, &ev)) < 0) {
+			res = EXIT_FAILURE;
+			break;
+		}
+		if (n) {
+			print_event (&ev);
+			read_count++;
+			continue;
+		}
+
+		/* Caught up with the writers. */
+		if (save_offset (&reader) < 0) {
+			res = EXIT_FAILURE;
+			break;
+		}
+		if (!tail_options.follow)
+			break;
+		sleep (POLL_INTERVAL);
+    }
+
+    if (save_offset (&reader) < 0)
+		res = EXIT_FAILURE;
+    wallet_event_reader_close (&reader);
+
+    exit (res);
+}
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+/*
+ * Watch the taps of every terminal as they happen (wallet-monitor.h):
+ *
+ *     fraud-monitor [-p port] [-m entries] [-w seconds] [-n count] [-W seconds]
+ *
+ * Prints one tab-separated line per anomaly as soon as the tap showing it
+ * arrives: time of the tap, kind, card UID, student, terminal and details.
+ *
+ *   two-terminals  the card was tapped at another terminal less than -w
+ *                  seconds before (30 by default)
+ *   two-cards      the student was seen on another card less than -w
+ *                  seconds before
+ *   forged         the record is sealed, but not for this card or with
+ *                  other content: a copy of another card's record
+ *   invalid        -n (3) unreadable or forged records of one card, or
+ *                  records not matching the database ("Invalid balance"),
+ *                  within -W seconds (300)
+ *   replayed       the record is older (lower write sequence) than one
+ *                  already seen on the card
+ *   balance-up     the balance went up without any write to the card
+ *
+ * State is kept per card and per student in one table of -m entries
+ * (65536), allocated at startup: when it is full, the entry seen longest
+ * ago makes room.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-db.h"
+#include "wallet-monitor.h"
+#include "wallet-tapsnap.h"
+
+#define DEFAULT_ENTRIES	65536
+#define PROBE_MAX	16
+#define INVALID_MAX	8
+
+struct {
+    const char *port;
+    size_t entries;
+    int window;
+    int invalid;
+    int invalid_window;
+} monitor_options = {
+    .port = WALLET_MONITOR_PORT,
+    .entries = DEFAULT_ENTRIES,
+    .window = 30,
+    .invalid = 3,
+    .invalid_window = 300
+};
+
+enum entry_kind {
+    ENTRY_FREE,
+    ENTRY_CARD,
+    ENTRY_STUDENT
+};
+
+struct entry {
+    uint8_t kind;
+    uint8_t key_len;
+    uint8_t key[WALLET_UID_MAX];	/* card UID or student ID */
+    uint16_t terminal;
+    time_t seen;			/* arrival of its last tap */
+
+    /* cards */
+    int32_t balance;			/* -1 until a record was read */
+    uint32_t seq;
+    uint8_t invalid_next;
+    time_t invalid[INVALID_MAX];	/* arrivals of the last bad records */
+    time_t invalid_alert;
+
+    /* students */
+    uint8_t uid_len;
+    uint8_t uid[WALLET_UID_MAX];
+};
+
+struct {
+    struct entry *table;
+    size_t mask;
+    unsigned long taps;
+    unsigned long evicted;		/* entries replaced while in a window */
+} monitor;
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-p port] [-m entries] [-w seconds] [-n count] [-W seconds]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -p     UDP port to receive the taps on (default %s)\n", WALLET_MONITOR_PORT);
+    fprintf (stderr, "  -m     Cards and students kept track of (default %d)\n", DEFAULT_ENTRIES);
+    fprintf (stderr, "  -w     Window of two-terminals and two-cards, in seconds (default 30)\n");
+    fprintf (stderr, "  -n     Bad or mismatched records of one card that raise invalid (default 3, at most %d)\n", INVALID_MAX);
+    fprintf (stderr, "  -W     Window of invalid, in seconds (default 300)\n");
+}
+
+static size_t
+hash_key (uint8_t kind, const uint8_t *key, size_t len)
+{
+    uint32_t h = 2166136261u ^ kind;
+
+    for (size_t i = 0; i < len; i++)
+		h = (h ^ key[i]) * 16777619u;
+    return h;
+}
+
+/*
+ * Entry of a card or student, taking a free slot or the one seen longest
+ * ago among the PROBE_MAX after its hash if it has none. *fresh tells
+ * whether it was just created.
+ */
+static struct entry *
+lookup (uint8_t kind, const uint8_t *key, size_t len, time_t now, int *fresh)
+{
+    size_t h = hash_key (kind, key, len);
+    struct entry *e, *victim = NULL;
+
+    for (size_t i = 0; i < PROBE_MAX; i++) {
+		e = &monitor.table[(h + i) & monitor.mask];
+		if ((e->kind == kind) && (e->key_len == len) && (0 == memcmp (e->key, key, len))) {
+			*fresh = 0;
+			return e;
+		}
+		if (!victim || (victim->kind && (!e->kind || (e->seen < victim->seen))))
+			victim = e;
+    }
+
+    if (victim->kind && (now - victim->seen <= monitor_options.invalid_window))
+		monitor.evicted++;
+    memset (victim, 0, sizeof (*victim));
+    victim->kind = kind;
+    victim->key_len = len;
+    memcpy (victim->key, key, len);
+    *fresh = 1;
+    return victim;
+}
+
+static void
+alert (const struct wallet_monitor_tap *tap, const char *kind, const char *fmt, ...)
+{
+    char time_char[24], uid[2 * WALLET_UID_MAX + 1];
+    time_t t = tap->snap.time;
+    va_list ap;
+
+    strftime (time_char, sizeof (time_char), "%Y-%m-%d %H:%M:%S", localtime (&t));
+    printf ("%s\t%s\t%s\t%.*s\t%u\t", time_char, kind, wallet_tapsnap_uid (&tap->snap, uid, sizeof (uid)),
+	    WALLET_ID_LEN, tap->snap.student_id[0] ? tap->snap.student_id : "-", tap->terminal);
+    va_start (ap, fmt);
+    vprintf (fmt, ap);
+    va_end (ap);
+    printf ("\n");
+    fflush (stdout);
+}
+
+static void
+check_student (const struct wallet_monitor_tap *tap, time_t now)
+{
+    const struct wallet_tapsnap *snap = &tap->snap;
+    char other[2 * WALLET_UID_MAX + 1];
+    struct entry *student;
+    int fresh;
+
+    student = lookup (ENTRY_STUDENT, (const uint8_t *) snap->student_id, WALLET_ID_LEN, now, &fresh);
+    if (!fresh && (now - student->seen <= monitor_options.window) &&
+	wallet_uid_cmp (student->uid, student->uid_len, snap->uid, snap->uid_len))
+		alert (tap, "two-cards", "also on card %s at terminal %u %llds before",
+		       wallet_uid_format (student->uid, student->uid_len, other, sizeof (other)), student->terminal,
+		       (long long) (now - student->seen));
+
+    student->uid_len = snap->uid_len;
+    memcpy (student->uid, snap->uid, WALLET_UID_MAX);
+    student->terminal = tap->terminal;
+    student->seen = now;
+}
+
+static void
+process (const struct wallet_monitor_tap *tap, time_t now)
+{
+    const struct wallet_tapsnap *snap = &tap->snap;
+    char balance_char[16], before_char[16];
+    struct entry *card;
+    int fresh, bad = 0;
+
+    monitor.taps++;
+    card = lookup (ENTRY_CARD, snap->uid, snap->uid_len, now, &fresh);
+    if (fresh)
+		card->balance = -1;
+
+    if (!fresh && tap->terminal && card->terminal && (tap->terminal != card->terminal) && (now - card->seen <= monitor_options.window))
+		alert (tap, "two-terminals", "also at terminal %u %llds before", card->terminal, (long long) (now - card->seen));
+
+    if (tap->check == WALLET_MONITOR_FORGED)
+		alert (tap, "forged", "record sealed for another card or altered");
+
+    if (tap->check != WALLET_MONITOR_VALID) {
+		card->invalid[card->invalid_next++ % INVALID_MAX] = now;
+		for (int i = 0; i < INVALID_MAX; i++)
+			bad += card->invalid[i] && (now - card->invalid[i] <= monitor_options.invalid_window);
+		if ((bad >= monitor_options.invalid) && (now - card->invalid_alert > monitor_options.invalid_window)) {
+			alert (tap, "invalid", "%d unreadable, forged or mismatched records in %ds", bad, monitor_options.invalid_window);
+			card->invalid_alert = now;
+		}
+    } else if (snap->balance >= 0) {
+		/* Version 0 records carry no write sequence to go by. */
+		if ((card->balance >= 0) && snap->seq && card->seq) {
+			if (snap->seq < card->seq)
+				alert (tap, "replayed", "write %u after write %u was seen, balance %s (was %s)", snap->seq, card->seq,
+				       wallet_format_cents (balance_char, sizeof (balance_char), snap->balance),
+				       wallet_format_cents (before_char, sizeof (before_char), card->balance));
+			else if ((snap->seq == card->seq) && (snap->balance > card->balance))
+				alert (tap, "balance-up", "balance %s up from %s without a write",
+				       wallet_format_cents (balance_char, sizeof (balance_char), snap->balance),
+				       wallet_format_cents (before_char, sizeof (before_char), card->balance));
+		}
+		if ((card->balance < 0) || (snap->seq >= card->seq)) {
+			card->balance = snap->balance;
+			card->seq = snap->seq;
+		}
+		if (snap->student_id[0])
+			check_student (tap, now);
+    }
+
+    card->terminal = tap->terminal;
+    card->seen = now;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct wallet_monitor_tap tap;
+    size_t entries = 1;
+    ssize_t n;
+    int ch, fd;
+
+    while ((ch = getopt (argc, argv, "hm:n:p:w:W:")) != -1) {
+		switch (ch) {
+		case 'm':
+			monitor_options.entries = strtoul (optarg, NULL, 10);
+			break;
+		case 'n':
+			monitor_options.invalid = atoi (optarg);
+			break;
+		case 'p':
+			monitor_options.port = optarg;
+			break;
+		case 'w':
+			monitor_options.window = atoi (optarg);
+			break;
+		case 'W':
+			monitor_options.invalid_window = atoi (optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+    if ((monitor_options.invalid < 1) || (monitor_options.invalid > INVALID_MAX) || !monitor_options.entries) {
+		usage(argv[0]);
+		exit (EXIT_FAILURE);
+    }
+
+    /* A power of two, for the probing. */
+    while (entries < monitor_options.entries)
+		entries <<= 1;
+    if (!(monitor.table = calloc (entries, sizeof (*monitor.table))))
+		err (EXIT_FAILURE, "%zu entries", entries);
+    monitor.mask = entries - 1;
+
+    if ((fd = wallet_monitor_listen (monitor_options.port)) < 0)
+		exit (EXIT_FAILURE);
+    fprintf (stderr, "Listening on port %s, %zu entries (%zu KiB)\n", monitor_options.port, entries, entries * sizeof (*monitor.table) / 1024);
+
+    for (;;) {
+		if ((n = recv (fd, &tap, sizeof (tap), 0)) < 0) {
+			warn ("recv");
+			continue;
+		}
+		if ((n != sizeof (tap)) || memcmp (tap.magic, WALLET_MONITOR_MAGIC, sizeof (tap.magic)))
+			continue;
+		process (&tap, time (NULL));
+    }
+}
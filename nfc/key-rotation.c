@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Progress of the sector key rotation over the registered cards:
+ *
+ *     key-rotation [-l]
+ *
+ * The rotation itself happens on the terminals, one sector per tap (see
+ * wallet-rotate.c); with -l the cards not done yet are listed with the
+ * date they were last rotated, so that idle cards can be called in.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+#include "wallet-keys.h"
+
+struct {
+    int list;
+} rotation_options;
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-l]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -l     List the cards not on generation %d yet\n", WALLET_KEY_GENERATION);
+}
+
+static int
+report (MYSQL *conn)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    if (wallet_db_exec (conn,
+	"SELECT COUNT(*), "
+	"COALESCE(SUM(r.generation = %d AND r.complete = 1), 0), "
+	"COALESCE(SUM(r.generation = %d AND r.complete = 0), 0) "
+	"FROM student s LEFT JOIN key_rotation r ON r.uid = s.uid "
+	"WHERE s.uid IS NOT NULL", WALLET_KEY_GENERATION, WALLET_KEY_GENERATION) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn)))
+		return -1;
+    if ((row = mysql_fetch_row (result))) {
+		unsigned long total = strtoul (row[0], NULL, 10);
+		unsigned long complete = strtoul (row[1], NULL, 10);
+		unsigned long partial = strtoul (row[2], NULL, 10);
+
+		printf ("key generation %d: %lu cards, %lu done, %lu in progress, %lu not started\n",
+			WALLET_KEY_GENERATION, total, complete, partial, total - complete - partial);
+    }
+    mysql_free_result (result);
+
+    return 0;
+}
+
+static int
+list_pending (MYSQL *conn)
+{
+    struct wallet_db_cursor cur;
+    MYSQL_ROW row;
+
+    if (wallet_db_cursor_open (&cur, conn,
+	"SELECT LOWER(HEX(s.uid)), s.student_id, IF(r.generation = %d, r.updated, NULL) "
+	"FROM student s LEFT JOIN key_rotation r ON r.uid = s.uid "
+	"WHERE s.uid IS NOT NULL AND NOT (r.generation <=> %d AND r.complete <=> 1) "
+	"ORDER BY s.uid", WALLET_KEY_GENERATION, WALLET_KEY_GENERATION) < 0)
+		return -1;
+    while ((row = wallet_db_cursor_next (&cur)))
+		printf ("%-20s %-8s %s\n", row[0], row[1], row[2] ? row[2] : "-");
+
+    return wallet_db_cursor_close (&cur);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch;
+
+    while ((ch = getopt (argc, argv, "hl")) != -1) {
+		switch (ch) {
+		case 'l':
+			rotation_options.list = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    if ((report (conn) < 0) || (rotation_options.list && (list_pending (conn) < 0)))
+		exit (EXIT_FAILURE);
+
+	mysql_close(conn);
+    exit (EXIT_SUCCESS);
+}
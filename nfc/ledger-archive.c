@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Export the closed months of the sales and topup ledgers to columnar
+ * archive files (see wallet-archive.h) for archive-query:
+ *
+ *     ledger-archive [-d dir] [-m YYYY-MM]
+ *
+ * Every closed month without a file yet is exported, or only the given one,
+ * which is then written again. Files are named sales-YYYYMM.col and
+ * topup-YYYYMM.col. Run it before ledger-partitions -k moves the months out
+ * of the ledgers.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-archive.h"
+#include "wallet-db.h"
+
+#define DEFAULT_ARCHIVE_DIR	"/var/lib/ccsun/archive"
+
+static const char *ledgers[] = {
+    [WALLET_ARCHIVE_SALES] = "sales",
+    [WALLET_ARCHIVE_TOPUP] = "topup"
+};
+
+struct {
+    const char *dir;
+    int month;			/* year * 12 + month - 1, -1 for all */
+} archive_options = {
+    .dir = DEFAULT_ARCHIVE_DIR,
+    .month = -1
+};
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-d dir] [-m YYYY-MM]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -d     Archive directory (default %s)\n", DEFAULT_ARCHIVE_DIR);
+    fprintf (stderr, "  -m     Export this month only, again if it was already\n");
+}
+
+static int
+export_month (MYSQL *conn, enum wallet_archive_ledger ledger, int m, int force)
+{
+    char path[PATH_MAX];
+    int year = m / 12, month = m % 12 + 1;
+
+    snprintf (path, sizeof (path), "%s/%s-%04d%02d.col", archive_options.dir, ledgers[ledger], year, month);
+    if (!force && (0 == access (path, F_OK)))
+		return 0;
+    if (wallet_archive_export (conn, ledger, year, month, path) < 0) {
+		warnx ("%s not written", path);
+		return -1;
+    }
+    printf ("%s\n", path);
+    return 0;
+}
+
+/*
+ * The months from the oldest row of the ledger to the last closed one.
+ */
+static int
+export_ledger (MYSQL *conn, enum wallet_archive_ledger ledger, int current)
+{
+    char first_char[8];
+    int first;
+
+    switch (wallet_db_select_str (conn, first_char, sizeof (first_char), "SELECT DATE_FORMAT(MIN(time), '%%Y%%m') FROM %s", ledgers[ledger])) {
+	case 1:
+		first = (atoi (first_char) / 100) * 12 + (atoi (first_char) % 100) - 1;
+		break;
+	case 0:
+		return 0;
+	default:
+		return -1;
+    }
+    for (int m = first; m < current; m++)
+		if (export_month (conn, ledger, m, 0) < 0)
+			return -1;
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch, year, month;
+
+    while ((ch = getopt (argc, argv, "d:hm:")) != -1) {
+		switch (ch) {
+		case 'd':
+			archive_options.dir = optarg;
+			break;
+		case 'm':
+			if ((2 != sscanf (optarg, "%4d-%2d", &year, &month)) || (month < 1) || (month > 12))
+				errx (EXIT_FAILURE, "invalid month \"%s\"", optarg);
+			archive_options.month = year * 12 + month - 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    time_t now = time (NULL);
+    struct tm *tm = localtime (&now);
+    int current = (tm->tm_year + 1900) * 12 + tm->tm_mon;
+    int res = EXIT_SUCCESS;
+
+    if (archive_options.month >= current)
+		errx (EXIT_FAILURE, "month not closed yet");
+
+    for (size_t i = 0; i < sizeof (ledgers) / sizeof (ledgers[0]); i++) {
+		if (archive_options.month >= 0) {
+			if (export_month (conn, i, archive_options.month, 1) < 0)
+				res = EXIT_FAILURE;
+		} else if (export_ledger (conn, i, current) < 0) {
+			res = EXIT_FAILURE;
+		}
+    }
+
+	mysql_close(conn);
+    exit (res);
+}
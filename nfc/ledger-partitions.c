@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Monthly partitions of the sales and topup ledgers (run from cron):
+ *
+ *     ledger-partitions [-l] [-n] [-a months] [-k months]
+ *
+ * Every month lives in its own partition pYYYYMM, split off the catch-all
+ * partition pmax ahead of time, so that pmax stays empty and the splits
+ * cost nothing. With -k the months older than the given number are moved
+ * out of the ledger into archive tables sales_YYYYMM and topup_YYYYMM,
+ * one partition exchange each. -n prints the statements instead of running
+ * them; -l only lists the partitions.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+
+#define DEFAULT_AHEAD		3
+#define SPLIT_BATCH		12	/* months per REORGANIZE, within WALLET_SQL_MAX */
+
+/* Months are counted as year * 12 + month - 1. */
+#define MONTH_YEAR(m)		((m) / 12)
+#define MONTH_NUMBER(m)		((m) % 12 + 1)
+
+static const char *ledgers[] = { "sales", "topup" };
+
+struct {
+    int list;
+    int dry_run;
+    int ahead;
+    int keep;
+} partition_options = {
+    .ahead = DEFAULT_AHEAD
+};
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-l] [-n] [-a months] [-k months]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -a     Months to create ahead of the current one (default %d)\n", DEFAULT_AHEAD);
+    fprintf (stderr, "  -k     Archive the months older than the given number (default: keep all)\n");
+    fprintf (stderr, "  -l     List the partitions\n");
+    fprintf (stderr, "  -n     Print the statements, run nothing\n");
+}
+
+static int
+run (MYSQL *conn, const char *fmt, ...)
+{
+    va_list ap;
+    int res = 0;
+
+    va_start (ap, fmt);
+    if (partition_options.dry_run) {
+		vprintf (fmt, ap);
+		printf (";\n");
+    } else {
+		res = wallet_db_vexec (conn, fmt, ap);
+    }
+    va_end (ap);
+
+    return res;
+}
+
+struct ledger_partitions {
+    int first, last;		/* month partitions, -1 if none */
+    int has_max;
+};
+
+static int
+load_partitions (MYSQL *conn, const char *table, struct ledger_partitions *parts)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int year, month, res = 0;
+
+    parts->first = parts->last = -1;
+    parts->has_max = 0;
+    if (wallet_db_exec (conn, "SELECT PARTITION_NAME, TABLE_ROWS FROM information_schema.PARTITIONS "
+			"WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='%s' ORDER BY PARTITION_ORDINAL_POSITION", table) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn))) {
+		warnx ("%s: %s", table, mysql_error (conn));
+		return -1;
+    }
+    while ((row = mysql_fetch_row (result))) {
+		if (!row[0]) {
+			warnx ("%s is not partitioned, run migrate first", table);
+			res = -1;
+			break;
+		}
+		if (partition_options.list)
+			printf ("%-8s %-8s %10s\n", table, row[0], row[1] ? row[1] : "-");
+		if (0 == strcmp (row[0], "pmax")) {
+			parts->has_max = 1;
+		} else if ((2 == sscanf (row[0], "p%4d%2d", &year, &month)) && (month >= 1) && (month <= 12)) {
+			int m = year * 12 + month - 1;
+
+			if ((parts->first < 0) || (m < parts->first))
+				parts->first = m;
+			if (m > parts->last)
+				parts->last = m;
+		}
+    }
+    mysql_free_result (result);
+
+    if (!res && !parts->has_max) {
+		warnx ("%s has no pmax partition", table);
+		res = -1;
+    }
+    return res;
+}
+
+/*
+ * Split the months from..to off pmax. Rows already in pmax are moved into
+ * the new partitions, which only happens on the first run.
+ */
+static int
+create_partitions (MYSQL *conn, const char *table, int from, int to)
+{
+    char clauses[WALLET_SQL_MAX];
+
+    while (from <= to) {
+		size_t n = 0;
+
+		for (int i = 0; (i < SPLIT_BATCH) && (from <= to); i++, from++) {
+			int next = from + 1;
+
+			n += snprintf (clauses + n, sizeof (clauses) - n,
+				"PARTITION p%04d%02d VALUES LESS THAN (TO_DAYS('%04d-%02d-01')), ",
+				MONTH_YEAR (from), MONTH_NUMBER (from), MONTH_YEAR (next), MONTH_NUMBER (next));
+		}
+		if (run (conn, "ALTER TABLE %s REORGANIZE PARTITION pmax INTO (%sPARTITION pmax VALUES LESS THAN MAXVALUE)",
+			 table, clauses) < 0)
+			return -1;
+    }
+    return 0;
+}
+
+/*
+ * Swap the partition of a month with an empty table of the same layout and
+ * drop the then empty partition. An archive table left with rows by an
+ * earlier run is not touched.
+ */
+static int
+archive_partition (MYSQL *conn, const char *table, int month)
+{
+    char archive[32], nonempty[8];
+    int year = MONTH_YEAR (month), number = MONTH_NUMBER (month);
+
+    snprintf (archive, sizeof (archive), "%s_%04d%02d", table, year, number);
+    if (run (conn, "CREATE TABLE IF NOT EXISTS %s LIKE %s", archive, table) < 0)
+		return -1;
+    if (!partition_options.dry_run) {
+		if (wallet_db_select_str (conn, nonempty, sizeof (nonempty), "SELECT EXISTS (SELECT 1 FROM %s)", archive) != 1)
+			return -1;
+		if (nonempty[0] != '0') {
+			warnx ("%s is not empty, p%04d%02d of %s left in place", archive, year, number, table);
+			return 0;
+		}
+    }
+    if ((run (conn, "ALTER TABLE %s REMOVE PARTITIONING", archive) < 0) ||
+	(run (conn, "ALTER TABLE %s EXCHANGE PARTITION p%04d%02d WITH TABLE %s", table, year, number, archive) < 0) ||
+	(run (conn, "ALTER TABLE %s DROP PARTITION p%04d%02d", table, year, number) < 0))
+		return -1;
+
+    printf ("%s: p%04d%02d archived to %s\n", table, year, number, archive);
+    return 0;
+}
+
+static int
+maintain (MYSQL *conn, const char *table, int current)
+{
+    struct ledger_partitions parts;
+    char first_char[8];
+    int from;
+
+    if (load_partitions (conn, table, &parts) < 0)
+		return -1;
+    if (partition_options.list)
+		return 0;
+
+    /* The first run starts from the oldest row, later ones after the last month. */
+    if (parts.last >= 0) {
+		from = parts.last + 1;
+    } else {
+		from = current;
+		switch (wallet_db_select_str (conn, first_char, sizeof (first_char), "SELECT DATE_FORMAT(MIN(time), '%%Y%%m') FROM %s", table)) {
+		case 1:
+			from = (atoi (first_char) / 100) * 12 + (atoi (first_char) % 100) - 1;
+			break;
+		case 0:
+			break;
+		default:
+			return -1;
+		}
+    }
+    if ((from <= current + partition_options.ahead) &&
+	(create_partitions (conn, table, from, current + partition_options.ahead) < 0))
+		return -1;
+
+    if (partition_options.keep && (parts.first >= 0)) {
+		for (int m = parts.first; (m <= parts.last) && (m < current - partition_options.keep); m++)
+			if (archive_partition (conn, table, m) < 0)
+				return -1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch;
+
+    while ((ch = getopt (argc, argv, "a:hk:ln")) != -1) {
+		switch (ch) {
+		case 'a':
+			partition_options.ahead = atoi (optarg);
+			break;
+		case 'k':
+			if ((partition_options.keep = atoi (optarg)) < 1)
+				errx (EXIT_FAILURE, "-k needs at least one month");
+			break;
+		case 'l':
+			partition_options.list = 1;
+			break;
+		case 'n':
+			partition_options.dry_run = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    time_t now = time (NULL);
+    struct tm *tm = localtime (&now);
+    int current = (tm->tm_year + 1900) * 12 + tm->tm_mon;
+    int res = EXIT_SUCCESS;
+
+    for (size_t i = 0; i < sizeof (ledgers) / sizeof (ledgers[0]); i++)
+		if (maintain (conn, ledgers[i], current) < 0)
+			res = EXIT_FAILURE;
+
+	mysql_close(conn);
+    exit (res);
+}
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Bring the database schema up to date:
+ *
+ *     migrate [-n] [-d dir]
+ *
+ * Migrations are the files NNN-name.sql of the schema directory, applied in
+ * the order of NNN and recorded in schema_version, so each is applied once.
+ * They are read the way the mysql client reads them: "--" comment lines,
+ * statements ended by the current delimiter, DELIMITER lines changing it.
+ * With -n the pending migrations are only listed.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+
+#define DEFAULT_SCHEMA_DIR	"/usr/share/ccsun/schema"
+
+struct {
+    const char *dir;
+    int dry_run;
+} migrate_options = {
+    .dir = DEFAULT_SCHEMA_DIR
+};
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-n] [-d dir]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -d     Schema directory (default %s)\n", DEFAULT_SCHEMA_DIR);
+    fprintf (stderr, "  -n     List the pending migrations, apply nothing\n");
+}
+
+static int
+is_migration (const struct dirent *entry)
+{
+    const char *name = entry->d_name;
+    size_t len = strlen (name);
+
+    return (len > 8) && isdigit (name[0]) && isdigit (name[1]) && isdigit (name[2]) &&
+	   (name[3] == '-') && (0 == strcmp (name + len - 4, ".sql"));
+}
+
+static int
+run_statement (MYSQL *conn, const char *path, int lineno, const char *stmt, size_t len)
+{
+    MYSQL_RES *result;
+
+    if (mysql_real_query (conn, stmt, len)) {
+		warnx ("%s:%d: %s", path, lineno, mysql_error (conn));
+		return -1;
+    }
+    if ((result = mysql_store_result (conn)))
+		mysql_free_result (result);
+    return 0;
+}
+
+/*
+ * Run every statement of the file. DDL commits on its own in MySQL, so a
+ * failed migration is left half applied: migrations are written to be run
+ * again (IF NOT EXISTS, DROP ... IF EXISTS) wherever MySQL allows it.
+ */
+static int
+apply_file (MYSQL *conn, const char *path)
+{
+    FILE *f;
+    char *line = NULL;
+    size_t line_size = 0;
+    char *stmt = NULL;
+    size_t stmt_len = 0, stmt_size = 0;
+    char delimiter[16] = ";";
+    int lineno = 0, res = 0;
+    ssize_t n;
+
+    if (!(f = fopen (path, "r"))) {
+		warn ("%s", path);
+		return -1;
+    }
+
+    while ((res == 0) && ((n = getline (&line, &line_size, f)) != -1)) {
+		char *p = line;
+
+		lineno++;
+		while ((n > 0) && isspace ((unsigned char) line[n - 1]))
+			line[--n] = '\0';
+		while (isspace ((unsigned char) *p))
+			p++;
+
+		if (0 == strncmp (p, "--", 2))
+			continue;
+		if ((stmt_len == 0) && (*p == '\0'))
+			continue;
+		if ((stmt_len == 0) && (0 == strncasecmp (p, "DELIMITER ", 10))) {
+			snprintf (delimiter, sizeof (delimiter), "%s", p + 10);
+			continue;
+		}
+
+		if (stmt_len + n + 2 > stmt_size) {
+			stmt_size = 2 * (stmt_len + n + 2);
+			if (!(stmt = realloc (stmt, stmt_size)))
+				err (EXIT_FAILURE, "realloc");
+		}
+		memcpy (stmt + stmt_len, line, n);
+		stmt_len += n;
+		stmt[stmt_len++] = '\n';
+		stmt[stmt_len] = '\0';
+
+		size_t dlen = strlen (delimiter);
+		if (((size_t) n >= dlen) && (0 == strcmp (line + n - dlen, delimiter))) {
+			/* Drop the delimiter and the newline after it. */
+			stmt_len -= dlen + 1;
+			stmt[stmt_len] = '\0';
+			res = run_statement (conn, path, lineno, stmt, stmt_len);
+			stmt_len = 0;
+		}
+    }
+
+    if ((res == 0) && (stmt_len > 0)) {
+		warnx ("%s:%d: statement not terminated by \"%s\"", path, lineno, delimiter);
+		res = -1;
+    }
+
+    free (stmt);
+    free (line);
+    fclose (f);
+
+    return res;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch;
+
+    while ((ch = getopt (argc, argv, "hd:n")) != -1) {
+		switch (ch) {
+		case 'd':
+			migrate_options.dir = optarg;
+			break;
+		case 'n':
+			migrate_options.dry_run = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+
+    struct dirent **migrations;
+    int count;
+
+    if ((count = scandir (migrate_options.dir, &migrations, is_migration, alphasort)) < 0)
+		err (EXIT_FAILURE, "%s", migrate_options.dir);
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    if (wallet_db_exec (conn,
+	"CREATE TABLE IF NOT EXISTS schema_version ("
+	"version INT UNSIGNED NOT NULL, "
+	"name VARCHAR(64) NOT NULL, "
+	"applied DATETIME NOT NULL, "
+	"PRIMARY KEY (version)) ENGINE=InnoDB") < 0)
+		exit (EXIT_FAILURE);
+
+    int error = EXIT_SUCCESS;
+    int applied = 0, last = -1;
+
+    for (int i = 0; i < count; i++) {
+		const char *name = migrations[i]->d_name;
+		int version = atoi (name);
+		char path[PATH_MAX];
+		char done[64];
+
+		if (version == last) {
+			warnx ("%s: migration %03d is there twice", name, version);
+			error = EXIT_FAILURE;
+			break;
+		}
+		last = version;
+
+		switch (wallet_db_select_str (conn, done, sizeof (done), "SELECT name FROM schema_version WHERE version=%d", version)) {
+		case 1:
+			continue;
+		case 0:
+			break;
+		default:
+			error = EXIT_FAILURE;
+			goto out;
+		}
+
+		if (migrate_options.dry_run) {
+			printf ("pending %s\n", name);
+			continue;
+		}
+
+		snprintf (path, sizeof (path), "%s/%s", migrate_options.dir, name);
+		printf ("applying %s\n", name);
+		if ((apply_file (conn, path) < 0) ||
+			(wallet_db_exec (conn, "INSERT INTO schema_version (version, name, applied) VALUES (%d, '%.60s', NOW())", version, name) < 0)) {
+			warnx ("%s failed, later migrations not applied", name);
+			error = EXIT_FAILURE;
+			break;
+		}
+		applied++;
+    }
+
+    if (!migrate_options.dry_run)
+		printf ("%d migrations applied\n", applied);
+
+out:
+    for (int i = 0; i < count; i++)
+		free (migrations[i]);
+    free (migrations);
+
+	mysql_close(conn);
+    exit (error);
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Upload the sales journaled by a terminal running offline (checkout -o):
+ *
+ *     offline-sync
+ *
+ * Each sale is replayed as a card intent: recorded as prepared, then
+ * finalized (balance, sales ledger) if the card is known to hold the new
+ * record. A sale still in doubt stays prepared and is decided by the next
+ * online tap of the card. Running it again after a failure is safe.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+#include "wallet-config.h"
+#include "wallet-intent.h"
+#include "wallet-offline.h"
+
+struct {
+    size_t sales;
+    size_t committed;
+    size_t in_doubt;
+    size_t aborted;
+    size_t failed;
+    long amount;
+} sync_stats;
+
+/*
+ * Look for the intent a previous run (or an earlier journal entry) already
+ * recorded for this sale. Returns 1 and sets intent->id if there is one.
+ */
+int
+find_intent (MYSQL *conn, struct wallet_intent *intent)
+{
+    char uid_sql[WALLET_UID_SQL_LEN];
+    char id_char[24];
+    int res;
+
+    wallet_uid_sql (intent->uid, uid_sql);
+    res = wallet_db_select_str (conn, id_char, sizeof (id_char), "SELECT id FROM card_intent WHERE uid=%s AND kind='sale' AND new_seq=%u "
+				"AND state IN ('prepared', 'committed') ORDER BY id DESC LIMIT 1", uid_sql, intent->after.seq);
+    if (res == 1)
+		intent->id = strtoll (id_char, NULL, 10);
+    return res;
+}
+
+int
+sync_sale (MYSQL *conn, const struct wallet_offline_sale *sale)
+{
+    struct wallet_intent intent;
+    int found;
+
+    wallet_offline_intent (sale, &intent);
+
+    if ((found = find_intent (conn, &intent)) < 0)
+		return -1;
+
+    switch (sale->state) {
+	case WALLET_OFFLINE_ABORTED:
+		sync_stats.aborted++;
+		return found ? wallet_intent_abort (conn, &intent) : 0;
+	case WALLET_OFFLINE_IN_DOUBT:
+		sync_stats.in_doubt++;
+		return found ? 0 : wallet_intent_prepare (conn, &intent);
+	case WALLET_OFFLINE_COMMITTED:
+	default:
+		if (!found && (wallet_intent_prepare (conn, &intent) < 0))
+			return -1;
+		/* 1: finalized by an earlier run or an online tap. */
+		if (wallet_intent_finalize (conn, &intent) < 0)
+			return -1;
+		sync_stats.committed++;
+		sync_stats.amount += sale->amount;
+		return 0;
+    }
+}
+
+/*
+ * Replay one journal file; returns the number of sales that failed.
+ */
+size_t
+sync_file (MYSQL *conn, const char *path)
+{
+    struct wallet_offline_sale sale;
+    FILE *journal;
+    size_t failed = 0;
+
+    if (!(journal = fopen (path, "r"))) {
+		warn ("%s", path);
+		return 1;
+    }
+    while (fread (&sale, sizeof (sale), 1, journal) == 1) {
+		sync_stats.sales++;
+		if (sync_sale (conn, &sale) < 0) {
+			char student_id[WALLET_ID_LEN + 1] = { '\0' };
+
+			memcpy (student_id, sale.student_id, WALLET_ID_LEN);
+			warnx ("%s: sale of seq %u not synced", student_id, sale.seq + 1);
+			failed++;
+		}
+    }
+    if (ferror (journal)) {
+		warn ("%s", path);
+		failed++;
+    }
+    fclose (journal);
+
+    return failed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char log_path[PATH_MAX], sync_path[PATH_MAX];
+
+    wallet_spool_path (log_path, sizeof (log_path), WALLET_OFFLINE_FILE);
+    wallet_spool_path (sync_path, sizeof (sync_path), WALLET_OFFLINE_SYNC_FILE);
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    /*
+     * The journal is moved aside before it is read, so that sales made
+     * meanwhile go to a new one. A file left by a failed run is finished
+     * first.
+     */
+    if ((access (sync_path, F_OK) < 0) && (rename (log_path, sync_path) < 0)) {
+		if (errno != ENOENT)
+			err (EXIT_FAILURE, "%s", log_path);
+		printf ("No offline sales\n");
+		mysql_close(conn);
+		exit (EXIT_SUCCESS);
+    }
+
+    sync_stats.failed = sync_file (conn, sync_path);
+
+    char amount_char[16];
+
+    printf ("%zu sales: %zu committed (RM%s), %zu in doubt, %zu aborted, %zu failed\n",
+	    sync_stats.sales, sync_stats.committed, wallet_format_cents (amount_char, sizeof (amount_char), sync_stats.amount),
+	    sync_stats.in_doubt, sync_stats.aborted, sync_stats.failed);
+
+    if (sync_stats.failed)
+		warnx ("%s kept, run again", sync_path);
+    else if (unlink (sync_path) < 0)
+		warn ("%s", sync_path);
+
+	mysql_close(conn);
+    exit (sync_stats.failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
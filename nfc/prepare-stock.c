@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Prepare blank cards for lost-card and renew-card ahead of time:
+ *
+ *     prepare-stock
+ *
+ * Place the cards on the reader one after the other. Each one gets its MAD,
+ * the NFCForum application with its own sector keys and an empty wallet
+ * record, and is recorded as unassigned stock. Cards registered to a
+ * student or hotlisted are left alone.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+#include "wallet-card.h"
+#include "wallet-provision.h"
+#include "wallet-stock.h"
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+static int
+prepare_card (MYSQL *conn, nfc_device_t *device, MifareTag tag)
+{
+    struct wallet_record record = { .balance = 0 };
+    uint8_t ndef_msg[WALLET_RECORD_LEN];
+    size_t ndef_msg_len, encoded_size;
+    uint8_t *tlv_data;
+    char student_id[WALLET_ID_LEN + 1], reason[32];
+    char *tag_uid = freefare_get_tag_uid (tag);
+    char uid_sql[WALLET_UID_SQL_LEN];
+    int res = -1;
+
+    wallet_uid_sql (tag_uid, uid_sql);
+    printf ("Found %s with UID %s.\n", freefare_get_tag_friendly_name (tag), tag_uid);
+
+    switch (wallet_db_select_str (conn, student_id, sizeof (student_id), "SELECT student_id FROM student WHERE uid=%s", uid_sql)) {
+	case 0:
+		break;
+	case 1:
+		warnx ("card %s is registered to %s, skipped", tag_uid, student_id);
+		free (tag_uid);
+		return 0;
+	default:
+		free (tag_uid);
+		return -1;
+    }
+
+    /*
+     * A hotlisted card (lost, stolen, or closed and not recycled yet) must
+     * stay out of the stock: wallet_stock_add() would issue it again.
+     */
+    switch (wallet_db_select_str (conn, reason, sizeof (reason), "SELECT reason FROM hotlist WHERE uid=%s", uid_sql)) {
+	case 0:
+		break;
+	case 1:
+		warnx ("card %s is hotlisted (%s), skipped", tag_uid, reason);
+		free (tag_uid);
+		return 0;
+	default:
+		free (tag_uid);
+		return -1;
+    }
+
+    /* Sealed or not, the record takes the first application sector. */
+    wallet_record_seal (&record, tag_uid);
+    ndef_msg_len = wallet_record_encode (&record, ndef_msg, sizeof (ndef_msg));
+    if (!(tlv_data = tlv_encode (3, ndef_msg, ndef_msg_len, &encoded_size))) {
+		free (tag_uid);
+		return -1;
+    }
+
+    if (wallet_card_provision (device, tag, tlv_data, encoded_size) < 0)
+		warnx ("card %s cannot be prepared", tag_uid);
+    else if (wallet_stock_add (conn, tag_uid) == 0)
+		res = 1;
+    mifare_classic_disconnect (tag);
+
+    free (tlv_data);
+    free (tag_uid);
+    return res;
+}
+
+int
+main(int argc, char *argv[])
+{
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    nfc_device_t *device = NULL;
+    MifareTag *tags = NULL;
+    nfc_device_desc_t devices[8];
+    size_t device_count;
+    char buffer[BUFSIZ];
+    int prepared = 0;
+    int error = EXIT_SUCCESS;
+
+    nfc_list_devices (devices, 8, &device_count);
+    if (!device_count)
+		errx (EXIT_FAILURE, "No NFC device found.");
+
+    if (!(device = nfc_connect (&(devices[0]))))
+		errx (EXIT_FAILURE, "nfc_connect() failed.");
+
+    for (;;) {
+		printf ("\nPlace a blank card on the reader and press enter ('q' to stop): ");
+		if (!fgets (buffer, BUFSIZ, stdin) || (buffer[0] == 'q') || (buffer[0] == 'Q'))
+			break;
+
+		if (!(tags = freefare_get_tags (device))) {
+			warnx ("Error listing Mifare Classic tag.");
+			continue;
+		}
+		for (int i = 0; tags[i]; i++) {
+			switch (freefare_get_tag_type (tags[i])) {
+			case CLASSIC_1K:
+			case CLASSIC_4K:
+				break;
+			default:
+				continue;
+			}
+
+			switch (prepare_card (conn, device, tags[i])) {
+			case 1:
+				prepared++;
+				printf ("Card added to stock.\n");
+				break;
+			case 0:
+				break;
+			default:
+				error = EXIT_FAILURE;
+				break;
+			}
+		}
+		freefare_free_tags (tags);
+    }
+
+    printf ("%d cards prepared\n", prepared);
+
+    nfc_disconnect (device);
+	mysql_close(conn);
+    exit (error);
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Reconciliation sweep: compare what the terminals last saw on every card
+ * with the student table and report the cards that drifted.
+ *
+ *     reconcile [-v] taps.log...
+ *
+ * The tap logs collected from the terminals are sorted by UID and reduced
+ * to the latest snapshot per card, then merged with the student table read
+ * in UID order in a single streamed pass. A card is expected to hold its
+ * database balance minus the credits still pending for it.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+#include "wallet-card.h"
+#include "wallet-tapsnap.h"
+
+struct {
+    int verbose;
+} reconcile_options;
+
+struct {
+    size_t snapshots;
+    size_t cards;
+    size_t students;
+    size_t matched;
+    size_t drifted;
+    size_t stale;
+    size_t in_doubt;
+    size_t unreadable;
+    size_t unknown;
+    size_t unseen;
+    long drift;
+} reconcile_stats;
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-v] taps.log...\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -v     Also list stale snapshots and cards never seen\n");
+}
+
+/*
+ * Append the snapshots of one terminal log to *snaps.
+ */
+int
+load_log (const char *path, struct wallet_tapsnap **snaps, size_t *count, size_t *allocated)
+{
+    FILE *log;
+    struct wallet_tapsnap snap;
+    size_t n;
+
+    if (!(log = fopen (path, "r"))) {
+		warn ("%s", path);
+		return -1;
+    }
+    while ((n = fread (&snap, 1, sizeof (snap), log)) == sizeof (snap)) {
+		if (*count == *allocated) {
+			struct wallet_tapsnap *p;
+
+			*allocated = *allocated ? 2 * *allocated : 4096;
+			if (!(p = realloc (*snaps, *allocated * sizeof (**snaps))))
+				err (EXIT_FAILURE, "realloc");
+			*snaps = p;
+		}
+		(*snaps)[(*count)++] = snap;
+    }
+    if (ferror (log))
+		warn ("%s", path);
+    else if (n)
+		warnx ("%s: ignoring truncated last record", path);
+    fclose (log);
+    return 0;
+}
+
+/*
+ * Keep only the last (most recent) snapshot of each card in the sorted
+ * array; returns the new count.
+ */
+size_t
+latest_snapshots (struct wallet_tapsnap *snaps, size_t count)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < count; i++) {
+		if ((i + 1 < count) && (0 == wallet_uid_cmp (snaps[i].uid, snaps[i].uid_len, snaps[i + 1].uid, snaps[i + 1].uid_len)))
+			continue;
+		snaps[n++] = snaps[i];
+    }
+    return n;
+}
+
+void
+report (const char *kind, const char *uid, const char *student_id, const char *fmt, ...)
+{
+    va_list ap;
+
+    printf ("%-10s %-20s %-8s ", kind, uid, student_id ? student_id : "-");
+    va_start (ap, fmt);
+    vprintf (fmt, ap);
+    va_end (ap);
+    printf ("\n");
+}
+
+/*
+ * Compare the latest snapshot of a card with its student row.
+ */
+void
+check_card (const struct wallet_tapsnap *snap, MYSQL_ROW row)
+{
+    const char *uid = row[0], *student_id = row[1];
+    long balance = wallet_parse_cents (row[2]);
+    long pending = row[3] ? wallet_parse_cents (row[3]) : 0;
+    unsigned long seq = row[4] ? strtoul (row[4], NULL, 10) : 0;
+    unsigned long in_doubt = row[5] ? strtoul (row[5], NULL, 10) : 0;
+    long expected = balance - pending;
+    char card_char[16], expected_char[16], diff_char[16], fix_char[16];
+
+    reconcile_stats.matched++;
+
+    if (snap->balance < 0) {
+		reconcile_stats.unreadable++;
+		report ("unreadable", uid, student_id, "card record unreadable; rewrite it with update-balance");
+		return;
+    }
+    if (in_doubt) {
+		/* The next tap decides it (wallet_intent_resolve). */
+		reconcile_stats.in_doubt++;
+		report ("in-doubt", uid, student_id, "%lu card write(s) not resolved; tap the card", in_doubt);
+		return;
+    }
+    if (snap->seq < seq) {
+		/* Written since, by a terminal whose log is not part of this run. */
+		reconcile_stats.stale++;
+		if (reconcile_options.verbose)
+			report ("stale", uid, student_id, "snapshot seq %u, database seq %lu", snap->seq, seq);
+		return;
+    }
+    if (snap->balance == expected)
+		return;
+
+    reconcile_stats.drifted++;
+    reconcile_stats.drift += snap->balance - expected;
+    wallet_format_cents (card_char, sizeof (card_char), snap->balance);
+    wallet_format_cents (expected_char, sizeof (expected_char), expected);
+    wallet_format_cents (diff_char, sizeof (diff_char), labs (snap->balance - expected));
+
+    if ((seq != 0) && (snap->seq == seq)) {
+		/*
+		 * The card holds exactly what the last committed write put there:
+		 * the balance was changed in the database behind the card's back.
+		 */
+		wallet_format_cents (fix_char, sizeof (fix_char), snap->balance + pending);
+		report ("drift", uid, student_id, "card %s expected %s (%c%s); database changed outside a card write: "
+			"UPDATE student SET balance=%s WHERE student_id='%s';",
+			card_char, expected_char, (snap->balance > expected) ? '+' : '-', diff_char, fix_char, student_id);
+    } else {
+		report ("drift", uid, student_id, "card %s expected %s (%c%s); card written outside the wallet tools: "
+			"rewrite it with update-balance",
+			card_char, expected_char, (snap->balance > expected) ? '+' : '-', diff_char);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch;
+
+    while ((ch = getopt (argc, argv, "hv")) != -1) {
+		switch (ch) {
+		case 'v':
+			reconcile_options.verbose = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+		usage(argv[-optind]);
+		exit (EXIT_FAILURE);
+    }
+
+    struct wallet_tapsnap *snaps = NULL;
+    size_t count = 0, allocated = 0;
+
+    for (int i = 0; i < argc; i++)
+		load_log (argv[i], &snaps, &count, &allocated);
+    reconcile_stats.snapshots = count;
+
+    qsort (snaps, count, sizeof (*snaps), wallet_tapsnap_compare);
+    count = latest_snapshots (snaps, count);
+    reconcile_stats.cards = count;
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    /*
+     * One pass over the student table in UID order. UIDs are stored as
+     * bytes and sort as the snapshots do; they are read back as hex.
+     * Pending credits and card writes are aggregated once, not per row.
+     */
+    struct wallet_db_cursor cur;
+    MYSQL_ROW row;
+    size_t next = 0;
+    char uid[(2 * WALLET_UID_MAX) + 1];
+
+    if (wallet_db_cursor_open (&cur, conn, "SELECT LOWER(HEX(s.uid)), s.student_id, s.balance, p.amount, i.seq, i.in_doubt FROM student s "
+			       "LEFT JOIN (SELECT student_id, SUM(amount) AS amount FROM pending_credit WHERE settled IS NULL GROUP BY student_id) p "
+			       "ON p.student_id=s.student_id "
+			       "LEFT JOIN (SELECT uid, MAX(IF(state='committed', new_seq, NULL)) AS seq, SUM(state='prepared') AS in_doubt FROM card_intent GROUP BY uid) i "
+			       "ON i.uid=s.uid "
+			       "WHERE s.uid IS NOT NULL ORDER BY s.uid") < 0)
+		exit (EXIT_FAILURE);
+
+    while ((row = wallet_db_cursor_next (&cur))) {
+		int cmp = -1;
+
+		reconcile_stats.students++;
+
+		//cards seen by the terminals but missing from the database
+		while ((next < count) && ((cmp = wallet_tapsnap_uid_cmp (&snaps[next], row[0])) < 0)) {
+			reconcile_stats.unknown++;
+			report ("unknown", wallet_tapsnap_uid (&snaps[next], uid, sizeof (uid)), NULL,
+				"card in use but not registered; block it");
+			next++;
+		}
+
+		if ((next < count) && (cmp == 0)) {
+			check_card (&snaps[next], row);
+			next++;
+		} else {
+			reconcile_stats.unseen++;
+			if (reconcile_options.verbose)
+				report ("unseen", row[0], row[1], "no snapshot");
+		}
+    }
+    if (wallet_db_cursor_close (&cur) < 0)
+		exit (EXIT_FAILURE);
+
+    for (; next < count; next++) {
+		reconcile_stats.unknown++;
+		report ("unknown", wallet_tapsnap_uid (&snaps[next], uid, sizeof (uid)), NULL,
+			"card in use but not registered; block it");
+    }
+
+    char drift_char[16];
+
+    printf ("\n%zu snapshots of %zu cards, %zu students, %zu matched\n",
+	    reconcile_stats.snapshots, reconcile_stats.cards, reconcile_stats.students, reconcile_stats.matched);
+    printf ("%zu drifted (net %c%s), %zu in doubt, %zu unreadable, %zu stale, %zu unknown cards, %zu students unseen\n",
+	    reconcile_stats.drifted, (reconcile_stats.drift < 0) ? '-' : '+',
+	    wallet_format_cents (drift_char, sizeof (drift_char), labs (reconcile_stats.drift)),
+	    reconcile_stats.in_doubt, reconcile_stats.unreadable, reconcile_stats.stale,
+	    reconcile_stats.unknown, reconcile_stats.unseen);
+
+    free (snaps);
+	mysql_close(conn);
+
+    exit ((reconcile_stats.drifted || reconcile_stats.unknown) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Recycling batch for the cards of closed accounts:
+ *
+ *     recycle-cards [-s]
+ *
+ * delete-user and transfer-balance only hotlist the card and invalidate its
+ * record at the desk. Place the collected cards on the reader one after the
+ * other: each card queued in card_recycle is formatted back to the transport
+ * configuration and taken off the hotlist. With -s it is then prepared again
+ * and goes back into stock (see prepare-stock).
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+#include "wallet-card.h"
+#include "wallet-provision.h"
+#include "wallet-stock.h"
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+struct {
+    int stock;
+} recycle_options;
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-s]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -s     Prepare the recycled cards again and add them to the stock\n");
+}
+
+/*
+ * Returns 1 if the card was recycled, 0 if it was left alone and -1 on
+ * error.
+ */
+static int
+recycle_card (MYSQL *conn, nfc_device_t *device, MifareTag tag)
+{
+    char *tag_uid = freefare_get_tag_uid (tag);
+    char uid_sql[WALLET_UID_SQL_LEN];
+    char queued[32];
+    int res = -1;
+
+    wallet_uid_sql (tag_uid, uid_sql);
+    printf ("Found %s with UID %s.\n", freefare_get_tag_friendly_name (tag), tag_uid);
+
+    switch (wallet_db_select_str (conn, queued, sizeof (queued), "SELECT queued FROM card_recycle WHERE uid=%s AND recycled IS NULL", uid_sql)) {
+	case 1:
+		break;
+	case 0:
+		warnx ("card %s is not waiting for recycling, skipped", tag_uid);
+		res = 0;
+		/* FALLTHROUGH */
+	default:
+		free (tag_uid);
+		return res;
+    }
+
+    if (wallet_card_format (tag) < 0) {
+		warnx ("card %s cannot be formatted", tag_uid);
+		free (tag_uid);
+		return -1;
+    }
+    if (wallet_stock_recycled (conn, tag_uid) < 0) {
+		free (tag_uid);
+		return -1;
+    }
+    res = 1;
+
+    if (recycle_options.stock) {
+		struct wallet_record record = { .balance = 0 };
+		uint8_t ndef_msg[WALLET_RECORD_LEN];
+		size_t ndef_msg_len, encoded_size;
+		uint8_t *tlv_data;
+
+		wallet_record_seal (&record, tag_uid);
+		ndef_msg_len = wallet_record_encode (&record, ndef_msg, sizeof (ndef_msg));
+		if ((tlv_data = tlv_encode (3, ndef_msg, ndef_msg_len, &encoded_size))) {
+			if ((wallet_card_provision (device, tag, tlv_data, encoded_size) < 0) ||
+				(wallet_stock_add (conn, tag_uid) < 0))
+				warnx ("card %s recycled but not added to stock", tag_uid);
+			else
+				printf ("Card added to stock.\n");
+			mifare_classic_disconnect (tag);
+			free (tlv_data);
+		}
+    }
+
+    free (tag_uid);
+    return res;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch;
+
+    while ((ch = getopt (argc, argv, "hs")) != -1) {
+		switch (ch) {
+		case 's':
+			recycle_options.stock = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    nfc_device_t *device = NULL;
+    MifareTag *tags = NULL;
+    nfc_device_desc_t devices[8];
+    size_t device_count;
+    char buffer[BUFSIZ];
+    int recycled = 0;
+    int error = EXIT_SUCCESS;
+
+    nfc_list_devices (devices, 8, &device_count);
+    if (!device_count)
+		errx (EXIT_FAILURE, "No NFC device found.");
+
+    if (!(device = nfc_connect (&(devices[0]))))
+		errx (EXIT_FAILURE, "nfc_connect() failed.");
+
+    for (;;) {
+		printf ("\nPlace a collected card on the reader and press enter ('q' to stop): ");
+		if (!fgets (buffer, BUFSIZ, stdin) || (buffer[0] == 'q') || (buffer[0] == 'Q'))
+			break;
+
+		if (!(tags = freefare_get_tags (device))) {
+			warnx ("Error listing Mifare Classic tag.");
+			continue;
+		}
+		for (int i = 0; tags[i]; i++) {
+			switch (freefare_get_tag_type (tags[i])) {
+			case CLASSIC_1K:
+			case CLASSIC_4K:
+				break;
+			default:
+				continue;
+			}
+
+			switch (recycle_card (conn, device, tags[i])) {
+			case 1:
+				recycled++;
+				printf ("Card recycled.\n");
+				break;
+			case 0:
+				break;
+			default:
+				error = EXIT_FAILURE;
+				break;
+			}
+		}
+		freefare_free_tags (tags);
+    }
+
+    printf ("%d cards recycled\n", recycled);
+
+    nfc_disconnect (device);
+	mysql_close(conn);
+    exit (error);
+}
@@ -28,135 +28,65 @@
 #include <unistd.h>
 #include <mysql/mysql.h>
 #include "common.h"
+#include "wallet-db.h"
+#include "wallet-card.h"
+#include "wallet-rebind.h"
+#include "wallet-stock.h"
 
 #include <nfc/nfc.h>
 
 #include <freefare.h>
 
-
-#define START_FORMAT_N	"Formatting %d sectors ["
-#define DONE_FORMAT	"] done.\n"
-
-MifareClassicKey default_keys[] = {
-    { 0xff,0xff,0xff,0xff,0xff,0xff },
-    { 0xd3,0xf7,0xd3,0xf7,0xd3,0xf7 },
-    { 0xa0,0xa1,0xa2,0xa3,0xa4,0xa5 },
-    { 0xb0,0xb1,0xb2,0xb3,0xb4,0xb5 },
-    { 0x4d,0x3a,0x99,0xc3,0x51,0xdd },
-    { 0x1a,0x98,0x2c,0x7e,0x45,0x9a },
-    { 0xaa,0xbb,0xcc,0xdd,0xee,0xff },
-    { 0x00,0x00,0x00,0x00,0x00,0x00 }
-};
-int		 format_mifare_classic_1k (MifareTag tag);
-int		 format_mifare_classic_4k (MifareTag tag);
-int		 try_format_sector (MifareTag tag, MifareClassicSectorNumber sector);
-
-static int at_block = 0;
-static int mod_block = 10;
-
 struct {
-    bool fast;
     bool interactive;
-} format_options = {
-    .fast        = false,
+} renew_options = {
     .interactive = true
 };
 
-void
-display_progress ()
+/*
+ * Invalidate the wallet record of the card the student was moved off, once
+ * it is back on the reader. The card is hotlisted whether or not this
+ * works.
+ */
+static void
+void_old_card (nfc_device_t *device, const char *old_uid)
 {
-    at_block++;
-    if (0 == (at_block % mod_block)) {
-		printf ("%d", at_block);
-		fflush (stdout);
-    } else {
-		printf (".");
-		fflush (stdout);
-    }
-}
+    MifareTag *tags;
+    int voided = 0;
 
-int
-format_mifare_classic_1k (MifareTag tag)
-{
-    printf (START_FORMAT_N, 16);
-    for (int sector = 0; sector < 16; sector++) {
-		if (!try_format_sector (tag, sector))
-			return 0;
-    }
-    printf (DONE_FORMAT);
-    return 1;
-}
+    printf ("\nPlace the old card back on the reader to invalidate it, then press enter.");
+    getchar ();
 
-int
-format_mifare_classic_4k (MifareTag tag)
-{
-    printf (START_FORMAT_N, 32 + 8);
-    for (int sector = 0; sector < (32 + 8); sector++) {
-		if (!try_format_sector (tag, sector))
-			return 0;
-    }
-    printf (DONE_FORMAT);
-    return 1;
-}
+    if ((tags = freefare_get_tags (device))) {
+		for (int i = 0; tags[i]; i++) {
+			char *uid = freefare_get_tag_uid (tags[i]);
 
-int
-try_format_sector (MifareTag tag, MifareClassicSectorNumber sector)
-{
-    display_progress ();
-    for (size_t i = 0; i < (sizeof (default_keys) / sizeof (MifareClassicKey)); i++) {
-		MifareClassicBlockNumber block = mifare_classic_sector_last_block (sector);
-		if ((0 == mifare_classic_connect (tag)) && (0 == mifare_classic_authenticate (tag, block, default_keys[i], MFC_KEY_A))) {
-			if (0 == mifare_classic_format_sector (tag, sector)) {
-				mifare_classic_disconnect (tag);
-				return 1;
-			} else if (EIO == errno) {
-				err (EXIT_FAILURE, "sector %d", sector);
-			}
-			mifare_classic_disconnect (tag);
-		}
-
-		if ((0 == mifare_classic_connect (tag)) && (0 == mifare_classic_authenticate (tag, block, default_keys[i], MFC_KEY_B))) {
-			if (0 == mifare_classic_format_sector (tag, sector)) {
-				mifare_classic_disconnect (tag);
-				return 1;
-			} else if (EIO == errno) {
-				err (EXIT_FAILURE, "sector %d", sector);
-			}
-			mifare_classic_disconnect (tag);
+			if (0 == strcmp (uid, old_uid))
+				voided = (0 == wallet_stock_void (tags[i]));
+			free (uid);
 		}
+		freefare_free_tags (tags);
     }
-
-    warnx ("No known authentication key for sector %d", sector);
-    return 0;
+    if (!voided)
+		printf ("Old card could not be invalidated, it is blocked anyway.\n");
 }
 
 int
 main(int argc, char *argv[])
 {
-	double balance = 0;
-	double rc_balance = 0;
-	int found_user = 0;
-	char *ID_db = NULL;
-	
 	//initilize database
 	MYSQL *conn;
-	MYSQL_RES *result;
-	MYSQL_ROW row;
-	MYSQL_FIELD *field;
-	int retval;
 	
 	conn = mysql_init(NULL);
 	
-	retval = mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag);
-	if(!retval)
+	//card_rebind is a stored procedure
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag | CLIENT_MULTI_RESULTS))
 	{
 		printf("Error connecting to database: %s\n", mysql_error(conn));
 		return -1;
 	}
 	printf("Connection successful\n");
 	
-	
-    int ch;
     int error = EXIT_SUCCESS;
     nfc_device_t *device = NULL;
     MifareTag *tags = NULL;
@@ -166,7 +96,7 @@ main(int argc, char *argv[])
 
     nfc_list_devices (devices, 8, &device_count);
     if (!device_count)
-	errx (EXIT_FAILURE, "No NFC device found.");
+		errx (EXIT_FAILURE, "No NFC device found.");
 
     for (size_t d = 0; d < device_count; d++) {
 		device = nfc_connect (&(devices[d]));
@@ -194,143 +124,72 @@ main(int argc, char *argv[])
 			char *tag_uid = freefare_get_tag_uid (tags[i]);
 			char buffer[BUFSIZ];
 
-			//erasing card
 			printf ("Found %s with UID %s. ", freefare_get_tag_friendly_name (tags[i]), tag_uid);
-			bool format = true;
-			if (format_options.interactive) {
-				printf ("Are you sure you want to format this card? [yN] ");
+			bool renew = true;
+			if (renew_options.interactive) {
+				printf ("Are you sure you want to replace this card? [yN] ");
 				fgets (buffer, BUFSIZ, stdin);
-				format = ((buffer[0] == 'y') || (buffer[0] == 'Y'));
+				renew = ((buffer[0] == 'y') || (buffer[0] == 'Y'));
 			} else {
 				printf ("\n");
 			}
 
-			if (format) {
-				enum mifare_tag_type tt = freefare_get_tag_type (tags[i]);
-				at_block = 0;
-
-				if (format_options.fast) {
-					printf (START_FORMAT_N, (tt == CLASSIC_1K) ? 1 : 2);
-					if (!try_format_sector (tags[i], 0x00))
-						break;
-
-					if (tt == CLASSIC_4K)
-						if (!try_format_sector (tags[i], 0x10))
-							break;
-
-					printf (DONE_FORMAT);
-					continue;
-				}
-				switch (tt) {
-				case CLASSIC_1K:
-					mod_block = 4;
-					if (!format_mifare_classic_1k (tags[i]))
-						error = 1;
-					break;
-				case CLASSIC_4K:
-					mod_block = 10;
-					if (!format_mifare_classic_4k (tags[i]))
-						error = 1;
-					break;
-				default:
-					/* Keep compiler quiet */
-					break;
-				}
-				
-				//get the student id from database
-				ulong uid_length = strlen(tag_uid);
-				char uid_esc[(2 * uid_length)+1];
-
-				mysql_real_escape_string(conn, uid_esc, tag_uid, uid_length);
-				
-				int n = 0;
+			if (renew) {
+				//prompt user to place the new card
+				printf("\n\nRemove the card and place the new card on the reader.");
+				printf("\nThen press enter.");
+				getchar();
 				
-				char sql_stmnta[52] = {'\0'};
+				//same device session, only the tags are listed again
+				MifareTag *new_tags = freefare_get_tags (device);
+				MifareTag new_tag = NULL;
 				
-				n = snprintf(sql_stmnta, 52, "SELECT student_id FROM student WHERE uid='%s'", uid_esc);
-				retval = mysql_real_query(conn, sql_stmnta, n);
-				if(retval)
-				{
-					printf("Select data from DB Failed\n");
-					return -1;
+				for (int j = 0; new_tags && new_tags[j]; j++) {
+					enum mifare_tag_type tt = freefare_get_tag_type (new_tags[j]);
+					if ((tt == CLASSIC_1K) || (tt == CLASSIC_4K)) {
+						new_tag = new_tags[j];
+						break;
+					}
 				}
-				printf("Select to DB successful\n");
 				
-				result = mysql_store_result(conn);
-				while (row = mysql_fetch_row(result)) {
-					ID_db = row[0];
-				}
-					
-					
-				//get the remaining balance of the user	
-				char sql_stmntb[49] = {'\0'};				
-				n = snprintf(sql_stmntb, 49, "SELECT balance FROM student WHERE uid='%s'", uid_esc);
-				retval = mysql_real_query(conn, sql_stmntb, n);
-				if(retval)
+				if (new_tag == NULL)
 				{
-					printf("Select data from DB Failed\n");
-					return -1;
+					printf("No new card found.\n");
+					error = EXIT_FAILURE;
 				}
-				printf("Select to DB successful\n");
-				
-				result = mysql_store_result(conn);
-
-				while(field = mysql_fetch_field(result))
+				else
 				{
-					if(field->type == MYSQL_TYPE_NEWDECIMAL)
+					char *new_tag_uid = freefare_get_tag_uid (new_tag);
+					struct wallet_rebind rebind;
+					enum wallet_rebind_status status;
+					
+					//one call moves the student to the new card
+					status = wallet_rebind(conn, tag_uid, new_tag_uid, &rebind);
+					puts(wallet_rebind_strerror(status));
+					if (status != WALLET_REBIND_OK)
 					{
-						while (row = mysql_fetch_row(result))
-						{
-							balance = atof(row[0]);
-						}
+						error = EXIT_FAILURE;
+					}
+					else if (wallet_rebind_issue (device, new_tag, &rebind) < 0)
+					{
+						printf("Card write failed, tap the card at update-balance to finish.\n");
+						error = EXIT_FAILURE;
 					}
 					else
 					{
-						printf("The field contains non-numeric data.\n");
+						char balance_char[16] = {'\0'};
+						printf("%s moved to card %s, balance RM%s\n", rebind.student_id, new_tag_uid, wallet_format_cents(balance_char, sizeof(balance_char), rebind.balance));
 					}
-				}	
-				
-				//delete user from database
-				char sql_stmnt_del[41] = {'\0'};
-				
-				n = snprintf(sql_stmnt_del, 41, "DELETE FROM student WHERE uid='%s'", uid_esc);
-				retval = mysql_real_query(conn, sql_stmnt_del, n);
-				if(retval)
-				{
-					printf("Deleting record from DB Failed\n");
-					return -1;
-				}
-				printf("Delete successful\n");
-				
-				//prompt user to place the new card
-				printf("\n\nRemove the card and place the new card on the reader.");
-				printf("\nThen press enter.");
-				getchar();
-				
-				//get the new card's uid, have to reconnect again to connect to the new card
-				MifareTag *new_tags = NULL;
-				new_tags = freefare_get_tags (device);
-				char *new_tag_uid = freefare_get_tag_uid (new_tags[i]);
-				
-				//create new student record in database
-				char sql_stmntc[57] = {'\0'};
-				
-				//filter tag_uid
-				ulong new_uid_length = strlen(new_tag_uid);
-				char new_uid_esc[(2 * new_uid_length)+1];
-				mysql_real_escape_string(conn, new_uid_esc, new_tag_uid, new_uid_length);
-				
-				n = snprintf(sql_stmntc, 57, "INSERT INTO student VALUES('%s', '%s', %.1f)", new_uid_esc, ID_db, balance);
-				retval = mysql_real_query(conn, sql_stmntc, n);
-				if(retval)
-				{
-					printf("Inserting data from DB Failed\n");
-					return -1;
+					
+					//only now that the student has left it is the old card
+					//wiped; card_rebind has hotlisted it already
+					if (status == WALLET_REBIND_OK)
+						void_old_card (device, tag_uid);
+					free (new_tag_uid);
 				}
-				printf("Insert to DB successful\n");
 				
-				freefare_free_tags (new_tags);
-				free (new_tag_uid);
+				if (new_tags)
+					freefare_free_tags (new_tags);
 			}
 
 			free (tag_uid);
@@ -340,34 +199,6 @@ main(int argc, char *argv[])
 		nfc_disconnect (device);
     }
 	
-	mysql_free_result(result);
 	mysql_close(conn);
-	
-	//write data to new card
-	char balance_char[6] = {'\0'};
-	char final_balance[6] = {'\0'};
-
-	snprintf(balance_char, 6, "%.2f", balance);
-
-	if(strlen(balance_char) != 5)
-	{
-		strcat(final_balance, "0");
-		strcat(final_balance, balance_char);
-	}
-	else
-	{
-		strcpy(final_balance, balance_char);
-	}
-
-
-	//write back to card
-	char command[66] = {'\0'};
-
-	strcat(command, "~/Dropbox/Work/libfreefare/examples/simple-write -i ");
-	strcat(command, ID_db);
-	strcat(command, final_balance);
-
-	system(command);
-	
     exit (error);
 }
@@ -0,0 +1,27 @@
+--
+-- The tables the first tools were written against. Existing installs have
+-- them already and keep their data; 003-ledger-keys.sql brings both kinds
+-- of install to the same keys.
+--
+--   student: the card UID of every student and the balance of the account
+--   sales:   one row per checkout
+--   topup:   one row per top-up
+--
+
+CREATE TABLE IF NOT EXISTS student (
+	uid		VARCHAR(20) DEFAULT NULL,
+	student_id	CHAR(8) NOT NULL,
+	balance		DECIMAL(5,2) NOT NULL DEFAULT 0
+) ENGINE=InnoDB;
+
+CREATE TABLE IF NOT EXISTS sales (
+	time		DATETIME NOT NULL,
+	price		DECIMAL(5,2) NOT NULL,
+	uid		VARCHAR(20) NOT NULL
+) ENGINE=InnoDB;
+
+CREATE TABLE IF NOT EXISTS topup (
+	time		DATETIME NOT NULL,
+	amount		DECIMAL(5,2) NOT NULL,
+	uid		VARCHAR(20) NOT NULL
+) ENGINE=InnoDB;
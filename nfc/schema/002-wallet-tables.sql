@@ -0,0 +1,244 @@
+--
+-- Tables, triggers and procedures used by the wallet tools in addition to
+-- the original student, sales and topup tables (001-base-tables.sql).
+--
+-- All wallet tables must use InnoDB: the tools rely on transactions and
+-- row locks.
+--
+
+-- Ledger of balance transfers between students (transfer-balance).
+CREATE TABLE IF NOT EXISTS transfer (
+	id		BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
+	time		DATETIME NOT NULL,
+	amount		DECIMAL(5,2) NOT NULL,
+	from_student	CHAR(8) NOT NULL,
+	to_student	CHAR(8) NOT NULL,
+	PRIMARY KEY (id),
+	KEY from_student (from_student, time),
+	KEY to_student (to_student, time)
+) ENGINE=InnoDB;
+
+-- Balance changes made without the card on the reader, still to be written
+-- to the card. settled is NULL until the card has been updated.
+CREATE TABLE IF NOT EXISTS pending_credit (
+	id		BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
+	student_id	CHAR(8) NOT NULL,
+	amount		DECIMAL(5,2) NOT NULL,
+	reason		VARCHAR(16) NOT NULL,
+	created		DATETIME NOT NULL,
+	settled		DATETIME NULL,
+	PRIMARY KEY (id),
+	KEY student_pending (student_id, settled)
+) ENGINE=InnoDB;
+
+-- Card writes in progress (see wallet-intent.c). A prepared intent is
+-- either committed (card written, database updated) or aborted (card left
+-- unchanged); old_seq/new_seq are the write sequence numbers on the card.
+CREATE TABLE IF NOT EXISTS card_intent (
+	id		BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
+	kind		ENUM('sync','sale','topup') NOT NULL,
+	uid		VARCHAR(20) NOT NULL,
+	student_id	CHAR(8) NOT NULL,
+	amount		DECIMAL(5,2) NOT NULL,
+	pending_last_id	BIGINT UNSIGNED NOT NULL DEFAULT 0,
+	old_balance	DECIMAL(5,2) NOT NULL,
+	old_seq		INT UNSIGNED NOT NULL,
+	new_balance	DECIMAL(5,2) NOT NULL,
+	new_seq		INT UNSIGNED NOT NULL,
+	state		ENUM('prepared','committed','aborted') NOT NULL,
+	created		DATETIME NOT NULL,
+	resolved	DATETIME NULL,
+	PRIMARY KEY (id),
+	KEY uid_state (uid, state, new_seq),
+	KEY state (state)
+) ENGINE=InnoDB;
+
+-- Every change to a student row, in commit order of its id, for the local
+-- snapshots of the terminals (see wallet-snapshot.c). A row whose card was
+-- replaced or removed is recorded as deleted under its old uid. Rows older
+-- than the oldest terminal snapshot can be pruned (snapshot-sync -p).
+CREATE TABLE IF NOT EXISTS student_change (
+	id		BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
+	uid		VARCHAR(20) NULL,
+	student_id	CHAR(8) NOT NULL,
+	balance		DECIMAL(5,2) NOT NULL,
+	deleted		TINYINT(1) NOT NULL DEFAULT 0,
+	time		DATETIME NOT NULL,
+	PRIMARY KEY (id),
+	KEY time (time)
+) ENGINE=InnoDB;
+
+DROP TRIGGER IF EXISTS student_change_insert;
+DROP TRIGGER IF EXISTS student_change_update;
+DROP TRIGGER IF EXISTS student_change_delete;
+
+DELIMITER ;;
+
+CREATE TRIGGER student_change_insert AFTER INSERT ON student FOR EACH ROW
+BEGIN
+	INSERT INTO student_change (uid, student_id, balance, time)
+		VALUES (NEW.uid, NEW.student_id, NEW.balance, NOW());
+END;;
+
+CREATE TRIGGER student_change_update AFTER UPDATE ON student FOR EACH ROW
+BEGIN
+	IF NOT (OLD.uid <=> NEW.uid) THEN
+		INSERT INTO student_change (uid, student_id, balance, deleted, time)
+			VALUES (OLD.uid, OLD.student_id, OLD.balance, 1, NOW());
+	END IF;
+	INSERT INTO student_change (uid, student_id, balance, time)
+		VALUES (NEW.uid, NEW.student_id, NEW.balance, NOW());
+END;;
+
+CREATE TRIGGER student_change_delete AFTER DELETE ON student FOR EACH ROW
+BEGIN
+	INSERT INTO student_change (uid, student_id, balance, deleted, time)
+		VALUES (OLD.uid, OLD.student_id, OLD.balance, 1, NOW());
+END;;
+
+DELIMITER ;
+
+-- Cards that must no longer be accepted (lost, stolen, decommissioned),
+-- whether or not they are still registered to a student.
+CREATE TABLE IF NOT EXISTS hotlist (
+	uid		VARCHAR(20) NOT NULL,
+	reason		VARCHAR(16) NOT NULL,
+	created		DATETIME NOT NULL,
+	PRIMARY KEY (uid)
+) ENGINE=InnoDB;
+
+-- Sale by card UID alone (checkout -u): check the hotlist, debit the
+-- student and record the sale in one call. The card itself is not written,
+-- so the debit is queued as a negative pending credit for the next tap in
+-- the normal mode. Returns one row: status, student_id, balance.
+DROP PROCEDURE IF EXISTS wallet_debit;
+
+DELIMITER ;;
+
+CREATE PROCEDURE wallet_debit (IN p_uid VARCHAR(20), IN p_amount DECIMAL(5,2))
+BEGIN
+	DECLARE v_student CHAR(8) DEFAULT NULL;
+	DECLARE v_balance DECIMAL(5,2) DEFAULT NULL;
+	DECLARE EXIT HANDLER FOR SQLEXCEPTION
+	BEGIN
+		ROLLBACK;
+		RESIGNAL;
+	END;
+
+	START TRANSACTION;
+	SELECT student_id, balance INTO v_student, v_balance
+		FROM student WHERE uid = p_uid FOR UPDATE;
+
+	IF EXISTS (SELECT 1 FROM hotlist WHERE uid = p_uid) THEN
+		ROLLBACK;
+		SELECT 'blocked', v_student, v_balance;
+	ELSEIF v_student IS NULL THEN
+		ROLLBACK;
+		SELECT 'unknown', NULL, NULL;
+	ELSEIF v_balance < p_amount THEN
+		ROLLBACK;
+		SELECT 'insufficient', v_student, v_balance;
+	ELSE
+		UPDATE student SET balance = balance - p_amount WHERE student_id = v_student;
+		INSERT INTO sales (time, price, uid) VALUES (NOW(), p_amount, p_uid);
+		INSERT INTO pending_credit (student_id, amount, reason, created)
+			VALUES (v_student, -p_amount, 'uid-sale', NOW());
+		COMMIT;
+		SELECT 'ok', v_student, v_balance - p_amount;
+	END IF;
+END;;
+
+DELIMITER ;
+
+-- Progress of the sector key rotation (wallet-rotate.c), one row per card:
+-- the wallet sectors (bit n for sector n) already on the keys of the given
+-- generation, and whether that covers the whole application.
+CREATE TABLE IF NOT EXISTS key_rotation (
+	uid		VARCHAR(20) NOT NULL,
+	generation	TINYINT UNSIGNED NOT NULL,
+	sectors		BIGINT UNSIGNED NOT NULL DEFAULT 0,
+	complete	TINYINT(1) NOT NULL DEFAULT 0,
+	updated		DATETIME NOT NULL,
+	PRIMARY KEY (uid),
+	KEY generation_complete (generation, complete)
+) ENGINE=InnoDB;
+
+-- Blank cards prepared ahead of time by prepare-stock. issued and
+-- student_id are set when lost-card or renew-card hands one out.
+CREATE TABLE IF NOT EXISTS card_stock (
+	uid		VARCHAR(20) NOT NULL,
+	prepared	DATETIME NOT NULL,
+	issued		DATETIME DEFAULT NULL,
+	student_id	CHAR(8) DEFAULT NULL,
+	PRIMARY KEY (uid),
+	KEY issued (issued)
+) ENGINE=InnoDB;
+
+-- Cards of closed accounts (delete-user, transfer-balance), invalidated
+-- and hotlisted at the desk, waiting for the full format of recycle-cards.
+CREATE TABLE IF NOT EXISTS card_recycle (
+	uid		VARCHAR(20) NOT NULL,
+	queued		DATETIME NOT NULL,
+	recycled	DATETIME DEFAULT NULL,
+	PRIMARY KEY (uid),
+	KEY recycled (recycled)
+) ENGINE=InnoDB;
+
+-- Cards a student had before the current one (renew-card).
+CREATE TABLE IF NOT EXISTS uid_history (
+	id		BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
+	student_id	CHAR(8) NOT NULL,
+	uid		VARCHAR(20) NOT NULL,
+	replaced_by	VARCHAR(20) NOT NULL,
+	replaced	DATETIME NOT NULL,
+	PRIMARY KEY (id),
+	KEY student_id (student_id, replaced),
+	KEY uid (uid)
+) ENGINE=InnoDB;
+
+-- Move the student of card p_old to card p_new in one transaction: the
+-- student row keeps its place and only its uid changes. Returns one row:
+-- status, student_id, balance, whether p_new came from card_stock.
+DROP PROCEDURE IF EXISTS card_rebind;
+
+DELIMITER ;;
+
+CREATE PROCEDURE card_rebind (IN p_old VARCHAR(20), IN p_new VARCHAR(20))
+BEGIN
+	DECLARE v_student CHAR(8) DEFAULT NULL;
+	DECLARE v_balance DECIMAL(5,2) DEFAULT NULL;
+	DECLARE v_stock INT DEFAULT 0;
+	DECLARE EXIT HANDLER FOR SQLEXCEPTION
+	BEGIN
+		ROLLBACK;
+		RESIGNAL;
+	END;
+
+	START TRANSACTION;
+	SELECT student_id, balance INTO v_student, v_balance
+		FROM student WHERE uid = p_old FOR UPDATE;
+
+	IF v_student IS NULL THEN
+		ROLLBACK;
+		SELECT 'unknown', NULL, NULL, 0;
+	ELSEIF EXISTS (SELECT 1 FROM student WHERE uid = p_new) OR
+	       EXISTS (SELECT 1 FROM hotlist WHERE uid = p_new) THEN
+		ROLLBACK;
+		SELECT 'in-use', v_student, v_balance, 0;
+	ELSE
+		UPDATE student SET uid = p_new WHERE uid = p_old;
+		INSERT INTO uid_history (student_id, uid, replaced_by, replaced)
+			VALUES (v_student, p_old, p_new, NOW());
+		INSERT IGNORE INTO hotlist (uid, reason, created)
+			VALUES (p_old, 'renewed', NOW());
+		INSERT INTO card_recycle (uid, queued) VALUES (p_old, NOW())
+			ON DUPLICATE KEY UPDATE queued = VALUES(queued), recycled = NULL;
+		UPDATE card_stock SET issued = NOW(), student_id = v_student
+			WHERE uid = p_new AND issued IS NULL;
+		SET v_stock = ROW_COUNT();
+		COMMIT;
+		SELECT 'ok', v_student, v_balance, v_stock;
+	END IF;
+END;;
+
+DELIMITER ;
@@ -0,0 +1,37 @@
+--
+-- Keys for the tap path. Every lookup the tools make on student is by uid
+-- or by student_id; sales and topup are appended to in time order and read
+-- per card over a period, so they are clustered on time with a per-card
+-- index beside.
+--
+-- Installs that added indexes of their own to these tables should drop
+-- them first: migrate stops at the first statement that fails and does not
+-- record the migration.
+--
+
+ALTER TABLE student
+	MODIFY uid VARCHAR(20) DEFAULT NULL,
+	MODIFY student_id CHAR(8) NOT NULL,
+	MODIFY balance DECIMAL(5,2) NOT NULL DEFAULT 0,
+	ADD PRIMARY KEY (student_id),
+	ADD UNIQUE KEY uid (uid),
+	ENGINE=InnoDB;
+
+-- id only breaks ties between rows of the same second.
+ALTER TABLE sales
+	MODIFY time DATETIME NOT NULL,
+	MODIFY uid VARCHAR(20) NOT NULL,
+	ADD COLUMN id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
+	ADD PRIMARY KEY (time, id),
+	ADD KEY id (id),
+	ADD KEY uid_time (uid, time),
+	ENGINE=InnoDB;
+
+ALTER TABLE topup
+	MODIFY time DATETIME NOT NULL,
+	MODIFY uid VARCHAR(20) NOT NULL,
+	ADD COLUMN id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
+	ADD PRIMARY KEY (time, id),
+	ADD KEY id (id),
+	ADD KEY uid_time (uid, time),
+	ENGINE=InnoDB;
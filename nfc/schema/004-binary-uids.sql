@@ -0,0 +1,193 @@
+--
+-- Card UIDs as their 4, 7 or 10 bytes instead of lower-case hex text, and
+-- an integer key for students that the sales and topup ledgers refer to.
+--
+-- The tools write UIDs as X'...' literals (wallet_uid_sql) and read them
+-- back with LOWER(HEX(uid)) where they need the text. Binary UIDs sort the
+-- way their hex form did, so ORDER BY uid is unchanged.
+--
+-- Every uid column is converted in place: hex text and binary UIDs differ
+-- in length, so rows already converted never collide with rows that are
+-- not. The student_change triggers are dropped for the conversion, which
+-- would otherwise log every student row as changed.
+--
+
+DROP TRIGGER IF EXISTS student_change_insert;
+DROP TRIGGER IF EXISTS student_change_update;
+DROP TRIGGER IF EXISTS student_change_delete;
+
+-- student: id is the key the ledgers use; student_id stays unique.
+ALTER TABLE student
+	MODIFY uid VARBINARY(20) DEFAULT NULL,
+	DROP PRIMARY KEY,
+	ADD COLUMN id INT UNSIGNED NOT NULL AUTO_INCREMENT FIRST,
+	ADD PRIMARY KEY (id),
+	ADD UNIQUE KEY student_id (student_id);
+UPDATE student SET uid = UNHEX(uid) WHERE uid IS NOT NULL;
+ALTER TABLE student MODIFY uid VARBINARY(10) DEFAULT NULL;
+
+ALTER TABLE student_change MODIFY uid VARBINARY(20) NULL;
+UPDATE student_change SET uid = UNHEX(uid) WHERE uid IS NOT NULL;
+ALTER TABLE student_change MODIFY uid VARBINARY(10) NULL;
+
+ALTER TABLE card_intent MODIFY uid VARBINARY(20) NOT NULL;
+UPDATE card_intent SET uid = UNHEX(uid);
+ALTER TABLE card_intent MODIFY uid VARBINARY(10) NOT NULL;
+
+ALTER TABLE hotlist MODIFY uid VARBINARY(20) NOT NULL;
+UPDATE hotlist SET uid = UNHEX(uid);
+ALTER TABLE hotlist MODIFY uid VARBINARY(10) NOT NULL;
+
+ALTER TABLE key_rotation MODIFY uid VARBINARY(20) NOT NULL;
+UPDATE key_rotation SET uid = UNHEX(uid);
+ALTER TABLE key_rotation MODIFY uid VARBINARY(10) NOT NULL;
+
+ALTER TABLE card_stock MODIFY uid VARBINARY(20) NOT NULL;
+UPDATE card_stock SET uid = UNHEX(uid);
+ALTER TABLE card_stock MODIFY uid VARBINARY(10) NOT NULL;
+
+ALTER TABLE card_recycle MODIFY uid VARBINARY(20) NOT NULL;
+UPDATE card_recycle SET uid = UNHEX(uid);
+ALTER TABLE card_recycle MODIFY uid VARBINARY(10) NOT NULL;
+
+ALTER TABLE uid_history
+	MODIFY uid VARBINARY(20) NOT NULL,
+	MODIFY replaced_by VARBINARY(20) NOT NULL;
+UPDATE uid_history SET uid = UNHEX(uid), replaced_by = UNHEX(replaced_by);
+ALTER TABLE uid_history
+	MODIFY uid VARBINARY(10) NOT NULL,
+	MODIFY replaced_by VARBINARY(10) NOT NULL;
+
+-- sales and topup keep the UID of the card used and gain the student it
+-- was registered to. Rows of cards since replaced are found through
+-- uid_history; rows of deleted students are left with a NULL student.
+ALTER TABLE sales
+	MODIFY uid VARBINARY(20) NOT NULL,
+	ADD COLUMN student INT UNSIGNED DEFAULT NULL AFTER uid,
+	ADD KEY student_time (student, time);
+UPDATE sales SET uid = UNHEX(uid);
+ALTER TABLE sales MODIFY uid VARBINARY(10) NOT NULL;
+UPDATE sales l JOIN student s ON s.uid = l.uid SET l.student = s.id;
+UPDATE sales l JOIN uid_history h ON h.uid = l.uid JOIN student s ON s.student_id = h.student_id
+	SET l.student = s.id WHERE l.student IS NULL;
+
+ALTER TABLE topup
+	MODIFY uid VARBINARY(20) NOT NULL,
+	ADD COLUMN student INT UNSIGNED DEFAULT NULL AFTER uid,
+	ADD KEY student_time (student, time);
+UPDATE topup SET uid = UNHEX(uid);
+ALTER TABLE topup MODIFY uid VARBINARY(10) NOT NULL;
+UPDATE topup l JOIN student s ON s.uid = l.uid SET l.student = s.id;
+UPDATE topup l JOIN uid_history h ON h.uid = l.uid JOIN student s ON s.student_id = h.student_id
+	SET l.student = s.id WHERE l.student IS NULL;
+
+DELIMITER ;;
+
+CREATE TRIGGER student_change_insert AFTER INSERT ON student FOR EACH ROW
+BEGIN
+	INSERT INTO student_change (uid, student_id, balance, time)
+		VALUES (NEW.uid, NEW.student_id, NEW.balance, NOW());
+END;;
+
+CREATE TRIGGER student_change_update AFTER UPDATE ON student FOR EACH ROW
+BEGIN
+	IF NOT (OLD.uid <=> NEW.uid) THEN
+		INSERT INTO student_change (uid, student_id, balance, deleted, time)
+			VALUES (OLD.uid, OLD.student_id, OLD.balance, 1, NOW());
+	END IF;
+	INSERT INTO student_change (uid, student_id, balance, time)
+		VALUES (NEW.uid, NEW.student_id, NEW.balance, NOW());
+END;;
+
+CREATE TRIGGER student_change_delete AFTER DELETE ON student FOR EACH ROW
+BEGIN
+	INSERT INTO student_change (uid, student_id, balance, deleted, time)
+		VALUES (OLD.uid, OLD.student_id, OLD.balance, 1, NOW());
+END;;
+
+DELIMITER ;
+
+-- wallet_debit and card_rebind of 002-wallet-tables.sql, on binary UIDs.
+DROP PROCEDURE IF EXISTS wallet_debit;
+
+DELIMITER ;;
+
+CREATE PROCEDURE wallet_debit (IN p_uid VARBINARY(10), IN p_amount DECIMAL(5,2))
+BEGIN
+	DECLARE v_key INT UNSIGNED DEFAULT NULL;
+	DECLARE v_student CHAR(8) DEFAULT NULL;
+	DECLARE v_balance DECIMAL(5,2) DEFAULT NULL;
+	DECLARE EXIT HANDLER FOR SQLEXCEPTION
+	BEGIN
+		ROLLBACK;
+		RESIGNAL;
+	END;
+
+	START TRANSACTION;
+	SELECT id, student_id, balance INTO v_key, v_student, v_balance
+		FROM student WHERE uid = p_uid FOR UPDATE;
+
+	IF EXISTS (SELECT 1 FROM hotlist WHERE uid = p_uid) THEN
+		ROLLBACK;
+		SELECT 'blocked', v_student, v_balance;
+	ELSEIF v_student IS NULL THEN
+		ROLLBACK;
+		SELECT 'unknown', NULL, NULL;
+	ELSEIF v_balance < p_amount THEN
+		ROLLBACK;
+		SELECT 'insufficient', v_student, v_balance;
+	ELSE
+		UPDATE student SET balance = balance - p_amount WHERE id = v_key;
+		INSERT INTO sales (time, price, uid, student) VALUES (NOW(), p_amount, p_uid, v_key);
+		INSERT INTO pending_credit (student_id, amount, reason, created)
+			VALUES (v_student, -p_amount, 'uid-sale', NOW());
+		COMMIT;
+		SELECT 'ok', v_student, v_balance - p_amount;
+	END IF;
+END;;
+
+DELIMITER ;
+
+DROP PROCEDURE IF EXISTS card_rebind;
+
+DELIMITER ;;
+
+CREATE PROCEDURE card_rebind (IN p_old VARBINARY(10), IN p_new VARBINARY(10))
+BEGIN
+	DECLARE v_student CHAR(8) DEFAULT NULL;
+	DECLARE v_balance DECIMAL(5,2) DEFAULT NULL;
+	DECLARE v_stock INT DEFAULT 0;
+	DECLARE EXIT HANDLER FOR SQLEXCEPTION
+	BEGIN
+		ROLLBACK;
+		RESIGNAL;
+	END;
+
+	START TRANSACTION;
+	SELECT student_id, balance INTO v_student, v_balance
+		FROM student WHERE uid = p_old FOR UPDATE;
+
+	IF v_student IS NULL THEN
+		ROLLBACK;
+		SELECT 'unknown', NULL, NULL, 0;
+	ELSEIF EXISTS (SELECT 1 FROM student WHERE uid = p_new) OR
+	       EXISTS (SELECT 1 FROM hotlist WHERE uid = p_new) THEN
+		ROLLBACK;
+		SELECT 'in-use', v_student, v_balance, 0;
+	ELSE
+		UPDATE student SET uid = p_new WHERE uid = p_old;
+		INSERT INTO uid_history (student_id, uid, replaced_by, replaced)
+			VALUES (v_student, p_old, p_new, NOW());
+		INSERT IGNORE INTO hotlist (uid, reason, created)
+			VALUES (p_old, 'renewed', NOW());
+		INSERT INTO card_recycle (uid, queued) VALUES (p_old, NOW())
+			ON DUPLICATE KEY UPDATE queued = VALUES(queued), recycled = NULL;
+		UPDATE card_stock SET issued = NOW(), student_id = v_student
+			WHERE uid = p_new AND issued IS NULL;
+		SET v_stock = ROW_COUNT();
+		COMMIT;
+		SELECT 'ok', v_student, v_balance, v_stock;
+	END IF;
+END;;
+
+DELIMITER ;
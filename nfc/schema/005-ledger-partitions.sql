@@ -0,0 +1,21 @@
+--
+-- sales and topup range-partitioned by month of time, so that inserts only
+-- touch the indexes of the current month and a query bounded on time only
+-- reads the months it covers.
+--
+-- Only the catch-all partition is created here; ledger-partitions splits
+-- one partition per month off it (all of the existing history on its first
+-- run), keeps a few months ahead of the clock and can move old months out
+-- into archive tables. Run it from cron.
+--
+-- Queries must bound time itself (time >= '2012-03-01' AND time <
+-- '2012-04-01'); a function of time such as DATE(time) defeats pruning.
+--
+
+ALTER TABLE sales PARTITION BY RANGE (TO_DAYS(time)) (
+	PARTITION pmax VALUES LESS THAN MAXVALUE
+);
+
+ALTER TABLE topup PARTITION BY RANGE (TO_DAYS(time)) (
+	PARTITION pmax VALUES LESS THAN MAXVALUE
+);
@@ -0,0 +1,36 @@
+--
+-- Seals of the sales and topup ledgers, made by audit-ledger (see
+-- wallet-audit.h): one row per batch of ledger rows, in id order, with the
+-- Merkle root of the batch and the hash chaining it to the batch before.
+--
+-- audit_horizon keeps, per ledger, the highest id the previous run saw,
+-- and only rows up to it are sealed. Ids are handed out when a row is
+-- inserted, not when it is committed, so this assumes that no transaction
+-- writing the ledgers stays open from one run to the next: run
+-- audit-ledger far less often than the longest of them takes (every few
+-- minutes at least). A row committed later below a sealed id is reported
+-- by -v as a row added to its batch.
+--
+-- Only the account audit-ledger runs as should write these tables. Each
+-- seal is also copied to its spool directory, and checked against it.
+--
+
+CREATE TABLE IF NOT EXISTS audit_batch (
+	ledger		ENUM('sales','topup') NOT NULL,
+	batch		INT UNSIGNED NOT NULL,
+	first_id	BIGINT UNSIGNED NOT NULL,
+	last_id		BIGINT UNSIGNED NOT NULL,
+	entries		INT UNSIGNED NOT NULL,
+	root		BINARY(32) NOT NULL,
+	chain		BINARY(32) NOT NULL,
+	sealed		DATETIME NOT NULL,
+	verified	DATETIME DEFAULT NULL,
+	PRIMARY KEY (ledger, batch),
+	KEY last_id (ledger, last_id)
+) ENGINE=InnoDB;
+
+CREATE TABLE IF NOT EXISTS audit_horizon (
+	ledger		ENUM('sales','topup') NOT NULL,
+	horizon		BIGINT UNSIGNED NOT NULL,
+	PRIMARY KEY (ledger)
+) ENGINE=InnoDB;
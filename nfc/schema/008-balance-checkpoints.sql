@@ -0,0 +1,32 @@
+--
+-- Periodic copies of every balance (balance-at -c), so that the balance of
+-- a student at any moment is a checkpoint plus the ledger rows after it.
+--
+-- A checkpoint records, with the balances, the highest id of each ledger
+-- when it was taken: every row up to it is in the balances, every row
+-- above is not, whatever its time (offline sales are recorded with the time
+-- of the sale, hours after the fact). The (student, id) keys find the rows
+-- of a student after a checkpoint without reading the ones before.
+--
+
+CREATE TABLE IF NOT EXISTS balance_checkpoint (
+	taken		DATETIME NOT NULL,
+	sales_id	BIGINT UNSIGNED NOT NULL,
+	topup_id	BIGINT UNSIGNED NOT NULL,
+	transfer_id	BIGINT UNSIGNED NOT NULL,
+	PRIMARY KEY (taken)
+) ENGINE=InnoDB;
+
+CREATE TABLE IF NOT EXISTS checkpoint_balance (
+	taken		DATETIME NOT NULL,
+	student_id	CHAR(8) NOT NULL,
+	student		INT UNSIGNED NOT NULL,
+	balance		DECIMAL(5,2) NOT NULL,
+	PRIMARY KEY (taken, student_id)
+) ENGINE=InnoDB;
+
+ALTER TABLE sales ADD KEY student_id (student, id);
+ALTER TABLE topup ADD KEY student_id (student, id);
+ALTER TABLE transfer
+	ADD KEY from_id (from_student, id),
+	ADD KEY to_id (to_student, id);
@@ -0,0 +1,52 @@
+--
+-- card_rebind of 004-binary-uids.sql, also settling the pending credits of
+-- the student. The new card is written with student.balance, which already
+-- counts them: left unsettled, they would be added to the card a second time
+-- (checkout compares card + pending with the database and rejects the card).
+--
+
+DROP PROCEDURE IF EXISTS card_rebind;
+
+DELIMITER ;;
+
+CREATE PROCEDURE card_rebind (IN p_old VARBINARY(10), IN p_new VARBINARY(10))
+BEGIN
+	DECLARE v_student CHAR(8) DEFAULT NULL;
+	DECLARE v_balance DECIMAL(5,2) DEFAULT NULL;
+	DECLARE v_stock INT DEFAULT 0;
+	DECLARE EXIT HANDLER FOR SQLEXCEPTION
+	BEGIN
+		ROLLBACK;
+		RESIGNAL;
+	END;
+
+	START TRANSACTION;
+	SELECT student_id, balance INTO v_student, v_balance
+		FROM student WHERE uid = p_old FOR UPDATE;
+
+	IF v_student IS NULL THEN
+		ROLLBACK;
+		SELECT 'unknown', NULL, NULL, 0;
+	ELSEIF EXISTS (SELECT 1 FROM student WHERE uid = p_new) OR
+	       EXISTS (SELECT 1 FROM hotlist WHERE uid = p_new) THEN
+		ROLLBACK;
+		SELECT 'in-use', v_student, v_balance, 0;
+	ELSE
+		UPDATE student SET uid = p_new WHERE uid = p_old;
+		INSERT INTO uid_history (student_id, uid, replaced_by, replaced)
+			VALUES (v_student, p_old, p_new, NOW());
+		INSERT IGNORE INTO hotlist (uid, reason, created)
+			VALUES (p_old, 'renewed', NOW());
+		INSERT INTO card_recycle (uid, queued) VALUES (p_old, NOW())
+			ON DUPLICATE KEY UPDATE queued = VALUES(queued), recycled = NULL;
+		UPDATE card_stock SET issued = NOW(), student_id = v_student
+			WHERE uid = p_new AND issued IS NULL;
+		SET v_stock = ROW_COUNT();
+		UPDATE pending_credit SET settled = NOW()
+			WHERE student_id = v_student AND settled IS NULL;
+		COMMIT;
+		SELECT 'ok', v_student, v_balance, v_stock;
+	END IF;
+END;;
+
+DELIMITER ;
@@ -0,0 +1,60 @@
+--
+-- Former keys of students whose card was replaced by lost-card before it
+-- rebound students in place. It used to delete the student row and insert
+-- a new one, so the sales and topup rows of the lost card kept a student
+-- key that no longer exists, and the lost card was never written to
+-- uid_history.
+--
+-- The ledger rows are left as they are (audit-ledger may have sealed
+-- them, student key included): student_key_alias maps each former key to
+-- the current one, and statement and balance-at read the rows of both.
+--
+-- A lost card is one hotlisted as 'lost' and missing from uid_history. Its
+-- student is the one the delete of lost-card logged in student_change, and
+-- the card that replaced it the next registration of that student there.
+-- Rows of lost cards from before 004-binary-uids.sql carry no key at all
+-- and cannot be told apart from those of deleted students.
+--
+
+CREATE TABLE IF NOT EXISTS student_key_alias (
+	alias		INT UNSIGNED NOT NULL,
+	student		INT UNSIGNED NOT NULL,
+	PRIMARY KEY (alias),
+	KEY student (student)
+) ENGINE=InnoDB;
+
+CREATE TEMPORARY TABLE lost_card (
+	uid		VARBINARY(10) NOT NULL,
+	student_id	CHAR(8) NULL,
+	change_id	BIGINT UNSIGNED NULL,
+	lost		DATETIME NOT NULL,
+	PRIMARY KEY (uid)
+) ENGINE=InnoDB;
+
+INSERT INTO lost_card (uid, lost)
+	SELECT h.uid, h.created FROM hotlist h
+	WHERE h.reason = 'lost' AND NOT EXISTS (SELECT 1 FROM uid_history u WHERE u.uid = h.uid);
+UPDATE lost_card c SET c.change_id = (SELECT MAX(d.id) FROM student_change d WHERE d.uid = c.uid AND d.deleted = 1);
+UPDATE lost_card c JOIN student_change d ON d.id = c.change_id SET c.student_id = d.student_id;
+DELETE FROM lost_card WHERE student_id IS NULL;
+
+INSERT IGNORE INTO student_key_alias (alias, student)
+	SELECT DISTINCT l.student, s.id FROM sales l
+	JOIN lost_card c ON c.uid = l.uid
+	JOIN student s ON s.student_id = c.student_id
+	LEFT JOIN student o ON o.id = l.student
+	WHERE l.student IS NOT NULL AND o.id IS NULL;
+
+INSERT IGNORE INTO student_key_alias (alias, student)
+	SELECT DISTINCT l.student, s.id FROM topup l
+	JOIN lost_card c ON c.uid = l.uid
+	JOIN student s ON s.student_id = c.student_id
+	LEFT JOIN student o ON o.id = l.student
+	WHERE l.student IS NOT NULL AND o.id IS NULL;
+
+INSERT INTO uid_history (student_id, uid, replaced_by, replaced)
+	SELECT c.student_id, c.uid, n.uid, c.lost FROM lost_card c
+	JOIN student_change n ON n.id = (SELECT MIN(r.id) FROM student_change r
+		WHERE r.student_id = c.student_id AND r.deleted = 0 AND r.uid IS NOT NULL AND r.id > c.change_id);
+
+DROP TEMPORARY TABLE lost_card;
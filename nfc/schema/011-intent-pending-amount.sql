@@ -0,0 +1,9 @@
+--
+-- The sum of the pending credits an intent folded into the card, so that
+-- finalizing it can tell whether the entries it settles are still the ones
+-- that were read (see wallet_pending_settle()). Intents prepared before have
+-- 0 and are reported once if they settle anything.
+--
+
+ALTER TABLE card_intent
+	ADD COLUMN pending_amount DECIMAL(5,2) NOT NULL DEFAULT 0 AFTER pending_last_id;
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * End-of-day settlement of the checkout terminals:
+ *
+ *     settlement [-H] [-d YYYY-MM-DD] [-t terminal]
+ *
+ * Sales and takings per terminal for the day (today by default), read from
+ * the hourly rollups the sales ledger keeps up to date (sales_rollup, see
+ * schema/006-sales-rollup.sql) rather than from the ledger itself. -H
+ * breaks every terminal down by hour.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+
+struct {
+    char day[11];
+    int terminal;		/* -1 for all */
+    int hourly;
+} settlement_options = {
+    .terminal = -1
+};
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-H] [-d YYYY-MM-DD] [-t terminal]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -d     Day to settle (default today)\n");
+    fprintf (stderr, "  -H     Hourly breakdown\n");
+    fprintf (stderr, "  -t     Only this terminal\n");
+}
+
+static int
+settle (MYSQL *conn)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    char terminal_cond[32] = "";
+    char amount_char[16];
+    unsigned long total_sales = 0;
+    long total_amount = 0;
+
+    if (settlement_options.terminal >= 0)
+		snprintf (terminal_cond, sizeof (terminal_cond), " AND terminal=%d", settlement_options.terminal);
+
+    /* The day is a range of the key, not a function of hour. */
+    if (settlement_options.hourly) {
+		if (wallet_db_exec (conn, "SELECT terminal, DATE_FORMAT(hour, '%%H:00'), sales, amount FROM sales_rollup "
+				"WHERE hour >= '%s' AND hour < '%s' + INTERVAL 1 DAY%s ORDER BY terminal, hour",
+				settlement_options.day, settlement_options.day, terminal_cond) < 0)
+			return -1;
+    } else {
+		if (wallet_db_exec (conn, "SELECT terminal, 'day', SUM(sales), SUM(amount) FROM sales_rollup "
+				"WHERE hour >= '%s' AND hour < '%s' + INTERVAL 1 DAY%s GROUP BY terminal ORDER BY terminal",
+				settlement_options.day, settlement_options.day, terminal_cond) < 0)
+			return -1;
+    }
+    if (!(result = mysql_store_result (conn))) {
+		warnx ("sales_rollup: %s", mysql_error (conn));
+		return -1;
+    }
+
+    printf ("Settlement of %s\n\n", settlement_options.day);
+    printf ("%-8s %-5s %8s %12s\n", "terminal", "", "sales", "amount");
+    while ((row = mysql_fetch_row (result))) {
+		unsigned long sales = strtoul (row[2], NULL, 10);
+		long amount = wallet_parse_cents (row[3]);
+
+		printf ("%-8s %-5s %8lu %12s\n", row[0], row[1], sales,
+			wallet_format_cents (amount_char, sizeof (amount_char), amount));
+		total_sales += sales;
+		total_amount += amount;
+    }
+    mysql_free_result (result);
+
+    printf ("%-8s %-5s %8lu %12s\n", "total", "", total_sales,
+	    wallet_format_cents (amount_char, sizeof (amount_char), total_amount));
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch, year, month, mday;
+    time_t now = time (NULL);
+
+    strftime (settlement_options.day, sizeof (settlement_options.day), "%Y-%m-%d", localtime (&now));
+
+    while ((ch = getopt (argc, argv, "d:hHt:")) != -1) {
+		switch (ch) {
+		case 'd':
+			if ((3 != sscanf (optarg, "%4d-%2d-%2d", &year, &month, &mday)) ||
+			    (month < 1) || (month > 12) || (mday < 1) || (mday > 31))
+				errx (EXIT_FAILURE, "invalid day \"%s\"", optarg);
+			snprintf (settlement_options.day, sizeof (settlement_options.day), "%04d-%02d-%02d", year, month, mday);
+			break;
+		case 'H':
+			settlement_options.hourly = 1;
+			break;
+		case 't':
+			settlement_options.terminal = atoi (optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    if (settle (conn) < 0)
+		exit (EXIT_FAILURE);
+
+	mysql_close(conn);
+    exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Keep the local student snapshot of a terminal up to date (run from cron
+ * and when the terminal starts):
+ *
+ *     snapshot-sync [-f] [-m max] [-p days]
+ *
+ * The changes made since the last run are appended to the delta log; the
+ * snapshot is rebuilt when there is none yet, when the delta log grows past
+ * max changes or when the changes it needs have been pruned.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+#include "wallet-snapshot.h"
+
+#define DEFAULT_MAX_DELTA	10000
+
+struct {
+    int force;
+    size_t max_delta;
+    int prune_days;
+} sync_options = {
+    .max_delta = DEFAULT_MAX_DELTA
+};
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-f] [-m max] [-p days]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -f     Rebuild the snapshot\n");
+    fprintf (stderr, "  -m     Rebuild past max changes in the delta log (default %d)\n", DEFAULT_MAX_DELTA);
+    fprintf (stderr, "  -p     Prune student changes older than days first (one host only)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int ch;
+
+    while ((ch = getopt (argc, argv, "hfm:p:")) != -1) {
+		switch (ch) {
+		case 'f':
+			sync_options.force = 1;
+			break;
+		case 'm':
+			sync_options.max_delta = strtoul (optarg, NULL, 10);
+			break;
+		case 'p':
+			if ((sync_options.prune_days = atoi (optarg)) <= 0)
+				errx (EXIT_FAILURE, "invalid number of days: %s", optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+
+	//initilize database
+	MYSQL *conn;
+	
+	conn = mysql_init(NULL);
+	
+	if(!mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag))
+	{
+		printf("Error connecting to database: %s\n", mysql_error(conn));
+		return -1;
+	}
+
+    if (sync_options.prune_days &&
+	(wallet_db_exec (conn, "DELETE FROM student_change WHERE time < NOW() - INTERVAL %d DAY", sync_options.prune_days) < 0))
+		exit (EXIT_FAILURE);
+
+    struct wallet_snapshot snap;
+    long changes = -1;
+
+    if (!sync_options.force && (wallet_snapshot_open (&snap) == 0)) {
+		if ((changes = wallet_snapshot_refresh (conn, &snap)) >= 0)
+			printf ("%ld changes applied, %zu in delta log, up to %llu\n",
+				changes, snap.delta_count, (unsigned long long) snap.watermark);
+		if (snap.delta_count > sync_options.max_delta)
+			changes = -1;
+		wallet_snapshot_close (&snap);
+    }
+
+    if (changes < 0) {
+		if (wallet_snapshot_rebuild (conn) < 0)
+			errx (EXIT_FAILURE, "snapshot rebuild failed");
+		if (wallet_snapshot_open (&snap) < 0)
+			errx (EXIT_FAILURE, "snapshot unreadable after rebuild");
+		printf ("snapshot rebuilt: %llu cards, up to %llu\n",
+			(unsigned long long) snap.hdr->count, (unsigned long long) snap.watermark);
+		wallet_snapshot_close (&snap);
+    }
+
+	mysql_close(conn);
+    exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Spending history of a student, or of every student:
+ *
+ *     statement [-f from] [-u until] [-p page] student_id
+ *     statement -a -o dir [-j jobs] [-f from] [-u until] [-p page]
+ *
+ * Sales and top-ups are found by the student key the ledgers carry, so the
+ * history of every card the student had is included; the cards are listed
+ * in the heading. Keys the student had before lost-card rebound students
+ * in place are read too (student_key_alias, see
+ * schema/010-student-key-aliases.sql). Both ledgers are read in pages of
+ * (time, id) keyset ranges on their student index and merged by time as
+ * they are printed, so a statement of any length needs two pages of
+ * memory. -f and -u bound the period (YYYY-MM-DD, until excluded).
+ *
+ * With -a one statement per student is written to dir/student_id.txt by
+ * jobs processes, each with its own connection and share of the students.
+ */
+
+#include "config.h"
+
+#include <sys/wait.h>
+
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+#include "common.h"
+#include "wallet-db.h"
+
+#define DEFAULT_PAGE		500
+#define DEFAULT_JOBS		4
+
+struct {
+    char from[11];
+    char until[11];
+    unsigned page;
+    int all;
+    const char *dir;
+    int jobs;
+} statement_options = {
+    .from = "1000-01-01",
+    .until = "9999-12-31",
+    .page = DEFAULT_PAGE,
+    .jobs = DEFAULT_JOBS
+};
+
+/*
+ * One ledger read page by page, from the row after (time, id).
+ */
+struct cursor {
+    const char *table;
+    const char *amount;
+    const char *terminal;
+    const char *kind;
+    MYSQL_RES *page;
+    MYSQL_ROW row;
+    char last_time[20];
+    char last_id[24];
+    int last_page;
+};
+
+void
+usage(char *progname)
+{
+    fprintf (stderr, "usage: %s [-f from] [-u until] [-p page] student_id\n", progname);
+    fprintf (stderr, "       %s -a -o dir [-j jobs] [-f from] [-u until] [-p page]\n", progname);
+    fprintf (stderr, "\nOptions:\n");
+    fprintf (stderr, "  -a     Statements of all students\n");
+    fprintf (stderr, "  -f     From this day (YYYY-MM-DD)\n");
+    fprintf (stderr, "  -j     Parallel jobs with -a (default %d)\n", DEFAULT_JOBS);
+    fprintf (stderr, "  -o     Directory of the statements with -a\n");
+    fprintf (stderr, "  -p     Rows per page (default %d)\n", DEFAULT_PAGE);
+    fprintf (stderr, "  -u     Until this day, excluded (YYYY-MM-DD)\n");
+}
+
+static MYSQL *
+statement_connect (void)
+{
+    MYSQL *conn = mysql_init (NULL);
+
+    if (!mysql_real_connect (conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag)) {
+		printf ("Error connecting to database: %s\n", mysql_error (conn));
+		mysql_close (conn);
+		return NULL;
+    }
+    return conn;
+}
+
+static void
+cursor_init (struct cursor *c, const char *table, const char *amount, const char *terminal, const char *kind)
+{
+    memset (c, 0, sizeof (*c));
+    c->table = table;
+    c->amount = amount;
+    c->terminal = terminal;
+    c->kind = kind;
+    snprintf (c->last_time, sizeof (c->last_time), "%s", statement_options.from);
+    snprintf (c->last_id, sizeof (c->last_id), "0");
+}
+
+/*
+ * Move to the next row of the ledger, fetching the next page when the
+ * current one is used up. c->row is NULL at the end; returns -1 on error.
+ */
+static int
+cursor_next (MYSQL *conn, const char *keys, struct cursor *c)
+{
+    if (c->page && (c->row = mysql_fetch_row (c->page)))
+		goto found;
+
+    if (c->page) {
+		mysql_free_result (c->page);
+		c->page = NULL;
+		if (c->last_page)
+			return 0;
+    }
+    if (wallet_db_exec (conn, "SELECT time, id, %s, %s FROM %s WHERE student IN (%s) "
+			"AND time >= '%s' AND time < '%s' AND (time > '%s' OR (time = '%s' AND id > %s)) "
+			"ORDER BY time, id LIMIT %u",
+			c->amount, c->terminal, c->table, keys,
+			statement_options.from, statement_options.until, c->last_time, c->last_time, c->last_id,
+			statement_options.page) < 0)
+		return -1;
+    if (!(c->page = mysql_store_result (conn))) {
+		warnx ("%s: %s", c->table, mysql_error (conn));
+		return -1;
+    }
+    c->last_page = (mysql_num_rows (c->page) < statement_options.page);
+    if (!(c->row = mysql_fetch_row (c->page)))
+		return 0;
+
+found:
+    snprintf (c->last_time, sizeof (c->last_time), "%s", c->row[0]);
+    snprintf (c->last_id, sizeof (c->last_id), "%s", c->row[1]);
+    return 0;
+}
+
+static void
+cursor_close (struct cursor *c)
+{
+    if (c->page)
+		mysql_free_result (c->page);
+    c->page = NULL;
+}
+
+static int
+print_cards (MYSQL *conn, const char *id_esc, FILE *out)
+{
+    struct wallet_db_cursor cur;
+    MYSQL_ROW row;
+
+    if (wallet_db_cursor_open (&cur, conn, "SELECT LOWER(HEX(uid)), replaced FROM uid_history WHERE student_id='%s' ORDER BY replaced", id_esc) < 0)
+		return -1;
+    while ((row = wallet_db_cursor_next (&cur)))
+		fprintf (out, "Card:    %s (replaced %s)\n", row[0], row[1]);
+    return wallet_db_cursor_close (&cur);
+}
+
+/*
+ * Write the statement of one student. Returns 0 if the student is unknown,
+ * 1 when written, -1 on error.
+ */
+static int
+write_statement (MYSQL *conn, const char *student_id, FILE *out)
+{
+    ulong id_length = strlen (student_id);
+    char id_esc[(2 * id_length) + 1];
+    char key_char[24], balance_char[16], uid_char[24] = "-", amount_char[16];
+    char keys[256], aliases[232] = "";
+    struct cursor sales, topup;
+    long spent = 0, added = 0;
+    unsigned key;
+    int res = -1;
+
+    mysql_real_escape_string (conn, id_esc, student_id, id_length);
+    switch (wallet_db_select_str (conn, key_char, sizeof (key_char), "SELECT id FROM student WHERE student_id='%s'", id_esc)) {
+	case 1:
+		break;
+	case 0:
+		return 0;
+	default:
+		return -1;
+    }
+    key = strtoul (key_char, NULL, 10);
+    if ((wallet_db_select_str (conn, balance_char, sizeof (balance_char), "SELECT balance FROM student WHERE id=%u", key) < 0) ||
+	(wallet_db_select_str (conn, uid_char, sizeof (uid_char), "SELECT LOWER(HEX(uid)) FROM student WHERE id=%u", key) < 0) ||
+	(wallet_db_select_str (conn, aliases, sizeof (aliases), "SELECT GROUP_CONCAT(alias) FROM student_key_alias WHERE student=%u", key) < 0))
+		return -1;
+    if (strlen (aliases) == sizeof (aliases) - 1) {
+		warnx ("%s: too many former keys", student_id);
+		return -1;
+    }
+    snprintf (keys, sizeof (keys), "%u%s%s", key, aliases[0] ? ", " : "", aliases);
+
+    fprintf (out, "Student: %s\n", student_id);
+    fprintf (out, "Period:  %s to %s\n", statement_options.from, statement_options.until);
+    fprintf (out, "Card:    %s (current)\n", uid_char);
+    if (print_cards (conn, id_esc, out) < 0)
+		return -1;
+    fprintf (out, "\n%-19s %-6s %-8s %10s\n", "time", "", "terminal", "amount");
+
+    cursor_init (&sales, "sales", "price", "terminal", "sale");
+    cursor_init (&topup, "topup", "amount", "NULL", "topup");
+    if ((cursor_next (conn, keys, &sales) < 0) || (cursor_next (conn, keys, &topup) < 0))
+		goto out;
+
+    /* DATETIME text compares in time order. */
+    while (sales.row || topup.row) {
+		struct cursor *c = (!topup.row || (sales.row && (strcmp (sales.row[0], topup.row[0]) <= 0))) ? &sales : &topup;
+		long amount = wallet_parse_cents (c->row[2]);
+
+		if (c == &sales)
+			spent += amount;
+		else
+			added += amount;
+		fprintf (out, "%-19s %-6s %-8s %10s\n", c->row[0], c->kind, c->row[3] ? c->row[3] : "",
+			 wallet_format_cents (amount_char, sizeof (amount_char), (c == &sales) ? -amount : amount));
+		if (cursor_next (conn, keys, c) < 0)
+			goto out;
+    }
+
+    fprintf (out, "\nTopped up: %s\n", wallet_format_cents (amount_char, sizeof (amount_char), added));
+    fprintf (out, "Spent:     %s\n", wallet_format_cents (amount_char, sizeof (amount_char), spent));
+    fprintf (out, "Balance:   %s (now)\n", balance_char);
+    res = 1;
+
+out:
+    cursor_close (&sales);
+    cursor_close (&topup);
+    return res;
+}
+
+/*
+ * Statements of the students whose key is job modulo jobs, in key order.
+ */
+static int
+run_job (int job)
+{
+    char path[PATH_MAX], student_id[16];
+    unsigned last = 0;
+    size_t count;
+    int failed = 0;
+    MYSQL *conn;
+
+    if (!(conn = statement_connect ()))
+		return -1;
+
+    do {
+		MYSQL_RES *result;
+		MYSQL_ROW row;
+
+		if ((wallet_db_exec (conn, "SELECT id, student_id FROM student WHERE id > %u AND id %% %d = %d ORDER BY id LIMIT %u",
+				     last, statement_options.jobs, job, statement_options.page) < 0) ||
+		    !(result = mysql_store_result (conn))) {
+			failed++;
+			break;
+		}
+		count = mysql_num_rows (result);
+		while ((row = mysql_fetch_row (result))) {
+			FILE *out;
+
+			last = strtoul (row[0], NULL, 10);
+			snprintf (student_id, sizeof (student_id), "%s", row[1]);
+			snprintf (path, sizeof (path), "%s/%s.txt", statement_options.dir, student_id);
+			if (!(out = fopen (path, "w"))) {
+				warn ("%s", path);
+				failed++;
+				continue;
+			}
+			if ((write_statement (conn, student_id, out) < 0) | (fclose (out) != 0)) {
+				warnx ("%s: statement not written", student_id);
+				failed++;
+			}
+		}
+		mysql_free_result (result);
+    } while (count == statement_options.page);
+
+    mysql_close (conn);
+    return failed ? -1 : 0;
+}
+
+static int
+run_all (void)
+{
+    int failed = 0, status;
+    pid_t pid;
+
+    for (int job = 0; job < statement_options.jobs; job++) {
+		if ((pid = fork ()) < 0) {
+			warn ("fork");
+			failed++;
+			break;
+		}
+		if (pid == 0)
+			_exit ((run_job (job) < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    while ((pid = wait (&status)) > 0)
+		if (!WIFEXITED (status) || (WEXITSTATUS (status) != EXIT_SUCCESS))
+			failed++;
+
+    return failed ? -1 : 0;
+}
+
+static void
+parse_day (const char *arg, char day[11])
+{
+    int year, month, mday;
+
+    if ((3 != sscanf (arg, "%4d-%2d-%2d", &year, &month, &mday)) || (month < 1) || (month > 12) || (mday < 1) || (mday > 31))
+		errx (EXIT_FAILURE, "invalid day \"%s\"", arg);
+    snprintf (day, 11, "%04d-%02d-%02d", year, month, mday);
+}
+
+int
+main(int argc, char *argv[])
+{
+    MYSQL *conn;
+    int ch, res;
+
+    while ((ch = getopt (argc, argv, "af:hj:o:p:u:")) != -1) {
+		switch (ch) {
+		case 'a':
+			statement_options.all = 1;
+			break;
+		case 'f':
+			parse_day (optarg, statement_options.from);
+			break;
+		case 'j':
+			if ((statement_options.jobs = atoi (optarg)) < 1)
+				errx (EXIT_FAILURE, "-j needs at least one job");
+			break;
+		case 'o':
+			statement_options.dir = optarg;
+			break;
+		case 'p':
+			if ((statement_options.page = strtoul (optarg, NULL, 10)) < 1)
+				errx (EXIT_FAILURE, "-p needs at least one row");
+			break;
+		case 'u':
+			parse_day (optarg, statement_options.until);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit (EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+    }
+
+    if (statement_options.all) {
+		if (!statement_options.dir || (optind != argc)) {
+			usage(argv[0]);
+			exit (EXIT_FAILURE);
+		}
+		exit ((run_all () < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    if (optind + 1 != argc) {
+		usage(argv[0]);
+		exit (EXIT_FAILURE);
+    }
+
+    if (!(conn = statement_connect ()))
+		exit (EXIT_FAILURE);
+
+    if ((res = write_statement (conn, argv[optind], stdout)) == 0)
+		warnx ("%s: no such student", argv[optind]);
+
+	mysql_close(conn);
+    exit ((res == 1) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+/*
+ * wallet_transfer() runs a transaction that lost a deadlock again:
+ *
+ *     cc -I.. -o transfer-retry transfer-retry.c ../wallet-transfer.c ../wallet-db.c
+ *     ./transfer-retry
+ *
+ * The MySQL client calls are replaced by a fake connection that fails the
+ * balance UPDATE with ER_LOCK_DEADLOCK a given number of times, and clears
+ * the error on ROLLBACK as the real client does.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql/mysql.h>
+
+#include "wallet-event.h"
+#include "wallet-pending.h"
+#include "wallet-transfer.h"
+
+/* MySQL 8 dropped my_bool for bool; MariaDB (10.x and up) still has it. */
+#if defined (MYSQL_VERSION_ID) && (MYSQL_VERSION_ID >= 80000) && (MYSQL_VERSION_ID < 100000)
+typedef bool client_bool;
+#else
+typedef my_bool client_bool;
+#endif
+
+static struct {
+    int deadlocks;		/* UPDATEs still to fail */
+    unsigned int errno_;
+    int fetched;
+    int updates;
+    int rollbacks;
+} fake;
+
+static char *fake_rows[][2] = {
+    { "A0000001", "10.00" },
+    { "A0000002", "5.00" },
+};
+
+int
+mysql_real_query (MYSQL *conn, const char *q, unsigned long length)
+{
+    (void) conn;
+    (void) length;
+
+    fake.errno_ = 0;
+    if (0 == strncmp (q, "UPDATE student", 14)) {
+		if (fake.deadlocks) {
+			fake.deadlocks--;
+			fake.errno_ = 1213; /* ER_LOCK_DEADLOCK */
+			return 1;
+		}
+		fake.updates++;
+    }
+    return 0;
+}
+
+MYSQL_RES *
+mysql_store_result (MYSQL *conn)
+{
+    static char result;
+
+    (void) conn;
+    fake.fetched = 0;
+    return (MYSQL_RES *) &result;
+}
+
+MYSQL_RES *
+mysql_use_result (MYSQL *conn)
+{
+    return mysql_store_result (conn);
+}
+
+MYSQL_ROW
+mysql_fetch_row (MYSQL_RES *result)
+{
+    (void) result;
+    if (fake.fetched == 2)
+		return NULL;
+    return fake_rows[fake.fetched++];
+}
+
+unsigned long *
+mysql_fetch_lengths (MYSQL_RES *result)
+{
+    (void) result;
+    return NULL;
+}
+
+void
+mysql_free_result (MYSQL_RES *result)
+{
+    (void) result;
+}
+
+int
+mysql_next_result (MYSQL *conn)
+{
+    (void) conn;
+    return -1;
+}
+
+const char *
+mysql_error (MYSQL *conn)
+{
+    (void) conn;
+    return fake.errno_ ? "Deadlock found when trying to get lock" : "";
+}
+
+unsigned int
+mysql_errno (MYSQL *conn)
+{
+    (void) conn;
+    return fake.errno_;
+}
+
+unsigned long
+mysql_real_escape_string (MYSQL *conn, char *to, const char *from, unsigned long length)
+{
+    (void) conn;
+    memcpy (to, from, length + 1);
+    return length;
+}
+
+client_bool
+mysql_commit (MYSQL *conn)
+{
+    (void) conn;
+    fake.errno_ = 0;
+    return 0;
+}
+
+client_bool
+mysql_rollback (MYSQL *conn)
+{
+    (void) conn;
+    fake.errno_ = 0;
+    fake.rollbacks++;
+    return 0;
+}
+
+long long
+wallet_pending_enqueue (MYSQL *conn, const char *id_esc, long cents, const char *reason)
+{
+    (void) conn;
+    (void) id_esc;
+    (void) cents;
+    (void) reason;
+    return 1;
+}
+
+void
+wallet_event_init (struct wallet_event *ev, enum wallet_event_type type, const char *uid, const char *student_id)
+{
+    (void) type;
+    (void) uid;
+    (void) student_id;
+    memset (ev, 0, sizeof (*ev));
+}
+
+int
+wallet_event_publish (struct wallet_event *ev, size_t count)
+{
+    (void) ev;
+    (void) count;
+    return 0;
+}
+
+static int
+run (int deadlocks, enum wallet_transfer_status expected, int updates, int rollbacks)
+{
+    struct wallet_transfer res;
+    enum wallet_transfer_status status;
+
+    memset (&fake, 0, sizeof (fake));
+    fake.deadlocks = deadlocks;
+    status = wallet_transfer ((MYSQL *) &fake, "A0000001", "A0000002", 300, 0, &res);
+
+    if ((status != expected) || (fake.updates != updates) || (fake.rollbacks != rollbacks)) {
+		warnx ("%d deadlocks: status %d, %d updates, %d rollbacks (expected %d, %d, %d)",
+		       deadlocks, status, fake.updates, fake.rollbacks, expected, updates, rollbacks);
+		return 1;
+    }
+    return 0;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+
+    failed += run (0, WALLET_TRANSFER_OK, 1, 0);
+    /* One deadlock: rolled back and run again. */
+    failed += run (1, WALLET_TRANSFER_OK, 1, 1);
+    failed += run (2, WALLET_TRANSFER_OK, 1, 2);
+    /* Still deadlocked after the last try. */
+    failed += run (5, WALLET_TRANSFER_DB_ERROR, 0, 3);
+
+    if (failed)
+		exit (EXIT_FAILURE);
+    printf ("transfer-retry: ok\n");
+    exit (EXIT_SUCCESS);
+}
@@ -30,6 +30,13 @@
 #include <math.h>
 #include <mysql/mysql.h>
 #include "common.h"
+#include "wallet-db.h"
+#include "wallet-card.h"
+#include "wallet-pending.h"
+#include "wallet-intent.h"
+#include "wallet-monitor.h"
+#include "wallet-tapsnap.h"
+#include "wallet-rotate.h"
 
 #include <nfc/nfc.h>
 
@@ -126,8 +133,6 @@ int
 main(int argc, char *argv[])
 {
 
-	char ndef_input[15] = {'\0'};
-	
 	MYSQL *conn;
 	MYSQL_RES *result;
 	MYSQL_ROW row;
@@ -143,6 +148,10 @@ main(int argc, char *argv[])
 		return -1;
 	}
 	printf("Connection successful\n");
+	
+	//settle top-ups interrupted by a crash that later taps already decided
+	if((retval = wallet_intent_recover(conn)) > 0)
+		printf("Recovered %d interrupted transactions\n", retval);
     
     int error = 0;
     nfc_device_t *device = NULL;
@@ -199,7 +208,7 @@ main(int argc, char *argv[])
 				// Dump the NFCForum application using MAD information
 				uint8_t buffer[4096];
 				ssize_t len;
-				if ((len = mifare_application_read (tags[i], mad, mad_nfcforum_aid, buffer, sizeof(buffer), mifare_classic_nfcforum_public_key_a, MFC_KEY_A)) != -1) 
+				if ((len = wallet_app_read (tags[i], mad, buffer, sizeof(buffer))) != -1) 
 				{
 					uint8_t tlv_type;
 					uint16_t tlv_data_len;
@@ -232,34 +241,26 @@ main(int argc, char *argv[])
 							break;
 					}
 					
-					int i=0, j=0;
+					int j=0;
 					char ID[9] = {'\0'};
 					
-					for(i=0;i<8;i++)
-						ID[i] = tlv_data[i];
+					for(j=0;j<8;j++)
+						ID[j] = tlv_data[j];
 
-					ulong uid_length = strlen(tag_uid);
-					char uid_esc[(2 * uid_length)+1];
+					char uid_sql[WALLET_UID_SQL_LEN];
 
-					mysql_real_escape_string(conn, uid_esc, tag_uid, uid_length);
-					char sql_stmnt[52] = {'\0'};
-					int n = 0;
+					wallet_uid_sql(tag_uid, uid_sql);
+					char student_id_db[WALLET_ID_LEN + 1] = {'\0'};
 					
-					n = snprintf(sql_stmnt, 52, "SELECT student_id FROM student WHERE uid='%s'", uid_esc);
-					retval = mysql_real_query(conn, sql_stmnt, n);
-					if(retval)
+					retval = wallet_db_select_str(conn, student_id_db, sizeof(student_id_db), "SELECT student_id FROM student WHERE uid=%s", uid_sql);
+					if(retval < 0)
 					{
 						printf("Select data from DB Failed\n");
 						return -1;
 					}
 					printf("Select to DB successful\n");
 					
-					char *ID_db = NULL;
-					
-					result = mysql_store_result(conn);
-					while (row = mysql_fetch_row(result)) {
-						ID_db = row[0];
-					}
+					char *ID_db = (retval == 1) ? student_id_db : NULL;
 					
 					
 					if(ID_db == NULL)
@@ -281,6 +282,25 @@ main(int argc, char *argv[])
 						char id_esc[(2 * id_length)+1];
 
 						mysql_real_escape_string(conn, id_esc, ID, id_length);
+						
+						//finish or cancel a transaction that was interrupted on
+						//this card before looking at its balance
+						struct wallet_record record;
+						
+						if(wallet_record_decode(tlv_data, tlv_data_len, &record) < 0)
+						{
+							printf("\n\nInvalid balance\n\n");
+							wallet_tapsnap_append(tag_uid, NULL, 0);
+							goto done;
+						}
+						wallet_tapsnap_append(tag_uid, &record, 0);
+						if(wallet_intent_resolve(conn, tag_uid, &record) != 0)
+						{
+							printf("\nPrevious transaction on this card is unresolved, please tap again.\n");
+							error = EXIT_FAILURE;
+							goto done;
+						}
+						
 						char sql_stmnt[56] = {'\0'};
 						int n = 0;
 						
@@ -293,7 +313,7 @@ main(int argc, char *argv[])
 						}
 						printf("Select to DB successful\n");
 						
-						double balance_db = 0;
+						long balance_db = 0;
 						
 						result = mysql_store_result(conn);
 
@@ -303,42 +323,38 @@ main(int argc, char *argv[])
 							{
 								while (row = mysql_fetch_row(result))
 								{
-									balance_db = atof(row[0]);
+									balance_db = wallet_parse_cents(row[0]);
 								}
 							}
 							else
 							{
 								printf("The field contains non-numeric data.\n");
 							}
-						}	
+						}
+						mysql_free_result(result);
 						
-						//compare balance from database with balance from card
-						char balance_char[6] = {'\0'};
-						double balance = 0;
-						j=0;
-						for(i=8;i<13;i++)
+						//compare balance from database with balance from card,
+						//counting the credits queued while the card was away
+						struct wallet_pending pending;
+						
+						if(wallet_pending_fetch(conn, id_esc, &pending) < 0)
 						{
-							balance_char[j] = tlv_data[i];
-							j++;
+							printf("Select data from DB Failed\n");
+							return -1;
 						}
-							
-						balance = atof(balance_char);
 						
-						if(balance == balance_db)
+						if(record.balance + pending.amount == balance_db)
 						{
 							printf("\n\nValid balance\n\n");
 							
 							//start to top-up
 							double topup = 0;
+							long topup_cents = 0;
 							printf("\nTop Up: RM ");
 							scanf("%lf", &topup);
+							topup_cents = lround(topup * 100);
 							
-							if(balance + topup < 100)
-							{
-								balance += topup;
-								snprintf(balance_char, 6, "%.2f", balance ); 
-							}
-							else
+							if(balance_db + topup_cents >= WALLET_BALANCE_LIMIT)
 							{
 								printf("\nTop-up limit exceeded.\n");
 								printf("\nPress enter to continue.\n");
@@ -346,54 +362,52 @@ main(int argc, char *argv[])
 								exit(EXIT_SUCCESS);
 							}
 							
-							//ensure balance always with 4 digit, 4.00 => 04.00
-							char final_balance[6] = {'\0'};
-							if(strlen(balance_char) != 5)
-							{
-								strcat(final_balance, "0");
-								strcat(final_balance, balance_char);
-							}
-							else
-								strcpy(final_balance, balance_char);
-							
-							strcat(ndef_input, ID);
-							strcat(ndef_input, final_balance);
+							//record the intent, write the card and read it back,
+							//then commit the top-up together with the settlement
+							//of the queued credits
+							struct wallet_intent intent = {
+								.kind = WALLET_INTENT_TOPUP,
+								.amount = topup_cents,
+								.pending_last_id = pending.last_id,
+								.pending_amount = pending.amount,
+								.before = record,
+								.after = record
+							};
+							snprintf(intent.uid, sizeof(intent.uid), "%s", tag_uid);
+							intent.after.balance = balance_db + topup_cents;
 							
-							//update database
-							char sql_stmnt[60] = {'\0'};
-							int n = 0;
-							
-							n = snprintf(sql_stmnt, 60, "UPDATE student SET balance=%.1f WHERE student_id='%s'", balance, id_esc);
-							retval = mysql_real_query(conn, sql_stmnt, n);
-							if(retval)
-							{
-								printf("Updating data from DB Failed\n");
-								return -1;
-							}
-							else
+							switch(wallet_intent_run(conn, tags[i], mad, &intent))
 							{
-								printf("Update successful\n");
-								
-								//log activity into database
-								char sql_stmnt[50] = {'\0'};
-								int n = 0;
-								
-								n = snprintf(sql_stmnt, 50, "INSERT INTO topup VALUES(NOW(), %.1f, '%s')", topup, uid_esc);
-								retval = mysql_real_query(conn, sql_stmnt, n);
-								if(retval)
-								{
-									printf("Inserting data from DB Failed\n");
+								case WALLET_INTENT_COMMITTED:
+									printf("Update successful\n");
+									break;
+								case WALLET_INTENT_ABORTED:
+									printf("\nCard write failed, nothing was credited. Please tap again.\n");
+									error = EXIT_FAILURE;
+									goto done;
+								case WALLET_INTENT_IN_DOUBT:
+									printf("\nCard removed too early, please tap again to complete.\n");
+									error = EXIT_FAILURE;
+									goto done;
+								default:
+									printf("Updating data from DB Failed\n");
 									return -1;
-								}
-								printf("Insert to DB successful\n");
 							}
+							
+							char balance_char[16] = {'\0'};
+							printf("\nNew balance: RM%s\n", wallet_format_cents(balance_char, sizeof(balance_char), intent.after.balance));
+							
+							//move the card one sector closer to the current keys
+							wallet_key_rotate(conn, tags[i], mad);
 						}
 						else
 						{
 							printf("\n\nInvalid balance\n\n");
+							wallet_monitor_mismatch(tag_uid, &record);
 						}
 					}
 					
+					done:
 					free (tlv_data);
 				} else {
 					fprintf (stderr, "No NFC Forum application.\n");
@@ -418,20 +432,7 @@ main(int argc, char *argv[])
 		nfc_disconnect (device);
     }
 
-	mysql_free_result(result);
 	mysql_close(conn);
-	
-	//ndef_input will be empty if there is error, so continue if no error
-	if(strlen(ndef_input) != NULL)
-	{
-		//write back to card
-		char command[66] = {'\0'};
-		
-		strcat(command, "~/Dropbox/Work/libfreefare/examples/simple-write -i ");
-		strcat(command, ndef_input);
-		
-		system(command);
-	}
     exit (error);
 
 }
@@ -31,6 +31,12 @@
 #include <unistd.h>
 #include <mysql/mysql.h>
 #include "common.h"
+#include "wallet-db.h"
+#include "wallet-card.h"
+#include "wallet-pending.h"
+#include "wallet-intent.h"
+#include "wallet-tapsnap.h"
+#include "wallet-rotate.h"
 
 #include <nfc/nfc.h>
 
@@ -136,16 +142,12 @@ try_format_sector (MifareTag tag, MifareClassicSectorNumber sector)
 int
 main(int argc, char *argv[])
 {
-	double balance = 0;
-	double rc_balance = 0;
 	int found_user = 0;
-	char *ID_db = NULL;
+	struct wallet_record record;
+	struct wallet_pending pending;
 	
 	//initilize database
 	MYSQL *conn;
-	MYSQL_RES *result;
-	MYSQL_ROW row;
-	MYSQL_FIELD *field;
 	int retval;
 	
 	conn = mysql_init(NULL);
@@ -195,78 +197,81 @@ main(int argc, char *argv[])
 			}
 
 			char *tag_uid = freefare_get_tag_uid (tags[i]);
-			char buffer[BUFSIZ];
+			Mad mad;
 			
-			//get the remaining balance of the user
-			ulong uid_length = strlen(tag_uid);
-			char uid_esc[(2 * uid_length)+1];
+			//get the student id of the card owner
+			char uid_sql[WALLET_UID_SQL_LEN];
 
-			mysql_real_escape_string(conn, uid_esc, tag_uid, uid_length);
+			wallet_uid_sql(tag_uid, uid_sql);
 			
-			//get student_id
-			int n = 0;
-			
-			n = snprintf(sql_stmnt, 52, "SELECT student_id FROM student WHERE uid='%s'", uid_esc);
-			retval = mysql_real_query(conn, sql_stmnt, n);
-			if(retval)
+			retval = wallet_db_select_str(conn, record.student_id, sizeof(record.student_id), "SELECT student_id FROM student WHERE uid=%s", uid_sql);
+			if(retval < 0)
 			{
 				printf("Select data from DB Failed\n");
 				return -1;
 			}
 			printf("Select to DB successful\n");
-						
-			result = mysql_store_result(conn);
-			while (row = mysql_fetch_row(result)) {
-				ID_db = row[0];
-			}
 			
 			//exit if card is invalid
-			if (ID_db == NULL)
+			if (retval == 0)
 			{
 				puts("No user found/Invalid card.");
 				exit(EXIT_SUCCESS);
 			}
+			found_user = 1;
+			
+			ulong id_length = strlen(record.student_id);
+			char id_esc[(2 * id_length)+1];
+			mysql_real_escape_string(conn, id_esc, record.student_id, id_length);
 			
-			//get balance
-			char sql_stmnt[49] = {'\0'};
-			n = snprintf(sql_stmnt, 49, "SELECT balance FROM student WHERE uid='%s'", uid_esc);
-			retval = mysql_real_query(conn, sql_stmnt, n);
-			if(retval)
+			//write the database balance to the card while it is still on the
+			//reader; every queued credit is included in it
+			if ((mifare_classic_connect (tags[i]) != 0) || !(mad = mad_read (tags[i])))
 			{
-				printf("Select data from DB Failed\n");
-				return -1;
+				fprintf (stderr, "No MAD detected.\n");
+				error = EXIT_FAILURE;
+				found_user = 0;
+				free (tag_uid);
+				break;
 			}
-			printf("Select to DB successful\n");
 			
-			result = mysql_store_result(conn);
-			char *cols = NULL;
+			//an unreadable record is simply overwritten, otherwise a
+			//transaction interrupted on this card is decided first
+			struct wallet_intent intent = {
+				.kind = WALLET_INTENT_SYNC,
+				.before = record
+			};
+			snprintf(intent.uid, sizeof(intent.uid), "%s", tag_uid);
+			if (wallet_card_read(tags[i], mad, &intent.before) == 0) {
+				wallet_tapsnap_append(tag_uid, &intent.before, 0);
+				wallet_intent_resolve(conn, tag_uid, &intent.before);
+			}
 			
-			while(field = mysql_fetch_field(result))
+			intent.after = intent.before;
+			snprintf(intent.after.student_id, sizeof(intent.after.student_id), "%s", record.student_id);
+			if ((wallet_db_select_cents(conn, &intent.after.balance, "SELECT balance FROM student WHERE student_id='%s'", id_esc) != 1) ||
+				(wallet_pending_fetch(conn, id_esc, &pending) < 0))
 			{
-				if(field->type == MYSQL_TYPE_NEWDECIMAL)
-				{
-					while (row = mysql_fetch_row(result))
-					{
-						balance = atof(row[0]);
-						cols = row[0];
-					}
-				}
-				else
-				{
-					printf("The field contains non-numeric data.\n");
-				}
+				printf("Select data from DB Failed\n");
+				return -1;
 			}
+			intent.pending_last_id = pending.last_id;
+			intent.pending_amount = pending.amount;
 			
-			if (cols == NULL)
+			if (wallet_intent_run(conn, tags[i], mad, &intent) != WALLET_INTENT_COMMITTED)
 			{
-				puts("Cannot retrieve balance");
-				exit(EXIT_SUCCESS);
+				printf("Card write failed, please tap again.\n");
+				error = EXIT_FAILURE;
+				found_user = 0;
 			}
 			else
 			{
-				found_user = 1;
+				//move the card one sector closer to the current keys
+				wallet_key_rotate(conn, tags[i], mad);
 			}
+			record = intent.after;
 
+			free (mad);
 			free (tag_uid);
 		}
 
@@ -274,41 +279,13 @@ main(int argc, char *argv[])
 		nfc_disconnect (device);
     }
 	
-	mysql_free_result(result);
 	mysql_close(conn);
 	
 	if(found_user == 1)
 	{
-		//to-do, simply write database in child process.
-
-		printf("\nPlease place the card. Press Enter to continue.\n");
-		while (getchar() != '\n');
-		
-		char balance_char[6] = {'\0'};
-		char final_balance[6] = {'\0'};
-		
-		snprintf(balance_char, 6, "%.2f", balance);
-		
-		if(strlen(balance_char) != 5)
-		{
-			strcat(final_balance, "0");
-			strcat(final_balance, balance_char);
-		}
-		else
-		{
-			strcpy(final_balance, balance_char);
-		}
-		
-		
-		//write back to card
-		char command[66] = {'\0'};
-		
-		strcat(command, "~/Dropbox/Work/libfreefare/examples/simple-write -i ");
-		strcat(command, ID_db);
-		strcat(command, final_balance);
-		
-		system(command);
+		char balance_char[16] = {'\0'};
 		
+		printf("Card of %s updated: RM%s\n", record.student_id, wallet_format_cents(balance_char, sizeof(balance_char), record.balance));
 	}
 	
     exit (error);
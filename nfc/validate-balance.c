@@ -30,6 +30,14 @@
 #include "common.h"
 #include <mysql/mysql.h>
 #include "common.h"
+#include "wallet-db.h"
+#include "wallet-card.h"
+#include "wallet-pending.h"
+#include "wallet-intent.h"
+#include "wallet-monitor.h"
+#include "wallet-tapsnap.h"
+#include "wallet-rotate.h"
+#include "wallet-snapshot.h"
 
 #include <nfc/nfc.h>
 
@@ -45,20 +53,32 @@ main(int argc, char *argv[])
 
 	//initilize database
 	MYSQL *conn;
-	MYSQL_RES *result;
+	MYSQL_RES *result = NULL;
 	MYSQL_ROW row;
 	MYSQL_FIELD *field;
 	int retval;
 	
 	conn = mysql_init(NULL);
 	
+	//map the local student snapshot (kept up to date by snapshot-sync);
+	//it is enough to check cards while the database is unreachable
+	struct wallet_snapshot snapshot;
+	int offline = 0;
+	int snapshot_ok = (wallet_snapshot_open(&snapshot) == 0);
+	
 	retval = mysql_real_connect(conn, def_host_name, def_user_name, def_password, def_db_name, def_port_num, def_socket_name, def_client_flag);
 	if(!retval)
 	{
 		printf("Error connecting to database: %s\n", mysql_error(conn));
-		return -1;
+		if(!snapshot_ok)
+			return -1;
+		printf("Checking cards against the local snapshot\n");
+		offline = 1;
+	}
+	else
+	{
+		printf("Connection successful\n");
 	}
-	printf("Connection successful\n");
     
     int error = 0;
     nfc_device_t *device = NULL;
@@ -115,7 +135,7 @@ main(int argc, char *argv[])
 				// Dump the NFCForum application using MAD information
 				uint8_t buffer[4096];
 				ssize_t len;
-				if ((len = mifare_application_read (tags[i], mad, mad_nfcforum_aid, buffer, sizeof(buffer), mifare_classic_nfcforum_public_key_a, MFC_KEY_A)) != -1) 
+				if ((len = wallet_app_read (tags[i], mad, buffer, sizeof(buffer))) != -1) 
 				{
 					uint8_t tlv_type;
 					uint16_t tlv_data_len;
@@ -147,33 +167,37 @@ main(int argc, char *argv[])
 							break;
 					}
 					
-					int i=0, j=0;
+					int j=0;
 					char ID[9] = {'\0'};
 					
-					for(i=0;i<8;i++)
-						ID[i] = tlv_data[i];
+					for(j=0;j<8;j++)
+						ID[j] = tlv_data[j];
 
-					ulong uid_length = strlen(tag_uid);
-					char uid_esc[(2 * uid_length)+1];
+					char uid_sql[WALLET_UID_SQL_LEN];
 
-					mysql_real_escape_string(conn, uid_esc, tag_uid, uid_length);
-					char sql_stmnt[52] = {'\0'};
-					int n = 0;
-					
-					n = snprintf(sql_stmnt, 52, "SELECT student_id FROM student WHERE uid='%s'", uid_esc);
-					retval = mysql_real_query(conn, sql_stmnt, n);
-					if(retval)
-					{
-						printf("Select data from DB Failed\n");
-						return -1;
-					}
-					printf("Select to DB successful\n");
+					wallet_uid_sql(tag_uid, uid_sql);
 					
 					char *ID_db = NULL;
+					struct wallet_student student;
 					
-					result = mysql_store_result(conn);
-					while (row = mysql_fetch_row(result)) {
-						ID_db = row[0];
+					//look the card up in the snapshot first, in the database
+					//for cards registered since the last snapshot-sync
+					if(wallet_snapshot_lookup(&snapshot, tag_uid, &student) == 1)
+					{
+						ID_db = student.student_id;
+					}
+					else if(!offline)
+					{
+						retval = wallet_db_select_str(conn, student.student_id, sizeof(student.student_id), "SELECT student_id FROM student WHERE uid=%s", uid_sql);
+						if(retval < 0)
+						{
+							printf("Select data from DB Failed\n");
+							return -1;
+						}
+						printf("Select to DB successful\n");
+						
+						if(retval == 1)
+							ID_db = student.student_id;
 					}
 					
 					if(ID_db == NULL)
@@ -184,6 +208,39 @@ main(int argc, char *argv[])
 					{
 						printf("\nStudent found but not match to database\n");
 					}
+					else if(offline)
+					{
+						//the snapshot balance is as of the last snapshot-sync
+						//and does not show pending credits
+						struct wallet_record record = { .balance = -1 };
+						char balance_char[16] = {'\0'};
+						
+						printf("\nStudent found: %s\n", ID_db);
+						if(wallet_record_decode(tlv_data, tlv_data_len, &record) < 0)
+							wallet_tapsnap_append(tag_uid, NULL, 0);
+						else
+							wallet_tapsnap_append(tag_uid, &record, 0);
+						
+						printf("\nBalance (card): \tRM%s", wallet_format_cents(balance_char, sizeof(balance_char), record.balance));
+						printf("\nBalance (snapshot) : \tRM%s", wallet_format_cents(balance_char, sizeof(balance_char), student.balance));
+						
+						//a sealed record is authoritative without the database
+						if(wallet_record_verify(&record, tag_uid) == 1)
+							printf("\n\nValid balance (sealed card record)\n\n");
+						else if(record.sealed && wallet_mac_available())
+							printf("\n\nInvalid balance: card record seal does not match\n\n");
+						else if(record.balance == student.balance)
+							printf("\n\nValid balance\n\n");
+						else if((record.balance >= 0) && (record.balance < student.balance))
+							printf("\n\nBalance not confirmed (credits pending?), check again online\n\n");
+						else
+						{
+							printf("\n\nInvalid balance\n\n");
+							//an unreadable record was reported with its tap
+							if(record.balance >= 0)
+								wallet_monitor_mismatch(tag_uid, &record);
+						}
+					}
 					else
 					{
 						printf("\nStudent found: %s\n", ID_db);
@@ -192,6 +249,18 @@ main(int argc, char *argv[])
 						char id_esc[(2 * id_length)+1];
 
 						mysql_real_escape_string(conn, id_esc, ID, id_length);
+						
+						//a transaction interrupted on this card is decided by
+						//what the card holds now
+						struct wallet_record record = { .balance = -1 };
+						
+						if(wallet_record_decode(tlv_data, tlv_data_len, &record) < 0)
+							wallet_tapsnap_append(tag_uid, NULL, 0);
+						else
+							wallet_tapsnap_append(tag_uid, &record, 0);
+						if(wallet_intent_resolve(conn, tag_uid, &record) != 0)
+							printf("\nPrevious transaction on this card is unresolved\n");
+						
 						char sql_stmnt[56] = {'\0'};
 						int n = 0;
 						
@@ -204,7 +273,7 @@ main(int argc, char *argv[])
 						}
 						printf("Select to DB successful\n");
 						
-						double balance_db = 0;
+						long balance_db = 0;
 						
 						result = mysql_store_result(conn);
 
@@ -214,37 +283,54 @@ main(int argc, char *argv[])
 							{
 								while (row = mysql_fetch_row(result))
 								{
-									balance_db = atof(row[0]);
+									balance_db = wallet_parse_cents(row[0]);
 								}
 							}
 							else
 							{
 								printf("The field contains non-numeric data.\n");
 							}
-						}	
+						}
+						mysql_free_result(result);
+						
+						//compare balance from database with balance from card,
+						//counting the credits queued while the card was away
+						struct wallet_pending pending;
+						char balance_char[16] = {'\0'};
 						
-						//compare balance from database with balance from card
-						char balance_char[6] = {'\0'};
-						double balance = 0;
-						j=0;
-						for(i=8;i<13;i++)
+						if(wallet_pending_fetch(conn, id_esc, &pending) < 0)
 						{
-							balance_char[j] = tlv_data[i];
-							j++;
+							printf("Select data from DB Failed\n");
+							return -1;
 						}
-							
-						balance = atof(balance_char);
 						
-						printf("\nBalance (card): \tRM%.2f", balance);
-						printf("\nBalance (database) : \tRM%.2f", (double)balance_db);
+						printf("\nBalance (card): \tRM%s", wallet_format_cents(balance_char, sizeof(balance_char), record.balance));
+						if(pending.last_id)
+							printf("\nPending credits: \tRM%s", wallet_format_cents(balance_char, sizeof(balance_char), pending.amount));
+						printf("\nBalance (database) : \tRM%s", wallet_format_cents(balance_char, sizeof(balance_char), balance_db));
+						if(record.sealed && (wallet_record_verify(&record, tag_uid) == 0))
+							printf("\n\nCard record seal does not match, the card was rewritten outside the wallet tools");
 						
-						if(balance == (double)balance_db)
+						if(record.balance + pending.amount == balance_db)
 						{
 							printf("\n\nValid balance\n\n");
+							
+							//bring the card up to date while it is on the reader
+							if(pending.last_id)
+							{
+								if(wallet_pending_apply(conn, tags[i], mad, tag_uid, &record) < 0)
+									printf("Card update failed, pending credits kept\n");
+								else
+									printf("Card updated: RM%s\n", wallet_format_cents(balance_char, sizeof(balance_char), record.balance));
+							}
+							
+							//move the card one sector closer to the current keys
+							wallet_key_rotate(conn, tags[i], mad);
 						}
 						else
 						{
 							printf("\n\nInvalid balance\n\n");
+							wallet_monitor_mismatch(tag_uid, &record);
 						}
 					}	
 				
@@ -269,7 +355,7 @@ main(int argc, char *argv[])
 		freefare_free_tags (tags);
 		nfc_disconnect (device);
     }
-	mysql_free_result(result);
+	wallet_snapshot_close(&snapshot);
 	mysql_close(conn);
     exit (error);
 }
@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+
+#include "wallet-archive.h"
+#include "wallet-db.h"
+
+#define DICT_SLOTS	(2 * WALLET_ARCHIVE_DICT_MAX)
+#define ALIGN8(n)	(((n) + 7) & ~(uint64_t) 7)
+
+static const char *ledger_tables[] = {
+    [WALLET_ARCHIVE_SALES] = "sales",
+    [WALLET_ARCHIVE_TOPUP] = "topup"
+};
+
+/*
+ * Columns of a month being exported. The rows are streamed from the server
+ * and only their encoded form is kept, growing as needed.
+ */
+struct builder {
+    uint32_t *time;
+    uint16_t *student;
+    int32_t *amount;
+    uint16_t *terminal;
+    size_t rows, cap;
+    int64_t start;
+    uint32_t dict[WALLET_ARCHIVE_DICT_MAX];
+    size_t dict_count;
+    uint32_t slot_key[DICT_SLOTS];
+    int32_t slot_code[DICT_SLOTS];	/* -1 when free */
+};
+
+/*
+ * Dictionary code of a student key, added on first sight. Open addressing
+ * on a table twice the largest dictionary never fills up.
+ */
+static int
+builder_code (struct builder *b, uint32_t key)
+{
+    size_t slot = (key * 2654435761u) & (DICT_SLOTS - 1);
+
+    while (b->slot_code[slot] >= 0) {
+		if (b->slot_key[slot] == key)
+			return b->slot_code[slot];
+		slot = (slot + 1) & (DICT_SLOTS - 1);
+    }
+    if (b->dict_count == WALLET_ARCHIVE_DICT_MAX)
+		return -1;
+    b->slot_key[slot] = key;
+    b->slot_code[slot] = b->dict_count;
+    b->dict[b->dict_count] = key;
+    return b->dict_count++;
+}
+
+static int
+builder_append (struct builder *b, int64_t t, uint32_t key, int32_t amount, uint16_t terminal)
+{
+    int code;
+
+    if (b->rows == b->cap) {
+		size_t cap = b->cap ? 2 * b->cap : 4096;
+		void *p;
+
+		if (!(p = realloc (b->time, cap * sizeof (*b->time))))
+			return -1;
+		b->time = p;
+		if (!(p = realloc (b->student, cap * sizeof (*b->student))))
+			return -1;
+		b->student = p;
+		if (!(p = realloc (b->amount, cap * sizeof (*b->amount))))
+			return -1;
+		b->amount = p;
+		if (!(p = realloc (b->terminal, cap * sizeof (*b->terminal))))
+			return -1;
+		b->terminal = p;
+		b->cap = cap;
+    }
+    if ((code = builder_code (b, key)) < 0) {
+		warnx ("more than %d students in a month", WALLET_ARCHIVE_DICT_MAX);
+		return -1;
+    }
+
+    /* A month is far less than 2^32 seconds. */
+    b->time[b->rows] = (t > b->start) ? (uint32_t) (t - b->start) : 0;
+    b->student[b->rows] = code;
+    b->amount[b->rows] = amount;
+    b->terminal[b->rows] = terminal;
+    b->rows++;
+    return 0;
+}
+
+static void
+builder_free (struct builder *b)
+{
+    free (b->time);
+    free (b->student);
+    free (b->amount);
+    free (b->terminal);
+    free (b);
+}
+
+static int
+write_column (FILE *f, const void *data, size_t len)
+{
+    static const uint8_t pad[8];
+
+    if (len && (fwrite (data, len, 1, f) != 1))
+		return -1;
+    if ((ALIGN8 (len) != len) && (fwrite (pad, ALIGN8 (len) - len, 1, f) != 1))
+		return -1;
+    return 0;
+}
+
+static int
+builder_write (const struct builder *b, struct wallet_archive_hdr *hdr, const char *path)
+{
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    hdr->rows = b->rows;
+    hdr->dict_count = b->dict_count;
+    hdr->time_off = ALIGN8 (sizeof (*hdr));
+    hdr->student_off = hdr->time_off + ALIGN8 (b->rows * sizeof (*b->time));
+    hdr->amount_off = hdr->student_off + ALIGN8 (b->rows * sizeof (*b->student));
+    hdr->terminal_off = hdr->amount_off + ALIGN8 (b->rows * sizeof (*b->amount));
+    hdr->dict_off = hdr->terminal_off + ALIGN8 (b->rows * sizeof (*b->terminal));
+
+    snprintf (tmp, sizeof (tmp), "%s.tmp", path);
+    if (!(f = fopen (tmp, "w"))) {
+		warn ("%s", tmp);
+		return -1;
+    }
+    if ((write_column (f, hdr, sizeof (*hdr)) < 0) ||
+	(write_column (f, b->time, b->rows * sizeof (*b->time)) < 0) ||
+	(write_column (f, b->student, b->rows * sizeof (*b->student)) < 0) ||
+	(write_column (f, b->amount, b->rows * sizeof (*b->amount)) < 0) ||
+	(write_column (f, b->terminal, b->rows * sizeof (*b->terminal)) < 0) ||
+	(write_column (f, b->dict, b->dict_count * sizeof (*b->dict)) < 0) ||
+	(fflush (f) != 0) || (fsync (fileno (f)) < 0)) {
+		warn ("%s", tmp);
+		fclose (f);
+		unlink (tmp);
+		return -1;
+    }
+    fclose (f);
+
+    if (rename (tmp, path) < 0) {
+		warn ("%s", path);
+		unlink (tmp);
+		return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write the rows of one month of a ledger to an archive file. The month
+ * should be closed: rows added to it later are not in the file.
+ */
+int
+wallet_archive_export (MYSQL *conn, enum wallet_archive_ledger ledger, int year, int month, const char *path)
+{
+    struct wallet_archive_hdr hdr;
+    struct builder *b;
+    char start_char[24];
+    struct wallet_db_cursor cur;
+    MYSQL_ROW row;
+    int res = -1;
+
+    if (!(b = calloc (1, sizeof (*b)))) {
+		warn ("calloc");
+		return -1;
+    }
+    memset (b->slot_code, 0xff, sizeof (b->slot_code));
+
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, WALLET_ARCHIVE_MAGIC, sizeof (hdr.magic));
+    hdr.ledger = ledger;
+    hdr.month = year * 100 + month;
+    if (wallet_db_select_str (conn, start_char, sizeof (start_char), "SELECT UNIX_TIMESTAMP('%04d-%02d-01')", year, month) != 1)
+		goto out;
+    b->start = hdr.start = strtoll (start_char, NULL, 10);
+
+    /* A bounded range of time: one partition, read in clustered order. */
+    if (wallet_db_cursor_open (&cur, conn, "SELECT UNIX_TIMESTAMP(time), COALESCE(student, 0), %s, %s FROM %s "
+			       "WHERE time >= '%04d-%02d-01' AND time < '%04d-%02d-01' + INTERVAL 1 MONTH ORDER BY time, id",
+			       (ledger == WALLET_ARCHIVE_SALES) ? "price" : "amount",
+			       (ledger == WALLET_ARCHIVE_SALES) ? "terminal" : "0",
+			       ledger_tables[ledger], year, month, year, month) < 0)
+		goto out;
+    while ((row = wallet_db_cursor_next (&cur))) {
+		if (builder_append (b, strtoll (row[0], NULL, 10), strtoul (row[1], NULL, 10),
+				    wallet_parse_cents (row[2]), strtoul (row[3], NULL, 10)) < 0) {
+			wallet_db_cursor_close (&cur);
+			goto out;
+		}
+    }
+    if (wallet_db_cursor_close (&cur) < 0)
+		goto out;
+
+    res = builder_write (b, &hdr, path);
+
+out:
+    builder_free (b);
+    return res;
+}
+
+int
+wallet_archive_open (struct wallet_archive *archive, const char *path)
+{
+    const struct wallet_archive_hdr *hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset (archive, 0, sizeof (*archive));
+
+    if ((fd = open (path, O_RDONLY)) < 0) {
+		warn ("%s", path);
+		return -1;
+    }
+    if ((fstat (fd, &st) < 0) || (st.st_size < (off_t) sizeof (struct wallet_archive_hdr))) {
+		warnx ("%s: invalid archive", path);
+		close (fd);
+		return -1;
+    }
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+		warn ("%s", path);
+		return -1;
+    }
+
+    archive->hdr = hdr = map;
+    archive->map_len = st.st_size;
+    if (memcmp (hdr->magic, WALLET_ARCHIVE_MAGIC, sizeof (hdr->magic)) ||
+	(hdr->dict_count > WALLET_ARCHIVE_DICT_MAX) ||
+	(hdr->dict_off + hdr->dict_count * sizeof (uint32_t) > archive->map_len) ||
+	(hdr->time_off + hdr->rows * sizeof (uint32_t) > hdr->student_off) ||
+	(hdr->student_off + hdr->rows * sizeof (uint16_t) > hdr->amount_off) ||
+	(hdr->amount_off + hdr->rows * sizeof (int32_t) > hdr->terminal_off) ||
+	(hdr->terminal_off + hdr->rows * sizeof (uint16_t) > hdr->dict_off)) {
+		warnx ("%s: invalid archive", path);
+		wallet_archive_close (archive);
+		return -1;
+    }
+    archive->time = (const uint32_t *) ((const char *) map + hdr->time_off);
+    archive->student = (const uint16_t *) ((const char *) map + hdr->student_off);
+    archive->amount = (const int32_t *) ((const char *) map + hdr->amount_off);
+    archive->terminal = (const uint16_t *) ((const char *) map + hdr->terminal_off);
+    archive->dict = (const uint32_t *) ((const char *) map + hdr->dict_off);
+    return 0;
+}
+
+void
+wallet_archive_close (struct wallet_archive *archive)
+{
+    if (archive->hdr)
+		munmap ((void *) archive->hdr, archive->map_len);
+    memset (archive, 0, sizeof (*archive));
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_ARCHIVE_H__
+#define __WALLET_ARCHIVE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mysql/mysql.h>
+
+/*
+ * Columnar archive of the closed months of a ledger (sales or topup), one
+ * file per ledger and month, mapped read-only by archive-query.
+ *
+ * After the header come the columns, each an array of fixed-width values
+ * starting on an 8-byte boundary, one value per row in ledger order:
+ *
+ *   time:     seconds since start, the beginning of the month
+ *   student:  index into the dictionary of student keys
+ *   amount:   cents
+ *   terminal: terminal number, 0 for top-ups
+ *   dict:     the distinct student keys (student.id, 0 for none)
+ *
+ * Fixed widths keep the columns plain arrays that the scan loops of the
+ * query tool run over without decoding.
+ */
+
+#define WALLET_ARCHIVE_MAGIC	"WARCH\0\0\2"
+#define WALLET_ARCHIVE_DICT_MAX	65536
+
+enum wallet_archive_ledger {
+    WALLET_ARCHIVE_SALES,
+    WALLET_ARCHIVE_TOPUP
+};
+
+struct wallet_archive_hdr {
+    char magic[8];
+    uint32_t ledger;
+    uint32_t month;		/* year * 100 + month */
+    uint64_t rows;
+    uint64_t dict_count;
+    int64_t start;		/* first second of the month */
+    uint64_t time_off, student_off, amount_off, terminal_off, dict_off;
+};
+
+struct wallet_archive {
+    const struct wallet_archive_hdr *hdr;
+    size_t map_len;
+    const uint32_t *time;
+    const uint16_t *student;
+    const int32_t *amount;
+    const uint16_t *terminal;
+    const uint32_t *dict;
+};
+
+int	 wallet_archive_export (MYSQL *conn, enum wallet_archive_ledger ledger, int year, int month, const char *path);
+int	 wallet_archive_open (struct wallet_archive *archive, const char *path);
+void	 wallet_archive_close (struct wallet_archive *archive);
+
+#endif /* !__WALLET_ARCHIVE_H__ */
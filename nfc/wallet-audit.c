@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mysql/mysql.h>
+
+#include <openssl/sha.h>
+
+#include "wallet-audit.h"
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-db.h"
+
+#define LEAF_LEN	(1 + 8 + 8 + 4 + 4 + 2 + 1 + WALLET_UID_MAX)
+#define CHAIN_LEN	(WALLET_AUDIT_HASH_LEN + 4 + 8 + 8 + 8 + 4 + WALLET_AUDIT_HASH_LEN)
+
+static const char *audit_ledgers[] = {
+    [WALLET_AUDIT_SALES] = "sales",
+    [WALLET_AUDIT_TOPUP] = "topup"
+};
+
+const char *
+wallet_audit_ledger_name (enum wallet_audit_ledger ledger)
+{
+    return audit_ledgers[ledger];
+}
+
+char *
+wallet_audit_hex (const uint8_t *hash, char buf[2 * WALLET_AUDIT_HASH_LEN + 1])
+{
+    for (size_t i = 0; i < WALLET_AUDIT_HASH_LEN; i++)
+		snprintf (buf + 2 * i, 3, "%02x", hash[i]);
+    return buf;
+}
+
+static uint8_t *
+put_be (uint8_t *p, uint64_t value, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+		p[i] = value >> (8 * (len - 1 - i));
+    return p + len;
+}
+
+void
+wallet_audit_leaf (const struct wallet_audit_entry *entry, wallet_audit_hash hash)
+{
+    uint8_t buf[LEAF_LEN] = { 0x00 }, *p = buf + 1;
+
+    p = put_be (p, entry->id, 8);
+    p = put_be (p, (uint64_t) entry->time, 8);
+    p = put_be (p, (uint32_t) entry->amount, 4);
+    p = put_be (p, entry->student, 4);
+    p = put_be (p, entry->terminal, 2);
+    *p++ = entry->uid_len;
+    memcpy (p, entry->uid, WALLET_UID_MAX);
+
+    SHA256 (buf, sizeof (buf), hash);
+}
+
+static void
+node (const wallet_audit_hash left, const wallet_audit_hash right, wallet_audit_hash hash)
+{
+    uint8_t buf[1 + 2 * WALLET_AUDIT_HASH_LEN] = { 0x01 };
+
+    memcpy (buf + 1, left, WALLET_AUDIT_HASH_LEN);
+    memcpy (buf + 1 + WALLET_AUDIT_HASH_LEN, right, WALLET_AUDIT_HASH_LEN);
+    SHA256 (buf, sizeof (buf), hash);
+}
+
+/*
+ * Replace the n hashes of a level by the n/2 rounded up of the level
+ * above. An odd last node moves up unchanged, which builds the same tree
+ * as the recursive definition of RFC 6962.
+ */
+static size_t
+reduce (wallet_audit_hash *hashes, size_t n)
+{
+    size_t m = 0;
+
+    for (size_t i = 0; i + 1 < n; i += 2)
+		node (hashes[i], hashes[i + 1], hashes[m++]);
+    if (n % 2)
+		memcpy (hashes[m++], hashes[n - 1], WALLET_AUDIT_HASH_LEN);
+    return m;
+}
+
+/*
+ * Merkle root of count leaf hashes. The hashes are overwritten.
+ */
+void
+wallet_audit_root (wallet_audit_hash *hashes, size_t count, wallet_audit_hash root)
+{
+    if (!count) {
+		SHA256 (NULL, 0, root);
+		return;
+    }
+    while (count > 1)
+		count = reduce (hashes, count);
+    memcpy (root, hashes[0], WALLET_AUDIT_HASH_LEN);
+}
+
+/*
+ * Inclusion proof of leaf index: the sibling of each node on its path to
+ * the root, leaf first. Returns the number of hashes stored in path, at
+ * most WALLET_AUDIT_PROOF_MAX. The hashes are overwritten.
+ */
+size_t
+wallet_audit_proof (wallet_audit_hash *hashes, size_t count, size_t index, wallet_audit_hash *path)
+{
+    size_t len = 0;
+
+    while (count > 1) {
+		if ((index ^ 1) < count)
+			memcpy (path[len++], hashes[index ^ 1], WALLET_AUDIT_HASH_LEN);
+		count = reduce (hashes, count);
+		index >>= 1;
+    }
+    return len;
+}
+
+/*
+ * Whether path proves leaf to be leaf index of the count leaves under root.
+ */
+int
+wallet_audit_proof_verify (const wallet_audit_hash leaf, size_t index, size_t count, const wallet_audit_hash *path, size_t path_len, const wallet_audit_hash root)
+{
+    wallet_audit_hash hash;
+    size_t used = 0;
+
+    if (index >= count)
+		return 0;
+
+    memcpy (hash, leaf, WALLET_AUDIT_HASH_LEN);
+    while (count > 1) {
+		if ((index ^ 1) < count) {
+			if (used == path_len)
+				return 0;
+			if (index & 1)
+				node (path[used], hash, hash);
+			else
+				node (hash, path[used], hash);
+			used++;
+		}
+		index >>= 1;
+		count = (count + 1) / 2;
+    }
+    return (used == path_len) && (0 == memcmp (hash, root, WALLET_AUDIT_HASH_LEN));
+}
+
+/*
+ * Chain hash of a seal: over the chain hash of the previous seal of the
+ * ledger (zeros for the first) and every field of this one.
+ */
+void
+wallet_audit_chain (const wallet_audit_hash prev, const struct wallet_audit_seal *seal, wallet_audit_hash chain)
+{
+    uint8_t buf[CHAIN_LEN], *p = buf;
+
+    memcpy (p, prev, WALLET_AUDIT_HASH_LEN);
+    p += WALLET_AUDIT_HASH_LEN;
+    p = put_be (p, seal->ledger, 4);
+    p = put_be (p, seal->batch, 8);
+    p = put_be (p, seal->first_id, 8);
+    p = put_be (p, seal->last_id, 8);
+    p = put_be (p, seal->entries, 4);
+    memcpy (p, seal->root, WALLET_AUDIT_HASH_LEN);
+
+    SHA256 (buf, sizeof (buf), chain);
+}
+
+/*
+ * Leaf hashes of the rows after_id < id <= upto_id of the ledger, at most
+ * max of them, in id order; their ids go to ids unless it is NULL. Returns
+ * the number of rows, -1 on error.
+ */
+long
+wallet_audit_hash_rows (MYSQL *conn, enum wallet_audit_ledger ledger, uint64_t after_id, uint64_t upto_id, size_t max, wallet_audit_hash *hashes, uint64_t *ids)
+{
+    struct wallet_db_cursor cur;
+    struct wallet_audit_entry entry;
+    MYSQL_ROW row;
+    long n = 0;
+
+    if (wallet_db_cursor_open (&cur, conn, "SELECT id, TO_SECONDS(time), %s, uid, student, %s FROM %s WHERE id > %llu AND id <= %llu ORDER BY id LIMIT %zu",
+			       (ledger == WALLET_AUDIT_SALES) ? "price" : "amount", (ledger == WALLET_AUDIT_SALES) ? "terminal" : "0",
+			       audit_ledgers[ledger], (unsigned long long) after_id, (unsigned long long) upto_id, max) < 0)
+		return -1;
+
+    while ((row = wallet_db_cursor_next (&cur))) {
+		memset (&entry, 0, sizeof (entry));
+		entry.id = strtoull (row[0], NULL, 10);
+		entry.time = strtoll (row[1], NULL, 10);
+		entry.amount = wallet_parse_cents (row[2]);
+		entry.uid_len = wallet_uid_bytes (row[3], cur.lengths[3], entry.uid);
+		entry.student = row[4] ? strtoul (row[4], NULL, 10) : 0;
+		entry.terminal = strtoul (row[5], NULL, 10);
+
+		wallet_audit_leaf (&entry, hashes[n]);
+		if (ids)
+			ids[n] = entry.id;
+		n++;
+    }
+
+    if (wallet_db_cursor_close (&cur) < 0)
+		return -1;
+    return n;
+}
+
+static const char *
+seals_path (char *buf, size_t len, enum wallet_audit_ledger ledger)
+{
+    char name[32];
+
+    snprintf (name, sizeof (name), WALLET_AUDIT_FILE, audit_ledgers[ledger]);
+    return wallet_spool_path (buf, len, name);
+}
+
+/*
+ * Keep a copy of the seal outside the database, as record batch - 1 of the
+ * file of its ledger. A batch sealed again after a failed commit replaces
+ * its copy.
+ */
+int
+wallet_audit_append (const struct wallet_audit_seal *seal)
+{
+    char path[PATH_MAX];
+    off_t offset = (off_t) (seal->batch - 1) * sizeof (*seal);
+    int fd, res = 0;
+
+    if ((fd = open (seals_path (path, sizeof (path), seal->ledger), O_WRONLY | O_CREAT, 0600)) < 0) {
+		warn ("%s", path);
+		return -1;
+    }
+    if ((pwrite (fd, seal, sizeof (*seal), offset) != sizeof (*seal)) || (fsync (fd) < 0)) {
+		warn ("%s", path);
+		res = -1;
+    }
+    close (fd);
+
+    return res;
+}
+
+/*
+ * The copy of a seal kept by wallet_audit_append(). Returns 1 when found, 0
+ * when not and -1 on error.
+ */
+int
+wallet_audit_find (enum wallet_audit_ledger ledger, uint64_t batch, struct wallet_audit_seal *seal)
+{
+    char path[PATH_MAX];
+    struct wallet_audit_seal s;
+    ssize_t n;
+    int fd;
+
+    if (!batch)
+		return 0;
+    if ((fd = open (seals_path (path, sizeof (path), ledger), O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		warn ("%s", path);
+		return -1;
+    }
+    n = pread (fd, &s, sizeof (s), (off_t) (batch - 1) * sizeof (s));
+    close (fd);
+    if (n < 0) {
+		warn ("%s", path);
+		return -1;
+    }
+
+    /* Past the end, or in a hole left by a batch that was never copied. */
+    if (((size_t) n != sizeof (s)) || (s.ledger != ledger) || (s.batch != batch))
+		return 0;
+    *seal = s;
+    return 1;
+}
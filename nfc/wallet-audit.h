@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_AUDIT_H__
+#define __WALLET_AUDIT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mysql/mysql.h>
+
+#include "wallet-card.h"
+
+/*
+ * Tamper evidence for the sales and topup ledgers.
+ *
+ * The rows of a ledger are sealed in id order, in batches of a fixed
+ * number of rows. The seal of a batch holds the Merkle root of its rows
+ * (RFC 6962 tree: leaves hashed with a 0x00 prefix, nodes with 0x01) and a
+ * chain hash over the previous seal of the ledger and this one. Seals go to
+ * the audit_batch table and are copied to a file per ledger in the spool
+ * directory of the host that made them, out of reach of the database users;
+ * batch n is the nth record of the file.
+ *
+ * Checking a batch reads only its own rows; an inclusion proof for one row
+ * is the log2(rows) hashes of its path to the root.
+ */
+
+#define WALLET_AUDIT_HASH_LEN	32
+#define WALLET_AUDIT_PROOF_MAX	32
+
+enum wallet_audit_ledger {
+    WALLET_AUDIT_SALES,
+    WALLET_AUDIT_TOPUP
+};
+
+/* Canonical form of a ledger row, what the leaf hash covers. */
+struct wallet_audit_entry {
+    uint64_t id;
+    int64_t time;		/* TO_SECONDS(time), independent of the time zone */
+    int32_t amount;		/* cents */
+    uint32_t student;		/* student.id, 0 for none */
+    uint16_t terminal;		/* 0 for top-ups */
+    uint8_t uid_len;
+    uint8_t uid[WALLET_UID_MAX];
+};
+
+struct wallet_audit_seal {
+    uint32_t ledger;
+    uint32_t entries;
+    uint64_t batch;		/* from 1 */
+    uint64_t first_id;
+    uint64_t last_id;
+    uint8_t root[WALLET_AUDIT_HASH_LEN];
+    uint8_t chain[WALLET_AUDIT_HASH_LEN];
+};
+
+typedef uint8_t wallet_audit_hash[WALLET_AUDIT_HASH_LEN];
+
+const char	*wallet_audit_ledger_name (enum wallet_audit_ledger ledger);
+char		*wallet_audit_hex (const uint8_t *hash, char buf[2 * WALLET_AUDIT_HASH_LEN + 1]);
+
+void		 wallet_audit_leaf (const struct wallet_audit_entry *entry, wallet_audit_hash hash);
+void		 wallet_audit_root (wallet_audit_hash *hashes, size_t count, wallet_audit_hash root);
+size_t		 wallet_audit_proof (wallet_audit_hash *hashes, size_t count, size_t index, wallet_audit_hash *path);
+int		 wallet_audit_proof_verify (const wallet_audit_hash leaf, size_t index, size_t count, const wallet_audit_hash *path, size_t path_len, const wallet_audit_hash root);
+void		 wallet_audit_chain (const wallet_audit_hash prev, const struct wallet_audit_seal *seal, wallet_audit_hash chain);
+
+long		 wallet_audit_hash_rows (MYSQL *conn, enum wallet_audit_ledger ledger, uint64_t after_id, uint64_t upto_id, size_t max, wallet_audit_hash *hashes, uint64_t *ids);
+
+int		 wallet_audit_append (const struct wallet_audit_seal *seal);
+int		 wallet_audit_find (enum wallet_audit_ledger ledger, uint64_t batch, struct wallet_audit_seal *seal);
+
+#endif /* !__WALLET_AUDIT_H__ */
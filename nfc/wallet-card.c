@@ -0,0 +1,519 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+#include "wallet-keys.h"
+
+#define MIN(a,b) ((a < b) ? a: b)
+
+int
+wallet_record_decode (const uint8_t *data, size_t len, struct wallet_record *rec)
+{
+    char balance_char[WALLET_BALANCE_LEN + 1] = { '\0' };
+
+    if (len < WALLET_RECORD_V0_LEN)
+		return -1;
+
+    memcpy (rec->student_id, data, WALLET_ID_LEN);
+    rec->student_id[WALLET_ID_LEN] = '\0';
+    memcpy (balance_char, data + WALLET_ID_LEN, WALLET_BALANCE_LEN);
+
+    /* "NN.NN" */
+    if ((balance_char[2] != '.') || (balance_char[0] < '0') || (balance_char[0] > '9'))
+		return -1;
+    rec->balance = (balance_char[0] - '0') * 1000 + (balance_char[1] - '0') * 100 +
+		   (balance_char[3] - '0') * 10 + (balance_char[4] - '0');
+
+    rec->seq = 0;
+    rec->day = 0;
+    rec->day_spent = 0;
+    rec->version = 0;
+    rec->sealed = 0;
+    if ((len < WALLET_RECORD_V1_LEN) || (data[WALLET_RECORD_V0_LEN] < WALLET_RECORD_V1) || (data[WALLET_RECORD_V0_LEN] > WALLET_RECORD_VERSION))
+		return 0;
+
+    const uint8_t *p = data + WALLET_RECORD_V0_LEN;
+
+    rec->version = *p++;
+    rec->seq = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+    p += 4;
+
+    switch (rec->version) {
+	case WALLET_RECORD_V2:
+		if (len >= WALLET_RECORD_V1_LEN + WALLET_MAC_LEN) {
+			memcpy (rec->mac, p, WALLET_MAC_LEN);
+			rec->sealed = 1;
+		}
+		break;
+	case WALLET_RECORD_VERSION:
+		if (len < WALLET_RECORD_BODY_LEN) {
+			rec->version = WALLET_RECORD_V1;
+			break;
+		}
+		rec->day = (p[0] << 8) | p[1];
+		rec->day_spent = (p[2] << 8) | p[3];
+		p += 4;
+		if (len >= WALLET_RECORD_LEN) {
+			memcpy (rec->mac, p, WALLET_MAC_LEN);
+			rec->sealed = 1;
+		}
+		break;
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the number of bytes written to data, 0 if the record does not fit
+ * or cannot be represented on the card.
+ */
+size_t
+wallet_record_encode (const struct wallet_record *rec, uint8_t *data, size_t len)
+{
+    if ((len < (rec->sealed ? WALLET_RECORD_LEN : WALLET_RECORD_BODY_LEN)) || (rec->balance < 0) || (rec->balance > 9999) ||
+	(rec->day_spent < 0) || (rec->day_spent > UINT16_MAX))
+		return 0;
+
+    memset (data, ' ', WALLET_ID_LEN);
+    memcpy (data, rec->student_id, strnlen (rec->student_id, WALLET_ID_LEN));
+
+    //ensure balance always with 4 digit, 4.00 => 04.00; 0 to 9999 cents as checked above
+    data[WALLET_ID_LEN] = '0' + rec->balance / 1000;
+    data[WALLET_ID_LEN + 1] = '0' + rec->balance / 100 % 10;
+    data[WALLET_ID_LEN + 2] = '.';
+    data[WALLET_ID_LEN + 3] = '0' + rec->balance / 10 % 10;
+    data[WALLET_ID_LEN + 4] = '0' + rec->balance % 10;
+
+    uint8_t *p = data + WALLET_RECORD_V0_LEN;
+    *p++ = WALLET_RECORD_VERSION;
+    *p++ = rec->seq >> 24;
+    *p++ = rec->seq >> 16;
+    *p++ = rec->seq >> 8;
+    *p++ = rec->seq;
+    *p++ = rec->day >> 8;
+    *p++ = rec->day;
+    *p++ = rec->day_spent >> 8;
+    *p++ = rec->day_spent;
+
+    if (!rec->sealed)
+		return WALLET_RECORD_BODY_LEN;
+    memcpy (p, rec->mac, WALLET_MAC_LEN);
+    return WALLET_RECORD_LEN;
+}
+
+/*
+ * MAC input: UID bytes, then the record fields in a fixed binary layout.
+ * Version 2 seals do not cover the daily spend.
+ */
+static int
+record_mac (const struct wallet_record *rec, const char *uid, uint8_t mac[WALLET_MAC_LEN])
+{
+    uint8_t data[WALLET_UID_MAX + 1 + WALLET_ID_LEN + 4 + 4 + 2 + 2];
+    uint8_t *p = data;
+    size_t uid_len;
+
+    if (!(uid_len = wallet_uid_parse (uid, p + 1)))
+		return -1;
+    *p = uid_len;
+    p += 1 + WALLET_UID_MAX;
+
+    memset (p, ' ', WALLET_ID_LEN);
+    memcpy (p, rec->student_id, strnlen (rec->student_id, WALLET_ID_LEN));
+    p += WALLET_ID_LEN;
+
+    *p++ = rec->balance >> 24;
+    *p++ = rec->balance >> 16;
+    *p++ = rec->balance >> 8;
+    *p++ = rec->balance;
+    *p++ = rec->seq >> 24;
+    *p++ = rec->seq >> 16;
+    *p++ = rec->seq >> 8;
+    *p++ = rec->seq;
+
+    if (rec->version != WALLET_RECORD_V2) {
+		*p++ = rec->day >> 8;
+		*p++ = rec->day;
+		*p++ = rec->day_spent >> 8;
+		*p++ = rec->day_spent;
+    }
+
+    return wallet_mac (data, p - data, mac);
+}
+
+/*
+ * Seal the record for the card with the given UID. Returns -1 if this
+ * terminal has no wallet key, the record is then written unsealed.
+ */
+int
+wallet_record_seal (struct wallet_record *rec, const char *uid)
+{
+    rec->sealed = 0;
+    rec->version = WALLET_RECORD_VERSION;
+    if (record_mac (rec, uid, rec->mac) < 0)
+		return -1;
+    rec->sealed = 1;
+    return 0;
+}
+
+/*
+ * Returns 1 if the record was sealed by a terminal holding the wallet key
+ * for this very card, 0 if it is unsealed or forged and -1 if it cannot be
+ * checked here.
+ */
+int
+wallet_record_verify (const struct wallet_record *rec, const char *uid)
+{
+    uint8_t mac[WALLET_MAC_LEN];
+
+    if (!wallet_mac_available ())
+		return -1;
+    if (!rec->sealed || (record_mac (rec, uid, mac) < 0))
+		return 0;
+    return wallet_mac_equal (mac, rec->mac);
+}
+
+int
+wallet_record_equal (const struct wallet_record *a, const struct wallet_record *b)
+{
+    return (0 == strncmp (a->student_id, b->student_id, WALLET_ID_LEN)) &&
+	   (a->balance == b->balance) && (a->seq == b->seq);
+}
+
+/*
+ * Local calendar day of t, as stored in the record.
+ */
+uint16_t
+wallet_day (time_t t)
+{
+    struct tm tm;
+
+    localtime_r (&t, &tm);
+    return (t + tm.tm_gmtoff) / 86400;
+}
+
+long
+wallet_record_spent_today (const struct wallet_record *rec, time_t now)
+{
+    return (rec->day == wallet_day (now)) ? rec->day_spent : 0;
+}
+
+/*
+ * Count a sale in the daily spend of the record, starting a new day if
+ * needed. Done on the record that is about to be written, so the counter
+ * and the debit reach the card in the same write.
+ */
+void
+wallet_record_spend (struct wallet_record *rec, long amount, time_t now)
+{
+    rec->day_spent = wallet_record_spent_today (rec, now) + amount;
+    rec->day = wallet_day (now);
+    if (rec->day_spent > UINT16_MAX)
+		rec->day_spent = UINT16_MAX;
+}
+
+/*
+ * Authenticate on a sector of the wallet application with the card's own
+ * key, or with the keys of older generations down to the legacy shared key
+ * for cards not rotated yet (and on terminals without the master secret).
+ * Returns the key generation of the sector, -1 if no key opens it.
+ */
+int
+wallet_sector_authenticate (MifareTag tag, MifareClassicSectorNumber sector, MifareClassicKeyType type)
+{
+    MifareClassicBlockNumber block = mifare_classic_sector_last_block (sector);
+    MifareClassicKey key;
+    char *uid = freefare_get_tag_uid (tag);
+    int generation = wallet_keys_available () ? WALLET_KEY_GENERATION : WALLET_KEY_LEGACY;
+    int res = -1;
+
+    for (;;) {
+		wallet_sector_key_generation (uid, sector, type, generation, key);
+		if (0 == mifare_classic_authenticate (tag, block, key, type)) {
+			res = generation;
+			break;
+		}
+		if (generation-- == WALLET_KEY_LEGACY)
+			break;
+
+		/* A failed authentication halts the card. */
+		mifare_classic_disconnect (tag);
+		if (mifare_classic_connect (tag) < 0)
+			break;
+    }
+    free (uid);
+
+    return res;
+}
+
+/*
+ * Read (key A) or write (key B) the data blocks of the NFCForum application,
+ * one authentication per sector. Returns the number of bytes transferred.
+ */
+static ssize_t
+app_transfer (MifareTag tag, Mad mad, uint8_t *data, size_t len, int write)
+{
+    MifareClassicSectorNumber *sectors, *p;
+    size_t n = 0;
+
+    if (!(sectors = mifare_application_find (mad, mad_nfcforum_aid)))
+		return -1;
+
+    for (p = sectors; *p && (n < len); p++) {
+		MifareClassicBlockNumber first = mifare_classic_sector_first_block (*p);
+		size_t count = mifare_classic_sector_block_count (*p) - 1;	/* without the trailer */
+
+		if (wallet_sector_authenticate (tag, *p, write ? MFC_KEY_B : MFC_KEY_A) < 0)
+			goto error;
+
+		for (size_t b = 0; (b < count) && (n < len); b++) {
+			MifareClassicBlock block;
+			size_t chunk = MIN (sizeof (block), len - n);
+
+			if (write) {
+				memset (block, 0, sizeof (block));
+				memcpy (block, data + n, chunk);
+				if (mifare_classic_write (tag, first + b, block) < 0)
+					goto error;
+			} else {
+				if (mifare_classic_read (tag, first + b, &block) < 0)
+					goto error;
+				memcpy (data + n, block, chunk);
+			}
+			n += chunk;
+		}
+    }
+    free (sectors);
+    return n;
+
+error:
+    free (sectors);
+    return -1;
+}
+
+/*
+ * Drop-in replacements for mifare_application_read() and
+ * mifare_application_write() on the NFCForum application, with the wallet
+ * sector keys.
+ */
+ssize_t
+wallet_app_read (MifareTag tag, Mad mad, void *buf, size_t len)
+{
+    return app_transfer (tag, mad, buf, len, 0);
+}
+
+ssize_t
+wallet_app_write (MifareTag tag, Mad mad, const void *buf, size_t len)
+{
+    return app_transfer (tag, mad, (uint8_t *) buf, len, 1);
+}
+
+/*
+ * Read the wallet record of a connected card whose MAD is already loaded.
+ */
+int
+wallet_card_read (MifareTag tag, Mad mad, struct wallet_record *rec)
+{
+    uint8_t buffer[4096];
+    uint8_t tlv_type;
+    uint16_t tlv_data_len;
+    uint8_t *tlv_data;
+    int res = -1;
+
+    if (wallet_app_read (tag, mad, buffer, sizeof (buffer)) < 0) {
+		warnx ("No NFC Forum application.");
+		return -1;
+    }
+
+    if (!(tlv_data = tlv_decode (buffer, &tlv_type, &tlv_data_len))) {
+		warnx ("NFCForum application contains an invalid TLV.");
+		return -1;
+    }
+
+    switch (tlv_type) {
+	case 0x03:
+		if ((res = wallet_record_decode (tlv_data, tlv_data_len, rec)) < 0)
+			warnx ("NDEF Message TLV does not hold a wallet record.");
+		break;
+	case 0xFE:
+		warnx ("NFCForum application contains a \"Terminator TLV\", no available data.");
+		break;
+	default:
+		warnx ("NFCForum application contains an unexpected TLV (0x%02x).", tlv_type);
+		break;
+    }
+    free (tlv_data);
+
+    return res;
+}
+
+/*
+ * Write the wallet record back to the card in the current RF session, sealed
+ * if the terminal holds the wallet key. The NFCForum application must already
+ * exist (see create-user).
+ */
+int
+wallet_card_write (MifareTag tag, Mad mad, const struct wallet_record *rec)
+{
+    uint8_t ndef_msg[WALLET_RECORD_LEN];
+    size_t ndef_msg_len, encoded_size;
+    uint8_t *tlv_data;
+    struct wallet_record sealed = *rec;
+    char *uid;
+    int res = 0;
+
+    /* Every terminal holding the key seals what it writes. */
+    uid = freefare_get_tag_uid (tag);
+    wallet_record_seal (&sealed, uid);
+    free (uid);
+
+    if (!(ndef_msg_len = wallet_record_encode (&sealed, ndef_msg, sizeof (ndef_msg)))) {
+		warnx ("Cannot encode wallet record for %s", rec->student_id);
+		return -1;
+    }
+
+    if (!(tlv_data = tlv_encode (3, ndef_msg, ndef_msg_len, &encoded_size)))
+		return -1;
+
+    if ((ssize_t) encoded_size != wallet_app_write (tag, mad, tlv_data, encoded_size)) {
+		warnx ("wallet_app_write failed");
+		res = -1;
+    }
+    free (tlv_data);
+
+    return res;
+}
+
+/*
+ * Invalidate the wallet record of a connected card whose MAD is loaded with
+ * a Terminator TLV over the first application block: one block write, every
+ * reader then finds no record. Sector keys and MAD are left for the
+ * recycling batch (recycle-cards).
+ */
+int
+wallet_card_invalidate (MifareTag tag, Mad mad)
+{
+    const uint8_t terminator = 0xFE;
+
+    if (1 != wallet_app_write (tag, mad, &terminator, sizeof (terminator))) {
+		warnx ("wallet_app_write failed");
+		return -1;
+    }
+    return 0;
+}
+
+static int
+hex_value (char c)
+{
+    if ((c >= '0') && (c <= '9'))
+		return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F'))
+		return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Convert a hex UID to bytes, zero padded to WALLET_UID_MAX. Returns the
+ * UID length, 0 if it is not valid hex.
+ */
+size_t
+wallet_uid_parse (const char *hex, uint8_t uid[WALLET_UID_MAX])
+{
+    size_t len = strlen (hex);
+
+    memset (uid, 0, WALLET_UID_MAX);
+    if ((len % 2) || (len > 2 * WALLET_UID_MAX))
+		return 0;
+    for (size_t i = 0; i < len / 2; i++) {
+		int hi = hex_value (hex[2 * i]), lo = hex_value (hex[2 * i + 1]);
+
+		if ((hi < 0) || (lo < 0))
+			return 0;
+		uid[i] = (hi << 4) | lo;
+    }
+    return len / 2;
+}
+
+char *
+wallet_uid_format (const uint8_t *uid, size_t len, char *buf, size_t buf_len)
+{
+    size_t n = 0;
+
+    buf[0] = '\0';
+    for (size_t i = 0; (i < len) && (n + 3 <= buf_len); i++)
+		n += snprintf (buf + n, buf_len - n, "%02x", uid[i]);
+    return buf;
+}
+
+/*
+ * Compare two zero-padded UIDs in the order the database sorts their hex
+ * form.
+ */
+int
+wallet_uid_cmp (const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+    int res;
+
+    if ((res = memcmp (a, b, WALLET_UID_MAX)))
+		return res;
+    return (int) a_len - (int) b_len;
+}
+
+/*
+ * Take a binary uid column as fetched (row data and mysql_fetch_lengths()).
+ * Returns the UID length, 0 if it is NULL or not a card UID.
+ */
+size_t
+wallet_uid_bytes (const char *data, unsigned long len, uint8_t uid[WALLET_UID_MAX])
+{
+    memset (uid, 0, WALLET_UID_MAX);
+    if (!data || !len || (len > WALLET_UID_MAX))
+		return 0;
+    memcpy (uid, data, len);
+    return len;
+}
+
+/*
+ * SQL literal of a hex UID for the binary uid columns: X'...', or NULL,
+ * which matches no row, when it is not a UID. Needs no escaping.
+ */
+char *
+wallet_uid_sql (const char *hex, char buf[WALLET_UID_SQL_LEN])
+{
+    uint8_t uid[WALLET_UID_MAX];
+    size_t len = wallet_uid_parse (hex, uid);
+    char text[(2 * WALLET_UID_MAX) + 1];
+
+    if (!len)
+		snprintf (buf, WALLET_UID_SQL_LEN, "NULL");
+    else
+		snprintf (buf, WALLET_UID_SQL_LEN, "X'%s'", wallet_uid_format (uid, len, text, sizeof (text)));
+    return buf;
+}
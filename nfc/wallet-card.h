@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_CARD_H__
+#define __WALLET_CARD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-mac.h"
+
+/*
+ * Wallet record stored in the NFCForum application of the card, inside an
+ * NDEF Message TLV: the 8 characters of the student ID followed by the
+ * balance as "NN.NN". Readers that only know this layout (the Android app)
+ * ignore anything after it.
+ *
+ * Version 1 records append binary fields:
+ *
+ *   13     version (1)
+ *   14-17  write sequence number, big endian
+ *
+ * The sequence number is bumped on every write so that a terminal can tell
+ * whether a given write reached the card, even when the balance is the same.
+ *
+ * Version 3 records (written by every terminal now) go on with:
+ *
+ *   18-19  day of the last sale, in days since 1970-01-01 local time
+ *   20-21  amount spent on that day in cents, big endian
+ *   22-29  optional MAC over the card UID and the fields above (wallet-mac.c)
+ *
+ * A terminal holding the wallet key seals what it writes; only a sealed
+ * record can be trusted without asking the database. The daily spend lets
+ * offline terminals bound what a card can spend before it is seen online.
+ *
+ * Version 2 records (sequence number directly followed by the MAC) are
+ * still read.
+ */
+
+#define WALLET_ID_LEN		8
+#define WALLET_BALANCE_LEN	5
+#define WALLET_RECORD_V0_LEN	(WALLET_ID_LEN + WALLET_BALANCE_LEN)
+#define WALLET_RECORD_V1	1
+#define WALLET_RECORD_V1_LEN	(WALLET_RECORD_V0_LEN + 1 + 4)
+#define WALLET_RECORD_V2	2
+#define WALLET_RECORD_VERSION	3
+#define WALLET_RECORD_BODY_LEN	(WALLET_RECORD_V1_LEN + 2 + 2)
+#define WALLET_RECORD_LEN	(WALLET_RECORD_BODY_LEN + WALLET_MAC_LEN)
+
+/*
+ * Card UIDs (4, 7 or 10 bytes) as raw bytes. freefare_get_tag_uid() gives
+ * lower-case hex, the database stores the bytes (VARBINARY) and sorts them
+ * the way wallet_uid_cmp() does: zero padded, ties broken on the length.
+ * wallet_uid_sql() makes the X'...' literal the queries compare uid with.
+ */
+#define WALLET_UID_MAX		10
+#define WALLET_UID_SQL_LEN	(2 * WALLET_UID_MAX + 4)
+
+struct wallet_record {
+    char student_id[WALLET_ID_LEN + 1];
+    long balance;		/* cents */
+    uint32_t seq;		/* 0 on version 0 records */
+    uint16_t day;		/* day of day_spent, 0 before version 3 */
+    long day_spent;		/* cents */
+    int version;
+    int sealed;
+    uint8_t mac[WALLET_MAC_LEN];
+};
+
+int	 wallet_record_decode (const uint8_t *data, size_t len, struct wallet_record *rec);
+size_t	 wallet_record_encode (const struct wallet_record *rec, uint8_t *data, size_t len);
+
+int	 wallet_sector_authenticate (MifareTag tag, MifareClassicSectorNumber sector, MifareClassicKeyType type);
+ssize_t	 wallet_app_read (MifareTag tag, Mad mad, void *buf, size_t len);
+ssize_t	 wallet_app_write (MifareTag tag, Mad mad, const void *buf, size_t len);
+
+int	 wallet_card_read (MifareTag tag, Mad mad, struct wallet_record *rec);
+int	 wallet_card_write (MifareTag tag, Mad mad, const struct wallet_record *rec);
+int	 wallet_card_invalidate (MifareTag tag, Mad mad);
+int	 wallet_record_equal (const struct wallet_record *a, const struct wallet_record *b);
+int	 wallet_record_seal (struct wallet_record *rec, const char *uid);
+int	 wallet_record_verify (const struct wallet_record *rec, const char *uid);
+
+uint16_t wallet_day (time_t t);
+long	 wallet_record_spent_today (const struct wallet_record *rec, time_t now);
+void	 wallet_record_spend (struct wallet_record *rec, long amount, time_t now);
+
+size_t	 wallet_uid_parse (const char *hex, uint8_t uid[WALLET_UID_MAX]);
+char	*wallet_uid_format (const uint8_t *uid, size_t len, char *buf, size_t buf_len);
+int	 wallet_uid_cmp (const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len);
+size_t	 wallet_uid_bytes (const char *data, unsigned long len, uint8_t uid[WALLET_UID_MAX]);
+char	*wallet_uid_sql (const char *hex, char buf[WALLET_UID_SQL_LEN]);
+
+#endif /* !__WALLET_CARD_H__ */
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_CONFIG_H__
+#define __WALLET_CONFIG_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Terminal-local settings. Database settings live in common.h; files kept
+ * by a terminal go to its spool directory, WALLET_SPOOL in the environment
+ * or WALLET_SPOOL_DIR by default.
+ */
+
+#define WALLET_SPOOL_DIR	"/var/spool/ccsun"
+
+/* Card snapshots taken on every tap, see wallet-tapsnap.c */
+#define WALLET_TAPLOG_FILE	"taps.log"
+
+/* UDP port of fraud-monitor when WALLET_MONITOR names no port, see wallet-monitor.c */
+#define WALLET_MONITOR_PORT	"7740"
+
+/* Student table image and its updates, see wallet-snapshot.c */
+#define WALLET_SNAPSHOT_FILE	"students.snap"
+#define WALLET_DELTA_FILE	"students.delta"
+
+/* Offline sales waiting for offline-sync, see wallet-offline.c */
+#define WALLET_OFFLINE_FILE	"offline.log"
+#define WALLET_OFFLINE_SYNC_FILE	"offline.sync"
+
+/* Wallet change events and the offsets of their consumers, see wallet-event.c */
+#define WALLET_EVENT_LOCK_FILE	"events.lock"
+#define WALLET_EVENT_SEGMENT_FILE	"events.%08llu"
+#define WALLET_EVENT_OFFSET_FILE	"events.%s.offset"
+
+/* Copies of the audit seals of each ledger, see wallet-audit.c */
+#define WALLET_AUDIT_FILE	"audit.%s.seals"
+
+/*
+ * Key the card records are authenticated with (wallet-mac.c), WALLET_MAC_KEY
+ * in the environment or WALLET_MAC_KEY_FILE by default. It is shared by all
+ * terminals and must not be readable by anyone else.
+ */
+#define WALLET_MAC_KEY_FILE	"/etc/ccsun/wallet.key"
+
+/*
+ * Master secret the sector keys of every card are derived from
+ * (wallet-keys.c), WALLET_SECTOR_KEY in the environment or
+ * WALLET_SECTOR_KEY_FILE by default.
+ */
+#define WALLET_SECTOR_KEY_FILE	"/etc/ccsun/sector.key"
+
+/*
+ * Number of the terminal in the sales ledger and its rollups, WALLET_TERMINAL
+ * in the environment; 0 stands for a terminal without one.
+ */
+static inline unsigned
+wallet_terminal_id (void)
+{
+    const char *id = getenv ("WALLET_TERMINAL");
+
+    return id ? (unsigned) strtoul (id, NULL, 10) : 0;
+}
+
+/* Most a card may spend per day at offline terminals, in cents. */
+#define WALLET_OFFLINE_DAILY_LIMIT	3000
+
+static inline const char *
+wallet_spool_path (char *buf, size_t len, const char *name)
+{
+    const char *dir = getenv ("WALLET_SPOOL");
+
+    snprintf (buf, len, "%s/%s", dir ? dir : WALLET_SPOOL_DIR, name);
+    return buf;
+}
+
+#endif /* !__WALLET_CONFIG_H__ */
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql/mysql.h>
+
+#include "wallet-db.h"
+
+/*
+ * Format and run a statement that does not return rows.
+ * Returns 0 on success, -1 on error (already reported).
+ */
+int
+wallet_db_vexec (MYSQL *conn, const char *fmt, va_list ap)
+{
+    char sql_stmnt[WALLET_SQL_MAX];
+    int n;
+
+    n = vsnprintf (sql_stmnt, sizeof (sql_stmnt), fmt, ap);
+    if ((n < 0) || (n >= (int) sizeof (sql_stmnt))) {
+		warnx ("SQL statement too long");
+		return -1;
+    }
+    if (mysql_real_query (conn, sql_stmnt, n)) {
+		warnx ("%s: %s", sql_stmnt, mysql_error (conn));
+		return -1;
+    }
+    return 0;
+}
+
+int
+wallet_db_exec (MYSQL *conn, const char *fmt, ...)
+{
+    va_list ap;
+    int res;
+
+    va_start (ap, fmt);
+    res = wallet_db_vexec (conn, fmt, ap);
+    va_end (ap);
+
+    return res;
+}
+
+int
+wallet_db_begin (MYSQL *conn)
+{
+    return wallet_db_exec (conn, "START TRANSACTION");
+}
+
+int
+wallet_db_commit (MYSQL *conn)
+{
+    if (mysql_commit (conn)) {
+		warnx ("COMMIT: %s", mysql_error (conn));
+		return -1;
+    }
+    return 0;
+}
+
+int
+wallet_db_rollback (MYSQL *conn)
+{
+    if (mysql_rollback (conn)) {
+		warnx ("ROLLBACK: %s", mysql_error (conn));
+		return -1;
+    }
+    return 0;
+}
+
+/*
+ * Whether the last error aborted the transaction in a way that is worth
+ * running it again (deadlock victim or lock wait timeout). Ask before
+ * rolling back: a successful rollback clears the error.
+ */
+int
+wallet_db_retryable (MYSQL *conn)
+{
+    switch (mysql_errno (conn)) {
+	case 1205: /* ER_LOCK_WAIT_TIMEOUT */
+	case 1213: /* ER_LOCK_DEADLOCK */
+		return 1;
+	default:
+		return 0;
+    }
+}
+
+/*
+ * Roll back after a failed statement. Returns 1 if the transaction is worth
+ * running again (see wallet_db_retryable()), 0 otherwise.
+ */
+int
+wallet_db_abort (MYSQL *conn)
+{
+    int retryable = wallet_db_retryable (conn);
+
+    wallet_db_rollback (conn);
+    return retryable;
+}
+
+/*
+ * A CALL returns the result sets of the procedure followed by its status;
+ * all of them must be read before the connection can be used again.
+ */
+void
+wallet_db_drain (MYSQL *conn)
+{
+    MYSQL_RES *result;
+
+    while (0 == mysql_next_result (conn)) {
+		if ((result = mysql_store_result (conn)))
+			mysql_free_result (result);
+    }
+}
+
+static int
+wallet_db_vselect_str (MYSQL *conn, char *value, size_t len, const char *fmt, va_list ap)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int found = 0;
+
+    if (wallet_db_vexec (conn, fmt, ap) < 0)
+		return -1;
+
+    if (!(result = mysql_store_result (conn))) {
+		warnx ("mysql_store_result: %s", mysql_error (conn));
+		return -1;
+    }
+    if ((row = mysql_fetch_row (result)) && row[0]) {
+		snprintf (value, len, "%s", row[0]);
+		found = 1;
+    }
+    mysql_free_result (result);
+
+    return found;
+}
+
+/*
+ * Run a query and copy the first column of its first row into value.
+ * Returns 1 when a row was found, 0 when there is none, -1 on error.
+ */
+int
+wallet_db_select_str (MYSQL *conn, char *value, size_t len, const char *fmt, ...)
+{
+    va_list ap;
+    int res;
+
+    va_start (ap, fmt);
+    res = wallet_db_vselect_str (conn, value, len, fmt, ap);
+    va_end (ap);
+
+    return res;
+}
+
+/*
+ * Same as wallet_db_select_str() for a DECIMAL amount, returned in cents.
+ */
+int
+wallet_db_select_cents (MYSQL *conn, long *cents, const char *fmt, ...)
+{
+    char value[32];
+    va_list ap;
+    int res;
+
+    va_start (ap, fmt);
+    res = wallet_db_vselect_str (conn, value, sizeof (value), fmt, ap);
+    va_end (ap);
+
+    if (res == 1)
+		*cents = wallet_parse_cents (value);
+
+    return res;
+}
+
+/*
+ * Run a query and stream its rows: they are read from the server as they
+ * are fetched, so a scan of any size runs in constant memory. The
+ * connection is busy until the cursor is closed. Returns -1 on error, the
+ * cursor then needs no closing.
+ */
+int
+wallet_db_cursor_open (struct wallet_db_cursor *cur, MYSQL *conn, const char *fmt, ...)
+{
+    va_list ap;
+    int res;
+
+    memset (cur, 0, sizeof (*cur));
+    cur->conn = conn;
+
+    va_start (ap, fmt);
+    res = wallet_db_vexec (conn, fmt, ap);
+    va_end (ap);
+    if (res < 0)
+		return -1;
+
+    if (!(cur->result = mysql_use_result (conn))) {
+		warnx ("mysql_use_result: %s", mysql_error (conn));
+		return -1;
+    }
+    return 0;
+}
+
+/*
+ * Next row, with its column lengths in cur->lengths, or NULL at the end of
+ * the rows and on error; wallet_db_cursor_close() tells them apart.
+ */
+MYSQL_ROW
+wallet_db_cursor_next (struct wallet_db_cursor *cur)
+{
+    MYSQL_ROW row;
+
+    if (!cur->result)
+		return NULL;
+    if ((row = mysql_fetch_row (cur->result))) {
+		cur->lengths = mysql_fetch_lengths (cur->result);
+    } else if (mysql_errno (cur->conn)) {
+		warnx ("%s", mysql_error (cur->conn));
+		cur->error = 1;
+    }
+    return row;
+}
+
+/*
+ * Release the result, reading off the rows not fetched, so that the
+ * connection takes queries again. Safe to call more than once, so that
+ * every way out of a scan can close the cursor. Returns -1 if fetching the
+ * rows failed.
+ */
+int
+wallet_db_cursor_close (struct wallet_db_cursor *cur)
+{
+    if (cur->result) {
+		mysql_free_result (cur->result);
+		cur->result = NULL;
+    }
+    return cur->error ? -1 : 0;
+}
+
+/*
+ * Convert a decimal string such as "12.5", "04.30" or "-3.25" to cents,
+ * without going through a double.
+ */
+long
+wallet_parse_cents (const char *s)
+{
+    long units = 0, cents = 0;
+    int negative = 0, digits = 0;
+
+    while (*s == ' ')
+		s++;
+    if (*s == '-') {
+		negative = 1;
+		s++;
+    }
+    for (; *s >= '0' && *s <= '9'; s++)
+		units = units * 10 + (*s - '0');
+    if (*s == '.') {
+		for (s++; *s >= '0' && *s <= '9'; s++) {
+			if (digits < 2)
+				cents = cents * 10 + (*s - '0');
+			digits++;
+		}
+    }
+    if (digits == 1)
+		cents *= 10;
+
+    cents += units * 100;
+    return negative ? -cents : cents;
+}
+
+/*
+ * Print cents as "units.cc", suitable both for display and for SQL.
+ */
+char *
+wallet_format_cents (char *buf, size_t len, long cents)
+{
+    const char *sign = "";
+
+    if (cents < 0) {
+		sign = "-";
+		cents = -cents;
+    }
+    snprintf (buf, len, "%s%ld.%02ld", sign, cents / 100, cents % 100);
+    return buf;
+}
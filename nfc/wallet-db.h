@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_DB_H__
+#define __WALLET_DB_H__
+
+#include <stdarg.h>
+#include <mysql/mysql.h>
+
+/*
+ * Small helpers shared by the wallet tools on top of the MySQL C API.
+ *
+ * Money is handled as integer cents on the C side; the DECIMAL columns of the
+ * database are written as "cents/100" so that MySQL keeps exact arithmetic.
+ */
+
+#define WALLET_SQL_MAX	1024
+
+/* Highest balance a card may hold, in cents (see topup and transfer). */
+#define WALLET_BALANCE_LIMIT	10000
+
+int	 wallet_db_exec (MYSQL *conn, const char *fmt, ...);
+int	 wallet_db_vexec (MYSQL *conn, const char *fmt, va_list ap);
+int	 wallet_db_begin (MYSQL *conn);
+int	 wallet_db_commit (MYSQL *conn);
+int	 wallet_db_rollback (MYSQL *conn);
+int	 wallet_db_retryable (MYSQL *conn);
+int	 wallet_db_abort (MYSQL *conn);
+void	 wallet_db_drain (MYSQL *conn);
+
+int	 wallet_db_select_str (MYSQL *conn, char *value, size_t len, const char *fmt, ...);
+int	 wallet_db_select_cents (MYSQL *conn, long *cents, const char *fmt, ...);
+
+/*
+ * Scans of many rows go through a cursor (mysql_use_result) rather than a
+ * buffered result; every opened cursor must be closed.
+ */
+struct wallet_db_cursor {
+    MYSQL *conn;
+    MYSQL_RES *result;
+    unsigned long *lengths;	/* of the current row */
+    int error;
+};
+
+int	 wallet_db_cursor_open (struct wallet_db_cursor *cur, MYSQL *conn, const char *fmt, ...);
+MYSQL_ROW wallet_db_cursor_next (struct wallet_db_cursor *cur);
+int	 wallet_db_cursor_close (struct wallet_db_cursor *cur);
+
+long	 wallet_parse_cents (const char *s);
+char	*wallet_format_cents (char *buf, size_t len, long cents);
+
+#endif /* !__WALLET_DB_H__ */
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <mysql/mysql.h>
+
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-db.h"
+#include "wallet-debit.h"
+#include "wallet-event.h"
+
+#define DEBIT_RETRIES	3
+
+static enum wallet_debit_status
+debit_once (MYSQL *conn, const char *uid_sql, const char *amount_str, struct wallet_debit *res)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    enum wallet_debit_status status = WALLET_DEBIT_DB_ERROR;
+
+    if (wallet_db_exec (conn, "CALL wallet_debit(%s, %s, %u)", uid_sql, amount_str, wallet_terminal_id ()) < 0)
+		return WALLET_DEBIT_DB_ERROR;
+
+    if ((result = mysql_store_result (conn))) {
+		if ((row = mysql_fetch_row (result))) {
+			if (0 == strcmp (row[0], "ok"))
+				status = WALLET_DEBIT_OK;
+			else if (0 == strcmp (row[0], "unknown"))
+				status = WALLET_DEBIT_UNKNOWN;
+			else if (0 == strcmp (row[0], "blocked"))
+				status = WALLET_DEBIT_BLOCKED;
+			else if (0 == strcmp (row[0], "insufficient"))
+				status = WALLET_DEBIT_INSUFFICIENT;
+			snprintf (res->student_id, sizeof (res->student_id), "%s", row[1] ? row[1] : "");
+			res->balance = row[2] ? wallet_parse_cents (row[2]) : 0;
+		}
+		mysql_free_result (result);
+    } else {
+		warnx ("CALL wallet_debit: %s", mysql_error (conn));
+    }
+    wallet_db_drain (conn);
+
+    return status;
+}
+
+/*
+ * Charge amount cents to the student the card UID is registered to.
+ */
+enum wallet_debit_status
+wallet_debit (MYSQL *conn, const char *uid, long amount, struct wallet_debit *res)
+{
+    char uid_sql[WALLET_UID_SQL_LEN];
+    char amount_str[16];
+    enum wallet_debit_status status;
+    struct wallet_event ev;
+
+    memset (res, 0, sizeof (*res));
+    wallet_uid_sql (uid, uid_sql);
+    wallet_format_cents (amount_str, sizeof (amount_str), amount);
+
+    for (int attempt = 0; attempt < DEBIT_RETRIES; attempt++) {
+		status = debit_once (conn, uid_sql, amount_str, res);
+		if ((status != WALLET_DEBIT_DB_ERROR) || !wallet_db_retryable (conn))
+			break;
+		warnx ("debit %s: retrying", uid);
+    }
+
+    if (status == WALLET_DEBIT_OK) {
+		wallet_event_init (&ev, WALLET_EVENT_SALE, uid, res->student_id);
+		ev.amount = -amount;
+		ev.balance = res->balance;
+		wallet_event_publish (&ev, 1);
+    }
+
+    return status;
+}
+
+const char *
+wallet_debit_strerror (enum wallet_debit_status status)
+{
+    switch (status) {
+	case WALLET_DEBIT_OK:
+		return "Update successful";
+	case WALLET_DEBIT_UNKNOWN:
+		return "No user found/Invalid card.";
+	case WALLET_DEBIT_BLOCKED:
+		return "Card blocked, please see the counter";
+	case WALLET_DEBIT_INSUFFICIENT:
+		return "Insufficient fund.";
+	case WALLET_DEBIT_DB_ERROR:
+	default:
+		return "Updating data from DB Failed";
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_DEBIT_H__
+#define __WALLET_DEBIT_H__
+
+#include <mysql/mysql.h>
+
+#include "wallet-card.h"
+
+/*
+ * Server-side sale for terminals running in UID-only mode: the card is an
+ * identity token and only its UID is read. See wallet_debit in
+ * schema/006-sales-rollup.sql, its latest definition.
+ */
+
+enum wallet_debit_status {
+    WALLET_DEBIT_OK = 0,
+    WALLET_DEBIT_UNKNOWN,
+    WALLET_DEBIT_BLOCKED,
+    WALLET_DEBIT_INSUFFICIENT,
+    WALLET_DEBIT_DB_ERROR
+};
+
+struct wallet_debit {
+    char student_id[WALLET_ID_LEN + 1];
+    long balance;		/* cents, after the sale if it went through */
+};
+
+enum wallet_debit_status	 wallet_debit (MYSQL *conn, const char *uid, long amount, struct wallet_debit *res);
+const char			*wallet_debit_strerror (enum wallet_debit_status status);
+
+#endif /* !__WALLET_DEBIT_H__ */
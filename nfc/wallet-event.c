@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-event.h"
+
+static const char *event_types[] = {
+    [WALLET_EVENT_SALE]         = "sale",
+    [WALLET_EVENT_TOPUP]        = "topup",
+    [WALLET_EVENT_TRANSFER_OUT] = "transfer-out",
+    [WALLET_EVENT_TRANSFER_IN]  = "transfer-in",
+    [WALLET_EVENT_ENROL]        = "enrol",
+    [WALLET_EVENT_DELETE]       = "delete",
+    [WALLET_EVENT_REPLACE]      = "replace"
+};
+
+const char *
+wallet_event_type_name (enum wallet_event_type type)
+{
+    if ((type < WALLET_EVENT_SALE) || (type > WALLET_EVENT_REPLACE))
+		return "unknown";
+    return event_types[type];
+}
+
+static const char *
+segment_path (char *buf, size_t len, uint64_t segment)
+{
+    char name[32];
+
+    snprintf (name, sizeof (name), WALLET_EVENT_SEGMENT_FILE, (unsigned long long) segment);
+    return wallet_spool_path (buf, len, name);
+}
+
+static const char *
+offset_path (char *buf, size_t len, const char *consumer)
+{
+    char name[WALLET_EVENT_CONSUMER_MAX + 16];
+
+    snprintf (name, sizeof (name), WALLET_EVENT_OFFSET_FILE, consumer);
+    return wallet_spool_path (buf, len, name);
+}
+
+/*
+ * The lock file serializes the writers and holds the number of the segment
+ * being written. It is only a hint: a writer finding that segment full
+ * moves on to the next one.
+ */
+static int
+lock_log (uint64_t *segment)
+{
+    char path[PATH_MAX];
+    int fd;
+
+    if ((fd = open (wallet_spool_path (path, sizeof (path), WALLET_EVENT_LOCK_FILE), O_RDWR | O_CREAT, 0600)) < 0) {
+		warn ("%s", path);
+		return -1;
+    }
+    if (flock (fd, LOCK_EX) < 0) {
+		warn ("%s", path);
+		close (fd);
+		return -1;
+    }
+    if (pread (fd, segment, sizeof (*segment), 0) != sizeof (*segment))
+		*segment = 0;
+    return fd;
+}
+
+static uint64_t
+current_segment (void)
+{
+    char path[PATH_MAX];
+    uint64_t segment = 0;
+    int fd;
+
+    if ((fd = open (wallet_spool_path (path, sizeof (path), WALLET_EVENT_LOCK_FILE), O_RDONLY)) < 0)
+		return 0;
+    if (pread (fd, &segment, sizeof (segment), 0) != sizeof (segment))
+		segment = 0;
+    close (fd);
+    return segment;
+}
+
+/*
+ * Event of the given type for the card uid (hex, may be NULL) and student,
+ * made now on this terminal. The balance is left unknown.
+ */
+void
+wallet_event_init (struct wallet_event *ev, enum wallet_event_type type, const char *uid, const char *student_id)
+{
+    memset (ev, 0, sizeof (*ev));
+    ev->time = time (NULL);
+    ev->balance = WALLET_EVENT_NO_BALANCE;
+    ev->type = type;
+    ev->terminal = wallet_terminal_id ();
+    if (uid)
+		ev->uid_len = wallet_uid_parse (uid, ev->uid);
+    /* Fixed-size field, not NUL terminated when full. */
+    if (student_id)
+		memcpy (ev->student_id, student_id, strnlen (student_id, WALLET_ID_LEN));
+}
+
+/*
+ * Append count events, numbering them, and sync them to disk. The changes
+ * they describe are already committed: a failure is reported but leaves
+ * the caller's work alone, so most callers do not check it.
+ */
+int
+wallet_event_publish (struct wallet_event *ev, size_t count)
+{
+    char path[PATH_MAX];
+    uint64_t segment, used;
+    struct stat st;
+    size_t done = 0, batch;
+    int lock, fd, res = 0;
+
+    if ((lock = lock_log (&segment)) < 0)
+		return -1;
+
+    while (done < count) {
+		if ((fd = open (segment_path (path, sizeof (path), segment), O_WRONLY | O_CREAT, 0644)) < 0) {
+			warn ("%s", path);
+			res = -1;
+			break;
+		}
+		if (fstat (fd, &st) < 0) {
+			warn ("%s", path);
+			close (fd);
+			res = -1;
+			break;
+		}
+
+		/* A crash in the middle of an append leaves part of an event behind. */
+		used = st.st_size / sizeof (*ev);
+		if (((off_t) (used * sizeof (*ev)) != st.st_size) && (ftruncate (fd, used * sizeof (*ev)) < 0))
+			warn ("%s", path);
+
+		if (used >= WALLET_EVENT_SEGMENT) {
+			close (fd);
+			segment++;
+			if ((pwrite (lock, &segment, sizeof (segment), 0) != sizeof (segment)) || (fsync (lock) < 0))
+				warn ("%s", WALLET_EVENT_LOCK_FILE);
+			continue;
+		}
+
+		batch = count - done;
+		if (batch > WALLET_EVENT_SEGMENT - used)
+			batch = WALLET_EVENT_SEGMENT - used;
+		for (size_t i = 0; i < batch; i++)
+			ev[done + i].seq = segment * WALLET_EVENT_SEGMENT + used + i;
+
+		if ((pwrite (fd, ev + done, batch * sizeof (*ev), used * sizeof (*ev)) != (ssize_t) (batch * sizeof (*ev))) || (fsync (fd) < 0)) {
+			warn ("%s", path);
+			close (fd);
+			res = -1;
+			break;
+		}
+		close (fd);
+		done += batch;
+    }
+
+    close (lock);
+    return res;
+}
+
+/*
+ * Start reading at the offset saved by consumer, or at seq if it has none
+ * or consumer is NULL. Consumer names go into file names: letters, digits,
+ * '-' and '_' only.
+ */
+int
+wallet_event_reader_open (struct wallet_event_reader *reader, const char *consumer, uint64_t seq)
+{
+    char path[PATH_MAX];
+    unsigned long long saved;
+    FILE *f;
+
+    memset (reader, 0, sizeof (*reader));
+    reader->fd = -1;
+    reader->seq = seq;
+    if (!consumer)
+		return 0;
+
+    if (!*consumer || (strlen (consumer) > WALLET_EVENT_CONSUMER_MAX)) {
+		warnx ("%s: invalid consumer name", consumer);
+		return -1;
+    }
+    for (const char *p = consumer; *p; p++) {
+		if (!isalnum ((unsigned char) *p) && (*p != '-') && (*p != '_')) {
+			warnx ("%s: invalid consumer name", consumer);
+			return -1;
+		}
+    }
+    strcpy (reader->consumer, consumer);
+
+    if ((f = fopen (offset_path (path, sizeof (path), consumer), "r"))) {
+		if (1 == fscanf (f, "%llu", &saved))
+			reader->seq = saved;
+		fclose (f);
+    } else if (errno != ENOENT) {
+		warn ("%s", path);
+		return -1;
+    }
+    return 0;
+}
+
+/*
+ * Next event. Returns 1 when one was read, 0 when the reader has caught
+ * up with the writers (read again later) and -1 on error.
+ */
+int
+wallet_event_read (struct wallet_event_reader *reader, struct wallet_event *ev)
+{
+    char path[PATH_MAX];
+    ssize_t n;
+
+    for (;;) {
+		if ((reader->fd >= 0) && (reader->segment != reader->seq / WALLET_EVENT_SEGMENT)) {
+			close (reader->fd);
+			reader->fd = -1;
+		}
+		if (reader->fd < 0) {
+			reader->segment = reader->seq / WALLET_EVENT_SEGMENT;
+			if ((reader->fd = open (segment_path (path, sizeof (path), reader->segment), O_RDONLY)) < 0) {
+				if (errno != ENOENT) {
+					warn ("%s", path);
+					return -1;
+				}
+				if (reader->segment >= current_segment ())
+					return 0;
+				/* Pruned while this consumer was away. */
+				warnx ("events %llu to %llu were pruned", (unsigned long long) reader->seq,
+				       (unsigned long long) ((reader->segment + 1) * WALLET_EVENT_SEGMENT - 1));
+				reader->seq = (reader->segment + 1) * WALLET_EVENT_SEGMENT;
+				continue;
+			}
+		}
+
+		n = pread (reader->fd, ev, sizeof (*ev), (reader->seq % WALLET_EVENT_SEGMENT) * sizeof (*ev));
+		if (n < 0) {
+			warn ("%s", segment_path (path, sizeof (path), reader->segment));
+			return -1;
+		}
+		if ((n != sizeof (*ev)) || (ev->seq != reader->seq))
+			return 0;
+		reader->seq++;
+		return 1;
+    }
+}
+
+/*
+ * Save the offset of the consumer: the events read so far are handled.
+ */
+int
+wallet_event_commit (struct wallet_event_reader *reader)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + sizeof (".tmp")];
+    FILE *f;
+
+    if (!reader->consumer[0])
+		return 0;
+
+    offset_path (path, sizeof (path), reader->consumer);
+    snprintf (tmp, sizeof (tmp), "%s.tmp", path);
+    if (!(f = fopen (tmp, "w"))) {
+		warn ("%s", tmp);
+		return -1;
+    }
+    fprintf (f, "%llu\n", (unsigned long long) reader->seq);
+    if ((fflush (f) == EOF) || (fsync (fileno (f)) < 0)) {
+		warn ("%s", tmp);
+		fclose (f);
+		return -1;
+    }
+    fclose (f);
+    if (rename (tmp, path) < 0) {
+		warn ("%s", path);
+		return -1;
+    }
+    return 0;
+}
+
+void
+wallet_event_reader_close (struct wallet_event_reader *reader)
+{
+    if (reader->fd >= 0)
+		close (reader->fd);
+    reader->fd = -1;
+}
+
+/*
+ * Remove the segments that every consumer has read past. Without any
+ * consumer nothing is removed. Returns the number of segments removed, -1
+ * on error.
+ */
+int
+wallet_event_prune (void)
+{
+    char dir[PATH_MAX], path[PATH_MAX];
+    char consumer[WALLET_EVENT_CONSUMER_MAX + 1];
+    struct wallet_event_reader reader;
+    unsigned long long segment;
+    uint64_t current, oldest = UINT64_MAX;
+    struct dirent *entry;
+    DIR *d;
+    int lock, n, removed = 0;
+
+    if ((lock = lock_log (&current)) < 0)
+		return -1;
+
+    wallet_spool_path (dir, sizeof (dir), "");
+    if (!(d = opendir (dir))) {
+		warn ("%s", dir);
+		close (lock);
+		return -1;
+    }
+    while ((entry = readdir (d))) {
+		/* events.<consumer>.offset, see WALLET_EVENT_OFFSET_FILE */
+		if ((1 == sscanf (entry->d_name, "events.%32[A-Za-z0-9_-]%n", consumer, &n)) && (0 == strcmp (entry->d_name + n, ".offset")) &&
+		    (0 == wallet_event_reader_open (&reader, consumer, 0)) && (reader.seq < oldest))
+			oldest = reader.seq;
+    }
+
+    if (oldest != UINT64_MAX) {
+		rewinddir (d);
+		while ((entry = readdir (d))) {
+			if ((1 == sscanf (entry->d_name, "events.%llu%n", &segment, &n)) && (n == (int) strlen (entry->d_name)) &&
+			    (segment < oldest / WALLET_EVENT_SEGMENT) && (segment < current)) {
+				if (unlink (segment_path (path, sizeof (path), segment)) < 0)
+					warn ("%s", path);
+				else
+					removed++;
+			}
+		}
+    }
+    closedir (d);
+    close (lock);
+
+    return removed;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_EVENT_H__
+#define __WALLET_EVENT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wallet-card.h"
+
+/*
+ * Log of wallet changes for the tools downstream (notifications, finance,
+ * stock forecast), kept in the spool directory of the host that made them.
+ *
+ * Every change of a balance or of the card a student holds is appended as
+ * one fixed-size event once its transaction has committed, and synced to
+ * disk. Events are numbered from 0 in the order they were appended; the
+ * log is split in segments of WALLET_EVENT_SEGMENT events, so that the ones
+ * every consumer has read can be removed (wallet_event_prune).
+ *
+ * A consumer reads on from the number it saved last time (its offset), and
+ * saves the number of the next event once it has handled the ones before.
+ * It never queries the database.
+ */
+
+#define WALLET_EVENT_SEGMENT	65536
+#define WALLET_EVENT_NO_BALANCE	INT32_MIN
+#define WALLET_EVENT_CONSUMER_MAX	32
+
+enum wallet_event_type {
+    WALLET_EVENT_SALE = 1,
+    WALLET_EVENT_TOPUP,
+    WALLET_EVENT_TRANSFER_OUT,	/* peer_id received the money */
+    WALLET_EVENT_TRANSFER_IN,	/* peer_id sent it */
+    WALLET_EVENT_ENROL,		/* amount is the opening balance */
+    WALLET_EVENT_DELETE,	/* amount takes the balance to 0 */
+    WALLET_EVENT_REPLACE	/* new card in uid, the old one in peer_uid if known */
+};
+
+struct wallet_event {
+    uint64_t seq;		/* set by wallet_event_publish */
+    int64_t time;
+    int32_t amount;		/* change of the balance, cents */
+    int32_t balance;		/* after the change, or WALLET_EVENT_NO_BALANCE */
+    uint16_t type;
+    uint16_t terminal;
+    uint8_t uid_len;
+    uint8_t peer_uid_len;
+    uint8_t uid[WALLET_UID_MAX];
+    uint8_t peer_uid[WALLET_UID_MAX];
+    char student_id[WALLET_ID_LEN];
+    char peer_id[WALLET_ID_LEN];
+};
+
+struct wallet_event_reader {
+    char consumer[WALLET_EVENT_CONSUMER_MAX + 1];
+    uint64_t seq;		/* next event to read */
+    uint64_t segment;		/* of fd */
+    int fd;
+};
+
+void		 wallet_event_init (struct wallet_event *ev, enum wallet_event_type type, const char *uid, const char *student_id);
+int		 wallet_event_publish (struct wallet_event *ev, size_t count);
+const char	*wallet_event_type_name (enum wallet_event_type type);
+
+int		 wallet_event_reader_open (struct wallet_event_reader *reader, const char *consumer, uint64_t seq);
+int		 wallet_event_read (struct wallet_event_reader *reader, struct wallet_event *ev);
+int		 wallet_event_commit (struct wallet_event_reader *reader);
+void		 wallet_event_reader_close (struct wallet_event_reader *reader);
+int		 wallet_event_prune (void);
+
+#endif /* !__WALLET_EVENT_H__ */
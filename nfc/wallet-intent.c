@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-db.h"
+#include "wallet-event.h"
+#include "wallet-intent.h"
+#include "wallet-pending.h"
+#include "wallet-tapsnap.h"
+
+#define INTENT_COLUMNS	"id, kind, LOWER(HEX(uid)), student_id, amount, pending_last_id, old_balance, old_seq, new_balance, new_seq, terminal, pending_amount"
+
+static const char *intent_kinds[] = {
+    [WALLET_INTENT_SYNC]  = "sync",
+    [WALLET_INTENT_SALE]  = "sale",
+    [WALLET_INTENT_TOPUP] = "topup"
+};
+
+static void
+intent_from_row (MYSQL_ROW row, struct wallet_intent *intent)
+{
+    intent->id = strtoll (row[0], NULL, 10);
+    intent->kind = WALLET_INTENT_SYNC;
+    for (size_t k = 0; k < sizeof (intent_kinds) / sizeof (intent_kinds[0]); k++)
+		if (0 == strcmp (row[1], intent_kinds[k]))
+			intent->kind = k;
+    snprintf (intent->uid, sizeof (intent->uid), "%s", row[2]);
+    intent->amount = wallet_parse_cents (row[4]);
+    intent->pending_last_id = strtoll (row[5], NULL, 10);
+
+    snprintf (intent->before.student_id, sizeof (intent->before.student_id), "%s", row[3]);
+    intent->before.balance = wallet_parse_cents (row[6]);
+    intent->before.seq = strtoul (row[7], NULL, 10);
+
+    intent->after = intent->before;
+    intent->after.balance = wallet_parse_cents (row[8]);
+    intent->after.seq = strtoul (row[9], NULL, 10);
+    intent->terminal = strtoul (row[10], NULL, 10);
+    intent->pending_amount = wallet_parse_cents (row[11]);
+}
+
+/*
+ * Record the intended card write. Runs in autocommit mode: the intent must
+ * be durable before the card is touched.
+ */
+int
+wallet_intent_prepare (MYSQL *conn, struct wallet_intent *intent)
+{
+    ulong id_length = strlen (intent->before.student_id);
+    char id_esc[(2 * id_length) + 1];
+    char uid_sql[WALLET_UID_SQL_LEN];
+    char amount_char[16], pending_char[16], old_char[16], new_char[16];
+
+    mysql_real_escape_string (conn, id_esc, intent->before.student_id, id_length);
+    wallet_uid_sql (intent->uid, uid_sql);
+
+    intent->after.seq = intent->before.seq + 1;
+    intent->terminal = wallet_terminal_id ();
+
+    if (wallet_db_exec (conn, "INSERT INTO card_intent (kind, uid, student_id, amount, pending_last_id, pending_amount, old_balance, old_seq, new_balance, new_seq, terminal, state, created) "
+			"VALUES ('%s', %s, '%s', %s, %lld, %s, %s, %u, %s, %u, %u, 'prepared', NOW())",
+			intent_kinds[intent->kind], uid_sql, id_esc,
+			wallet_format_cents (amount_char, sizeof (amount_char), intent->amount), intent->pending_last_id,
+			wallet_format_cents (pending_char, sizeof (pending_char), intent->pending_amount),
+			wallet_format_cents (old_char, sizeof (old_char), intent->before.balance), intent->before.seq,
+			wallet_format_cents (new_char, sizeof (new_char), intent->after.balance), intent->after.seq, intent->terminal) < 0)
+		return -1;
+
+    intent->id = (long long) mysql_insert_id (conn);
+    return 0;
+}
+
+/*
+ * Write the new record and read it back. The read-back is what decides
+ * between committing and aborting; if the card cannot be read anymore the
+ * outcome is unknown and the intent stays prepared.
+ */
+enum wallet_intent_status
+wallet_intent_write (MifareTag tag, Mad mad, const struct wallet_intent *intent)
+{
+    struct wallet_record check;
+
+    wallet_card_write (tag, mad, &intent->after);
+
+    if (wallet_card_read (tag, mad, &check) < 0)
+		return WALLET_INTENT_IN_DOUBT;
+    if (wallet_record_equal (&check, &intent->after))
+		return WALLET_INTENT_COMMITTED;
+    if (wallet_record_equal (&check, &intent->before))
+		return WALLET_INTENT_ABORTED;
+
+    return WALLET_INTENT_IN_DOUBT;
+}
+
+/*
+ * Publish the balance change of a committed sale or top-up. Syncs only move
+ * credits the database has already counted onto the card.
+ */
+static void
+publish_intent (const struct wallet_intent *intent)
+{
+    struct wallet_event ev;
+
+    if (intent->kind == WALLET_INTENT_SYNC)
+		return;
+
+    wallet_event_init (&ev, (intent->kind == WALLET_INTENT_SALE) ? WALLET_EVENT_SALE : WALLET_EVENT_TOPUP, intent->uid, intent->before.student_id);
+    if (intent->time)
+		ev.time = intent->time;
+    ev.amount = (intent->kind == WALLET_INTENT_SALE) ? -intent->amount : intent->amount;
+    ev.balance = intent->after.balance;
+    ev.terminal = intent->terminal;
+    wallet_event_publish (&ev, 1);
+}
+
+/*
+ * Apply the database side of a written intent: balance, ledger row and
+ * pending credit settlement, in one transaction with the state change.
+ * Returns 0 on success, 1 if the intent was already resolved elsewhere and
+ * -1 on error.
+ */
+int
+wallet_intent_finalize (MYSQL *conn, const struct wallet_intent *intent)
+{
+    ulong id_length = strlen (intent->before.student_id);
+    char id_esc[(2 * id_length) + 1];
+    char uid_sql[WALLET_UID_SQL_LEN];
+    char amount_char[16], time_char[32] = "NOW()";
+    struct wallet_pending pending = {
+	.amount = intent->pending_amount,
+	.last_id = intent->pending_last_id
+    };
+    int settled;
+
+    mysql_real_escape_string (conn, id_esc, intent->before.student_id, id_length);
+    wallet_uid_sql (intent->uid, uid_sql);
+    wallet_format_cents (amount_char, sizeof (amount_char), intent->amount);
+    if (intent->time)
+		snprintf (time_char, sizeof (time_char), "FROM_UNIXTIME(%lld)", (long long) intent->time);
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+		if (wallet_db_begin (conn) < 0)
+			return -1;
+
+		/* Claim the intent first: this also serializes concurrent resolvers. */
+		if (wallet_db_exec (conn, "UPDATE card_intent SET state='committed', resolved=NOW() WHERE id=%lld AND state='prepared'", intent->id) < 0)
+			goto error;
+		if (mysql_affected_rows (conn) != 1) {
+			wallet_db_rollback (conn);
+			return 1;
+		}
+
+		switch (intent->kind) {
+		case WALLET_INTENT_SALE:
+			if ((wallet_db_exec (conn, "UPDATE student SET balance=balance-%s WHERE student_id='%s'", amount_char, id_esc) < 0) ||
+			    (wallet_db_exec (conn, "INSERT INTO sales (time, price, uid, student, terminal) VALUES(%s, %s, %s, (SELECT id FROM student WHERE student_id='%s'), %u)",
+					     time_char, amount_char, uid_sql, id_esc, intent->terminal) < 0))
+				goto error;
+			break;
+		case WALLET_INTENT_TOPUP:
+			if ((wallet_db_exec (conn, "UPDATE student SET balance=balance+%s WHERE student_id='%s'", amount_char, id_esc) < 0) ||
+			    (wallet_db_exec (conn, "INSERT INTO topup (time, amount, uid, student) VALUES(%s, %s, %s, (SELECT id FROM student WHERE student_id='%s'))",
+					     time_char, amount_char, uid_sql, id_esc) < 0))
+				goto error;
+			break;
+		case WALLET_INTENT_SYNC:
+			break;
+		}
+
+		if ((settled = wallet_pending_settle (conn, id_esc, &pending)) < 0)
+			goto error;
+		if (settled)
+			warnx ("intent %lld: pending credits of %s settled elsewhere meanwhile, check the card", intent->id, intent->before.student_id);
+
+		if (0 == wallet_db_commit (conn)) {
+			publish_intent (intent);
+			return 0;
+		}
+
+	error:
+		if (!wallet_db_abort (conn))
+			break;
+    }
+
+    return -1;
+}
+
+int
+wallet_intent_abort (MYSQL *conn, const struct wallet_intent *intent)
+{
+    return wallet_db_exec (conn, "UPDATE card_intent SET state='aborted', resolved=NOW() WHERE id=%lld AND state='prepared'", intent->id);
+}
+
+/*
+ * Run the three phases for a card that is on the reader.
+ */
+enum wallet_intent_status
+wallet_intent_run (MYSQL *conn, MifareTag tag, Mad mad, struct wallet_intent *intent)
+{
+    enum wallet_intent_status status;
+
+    if (wallet_intent_prepare (conn, intent) < 0)
+		return WALLET_INTENT_ERROR;
+
+    switch ((status = wallet_intent_write (tag, mad, intent))) {
+	case WALLET_INTENT_COMMITTED:
+		wallet_tapsnap_append (intent->uid, &intent->after, WALLET_TAPSNAP_WRITTEN);
+		if (wallet_intent_finalize (conn, intent) < 0) {
+			/* The card holds the new record: the next tap rolls it forward. */
+			warnx ("intent %lld written to card but not finalized", intent->id);
+			return WALLET_INTENT_IN_DOUBT;
+		}
+		break;
+	case WALLET_INTENT_ABORTED:
+		wallet_intent_abort (conn, intent);
+		break;
+	default:
+		break;
+    }
+
+    return status;
+}
+
+/*
+ * Resolve the intents left prepared for a card, given the record just read
+ * from it. Must run before the record is compared with the database.
+ * Returns the number of intents still in doubt, or -1 on error.
+ */
+int
+wallet_intent_resolve (MYSQL *conn, const char *uid, const struct wallet_record *rec)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    struct wallet_intent *intents = NULL;
+    size_t count = 0;
+    int in_doubt = 0;
+    char uid_sql[WALLET_UID_SQL_LEN];
+
+    if (wallet_db_exec (conn, "SELECT " INTENT_COLUMNS " FROM card_intent WHERE uid=%s AND state='prepared' ORDER BY id",
+			wallet_uid_sql (uid, uid_sql)) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn)))
+		return -1;
+    if (mysql_num_rows (result) && !(intents = malloc (mysql_num_rows (result) * sizeof (*intents)))) {
+		mysql_free_result (result);
+		return -1;
+    }
+    while ((row = mysql_fetch_row (result)))
+		intent_from_row (row, &intents[count++]);
+    mysql_free_result (result);
+
+    for (size_t i = 0; i < count; i++) {
+		if ((rec->seq >= intents[i].after.seq) && (rec->seq != intents[i].before.seq)) {
+			printf ("Completing interrupted %s (intent %lld)\n", intent_kinds[intents[i].kind], intents[i].id);
+			if (wallet_intent_finalize (conn, &intents[i]) < 0)
+				in_doubt++;
+		} else if (wallet_record_equal (rec, &intents[i].before)) {
+			printf ("Cancelling interrupted %s (intent %lld)\n", intent_kinds[intents[i].kind], intents[i].id);
+			wallet_intent_abort (conn, &intents[i]);
+		} else {
+			warnx ("intent %lld does not match the card of %s", intents[i].id, rec->student_id);
+			in_doubt++;
+		}
+    }
+    free (intents);
+
+    return in_doubt;
+}
+
+/*
+ * Startup recovery without the cards: an intent followed by a later one on
+ * the same card is decided by the record that later intent started from.
+ * The remaining ones wait for the card to be tapped again.
+ */
+int
+wallet_intent_recover (MYSQL *conn)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    int resolved = 0;
+
+    if (wallet_db_exec (conn, "SELECT p.id, p.kind, LOWER(HEX(p.uid)), p.student_id, p.amount, p.pending_last_id, p.old_balance, p.old_seq, p.new_balance, p.new_seq, p.terminal, p.pending_amount, "
+			"(SELECT l.old_seq FROM card_intent l WHERE l.uid=p.uid AND l.id>p.id ORDER BY l.id LIMIT 1) "
+			"FROM card_intent p WHERE p.state='prepared'") < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn)))
+		return -1;
+
+    while ((row = mysql_fetch_row (result))) {
+		struct wallet_intent intent;
+
+		if (!row[12])
+			continue;
+		intent_from_row (row, &intent);
+
+		uint32_t next_seq = strtoul (row[12], NULL, 10);
+		if (next_seq >= intent.after.seq) {
+			if (0 == wallet_intent_finalize (conn, &intent))
+				resolved++;
+		} else if (next_seq == intent.before.seq) {
+			if (0 == wallet_intent_abort (conn, &intent))
+				resolved++;
+		}
+    }
+    mysql_free_result (result);
+
+    return resolved;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_INTENT_H__
+#define __WALLET_INTENT_H__
+
+#include <time.h>
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+
+/*
+ * Two-phase commit between the database and the card.
+ *
+ *  1. prepare:  the intended card write (record before and after, amount,
+ *               pending credits folded in) is recorded in card_intent;
+ *  2. write:    the new record is written and read back from the card;
+ *  3. finalize: the balance update, the ledger row and the settlement of
+ *               the pending credits are committed together with the intent,
+ *               or the intent is aborted if the card still holds the old
+ *               record.
+ *
+ * An intent left prepared (card pulled away, crash) is resolved the next
+ * time the card is tapped by comparing its record, sequence number
+ * included, with both sides of the intent. At startup, wallet_intent_recover()
+ * settles the ones a later intent on the same card already proves.
+ */
+
+enum wallet_intent_kind {
+    WALLET_INTENT_SYNC,		/* only write the pending credits to the card */
+    WALLET_INTENT_SALE,
+    WALLET_INTENT_TOPUP
+};
+
+enum wallet_intent_status {
+    WALLET_INTENT_COMMITTED,
+    WALLET_INTENT_ABORTED,
+    WALLET_INTENT_IN_DOUBT,
+    WALLET_INTENT_ERROR
+};
+
+struct wallet_intent {
+    long long id;
+    enum wallet_intent_kind kind;
+    char uid[21];
+    long amount;		/* cents, always positive */
+    long long pending_last_id;	/* pending_credit entries folded into after */
+    long pending_amount;	/* their sum, cents */
+    struct wallet_record before;
+    struct wallet_record after;
+    time_t time;		/* when the card was written, 0 for now */
+    unsigned terminal;		/* that wrote the card, see wallet_terminal_id() */
+};
+
+int				 wallet_intent_prepare (MYSQL *conn, struct wallet_intent *intent);
+enum wallet_intent_status	 wallet_intent_write (MifareTag tag, Mad mad, const struct wallet_intent *intent);
+int				 wallet_intent_finalize (MYSQL *conn, const struct wallet_intent *intent);
+int				 wallet_intent_abort (MYSQL *conn, const struct wallet_intent *intent);
+enum wallet_intent_status	 wallet_intent_run (MYSQL *conn, MifareTag tag, Mad mad, struct wallet_intent *intent);
+
+int				 wallet_intent_resolve (MYSQL *conn, const char *uid, const struct wallet_record *rec);
+int				 wallet_intent_recover (MYSQL *conn);
+
+#endif /* !__WALLET_INTENT_H__ */
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-keys.h"
+
+/* Key B given to the NFCForum sectors by create-user before diversification. */
+static const MifareClassicKey legacy_keyb = {
+    0xd3, 0xf7, 0xd3, 0xf7, 0xd3, 0xf7
+};
+
+static uint8_t master[WALLET_KEY_MASTER_LEN];
+static int master_state;	/* 0 not loaded yet, 1 loaded, -1 unavailable */
+
+static int
+load_master (void)
+{
+    const char *path = getenv ("WALLET_SECTOR_KEY");
+    FILE *f;
+
+    if (master_state)
+		return master_state > 0 ? 0 : -1;
+
+    master_state = -1;
+    if (!path)
+		path = WALLET_SECTOR_KEY_FILE;
+    if (!(f = fopen (path, "r")))
+		return -1;
+    if (fread (master, 1, sizeof (master), f) == sizeof (master))
+		master_state = 1;
+    else
+		warnx ("%s: master secret must be %d bytes", path, WALLET_KEY_MASTER_LEN);
+    fclose (f);
+
+    return master_state > 0 ? 0 : -1;
+}
+
+/*
+ * Whether this terminal can derive the card keys.
+ */
+int
+wallet_keys_available (void)
+{
+    return 0 == load_master ();
+}
+
+/*
+ * Derive the key of a wallet sector of the card. Returns -1 and the legacy
+ * key if the terminal has no master secret.
+ */
+int
+wallet_sector_key (const char *uid, MifareClassicSectorNumber sector, MifareClassicKeyType type, MifareClassicKey key)
+{
+    return wallet_sector_key_generation (uid, sector, type, WALLET_KEY_GENERATION, key);
+}
+
+/*
+ * Same for a given key generation, WALLET_KEY_LEGACY giving the shared keys.
+ */
+int
+wallet_sector_key_generation (const char *uid, MifareClassicSectorNumber sector, MifareClassicKeyType type, int generation, MifareClassicKey key)
+{
+    uint8_t data[3 + WALLET_UID_MAX + 1];
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
+    size_t uid_len;
+
+    if (generation == WALLET_KEY_LEGACY) {
+		wallet_legacy_key (type, key);
+		return 0;
+    }
+    if ((load_master () < 0) || !(uid_len = wallet_uid_parse (uid, data + 3))) {
+		wallet_legacy_key (type, key);
+		return -1;
+    }
+    data[0] = generation;
+    data[1] = (type == MFC_KEY_A) ? 'A' : 'B';
+    data[2] = uid_len;
+    data[3 + WALLET_UID_MAX] = sector;
+
+    if (!HMAC (EVP_sha256 (), master, sizeof (master), data, sizeof (data), digest, &digest_len)) {
+		wallet_legacy_key (type, key);
+		return -1;
+    }
+    memcpy (key, digest, sizeof (MifareClassicKey));
+    return 0;
+}
+
+void
+wallet_legacy_key (MifareClassicKeyType type, MifareClassicKey key)
+{
+    if (type == MFC_KEY_A)
+		memcpy (key, mifare_classic_nfcforum_public_key_a, sizeof (MifareClassicKey));
+    else
+		memcpy (key, legacy_keyb, sizeof (MifareClassicKey));
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_KEYS_H__
+#define __WALLET_KEYS_H__
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+/*
+ * Sector keys of the wallet application.
+ *
+ * Each card gets its own keys A and B for every wallet sector, derived from
+ * its UID and the sector number with a master secret:
+ *
+ *     key = HMAC-SHA256 (master, generation || 'A'/'B' || UID || sector)[0..5]
+ *
+ * so a terminal computes the key of a sector and authenticates once instead
+ * of probing a key list, and a key read off one card opens no other card.
+ * Cards issued before (and terminals without the master secret) use the
+ * legacy shared keys: NFCForum public key A, and key B 0xd3f7d3f7d3f7. They
+ * count as generation 0.
+ *
+ * Bumping WALLET_KEY_GENERATION makes terminals authenticate with the new
+ * keys first, falling back to older generations, while wallet-rotate.c moves
+ * the cards over one sector trailer per tap.
+ */
+
+#define WALLET_KEY_GENERATION	1
+#define WALLET_KEY_LEGACY	0
+#define WALLET_KEY_MASTER_LEN	32
+
+int	 wallet_keys_available (void);
+int	 wallet_sector_key (const char *uid, MifareClassicSectorNumber sector, MifareClassicKeyType type, MifareClassicKey key);
+int	 wallet_sector_key_generation (const char *uid, MifareClassicSectorNumber sector, MifareClassicKeyType type, int generation, MifareClassicKey key);
+void	 wallet_legacy_key (MifareClassicKeyType type, MifareClassicKey key);
+
+#endif /* !__WALLET_KEYS_H__ */
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "wallet-config.h"
+#include "wallet-mac.h"
+
+static uint8_t mac_key[WALLET_MAC_KEY_LEN];
+static int mac_key_state;	/* 0 not loaded yet, 1 loaded, -1 unavailable */
+
+static int
+load_key (void)
+{
+    const char *path = getenv ("WALLET_MAC_KEY");
+    FILE *f;
+
+    if (mac_key_state)
+		return mac_key_state > 0 ? 0 : -1;
+
+    mac_key_state = -1;
+    if (!path)
+		path = WALLET_MAC_KEY_FILE;
+    if (!(f = fopen (path, "r")))
+		return -1;
+    if (fread (mac_key, 1, sizeof (mac_key), f) == sizeof (mac_key))
+		mac_key_state = 1;
+    else
+		warnx ("%s: key must be %d bytes", path, WALLET_MAC_KEY_LEN);
+    fclose (f);
+
+    return mac_key_state > 0 ? 0 : -1;
+}
+
+/*
+ * Whether this terminal holds the key, i.e. can seal and check records.
+ */
+int
+wallet_mac_available (void)
+{
+    return 0 == load_key ();
+}
+
+int
+wallet_mac (const uint8_t *data, size_t len, uint8_t mac[WALLET_MAC_LEN])
+{
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
+
+    if (load_key () < 0)
+		return -1;
+    if (!HMAC (EVP_sha256 (), mac_key, sizeof (mac_key), data, len, digest, &digest_len))
+		return -1;
+    memcpy (mac, digest, WALLET_MAC_LEN);
+    return 0;
+}
+
+/*
+ * Constant-time comparison.
+ */
+int
+wallet_mac_equal (const uint8_t a[WALLET_MAC_LEN], const uint8_t b[WALLET_MAC_LEN])
+{
+    uint8_t diff = 0;
+
+    for (size_t i = 0; i < WALLET_MAC_LEN; i++)
+		diff |= a[i] ^ b[i];
+    return diff == 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_MAC_H__
+#define __WALLET_MAC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Card record authentication: HMAC-SHA256 with the terminal key, truncated
+ * to WALLET_MAC_LEN bytes to fit the NFCForum sector.
+ */
+
+#define WALLET_MAC_LEN		8
+#define WALLET_MAC_KEY_LEN	32
+
+int	 wallet_mac_available (void);
+int	 wallet_mac (const uint8_t *data, size_t len, uint8_t mac[WALLET_MAC_LEN]);
+int	 wallet_mac_equal (const uint8_t a[WALLET_MAC_LEN], const uint8_t b[WALLET_MAC_LEN]);
+
+#endif /* !__WALLET_MAC_H__ */
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-monitor.h"
+#include "wallet-tapsnap.h"
+
+/*
+ * Socket to the monitor named by WALLET_MONITOR, -1 if there is none or it
+ * cannot be reached.
+ */
+static int
+monitor_socket (struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+    const char *monitor = getenv ("WALLET_MONITOR");
+    const char *port = WALLET_MONITOR_PORT;
+    char host[256], *colon;
+    struct addrinfo hints, *res;
+    int fd, error;
+
+    if (!monitor || !*monitor)
+		return -1;
+
+    snprintf (host, sizeof (host), "%s", monitor);
+    if ((colon = strrchr (host, ':'))) {
+		*colon = '\0';
+		port = colon + 1;
+    }
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if ((error = getaddrinfo (host, port, &hints, &res))) {
+		warnx ("%s: %s", monitor, gai_strerror (error));
+		return -1;
+    }
+
+    if ((fd = socket (res->ai_family, res->ai_socktype, res->ai_protocol)) < 0) {
+		warn ("%s", monitor);
+    } else {
+		fcntl (fd, F_SETFD, FD_CLOEXEC);
+		memcpy (addr, res->ai_addr, res->ai_addrlen);
+		*addr_len = res->ai_addrlen;
+    }
+    freeaddrinfo (res);
+
+    return fd;
+}
+
+static void
+monitor_send (const struct wallet_tapsnap *snap, enum wallet_monitor_check check)
+{
+    static int fd = -2;		/* not set up yet */
+    static struct sockaddr_storage addr;
+    static socklen_t addr_len;
+    struct wallet_monitor_tap tap;
+
+    if (fd == -2)
+		fd = monitor_socket (&addr, &addr_len);
+    if (fd < 0)
+		return;
+
+    memset (&tap, 0, sizeof (tap));
+    memcpy (tap.magic, WALLET_MONITOR_MAGIC, sizeof (tap.magic));
+    tap.terminal = wallet_terminal_id ();
+    tap.check = check;
+    tap.snap = *snap;
+
+    /* Dropped rather than waited for when the socket buffer is full. */
+    sendto (fd, &tap, sizeof (tap), MSG_DONTWAIT, (struct sockaddr *) &addr, addr_len);
+}
+
+/*
+ * Send a tap snapshot to the monitor, if there is one. uid and rec are what
+ * the snapshot was made from, rec NULL when the card had no readable record.
+ */
+void
+wallet_monitor_send (const struct wallet_tapsnap *snap, const char *uid, const struct wallet_record *rec)
+{
+    if (!rec)
+		monitor_send (snap, WALLET_MONITOR_UNREADABLE);
+    else if (rec->sealed && (0 == wallet_record_verify (rec, uid)))
+		monitor_send (snap, WALLET_MONITOR_FORGED);
+    else
+		monitor_send (snap, WALLET_MONITOR_VALID);
+}
+
+/*
+ * Report a card whose record does not match the database balance.
+ */
+void
+wallet_monitor_mismatch (const char *uid, const struct wallet_record *rec)
+{
+    struct wallet_tapsnap snap;
+
+    wallet_tapsnap_init (&snap, uid, rec, 0);
+    monitor_send (&snap, WALLET_MONITOR_MISMATCH);
+}
+
+/*
+ * UDP socket receiving the taps on port, on every address of the host.
+ */
+int
+wallet_monitor_listen (const char *port)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, error;
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((error = getaddrinfo (NULL, port, &hints, &res))) {
+		warnx ("port %s: %s", port, gai_strerror (error));
+		return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		if (0 == bind (fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close (fd);
+		fd = -1;
+    }
+    freeaddrinfo (res);
+
+    if (fd < 0)
+		warn ("port %s", port);
+    return fd;
+}
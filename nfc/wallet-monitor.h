@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_MONITOR_H__
+#define __WALLET_MONITOR_H__
+
+#include <stdint.h>
+
+#include "wallet-card.h"
+#include "wallet-tapsnap.h"
+
+/*
+ * Live tap stream for fraud-monitor.
+ *
+ * With WALLET_MONITOR=host[:port] in the environment of a terminal, every
+ * tap snapshot it logs (wallet-tapsnap.c) is also sent to the monitor as
+ * one UDP datagram, together with the terminal number and whether the card
+ * record could be read and its seal holds. Sending never waits: a terminal
+ * keeps selling when the monitor is down, the datagram is lost.
+ *
+ * A record that reads fine but disagrees with the database ("Invalid
+ * balance") is reported once more with wallet_monitor_mismatch(), once the
+ * tool has compared it.
+ */
+
+#define WALLET_MONITOR_MAGIC	"WTAP"
+
+enum wallet_monitor_check {
+    WALLET_MONITOR_VALID,
+    WALLET_MONITOR_UNREADABLE,	/* no wallet record could be decoded */
+    WALLET_MONITOR_FORGED,	/* sealed, but not for this card or this content */
+    WALLET_MONITOR_MISMATCH	/* readable, but card + pending differs from the database */
+};
+
+struct wallet_monitor_tap {
+    char magic[4];
+    uint16_t terminal;
+    uint8_t check;
+    uint8_t reserved;
+    struct wallet_tapsnap snap;
+};
+
+void	 wallet_monitor_send (const struct wallet_tapsnap *snap, const char *uid, const struct wallet_record *rec);
+void	 wallet_monitor_mismatch (const char *uid, const struct wallet_record *rec);
+int	 wallet_monitor_listen (const char *port);
+
+#endif /* !__WALLET_MONITOR_H__ */
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-intent.h"
+#include "wallet-offline.h"
+
+/*
+ * Journal an offline sale. The journal is the only record of the money
+ * until offline-sync runs: it is synced to disk before returning.
+ */
+int
+wallet_offline_append (const struct wallet_intent *intent, enum wallet_offline_state state)
+{
+    char path[PATH_MAX];
+    struct wallet_offline_sale sale;
+    int fd, res = 0;
+
+    memset (&sale, 0, sizeof (sale));
+    sale.time = intent->time;
+    sale.amount = intent->amount;
+    sale.balance = intent->before.balance;
+    sale.seq = intent->before.seq;
+    sale.uid_len = wallet_uid_parse (intent->uid, sale.uid);
+    sale.state = state;
+    memcpy (sale.student_id, intent->before.student_id, WALLET_ID_LEN);
+
+    /* Opened for each sale: offline-sync renames the journal away. */
+    if ((fd = open (wallet_spool_path (path, sizeof (path), WALLET_OFFLINE_FILE), O_WRONLY | O_APPEND | O_CREAT, 0600)) < 0) {
+		warn ("%s", path);
+		return -1;
+    }
+    if ((write (fd, &sale, sizeof (sale)) != sizeof (sale)) || (fsync (fd) < 0)) {
+		warn ("%s", path);
+		res = -1;
+    }
+    close (fd);
+
+    return res;
+}
+
+/*
+ * Rebuild the card intent of a journaled sale. offline-sync runs on the
+ * terminal that made the sale, the journal being in its spool.
+ */
+void
+wallet_offline_intent (const struct wallet_offline_sale *sale, struct wallet_intent *intent)
+{
+    memset (intent, 0, sizeof (*intent));
+    intent->kind = WALLET_INTENT_SALE;
+    wallet_uid_format (sale->uid, sale->uid_len, intent->uid, sizeof (intent->uid));
+    intent->amount = sale->amount;
+    intent->time = sale->time;
+    intent->terminal = wallet_terminal_id ();
+
+    memcpy (intent->before.student_id, sale->student_id, WALLET_ID_LEN);
+    intent->before.student_id[WALLET_ID_LEN] = '\0';
+    intent->before.balance = sale->balance;
+    intent->before.seq = sale->seq;
+
+    intent->after = intent->before;
+    intent->after.balance -= sale->amount;
+    intent->after.seq++;
+}
+
+/*
+ * Decide the last sale left in doubt on this card from what the card holds
+ * now, and journal the outcome. Returns 1 if that sale went through, 0
+ * otherwise.
+ */
+int
+wallet_offline_resolve (const char *uid, const struct wallet_record *rec)
+{
+    char path[PATH_MAX];
+    struct wallet_offline_sale sale, last;
+    struct wallet_intent intent;
+    uint8_t bytes[WALLET_UID_MAX];
+    size_t len = wallet_uid_parse (uid, bytes);
+    int found = 0;
+    FILE *journal;
+
+    if (!(journal = fopen (wallet_spool_path (path, sizeof (path), WALLET_OFFLINE_FILE), "r")))
+		return 0;
+    while (fread (&sale, sizeof (sale), 1, journal) == 1) {
+		if (0 == wallet_uid_cmp (sale.uid, sale.uid_len, bytes, len)) {
+			last = sale;
+			found = 1;
+		}
+    }
+    fclose (journal);
+
+    if (!found || (last.state != WALLET_OFFLINE_IN_DOUBT))
+		return 0;
+
+    wallet_offline_intent (&last, &intent);
+    if ((rec->seq == intent.after.seq) && (rec->balance == intent.after.balance)) {
+		wallet_offline_append (&intent, WALLET_OFFLINE_COMMITTED);
+		return 1;
+    }
+    if ((rec->seq == intent.before.seq) && (rec->balance == intent.before.balance))
+		wallet_offline_append (&intent, WALLET_OFFLINE_ABORTED);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_OFFLINE_H__
+#define __WALLET_OFFLINE_H__
+
+#include <stdint.h>
+
+#include "wallet-card.h"
+#include "wallet-intent.h"
+
+/*
+ * Offline sales.
+ *
+ * A terminal running without the database (checkout -o) trusts the sealed
+ * card record, writes the debit to the card and journals the sale locally.
+ * offline-sync later replays the journal as card intents, so the database
+ * ends up exactly where an online sale would have left it.
+ */
+
+enum wallet_offline_state {
+    WALLET_OFFLINE_COMMITTED,	/* the card holds the new record */
+    WALLET_OFFLINE_IN_DOUBT,	/* card pulled away before the read-back */
+    WALLET_OFFLINE_ABORTED	/* a later tap showed the old record */
+};
+
+struct wallet_offline_sale {
+    int64_t time;
+    int32_t amount;		/* cents */
+    int32_t balance;		/* card balance before the sale, cents */
+    uint32_t seq;		/* card sequence number before the sale */
+    uint8_t uid[WALLET_UID_MAX];
+    uint8_t uid_len;
+    uint8_t state;
+    char student_id[WALLET_ID_LEN];
+};
+
+int	 wallet_offline_append (const struct wallet_intent *intent, enum wallet_offline_state state);
+int	 wallet_offline_resolve (const char *uid, const struct wallet_record *rec);
+void	 wallet_offline_intent (const struct wallet_offline_sale *sale, struct wallet_intent *intent);
+
+#endif /* !__WALLET_OFFLINE_H__ */
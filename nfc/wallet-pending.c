@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+
+#include "wallet-db.h"
+#include "wallet-intent.h"
+#include "wallet-pending.h"
+
+/*
+ * Queue a credit (or a debit when cents is negative) for the card of the
+ * given student. id_esc must already be escaped. Meant to be called inside
+ * the transaction that changed the balance.
+ *
+ * Returns the id of the pending entry, or -1 on error.
+ */
+long long
+wallet_pending_enqueue (MYSQL *conn, const char *id_esc, long cents, const char *reason)
+{
+    if (wallet_db_exec (conn, "INSERT INTO pending_credit (student_id, amount, reason, created) VALUES ('%s', %ld/100, '%s', NOW())",
+			id_esc, cents, reason) < 0)
+		return -1;
+
+    return (long long) mysql_insert_id (conn);
+}
+
+/*
+ * Sum the credits not yet written to the card of the given student. This is
+ * a plain read, nothing stays locked while the card is written: entries are
+ * only ever appended, so settling "up to last_id" later on leaves the ones
+ * that arrive in between, and wallet_pending_settle() finds out about the
+ * ones settled elsewhere in the meantime.
+ */
+int
+wallet_pending_fetch (MYSQL *conn, const char *id_esc, struct wallet_pending *pending)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    pending->amount = 0;
+    pending->last_id = 0;
+
+    if (wallet_db_exec (conn, "SELECT SUM(amount), MAX(id) FROM pending_credit WHERE student_id='%s' AND settled IS NULL", id_esc) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn)))
+		return -1;
+    if ((row = mysql_fetch_row (result)) && row[0] && row[1]) {
+		pending->amount = wallet_parse_cents (row[0]);
+		pending->last_id = strtoll (row[1], NULL, 10);
+    }
+    mysql_free_result (result);
+
+    return 0;
+}
+
+/*
+ * Mark the entries counted by wallet_pending_fetch() as written to the card,
+ * inside the caller's transaction. They are locked and summed again first:
+ * returns 1 when they no longer add up to pending->amount (some were settled
+ * elsewhere since, e.g. by card_rebind), in which case the ones left are
+ * settled all the same, 0 when they do and -1 on error.
+ */
+int
+wallet_pending_settle (MYSQL *conn, const char *id_esc, const struct wallet_pending *pending)
+{
+    long amount;
+
+    if (!pending->last_id)
+		return 0;
+
+    if ((wallet_db_select_cents (conn, &amount, "SELECT COALESCE(SUM(amount), 0) FROM pending_credit WHERE student_id='%s' AND settled IS NULL AND id<=%lld FOR UPDATE",
+				 id_esc, pending->last_id) < 0) ||
+	(wallet_db_exec (conn, "UPDATE pending_credit SET settled=NOW() WHERE student_id='%s' AND settled IS NULL AND id<=%lld",
+			 id_esc, pending->last_id) < 0))
+		return -1;
+
+    return (amount != pending->amount) ? 1 : 0;
+}
+
+/*
+ * Bring a presented card up to date: add the outstanding credits to the
+ * record and write it in the same RF session through the card intent
+ * coordinator, which settles the entries once the write is confirmed.
+ *
+ * Returns 1 if the card was updated, 0 if there was nothing to apply and -1
+ * if the card could not be updated, in which case the credits stay queued.
+ */
+int
+wallet_pending_apply (MYSQL *conn, MifareTag tag, Mad mad, const char *uid, struct wallet_record *rec)
+{
+    ulong id_length = strlen (rec->student_id);
+    char id_esc[(2 * id_length) + 1];
+    struct wallet_pending pending;
+    struct wallet_intent intent = {
+	.kind = WALLET_INTENT_SYNC,
+	.before = *rec,
+	.after = *rec
+    };
+
+    mysql_real_escape_string (conn, id_esc, rec->student_id, id_length);
+
+    if (wallet_pending_fetch (conn, id_esc, &pending) < 0)
+		return -1;
+    if (!pending.last_id)
+		return 0;
+
+    snprintf (intent.uid, sizeof (intent.uid), "%s", uid);
+    intent.pending_last_id = pending.last_id;
+    intent.pending_amount = pending.amount;
+    intent.after.balance += pending.amount;
+
+    if (wallet_intent_run (conn, tag, mad, &intent) != WALLET_INTENT_COMMITTED)
+		return -1;
+
+    *rec = intent.after;
+    return 1;
+}
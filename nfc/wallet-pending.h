@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_PENDING_H__
+#define __WALLET_PENDING_H__
+
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+
+/*
+ * Pending card updates.
+ *
+ * Server-side operations change student.balance without the card being on
+ * the reader. The difference is queued in pending_credit so that the card
+ * can be brought up to date the next time it is presented.
+ *
+ * A tool that writes the card anyway (checkout, topup) folds the pending
+ * amount into its own card intent; the others call wallet_pending_apply()
+ * as soon as the record has been read.
+ */
+
+struct wallet_pending {
+    long amount;		/* sum of the outstanding entries, in cents */
+    long long last_id;		/* highest pending_credit id included in amount */
+};
+
+long long	 wallet_pending_enqueue (MYSQL *conn, const char *id_esc, long cents, const char *reason);
+int		 wallet_pending_fetch (MYSQL *conn, const char *id_esc, struct wallet_pending *pending);
+int		 wallet_pending_settle (MYSQL *conn, const char *id_esc, const struct wallet_pending *pending);
+int		 wallet_pending_apply (MYSQL *conn, MifareTag tag, Mad mad, const char *uid, struct wallet_record *rec);
+
+#endif /* !__WALLET_PENDING_H__ */
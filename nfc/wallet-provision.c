@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include "config.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+#include "wallet-keys.h"
+#include "wallet-provision.h"
+
+static const MifareClassicKey default_keys[] = {
+    { 0xff,0xff,0xff,0xff,0xff,0xff },
+    { 0xd3,0xf7,0xd3,0xf7,0xd3,0xf7 },
+    { 0xa0,0xa1,0xa2,0xa3,0xa4,0xa5 },
+    { 0xb0,0xb1,0xb2,0xb3,0xb4,0xb5 },
+    { 0x4d,0x3a,0x99,0xc3,0x51,0xdd },
+    { 0x1a,0x98,0x2c,0x7e,0x45,0x9a },
+    { 0xaa,0xbb,0xcc,0xdd,0xee,0xff },
+    { 0x00,0x00,0x00,0x00,0x00,0x00 }
+};
+
+static const MifareClassicKey transport_key = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static const MifareClassicKey default_keyb = {
+    0xd3, 0xf7, 0xd3, 0xf7, 0xd3, 0xf7
+};
+
+struct mifare_classic_key_and_type {
+    MifareClassicKey key;
+    MifareClassicKeyType type;
+};
+
+static int
+search_sector_key (MifareTag tag, MifareClassicSectorNumber sector, MifareClassicKey *key, MifareClassicKeyType *key_type)
+{
+    MifareClassicBlockNumber block = mifare_classic_sector_last_block (sector);
+
+    /*
+     * FIXME: We should not assume that if we have full access to trailer block
+     *        we also have a full access to data blocks.
+     */
+    mifare_classic_disconnect (tag);
+    for (size_t i = 0; i < (sizeof (default_keys) / sizeof (MifareClassicKey)); i++) {
+		if ((0 == mifare_classic_connect (tag)) && (0 == mifare_classic_authenticate (tag, block, default_keys[i], MFC_KEY_A))) {
+			if ((1 == mifare_classic_get_trailer_block_permission (tag, block, MCAB_WRITE_KEYA, MFC_KEY_A)) &&
+				(1 == mifare_classic_get_trailer_block_permission (tag, block, MCAB_WRITE_ACCESS_BITS, MFC_KEY_A)) &&
+				(1 == mifare_classic_get_trailer_block_permission (tag, block, MCAB_WRITE_KEYB, MFC_KEY_A))) {
+					memcpy (key, &default_keys[i], sizeof (MifareClassicKey));
+					*key_type = MFC_KEY_A;
+					return 1;
+			}
+		}
+		mifare_classic_disconnect (tag);
+
+		if ((0 == mifare_classic_connect (tag)) && (0 == mifare_classic_authenticate (tag, block, default_keys[i], MFC_KEY_B))) {
+			if ((1 == mifare_classic_get_trailer_block_permission (tag, block, MCAB_WRITE_KEYA, MFC_KEY_B)) &&
+				(1 == mifare_classic_get_trailer_block_permission (tag, block, MCAB_WRITE_ACCESS_BITS, MFC_KEY_B)) &&
+				(1 == mifare_classic_get_trailer_block_permission (tag, block, MCAB_WRITE_KEYB, MFC_KEY_B))) {
+					memcpy (key, &default_keys[i], sizeof (MifareClassicKey));
+					*key_type = MFC_KEY_B;
+					return 1;
+			}
+		}
+		mifare_classic_disconnect (tag);
+    }
+
+    warnx ("No known authentication key for sector 0x%02x", sector);
+    return 0;
+}
+
+static int
+fix_mad_trailer_block (nfc_device_t *device, MifareTag tag, MifareClassicSectorNumber sector, MifareClassicKey key, MifareClassicKeyType key_type)
+{
+    MifareClassicBlock block;
+    mifare_classic_trailer_block (&block, mad_public_key_a, 0x0, 0x1, 0x1, 0x6, 0x00, default_keyb);
+    if (mifare_classic_authenticate (tag, mifare_classic_sector_last_block (sector), key, key_type) < 0) {
+		nfc_perror (device, "fix_mad_trailer_block mifare_classic_authenticate");
+		return -1;
+    }
+    if (mifare_classic_write (tag, mifare_classic_sector_last_block (sector), block) < 0) {
+		nfc_perror (device, "mifare_classic_write");
+		return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns 0 on success, -1 if the card cannot be used.
+ */
+int
+wallet_card_provision (nfc_device_t *device, MifareTag tag, const uint8_t *tlv_data, size_t encoded_size)
+{
+    struct mifare_classic_key_and_type card_write_keys[40];
+    MifareClassicSectorNumber *sectors = NULL;
+    Mad mad = NULL;
+    char *tag_uid = freefare_get_tag_uid (tag);
+    int res = -1;
+
+    for (int n = 0; n < 40; n++) {
+		memcpy (card_write_keys[n].key, transport_key, sizeof (transport_key));
+		card_write_keys[n].type = MFC_KEY_A;
+    }
+
+    switch (freefare_get_tag_type (tag)) {
+	case CLASSIC_4K:
+		if (!search_sector_key (tag, 0x10, &(card_write_keys[0x10].key), &(card_write_keys[0x10].type)))
+			goto out;
+		/* fallthrough */
+	case CLASSIC_1K:
+		if (!search_sector_key (tag, 0x00, &(card_write_keys[0x00].key), &(card_write_keys[0x00].type)))
+			goto out;
+		break;
+	default:
+		/* Keep compiler quiet */
+		break;
+    }
+
+    /* Ensure the auth key is always a B one. If not, change it! */
+    switch (freefare_get_tag_type (tag)) {
+	case CLASSIC_4K:
+		if (card_write_keys[0x10].type != MFC_KEY_B) {
+			if (0 != fix_mad_trailer_block (device, tag, 0x10, card_write_keys[0x10].key, card_write_keys[0x10].type))
+				goto out;
+			memcpy (&(card_write_keys[0x10].key), &default_keyb, sizeof (MifareClassicKey));
+			card_write_keys[0x10].type = MFC_KEY_B;
+		}
+		/* fallthrough */
+	case CLASSIC_1K:
+		if (card_write_keys[0x00].type != MFC_KEY_B) {
+			if (0 != fix_mad_trailer_block (device, tag, 0x00, card_write_keys[0x00].key, card_write_keys[0x00].type))
+				goto out;
+			memcpy (&(card_write_keys[0x00].key), &default_keyb, sizeof (MifareClassicKey));
+			card_write_keys[0x00].type = MFC_KEY_B;
+		}
+		break;
+	default:
+		/* Keep compiler quiet */
+		break;
+    }
+
+    // If the card already has a MAD, load it.
+    if ((mad = mad_read (tag))) {
+		// If our application already exists, erase it.
+		MifareClassicSectorNumber *p;
+		sectors = p = mifare_application_find (mad, mad_nfcforum_aid);
+		if (sectors) {
+			while (*p) {
+				if (wallet_sector_authenticate (tag, *p, MFC_KEY_B) < 0) {
+					nfc_perror (device, "mifare_classic_authenticate");
+					goto out;
+				}
+				if (mifare_classic_format_sector (tag, *p) < 0) {
+					nfc_perror (device, "mifare_classic_format_sector");
+					goto out;
+				}
+				p++;
+			}
+		}
+		free (sectors);
+		sectors = NULL;
+		mifare_application_free (mad, mad_nfcforum_aid);
+    } else {
+		// Create a MAD and mark unaccessible sectors in the card
+		if (!(mad = mad_new ((freefare_get_tag_type (tag) == CLASSIC_4K) ? 2 : 1))) {
+			perror ("mad_new");
+			goto out;
+		}
+
+		MifareClassicSectorNumber max_s = (freefare_get_tag_type (tag) == CLASSIC_4K) ? 39 : 15;
+
+		// Mark unusable sectors as so
+		for (size_t s = max_s; s; s--) {
+			if (s == 0x10) continue;
+			if (!search_sector_key (tag, s, &(card_write_keys[s].key), &(card_write_keys[s].type))) {
+				mad_set_aid (mad, s, mad_defect_aid);
+			} else if ((memcmp (card_write_keys[s].key, transport_key, sizeof (transport_key)) != 0) &&
+				   (card_write_keys[s].type != MFC_KEY_A)) {
+				// Revert to transport configuration
+				if (mifare_classic_format_sector (tag, s) < 0) {
+					nfc_perror (device, "mifare_classic_format_sector");
+					goto out;
+				}
+			}
+		}
+    }
+
+    if (!(sectors = mifare_application_alloc (mad, mad_nfcforum_aid, encoded_size))) {
+		nfc_perror (device, "mifare_application_alloc");
+		goto out;
+    }
+
+    if (mad_write (tag, mad, card_write_keys[0x00].key, card_write_keys[0x10].key) < 0) {
+		nfc_perror (device, "mad_write");
+		goto out;
+    }
+
+    for (int s = 0; sectors[s]; s++) {
+		MifareClassicBlockNumber block = mifare_classic_sector_last_block (sectors[s]);
+		MifareClassicBlock block_data;
+		MifareClassicKey key_a, key_b;
+
+		//the card's own keys, see wallet-keys.c
+		wallet_sector_key (tag_uid, sectors[s], MFC_KEY_A, key_a);
+		wallet_sector_key (tag_uid, sectors[s], MFC_KEY_B, key_b);
+		mifare_classic_trailer_block (&block_data, key_a, 0x0, 0x0, 0x0, 0x6, 0x40, key_b);
+		if (mifare_classic_authenticate (tag, block, card_write_keys[sectors[s]].key, card_write_keys[sectors[s]].type) < 0) {
+			nfc_perror (device, "mifare_classic_authenticate");
+			goto out;
+		}
+		if (mifare_classic_write (tag, block, block_data) < 0) {
+			nfc_perror (device, "mifare_classic_write");
+			goto out;
+		}
+    }
+
+    if ((ssize_t) encoded_size != wallet_app_write (tag, mad, tlv_data, encoded_size)) {
+		nfc_perror (device, "wallet_app_write");
+		goto out;
+    }
+    res = 0;
+
+out:
+    free (sectors);
+    free (mad);
+    free (tag_uid);
+    return res;
+}
+
+/*
+ * Format a sector that is not part of the wallet application, with the
+ * transport keys or any other well-known key.
+ */
+static int
+format_sector_default (MifareTag tag, MifareClassicSectorNumber sector)
+{
+    MifareClassicBlockNumber block = mifare_classic_sector_last_block (sector);
+
+    mifare_classic_disconnect (tag);
+    for (size_t i = 0; i < (sizeof (default_keys) / sizeof (MifareClassicKey)); i++) {
+		if ((0 == mifare_classic_connect (tag)) && (0 == mifare_classic_authenticate (tag, block, default_keys[i], MFC_KEY_A)) &&
+			(0 == mifare_classic_format_sector (tag, sector)))
+			return 0;
+		mifare_classic_disconnect (tag);
+
+		if ((0 == mifare_classic_connect (tag)) && (0 == mifare_classic_authenticate (tag, block, default_keys[i], MFC_KEY_B)) &&
+			(0 == mifare_classic_format_sector (tag, sector)))
+			return 0;
+		mifare_classic_disconnect (tag);
+    }
+
+    warnx ("No known authentication key for sector 0x%02x", sector);
+    return -1;
+}
+
+/*
+ * Returns 0 if every sector is back to the transport configuration, -1
+ * otherwise. The card is left disconnected.
+ */
+int
+wallet_card_format (MifareTag tag)
+{
+    MifareClassicSectorNumber *sectors, *p;
+    MifareClassicSectorNumber last = (freefare_get_tag_type (tag) == CLASSIC_4K) ? 39 : 15;
+    uint64_t wallet = 0;
+    Mad mad;
+    int res = 0;
+
+    // The wallet sectors only open with the card's own keys.
+    if ((0 == mifare_classic_connect (tag)) && (mad = mad_read (tag))) {
+		if ((sectors = mifare_application_find (mad, mad_nfcforum_aid))) {
+			for (p = sectors; *p; p++)
+				wallet |= (uint64_t) 1 << *p;
+			free (sectors);
+		}
+		free (mad);
+    }
+    mifare_classic_disconnect (tag);
+
+    for (MifareClassicSectorNumber s = 0; s <= last; s++) {
+		if (wallet & ((uint64_t) 1 << s)) {
+			if ((mifare_classic_connect (tag) < 0) ||
+				(wallet_sector_authenticate (tag, s, MFC_KEY_B) < 0) ||
+				(mifare_classic_format_sector (tag, s) < 0)) {
+				warnx ("cannot format wallet sector 0x%02x", s);
+				res = -1;
+			}
+			mifare_classic_disconnect (tag);
+		} else if (format_sector_default (tag, s) < 0) {
+			res = -1;
+		} else {
+			mifare_classic_disconnect (tag);
+		}
+    }
+
+    return res;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef __WALLET_PROVISION_H__
+#define __WALLET_PROVISION_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+/*
+ * Turn a blank (or previously used) Mifare Classic card into a wallet card:
+ * find the transport keys of every sector, create the MAD marking the
+ * sectors no key opens as defect, allocate the NFCForum application with
+ * the card's own sector keys (wallet-keys.c) and write tlv_data to it.
+ *
+ * This takes a few seconds per card, so cards are normally prepared ahead of
+ * time with prepare-stock and only get their wallet record when issued.
+ *
+ * wallet_card_format() takes a card back to the transport configuration,
+ * every sector; closed accounts only invalidate the record at the desk and
+ * leave this to recycle-cards.
+ */
+
+int	 wallet_card_provision (nfc_device_t *device, MifareTag tag, const uint8_t *tlv_data, size_t encoded_size);
+int	 wallet_card_format (MifareTag tag);
+
+#endif /* !__WALLET_PROVISION_H__ */
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include "config.h"
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+#include "wallet-db.h"
+#include "wallet-event.h"
+#include "wallet-provision.h"
+#include "wallet-rebind.h"
+#include "wallet-stock.h"
+
+enum wallet_rebind_status
+wallet_rebind (MYSQL *conn, const char *old_uid, const char *new_uid, struct wallet_rebind *res)
+{
+    char old_sql[WALLET_UID_SQL_LEN], new_sql[WALLET_UID_SQL_LEN];
+    enum wallet_rebind_status status = WALLET_REBIND_DB_ERROR;
+    struct wallet_event ev;
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    memset (res, 0, sizeof (*res));
+    if (wallet_db_exec (conn, "CALL card_rebind(%s, %s)", wallet_uid_sql (old_uid, old_sql), wallet_uid_sql (new_uid, new_sql)) < 0)
+		return WALLET_REBIND_DB_ERROR;
+
+    if ((result = mysql_store_result (conn))) {
+		if ((row = mysql_fetch_row (result))) {
+			if (0 == strcmp (row[0], "ok"))
+				status = WALLET_REBIND_OK;
+			else if (0 == strcmp (row[0], "unknown"))
+				status = WALLET_REBIND_UNKNOWN;
+			else if (0 == strcmp (row[0], "in-use"))
+				status = WALLET_REBIND_IN_USE;
+			snprintf (res->student_id, sizeof (res->student_id), "%s", row[1] ? row[1] : "");
+			res->balance = row[2] ? wallet_parse_cents (row[2]) : 0;
+			res->stock = row[3] ? atoi (row[3]) : 0;
+		}
+		mysql_free_result (result);
+    } else {
+		warnx ("CALL card_rebind: %s", mysql_error (conn));
+    }
+    wallet_db_drain (conn);
+
+    if (status == WALLET_REBIND_OK) {
+		wallet_event_init (&ev, WALLET_EVENT_REPLACE, new_uid, res->student_id);
+		ev.peer_uid_len = wallet_uid_parse (old_uid, ev.peer_uid);
+		ev.balance = res->balance;
+		wallet_event_publish (&ev, 1);
+    }
+
+    return status;
+}
+
+/*
+ * Write the wallet record of a rebound student to the new card, which is on
+ * the reader but not connected: a stock card only needs the record, any
+ * other card is provisioned first.
+ */
+int
+wallet_rebind_issue (nfc_device_t *device, MifareTag tag, const struct wallet_rebind *rebind)
+{
+    struct wallet_record record = { .balance = rebind->balance };
+    uint8_t ndef_msg[WALLET_RECORD_LEN];
+    size_t ndef_msg_len, encoded_size;
+    uint8_t *tlv_data;
+    char *tag_uid;
+    int res;
+
+    snprintf (record.student_id, sizeof (record.student_id), "%s", rebind->student_id);
+    if (rebind->stock)
+		return wallet_stock_issue (tag, &record);
+
+    tag_uid = freefare_get_tag_uid (tag);
+    wallet_record_seal (&record, tag_uid);
+    free (tag_uid);
+    if (!(ndef_msg_len = wallet_record_encode (&record, ndef_msg, sizeof (ndef_msg))) ||
+	!(tlv_data = tlv_encode (3, ndef_msg, ndef_msg_len, &encoded_size)))
+		return -1;
+
+    res = wallet_card_provision (device, tag, tlv_data, encoded_size);
+    mifare_classic_disconnect (tag);
+    free (tlv_data);
+
+    return res;
+}
+
+const char *
+wallet_rebind_strerror (enum wallet_rebind_status status)
+{
+    switch (status) {
+	case WALLET_REBIND_OK:
+		return "Card renewed";
+	case WALLET_REBIND_UNKNOWN:
+		return "No user found/Invalid card.";
+	case WALLET_REBIND_IN_USE:
+		return "The new card is already in use.";
+	case WALLET_REBIND_DB_ERROR:
+	default:
+		return "Updating data from DB Failed";
+    }
+}
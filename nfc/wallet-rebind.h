@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef __WALLET_REBIND_H__
+#define __WALLET_REBIND_H__
+
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+
+/*
+ * Move a student from one card to another (renew-card): one call of the
+ * card_rebind procedure updates the UID of the student row in place,
+ * records the old UID in uid_history, hotlists it, queues the old card for
+ * recycling and takes the new card out of the stock if it comes from there.
+ * The new card gets the database balance, so the pending credits of the
+ * student are settled in the same transaction. The connection needs
+ * CLIENT_MULTI_RESULTS.
+ */
+
+enum wallet_rebind_status {
+    WALLET_REBIND_OK = 0,
+    WALLET_REBIND_UNKNOWN,	/* old card not registered */
+    WALLET_REBIND_IN_USE,	/* new card registered or hotlisted */
+    WALLET_REBIND_DB_ERROR
+};
+
+struct wallet_rebind {
+    char student_id[WALLET_ID_LEN + 1];
+    long balance;		/* cents */
+    int stock;			/* new card was prepared stock */
+};
+
+enum wallet_rebind_status	 wallet_rebind (MYSQL *conn, const char *old_uid, const char *new_uid, struct wallet_rebind *res);
+int				 wallet_rebind_issue (nfc_device_t *device, MifareTag tag, const struct wallet_rebind *rebind);
+const char			*wallet_rebind_strerror (enum wallet_rebind_status status);
+
+#endif /* !__WALLET_REBIND_H__ */
@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include "config.h"
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+#include "wallet-db.h"
+#include "wallet-keys.h"
+#include "wallet-rotate.h"
+
+/* Access conditions create-user gives the wallet sectors; only the keys change. */
+#define ROTATE_AB_DATA		0x0
+#define ROTATE_AB_TRAILER	0x6
+#define ROTATE_GPB		0x40
+
+/*
+ * Sectors of the card already on the current key generation. A row left by
+ * the rotation to an older generation counts as no progress.
+ */
+static int
+load_progress (MYSQL *conn, const char *uid_sql, uint64_t *done, int *complete)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+
+    *done = 0;
+    *complete = 0;
+    if (wallet_db_exec (conn, "SELECT sectors, complete FROM key_rotation WHERE uid=%s AND generation=%d",
+		uid_sql, WALLET_KEY_GENERATION) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn))) {
+		warnx ("key_rotation: %s", mysql_error (conn));
+		return -1;
+    }
+    if ((row = mysql_fetch_row (result))) {
+		*done = strtoull (row[0], NULL, 10);
+		*complete = atoi (row[1]);
+    }
+    mysql_free_result (result);
+
+    return 0;
+}
+
+static int
+save_progress (MYSQL *conn, const char *uid_sql, uint64_t done, int complete)
+{
+    return wallet_db_exec (conn,
+	"INSERT INTO key_rotation (uid, generation, sectors, complete, updated) "
+	"VALUES (%s, %d, %" PRIu64 ", %d, NOW()) "
+	"ON DUPLICATE KEY UPDATE "
+	"sectors=IF(generation=VALUES(generation), sectors | VALUES(sectors), VALUES(sectors)), "
+	"generation=VALUES(generation), complete=VALUES(complete), updated=VALUES(updated)",
+	uid_sql, WALLET_KEY_GENERATION, done, complete);
+}
+
+/*
+ * Write the trailer of a sector the terminal is authenticated on with key B.
+ */
+static int
+rotate_sector (MifareTag tag, const char *uid, MifareClassicSectorNumber sector)
+{
+    MifareClassicBlock trailer;
+    MifareClassicKey key_a, key_b;
+
+    if ((wallet_sector_key (uid, sector, MFC_KEY_A, key_a) < 0) ||
+	(wallet_sector_key (uid, sector, MFC_KEY_B, key_b) < 0))
+		return -1;
+
+    mifare_classic_trailer_block (&trailer, key_a, ROTATE_AB_DATA, ROTATE_AB_DATA, ROTATE_AB_DATA,
+	ROTATE_AB_TRAILER, ROTATE_GPB, key_b);
+    if (mifare_classic_write (tag, mifare_classic_sector_last_block (sector), trailer) < 0) {
+		warnx ("key rotation: cannot write trailer of sector %d of %s", sector, uid);
+		return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Move the card one step towards WALLET_KEY_GENERATION. Call it last in the
+ * RF session: a sector on an older generation costs a reconnection of the
+ * card to find its keys.
+ */
+enum wallet_rotate_status
+wallet_key_rotate (MYSQL *conn, MifareTag tag, Mad mad)
+{
+    MifareClassicSectorNumber *sectors, *p;
+    enum wallet_rotate_status status = WALLET_ROTATE_ERROR;
+    uint64_t done, before;
+    int complete, written = 0;
+
+    if (!wallet_keys_available ())
+		return WALLET_ROTATE_SKIPPED;
+
+    char *uid = freefare_get_tag_uid (tag);
+    char uid_sql[WALLET_UID_SQL_LEN];
+
+    wallet_uid_sql (uid, uid_sql);
+
+    if (load_progress (conn, uid_sql, &done, &complete) < 0)
+		goto out;
+    if (complete) {
+		status = WALLET_ROTATE_DONE;
+		goto out;
+    }
+    if (!(sectors = mifare_application_find (mad, mad_nfcforum_aid)))
+		goto out;
+
+    before = done;
+    status = WALLET_ROTATE_DONE;
+    for (p = sectors; *p; p++) {
+		uint64_t bit = (uint64_t) 1 << *p;
+		int generation;
+
+		if (done & bit)
+			continue;
+		if (written) {
+			/* One trailer write per tap, the rest waits. */
+			status = WALLET_ROTATE_PROGRESS;
+			break;
+		}
+		if ((generation = wallet_sector_authenticate (tag, *p, MFC_KEY_B)) < 0) {
+			warnx ("key rotation: no known key for sector %d of %s", *p, uid);
+			status = WALLET_ROTATE_ERROR;
+			break;
+		}
+		if (generation != WALLET_KEY_GENERATION) {
+			if (rotate_sector (tag, uid, *p) < 0) {
+				status = WALLET_ROTATE_ERROR;
+				break;
+			}
+			written = 1;
+		}
+		done |= bit;
+    }
+    free (sectors);
+
+    if (((done != before) || (status == WALLET_ROTATE_DONE)) &&
+	(save_progress (conn, uid_sql, done, status == WALLET_ROTATE_DONE) < 0))
+		status = WALLET_ROTATE_ERROR;
+
+out:
+    free (uid);
+    return status;
+}
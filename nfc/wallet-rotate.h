@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef __WALLET_ROTATE_H__
+#define __WALLET_ROTATE_H__
+
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+/*
+ * Key rotation over normal traffic.
+ *
+ * Every terminal holding the master secret calls wallet_key_rotate() once
+ * per tap, after its own work on the card. The first wallet sector still on
+ * an older key generation gets its trailer rewritten with the keys of
+ * WALLET_KEY_GENERATION, which is never more than one extra block write, and
+ * the sector is recorded in the key_rotation table. Progress survives
+ * crashes on both sides: a sector whose new trailer reached the card but not
+ * the database is found to authenticate with the new keys on the next tap,
+ * and recorded then without writing.
+ */
+
+enum wallet_rotate_status {
+    WALLET_ROTATE_DONE = 0,	/* every wallet sector is on the current keys */
+    WALLET_ROTATE_PROGRESS,	/* one more sector rotated, more to go */
+    WALLET_ROTATE_SKIPPED,	/* no master secret on this terminal */
+    WALLET_ROTATE_ERROR
+};
+
+enum wallet_rotate_status	 wallet_key_rotate (MYSQL *conn, MifareTag tag, Mad mad);
+
+#endif /* !__WALLET_ROTATE_H__ */
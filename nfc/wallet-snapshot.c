@@ -0,0 +1,410 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mysql/mysql.h>
+
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-db.h"
+#include "wallet-snapshot.h"
+
+/*
+ * A change may commit after one with a higher id has been read. Changes of
+ * the last WALLET_DELTA_OVERLAP seconds are therefore read again on every
+ * refresh; applying one twice is harmless.
+ */
+#define WALLET_DELTA_OVERLAP	60
+
+static int
+load_delta (struct wallet_snapshot *snap)
+{
+    char path[PATH_MAX];
+    struct wallet_deltahdr hdr;
+    struct wallet_snaprec rec;
+    size_t allocated = 0;
+    FILE *log;
+
+    if (!(log = fopen (wallet_spool_path (path, sizeof (path), WALLET_DELTA_FILE), "r")))
+		return 0;
+
+    /* A delta log left over from the previous snapshot is ignored. */
+    if ((fread (&hdr, sizeof (hdr), 1, log) != 1) || memcmp (hdr.magic, WALLET_DELTA_MAGIC, sizeof (hdr.magic)) ||
+	(hdr.base != snap->hdr->watermark)) {
+		fclose (log);
+		return 0;
+    }
+
+    while (fread (&rec, sizeof (rec), 1, log) == 1) {
+		if (snap->delta_count == allocated) {
+			struct wallet_snaprec *p;
+
+			allocated = allocated ? 2 * allocated : 256;
+			if (!(p = realloc (snap->delta, allocated * sizeof (*p)))) {
+				warn ("realloc");
+				fclose (log);
+				return -1;
+			}
+			snap->delta = p;
+		}
+		snap->delta[snap->delta_count++] = rec;
+		if (rec.version > snap->watermark)
+			snap->watermark = rec.version;
+    }
+    fclose (log);
+    return 0;
+}
+
+/*
+ * Map the snapshot of the terminal spool and load its delta log. Returns -1
+ * if there is no usable snapshot (run snapshot-sync).
+ */
+int
+wallet_snapshot_open (struct wallet_snapshot *snap)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset (snap, 0, sizeof (*snap));
+
+    if ((fd = open (wallet_spool_path (path, sizeof (path), WALLET_SNAPSHOT_FILE), O_RDONLY)) < 0)
+		return -1;
+    if ((fstat (fd, &st) < 0) || (st.st_size < (off_t) sizeof (struct wallet_snaphdr))) {
+		warnx ("%s: invalid snapshot", path);
+		close (fd);
+		return -1;
+    }
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+		warn ("%s", path);
+		return -1;
+    }
+
+    snap->hdr = map;
+    snap->map_len = st.st_size;
+    if (memcmp (snap->hdr->magic, WALLET_SNAPSHOT_MAGIC, sizeof (snap->hdr->magic)) ||
+	(snap->map_len != sizeof (*snap->hdr) + (snap->hdr->count * sizeof (struct wallet_snaprec)))) {
+		warnx ("%s: invalid snapshot", path);
+		wallet_snapshot_close (snap);
+		return -1;
+    }
+    snap->recs = (const struct wallet_snaprec *) (snap->hdr + 1);
+    snap->watermark = snap->hdr->watermark;
+
+    if (load_delta (snap) < 0) {
+		wallet_snapshot_close (snap);
+		return -1;
+    }
+    return 0;
+}
+
+void
+wallet_snapshot_close (struct wallet_snapshot *snap)
+{
+    if (snap->hdr)
+		munmap ((void *) snap->hdr, snap->map_len);
+    free (snap->delta);
+    memset (snap, 0, sizeof (*snap));
+}
+
+/*
+ * Find the student a card belongs to. Returns 1 if found, 0 if the card is
+ * unknown and -1 if it was unregistered since the snapshot was built.
+ */
+int
+wallet_snapshot_lookup (const struct wallet_snapshot *snap, const char *uid, struct wallet_student *student)
+{
+    const struct wallet_snaprec *found = NULL;
+    uint8_t bytes[WALLET_UID_MAX];
+    size_t len;
+
+    if (!snap->hdr || !(len = wallet_uid_parse (uid, bytes)))
+		return 0;
+
+    /* The delta log is short (snapshot-sync rebuilds past a limit). */
+    for (size_t i = 0; i < snap->delta_count; i++) {
+		const struct wallet_snaprec *rec = &snap->delta[i];
+
+		if ((0 == wallet_uid_cmp (rec->uid, rec->uid_len, bytes, len)) && (!found || (rec->version > found->version)))
+			found = rec;
+    }
+
+    if (!found) {
+		size_t lo = 0, hi = snap->hdr->count;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			int cmp = wallet_uid_cmp (snap->recs[mid].uid, snap->recs[mid].uid_len, bytes, len);
+
+			if (cmp == 0) {
+				found = &snap->recs[mid];
+				break;
+			}
+			if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+    }
+
+    if (!found)
+		return 0;
+    if (found->deleted)
+		return -1;
+
+    memcpy (student->student_id, found->student_id, WALLET_ID_LEN);
+    student->student_id[WALLET_ID_LEN] = '\0';
+    student->balance = found->balance;
+    student->version = found->version;
+    return 1;
+}
+
+static int
+fill_record (struct wallet_snaprec *rec, MYSQL_ROW row, unsigned long *lengths, uint64_t version)
+{
+    memset (rec, 0, sizeof (*rec));
+    rec->version = version;
+    if (!(rec->uid_len = wallet_uid_bytes (row[0], lengths[0], rec->uid)))
+		return -1;
+    memcpy (rec->student_id, row[1], strnlen (row[1], WALLET_ID_LEN));
+    rec->balance = wallet_parse_cents (row[2]);
+    return 0;
+}
+
+static int
+write_delta_header (uint64_t base)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + sizeof (".tmp")];
+    struct wallet_deltahdr hdr;
+    int fd;
+
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, WALLET_DELTA_MAGIC, sizeof (hdr.magic));
+    hdr.base = base;
+
+    wallet_spool_path (path, sizeof (path), WALLET_DELTA_FILE);
+    snprintf (tmp, sizeof (tmp), "%s.tmp", path);
+    if ((fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		warn ("%s", tmp);
+		return -1;
+    }
+    if ((write (fd, &hdr, sizeof (hdr)) != sizeof (hdr)) || (fsync (fd) < 0)) {
+		warn ("%s", tmp);
+		close (fd);
+		return -1;
+    }
+    close (fd);
+    if (rename (tmp, path) < 0) {
+		warn ("%s", path);
+		return -1;
+    }
+    return 0;
+}
+
+/*
+ * Build a new snapshot from the student table and start an empty delta log
+ * for it. The file is written aside and renamed, so that running terminals
+ * keep their mapping of the previous one.
+ */
+int
+wallet_snapshot_rebuild (MYSQL *conn)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + sizeof (".tmp")], watermark_char[24];
+    struct wallet_snaphdr hdr;
+    struct wallet_snaprec rec, prev;
+    struct wallet_db_cursor cur;
+    MYSQL_ROW row;
+    FILE *f = NULL;
+
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, WALLET_SNAPSHOT_MAGIC, sizeof (hdr.magic));
+
+    wallet_spool_path (path, sizeof (path), WALLET_SNAPSHOT_FILE);
+    snprintf (tmp, sizeof (tmp), "%s.tmp", path);
+    if (!(f = fopen (tmp, "w"))) {
+		warn ("%s", tmp);
+		return -1;
+    }
+    if (fwrite (&hdr, sizeof (hdr), 1, f) != 1)
+		goto io_error;
+
+    /* The watermark and the rows must come from the same read view. */
+    if (wallet_db_exec (conn, "START TRANSACTION WITH CONSISTENT SNAPSHOT") < 0)
+		goto error;
+    if (wallet_db_select_str (conn, watermark_char, sizeof (watermark_char), "SELECT COALESCE(MAX(id), 0) FROM student_change") != 1)
+		goto db_error;
+    hdr.watermark = strtoull (watermark_char, NULL, 10);
+
+    if (wallet_db_cursor_open (&cur, conn, "SELECT uid, student_id, balance FROM student WHERE uid IS NOT NULL ORDER BY uid") < 0)
+		goto db_error;
+    while ((row = wallet_db_cursor_next (&cur))) {
+		if (fill_record (&rec, row, cur.lengths, 0) < 0) {
+			warnx ("%s: invalid UID, skipped", row[1]);
+			continue;
+		}
+		if (hdr.count && (wallet_uid_cmp (prev.uid, prev.uid_len, rec.uid, rec.uid_len) >= 0)) {
+			warnx ("student table not in UID order at %s", row[1]);
+			wallet_db_cursor_close (&cur);
+			goto db_error;
+		}
+		if (fwrite (&rec, sizeof (rec), 1, f) != 1) {
+			wallet_db_cursor_close (&cur);
+			wallet_db_rollback (conn);
+			goto io_error;
+		}
+		prev = rec;
+		hdr.count++;
+    }
+    if (wallet_db_cursor_close (&cur) < 0)
+		goto db_error;
+    wallet_db_commit (conn);
+
+    hdr.built = time (NULL);
+    rewind (f);
+    if ((fwrite (&hdr, sizeof (hdr), 1, f) != 1) || (fflush (f) != 0) || (fsync (fileno (f)) < 0))
+		goto io_error;
+    fclose (f);
+
+    if (rename (tmp, path) < 0) {
+		warn ("%s", path);
+		unlink (tmp);
+		return -1;
+    }
+    return write_delta_header (hdr.watermark);
+
+io_error:
+    warn ("%s", tmp);
+    goto error;
+db_error:
+    wallet_db_rollback (conn);
+error:
+    fclose (f);
+    unlink (tmp);
+    return -1;
+}
+
+static int
+delta_contains (const struct wallet_snapshot *snap, uint64_t version)
+{
+    for (size_t i = snap->delta_count; i > 0; i--)
+		if (snap->delta[i - 1].version == version)
+			return 1;
+    return 0;
+}
+
+/*
+ * Append the student changes made since the last refresh to the delta log
+ * and to the loaded snapshot. Returns the number of changes applied, -1 if
+ * the snapshot must be rebuilt instead.
+ */
+long
+wallet_snapshot_refresh (MYSQL *conn, struct wallet_snapshot *snap)
+{
+    char path[PATH_MAX], min_char[24];
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    struct wallet_snaprec *p;
+    size_t count = 0, first = snap->delta_count;
+    struct stat st = { .st_size = 0 };
+    int fd;
+
+    if (!snap->hdr)
+		return -1;
+
+    /* Changes older than the oldest one kept are gone. */
+    if (wallet_db_select_str (conn, min_char, sizeof (min_char), "SELECT COALESCE(MIN(id), 0) FROM student_change") != 1)
+		return -1;
+    if (strtoull (min_char, NULL, 10) > snap->watermark + 1) {
+		warnx ("student changes since %llu pruned", (unsigned long long) snap->watermark);
+		return -1;
+    }
+
+    if (wallet_db_exec (conn, "SELECT id, uid, student_id, balance, deleted FROM student_change WHERE id > %llu "
+			"UNION SELECT id, uid, student_id, balance, deleted FROM student_change WHERE time > NOW() - INTERVAL %d SECOND "
+			"ORDER BY id", (unsigned long long) snap->watermark, WALLET_DELTA_OVERLAP) < 0)
+		return -1;
+    if (!(result = mysql_store_result (conn))) {
+		warnx ("%s", mysql_error (conn));
+		return -1;
+    }
+
+    if (mysql_num_rows (result) == 0) {
+		mysql_free_result (result);
+		return 0;
+    }
+    if (!(p = realloc (snap->delta, (snap->delta_count + mysql_num_rows (result)) * sizeof (*p)))) {
+		warn ("realloc");
+		mysql_free_result (result);
+		return -1;
+    }
+    snap->delta = p;
+
+    while ((row = mysql_fetch_row (result))) {
+		uint64_t version = strtoull (row[0], NULL, 10);
+		struct wallet_snaprec *rec = &snap->delta[snap->delta_count];
+
+		if ((version <= snap->watermark) && delta_contains (snap, version))
+			continue;
+		if (fill_record (rec, row + 1, mysql_fetch_lengths (result) + 1, version) < 0)
+			continue;
+		rec->deleted = (row[4][0] == '1');
+		snap->delta_count++;
+    }
+    mysql_free_result (result);
+
+    if (snap->delta_count == first)
+		return 0;
+
+    if ((fd = open (wallet_spool_path (path, sizeof (path), WALLET_DELTA_FILE), O_WRONLY | O_APPEND)) < 0) {
+		warn ("%s", path);
+		snap->delta_count = first;
+		return -1;
+    }
+    count = snap->delta_count - first;
+    if ((fstat (fd, &st) < 0) ||
+	(write (fd, &snap->delta[first], count * sizeof (*p)) != (ssize_t) (count * sizeof (*p))) || (fdatasync (fd) < 0)) {
+		warn ("%s", path);
+		/* Keep the log a whole number of records. */
+		if (st.st_size && (ftruncate (fd, st.st_size) < 0))
+			warn ("%s", path);
+		close (fd);
+		snap->delta_count = first;
+		return -1;
+    }
+    close (fd);
+
+    for (size_t i = first; i < snap->delta_count; i++)
+		if (snap->delta[i].version > snap->watermark)
+			snap->watermark = snap->delta[i].version;
+    return count;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_SNAPSHOT_H__
+#define __WALLET_SNAPSHOT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mysql/mysql.h>
+
+#include "wallet-card.h"
+
+/*
+ * Local image of the student table.
+ *
+ * A snapshot file holds one fixed-size record per card sorted by UID, which
+ * terminals map read-only and binary-search. Changes made since the snapshot
+ * was built (the student_change table) are appended to a delta log; a delta
+ * record always overrides the snapshot record of the same card.
+ */
+
+#define WALLET_SNAPSHOT_MAGIC	"WSNAP\0\0\1"
+#define WALLET_DELTA_MAGIC	"WDELTA\0\1"
+
+struct wallet_snaphdr {
+    char magic[8];
+    uint64_t count;
+    uint64_t watermark;		/* last student_change.id included */
+    int64_t built;
+};
+
+struct wallet_snaprec {
+    uint64_t version;		/* student_change.id, 0 in the snapshot */
+    int32_t balance;		/* cents */
+    uint8_t uid[WALLET_UID_MAX];
+    uint8_t uid_len;
+    uint8_t deleted;
+    char student_id[WALLET_ID_LEN];
+};
+
+struct wallet_deltahdr {
+    char magic[8];
+    uint64_t base;		/* watermark of the snapshot it applies to */
+};
+
+struct wallet_snapshot {
+    const struct wallet_snaphdr *hdr;
+    const struct wallet_snaprec *recs;
+    size_t map_len;
+    struct wallet_snaprec *delta;
+    size_t delta_count;
+    uint64_t watermark;
+};
+
+struct wallet_student {
+    char student_id[WALLET_ID_LEN + 1];
+    long balance;		/* cents, as of the last refresh */
+    uint64_t version;
+};
+
+int	 wallet_snapshot_open (struct wallet_snapshot *snap);
+void	 wallet_snapshot_close (struct wallet_snapshot *snap);
+int	 wallet_snapshot_lookup (const struct wallet_snapshot *snap, const char *uid, struct wallet_student *student);
+int	 wallet_snapshot_rebuild (MYSQL *conn);
+long	 wallet_snapshot_refresh (MYSQL *conn, struct wallet_snapshot *snap);
+
+#endif /* !__WALLET_SNAPSHOT_H__ */
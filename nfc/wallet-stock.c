@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#include "config.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+#include "wallet-db.h"
+#include "wallet-stock.h"
+
+/*
+ * Record a freshly prepared card as unassigned stock.
+ */
+int
+wallet_stock_add (MYSQL *conn, const char *uid)
+{
+    char uid_sql[WALLET_UID_SQL_LEN];
+
+    return wallet_db_exec (conn,
+	"INSERT INTO card_stock (uid, prepared) VALUES (%s, NOW()) "
+	"ON DUPLICATE KEY UPDATE prepared=VALUES(prepared), issued=NULL, student_id=NULL", wallet_uid_sql (uid, uid_sql));
+}
+
+/*
+ * Take the card out of the stock for the student. Returns 1 if it was
+ * unassigned stock, 0 if it is not a prepared card (or was issued already)
+ * and -1 on database error. id_esc is escaped already.
+ */
+int
+wallet_stock_claim (MYSQL *conn, const char *uid, const char *id_esc)
+{
+    char uid_sql[WALLET_UID_SQL_LEN];
+
+    if (wallet_db_exec (conn,
+	"UPDATE card_stock SET issued=NOW(), student_id='%s' WHERE uid=%s AND issued IS NULL",
+	id_esc, wallet_uid_sql (uid, uid_sql)) < 0)
+		return -1;
+
+    return (1 == mysql_affected_rows (conn)) ? 1 : 0;
+}
+
+/*
+ * Write the wallet record of the student to a stock card that is on the
+ * reader but not connected.
+ */
+int
+wallet_stock_issue (MifareTag tag, const struct wallet_record *rec)
+{
+    Mad mad;
+    int res = -1;
+
+    if (mifare_classic_connect (tag) < 0) {
+		warnx ("mifare_classic_connect failed");
+		return -1;
+    }
+    if ((mad = mad_read (tag))) {
+		res = wallet_card_write (tag, mad, rec);
+		free (mad);
+    } else {
+		warnx ("No MAD detected, not a prepared card.");
+    }
+    mifare_classic_disconnect (tag);
+
+    return res;
+}
+
+/*
+ * Block the card and queue it for recycling, in the caller's transaction
+ * when there is one.
+ */
+int
+wallet_stock_retire (MYSQL *conn, const char *uid, const char *reason)
+{
+    char uid_sql[WALLET_UID_SQL_LEN];
+
+    wallet_uid_sql (uid, uid_sql);
+    if (wallet_db_exec (conn,
+	"INSERT IGNORE INTO hotlist (uid, reason, created) VALUES (%s, '%s', NOW())", uid_sql, reason) < 0)
+		return -1;
+
+    return wallet_db_exec (conn,
+	"INSERT INTO card_recycle (uid, queued) VALUES (%s, NOW()) "
+	"ON DUPLICATE KEY UPDATE queued=VALUES(queued), recycled=NULL", uid_sql);
+}
+
+/*
+ * Invalidate the wallet record of a card that is on the reader but not
+ * connected, see wallet_card_invalidate().
+ */
+int
+wallet_stock_void (MifareTag tag)
+{
+    Mad mad;
+    int res = -1;
+
+    if (mifare_classic_connect (tag) < 0) {
+		warnx ("mifare_classic_connect failed");
+		return -1;
+    }
+    if ((mad = mad_read (tag))) {
+		res = wallet_card_invalidate (tag, mad);
+		free (mad);
+    } else {
+		warnx ("No MAD detected.");
+    }
+    mifare_classic_disconnect (tag);
+
+    return res;
+}
+
+/*
+ * The card has been formatted by recycle-cards: it leaves the queue and,
+ * as it is no longer a wallet card, the hotlist. Cards hotlisted for any
+ * other reason than closing the account or renewing the card stay
+ * blocked. Returns 1 if the card was queued, 0 if not.
+ */
+int
+wallet_stock_recycled (MYSQL *conn, const char *uid)
+{
+    char uid_sql[WALLET_UID_SQL_LEN];
+
+    wallet_uid_sql (uid, uid_sql);
+    if (wallet_db_begin (conn) < 0)
+		return -1;
+    if (wallet_db_exec (conn,
+	"UPDATE card_recycle SET recycled=NOW() WHERE uid=%s AND recycled IS NULL", uid_sql) < 0)
+		goto error;
+    if (1 != mysql_affected_rows (conn)) {
+		wallet_db_rollback (conn);
+		return 0;
+    }
+    if (wallet_db_exec (conn, "DELETE FROM hotlist WHERE uid=%s AND reason IN ('closed', 'renewed')", uid_sql) < 0)
+		goto error;
+    if (wallet_db_commit (conn) < 0)
+		return -1;
+    return 1;
+
+error:
+    wallet_db_rollback (conn);
+    return -1;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+
+#ifndef __WALLET_STOCK_H__
+#define __WALLET_STOCK_H__
+
+#include <mysql/mysql.h>
+
+#include <nfc/nfc.h>
+
+#include <freefare.h>
+
+#include "wallet-card.h"
+
+/*
+ * Card stock: blank cards provisioned ahead of time by prepare-stock (MAD,
+ * NFCForum application with the card's own keys, empty wallet record) and
+ * recorded in the card_stock table. Issuing one at the counter is binding
+ * its UID to the student and writing the wallet record, one authentication
+ * on the first application sector.
+ *
+ * Cards of closed accounts go the other way: at the desk the card is
+ * hotlisted and queued in card_recycle, and its record invalidated with one
+ * block write (wallet_stock_void). recycle-cards formats the collected
+ * cards later and can put them back into stock.
+ */
+
+int	 wallet_stock_add (MYSQL *conn, const char *uid);
+int	 wallet_stock_claim (MYSQL *conn, const char *uid, const char *id_esc);
+int	 wallet_stock_issue (MifareTag tag, const struct wallet_record *rec);
+
+int	 wallet_stock_retire (MYSQL *conn, const char *uid, const char *reason);
+int	 wallet_stock_void (MifareTag tag);
+int	 wallet_stock_recycled (MYSQL *conn, const char *uid);
+
+#endif /* !__WALLET_STOCK_H__ */
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wallet-card.h"
+#include "wallet-config.h"
+#include "wallet-monitor.h"
+#include "wallet-tapsnap.h"
+
+/*
+ * Snapshot of the card record taken now, rec NULL when it could not be
+ * decoded.
+ */
+void
+wallet_tapsnap_init (struct wallet_tapsnap *snap, const char *uid, const struct wallet_record *rec, uint8_t flags)
+{
+    memset (snap, 0, sizeof (*snap));
+    snap->time = time (NULL);
+    snap->balance = rec ? rec->balance : -1;
+    snap->seq = rec ? rec->seq : 0;
+    snap->flags = flags;
+    if (rec)
+		memcpy (snap->student_id, rec->student_id, WALLET_ID_LEN);
+
+    snap->uid_len = wallet_uid_parse (uid, snap->uid);
+}
+
+/*
+ * Append a snapshot of the card record to the terminal tap log, and pass
+ * it on to the fraud monitor. Best effort: a terminal keeps working if its
+ * spool is not writable.
+ */
+int
+wallet_tapsnap_append (const char *uid, const struct wallet_record *rec, uint8_t flags)
+{
+    static int fd = -1;
+    struct wallet_tapsnap snap;
+
+    wallet_tapsnap_init (&snap, uid, rec, flags);
+
+    wallet_monitor_send (&snap, uid, rec);
+
+    if (fd < 0) {
+		char path[PATH_MAX];
+
+		if ((fd = open (wallet_spool_path (path, sizeof (path), WALLET_TAPLOG_FILE), O_WRONLY | O_APPEND | O_CREAT, 0640)) < 0) {
+			warn ("%s", path);
+			return -1;
+		}
+    }
+
+    /* O_APPEND keeps records whole even with several tools on one terminal. */
+    if (write (fd, &snap, sizeof (snap)) != sizeof (snap)) {
+		warn ("tap log");
+		return -1;
+    }
+    return 0;
+}
+
+/*
+ * Order snapshots by UID, then by write sequence and time, so that the
+ * last snapshot of each card is the most recent state it was seen in.
+ */
+int
+wallet_tapsnap_compare (const void *a, const void *b)
+{
+    const struct wallet_tapsnap *sa = a, *sb = b;
+    int res;
+
+    if ((res = wallet_uid_cmp (sa->uid, sa->uid_len, sb->uid, sb->uid_len)))
+		return res;
+    if (sa->seq != sb->seq)
+		return (sa->seq < sb->seq) ? -1 : 1;
+    if (sa->time != sb->time)
+		return (sa->time < sb->time) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Compare a snapshot UID with a hex UID as read from the database, in the
+ * same order as wallet_tapsnap_compare().
+ */
+int
+wallet_tapsnap_uid_cmp (const struct wallet_tapsnap *snap, const char *uid)
+{
+    uint8_t bytes[WALLET_UID_MAX];
+    size_t len = wallet_uid_parse (uid, bytes);
+
+    return wallet_uid_cmp (snap->uid, snap->uid_len, bytes, len);
+}
+
+char *
+wallet_tapsnap_uid (const struct wallet_tapsnap *snap, char *buf, size_t len)
+{
+    return wallet_uid_format (snap->uid, snap->uid_len, buf, len);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_TAPSNAP_H__
+#define __WALLET_TAPSNAP_H__
+
+#include <stdint.h>
+
+#include "wallet-card.h"
+
+/*
+ * Card snapshots.
+ *
+ * Every terminal appends what it reads from (or confirms on) a card to a
+ * local log of fixed-size records. The logs of all terminals are later
+ * merged against the student table by reconcile.
+ */
+
+struct wallet_tapsnap {
+    int64_t time;
+    int32_t balance;		/* cents, -1 if the record could not be decoded */
+    uint32_t seq;
+    uint8_t uid[WALLET_UID_MAX];
+    uint8_t uid_len;
+    uint8_t flags;
+    char student_id[WALLET_ID_LEN];
+};
+
+/* The snapshot was taken right after a confirmed write. */
+#define WALLET_TAPSNAP_WRITTEN	0x01
+
+void	 wallet_tapsnap_init (struct wallet_tapsnap *snap, const char *uid, const struct wallet_record *rec, uint8_t flags);
+int	 wallet_tapsnap_append (const char *uid, const struct wallet_record *rec, uint8_t flags);
+int	 wallet_tapsnap_compare (const void *a, const void *b);
+int	 wallet_tapsnap_uid_cmp (const struct wallet_tapsnap *snap, const char *uid);
+char	*wallet_tapsnap_uid (const struct wallet_tapsnap *snap, char *buf, size_t len);
+
+#endif /* !__WALLET_TAPSNAP_H__ */
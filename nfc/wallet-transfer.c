@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mysql/mysql.h>
+
+#include "wallet-db.h"
+#include "wallet-event.h"
+#include "wallet-pending.h"
+#include "wallet-transfer.h"
+
+#define TRANSFER_RETRIES	3
+
+/*
+ * Both student rows are locked with a single SELECT ... FOR UPDATE walking
+ * the student_id index in ascending order. Every transfer therefore takes
+ * its row locks in the same global order, whichever way the money goes, so
+ * two concurrent transfers between the same students queue up instead of
+ * deadlocking. *retry is set when a database error is worth another try.
+ */
+static enum wallet_transfer_status
+transfer_once (MYSQL *conn, const char *from_esc, const char *to_esc, long amount, int flags, struct wallet_transfer *res, int *retry)
+{
+    MYSQL_RES *result;
+    MYSQL_ROW row;
+    long from_balance = -1, to_balance = -1;
+    long long pending_id;
+    char amount_str[16];
+    enum wallet_transfer_status status = WALLET_TRANSFER_OK;
+
+    *retry = 0;
+    if (wallet_db_begin (conn) < 0)
+		return WALLET_TRANSFER_DB_ERROR;
+
+    if (wallet_db_exec (conn, "SELECT student_id, balance FROM student WHERE student_id IN ('%s', '%s') ORDER BY student_id FOR UPDATE", from_esc, to_esc) < 0)
+		goto db_error;
+    if (!(result = mysql_store_result (conn)))
+		goto db_error;
+    while ((row = mysql_fetch_row (result))) {
+		if (0 == strcmp (row[0], from_esc))
+			from_balance = wallet_parse_cents (row[1]);
+		else
+			to_balance = wallet_parse_cents (row[1]);
+    }
+    mysql_free_result (result);
+
+    if (from_balance < 0)
+		status = WALLET_TRANSFER_NO_SENDER;
+    else if (to_balance < 0)
+		status = WALLET_TRANSFER_NO_RECEIVER;
+    else {
+		if (flags & (WALLET_TRANSFER_ALL | WALLET_TRANSFER_CLOSE))
+			amount = from_balance;
+		if ((amount <= 0) || (amount > from_balance))
+			status = WALLET_TRANSFER_INSUFFICIENT;
+		else if (to_balance + amount >= WALLET_BALANCE_LIMIT)
+			status = WALLET_TRANSFER_LIMIT;
+    }
+    if (status != WALLET_TRANSFER_OK) {
+		wallet_db_rollback (conn);
+		return status;
+    }
+
+    wallet_format_cents (amount_str, sizeof (amount_str), amount);
+    if (flags & WALLET_TRANSFER_CLOSE) {
+		/*
+		 * The credits still queued for the sender's card are in the
+		 * balance moved; with the student gone nothing would settle them.
+		 */
+		if (wallet_db_exec (conn, "UPDATE pending_credit SET settled=NOW() WHERE student_id='%s' AND settled IS NULL", from_esc) < 0)
+			goto db_error;
+		if (wallet_db_exec (conn, "DELETE FROM student WHERE student_id='%s'", from_esc) < 0)
+			goto db_error;
+		if (wallet_db_exec (conn, "UPDATE student SET balance=balance+%s WHERE student_id='%s'", amount_str, to_esc) < 0)
+			goto db_error;
+    } else {
+		if (wallet_db_exec (conn, "UPDATE student SET balance=CASE student_id WHEN '%s' THEN balance-%s ELSE balance+%s END WHERE student_id IN ('%s', '%s')",
+				    from_esc, amount_str, amount_str, from_esc, to_esc) < 0)
+			goto db_error;
+    }
+
+    if (wallet_db_exec (conn, "INSERT INTO transfer (time, amount, from_student, to_student) VALUES (NOW(), %s, '%s', '%s')", amount_str, from_esc, to_esc) < 0)
+		goto db_error;
+
+    if ((pending_id = wallet_pending_enqueue (conn, to_esc, amount, "transfer")) < 0)
+		goto db_error;
+
+    if (wallet_db_commit (conn) < 0)
+		goto db_error;
+
+    res->amount = amount;
+    res->sender_balance = from_balance - amount;
+    res->receiver_balance = to_balance + amount;
+    res->pending_id = pending_id;
+    return WALLET_TRANSFER_OK;
+
+db_error:
+    *retry = wallet_db_abort (conn);
+    return WALLET_TRANSFER_DB_ERROR;
+}
+
+/*
+ * Publish both sides of a committed transfer, and the removal of the sender
+ * with WALLET_TRANSFER_CLOSE.
+ */
+static void
+publish_transfer (const char *from_id, const char *to_id, int flags, const struct wallet_transfer *res)
+{
+    struct wallet_event ev[3];
+    size_t count = 2;
+
+    wallet_event_init (&ev[0], WALLET_EVENT_TRANSFER_OUT, NULL, from_id);
+    ev[0].amount = -res->amount;
+    ev[0].balance = res->sender_balance;
+    memcpy (ev[0].peer_id, to_id, strnlen (to_id, WALLET_ID_LEN));
+
+    wallet_event_init (&ev[1], WALLET_EVENT_TRANSFER_IN, NULL, to_id);
+    ev[1].amount = res->amount;
+    ev[1].balance = res->receiver_balance;
+    memcpy (ev[1].peer_id, from_id, strnlen (from_id, WALLET_ID_LEN));
+
+    if (flags & WALLET_TRANSFER_CLOSE) {
+		/* The balance left with the transfer, nothing is removed. */
+		wallet_event_init (&ev[2], WALLET_EVENT_DELETE, NULL, from_id);
+		ev[2].balance = 0;
+		count++;
+    }
+
+    wallet_event_publish (ev, count);
+}
+
+/*
+ * Move amount cents (or the whole sender balance with WALLET_TRANSFER_ALL)
+ * from one student to another in a single transaction, record it in the
+ * transfer ledger and queue the credit for the receiver's card.
+ */
+enum wallet_transfer_status
+wallet_transfer (MYSQL *conn, const char *from_id, const char *to_id, long amount, int flags, struct wallet_transfer *res)
+{
+    ulong from_length = strlen (from_id);
+    ulong to_length = strlen (to_id);
+    char from_esc[(2 * from_length) + 1];
+    char to_esc[(2 * to_length) + 1];
+    enum wallet_transfer_status status;
+    int retry;
+
+    if (0 == strcmp (from_id, to_id))
+		return WALLET_TRANSFER_SAME_STUDENT;
+
+    mysql_real_escape_string (conn, from_esc, from_id, from_length);
+    mysql_real_escape_string (conn, to_esc, to_id, to_length);
+
+    for (int attempt = 0; attempt < TRANSFER_RETRIES; attempt++) {
+		status = transfer_once (conn, from_esc, to_esc, amount, flags, res, &retry);
+		if (!retry || (attempt + 1 == TRANSFER_RETRIES))
+			break;
+		warnx ("transfer %s -> %s: retrying", from_id, to_id);
+    }
+
+    if (status == WALLET_TRANSFER_OK)
+		publish_transfer (from_id, to_id, flags, res);
+
+    return status;
+}
+
+const char *
+wallet_transfer_strerror (enum wallet_transfer_status status)
+{
+    switch (status) {
+	case WALLET_TRANSFER_OK:
+		return "Transfer successful";
+	case WALLET_TRANSFER_NO_SENDER:
+		return "No user found/Invalid card.";
+	case WALLET_TRANSFER_NO_RECEIVER:
+		return "ID cannot be found";
+	case WALLET_TRANSFER_SAME_STUDENT:
+		return "Cannot transfer to the same student";
+	case WALLET_TRANSFER_INSUFFICIENT:
+		return "Insufficient fund";
+	case WALLET_TRANSFER_LIMIT:
+		return "Sorry, the balance sum cannot be more than RM100";
+	case WALLET_TRANSFER_DB_ERROR:
+	default:
+		return "Transfer failed, nothing was changed";
+    }
+}
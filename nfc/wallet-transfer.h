@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2012 UCTI Sdn Bhd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef __WALLET_TRANSFER_H__
+#define __WALLET_TRANSFER_H__
+
+#include <mysql/mysql.h>
+
+enum wallet_transfer_status {
+    WALLET_TRANSFER_OK = 0,
+    WALLET_TRANSFER_NO_SENDER,
+    WALLET_TRANSFER_NO_RECEIVER,
+    WALLET_TRANSFER_SAME_STUDENT,
+    WALLET_TRANSFER_INSUFFICIENT,
+    WALLET_TRANSFER_LIMIT,
+    WALLET_TRANSFER_DB_ERROR
+};
+
+/* Move the whole balance of the sender instead of the given amount. */
+#define WALLET_TRANSFER_ALL	0x01
+/*
+ * Remove the sender's student row in the same transaction, moving its whole
+ * balance and settling the credits queued for its card.
+ */
+#define WALLET_TRANSFER_CLOSE	0x02
+
+struct wallet_transfer {
+    long amount;		/* cents actually moved */
+    long sender_balance;	/* sender balance after the transfer, in cents */
+    long receiver_balance;	/* receiver balance after the transfer, in cents */
+    long long pending_id;	/* pending_credit entry queued for the receiver card */
+};
+
+enum wallet_transfer_status	 wallet_transfer (MYSQL *conn, const char *from_id, const char *to_id, long amount, int flags, struct wallet_transfer *res);
+const char			*wallet_transfer_strerror (enum wallet_transfer_status status);
+
+#endif /* !__WALLET_TRANSFER_H__ */